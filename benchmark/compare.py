@@ -0,0 +1,118 @@
+#!/usr/bin/env python
+
+"""
+Compares benchmark results against baselines, see gate.sh.
+
+Every METRIC.STAT file holds samples, one per line. STAT is the statistic
+compared: median (throughput, higher is better) or p99 (latency, lower is
+better). For each metric, the ratio result/baseline of the statistic gets a
+bootstrap confidence interval: both sample sets are resampled with
+replacement, the ratio is computed for every resample, and the interval is
+the central CONFIDENCE of those ratios.
+
+A metric regresses when the whole interval is on the bad side of 1 (the
+change is significant) and the ratio itself is worse than TOLERANCE (the
+change matters). Any regression makes the exit status 1. Metrics without a
+baseline are only reported.
+
+Usage: ./compare.py <results_dir> <baselines_dir>
+"""
+
+import os
+import sys
+import json
+import random
+
+RESAMPLES = 2000
+CONFIDENCE = 0.95
+TOLERANCE = 0.05
+MAXSAMPLES = 1000 # larger sets are subsampled, bootstrap is O(n log n) each
+
+def percentile(sorted_samples, p):
+    """Nearest-rank percentile of sorted samples."""
+    i = int(round(p / 100.0 * (len(sorted_samples) - 1)))
+    return sorted_samples[i]
+
+STATS = {
+    # name: (statistic, higher is better)
+    "median": (lambda s: percentile(s, 50), True),
+    "p99": (lambda s: percentile(s, 99), False),
+}
+
+def load(path):
+    samples = [float(l) for l in open(path) if l.strip()]
+    if len(samples) > MAXSAMPLES:
+        samples = random.sample(samples, MAXSAMPLES)
+    return samples
+
+def bootstrap_ratio(new, base, stat):
+    """Confidence interval of stat(new) / stat(base)."""
+    ratios = []
+    for i in range(RESAMPLES):
+        n = sorted(random.choice(new) for j in range(len(new)))
+        b = sorted(random.choice(base) for j in range(len(base)))
+        sb = stat(b)
+        if sb != 0:
+            ratios.append(stat(n) / sb)
+    ratios.sort()
+    tail = (1 - CONFIDENCE) / 2 * 100
+    return percentile(ratios, tail), percentile(ratios, 100 - tail)
+
+def compare(results_dir, baselines_dir):
+    report = {}
+    regressions = 0
+
+    print "%-28s %12s %12s %8s %17s  %s" % ("metric", "baseline", "result",
+        "ratio", "%d%% CI" % (CONFIDENCE * 100), "verdict")
+    for name in sorted(os.listdir(results_dir)):
+        kind = name.rsplit(".", 1)[-1]
+        if kind not in STATS:
+            continue
+        stat, higher_better = STATS[kind]
+        new = load(os.path.join(results_dir, name))
+        if not new:
+            continue
+        value = stat(sorted(new))
+        entry = {"stat": kind, "value": value, "samples": len(new)}
+        report[name] = entry
+
+        base_path = os.path.join(baselines_dir, name)
+        base = load(base_path) if os.path.exists(base_path) else []
+        if not base:
+            print "%-28s %12s %12.3f %8s %17s  %s" % (name, "-", value, "-",
+                "-", "no baseline")
+            continue
+
+        base_value = stat(sorted(base))
+        ratio = value / base_value if base_value != 0 else 1.0
+        lo, hi = bootstrap_ratio(new, base, stat)
+        if higher_better:
+            regressed = hi < 1 and ratio < 1 - TOLERANCE
+            improved = lo > 1 and ratio > 1 + TOLERANCE
+        else:
+            regressed = lo > 1 and ratio > 1 + TOLERANCE
+            improved = hi < 1 and ratio < 1 - TOLERANCE
+        verdict = "REGRESSION" if regressed else \
+            "improved" if improved else "ok"
+        regressions += regressed
+
+        entry.update({"baseline": base_value, "ratio": ratio,
+                      "ci": [lo, hi], "verdict": verdict})
+        print "%-28s %12.3f %12.3f %8.3f [%7.3f, %7.3f]  %s" % (name,
+            base_value, value, ratio, lo, hi, verdict)
+
+    with open(os.path.join(results_dir, "summary.json"), "w") as f:
+        json.dump(report, f, indent=2, sort_keys=True)
+
+    return regressions
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        print "Usage:", sys.argv[0], "<results_dir> <baselines_dir>"
+        sys.exit(2)
+
+    random.seed(1) # the same data gives the same verdict
+    n = compare(sys.argv[1], sys.argv[2])
+    if n > 0:
+        print "%d significant regression(s)" % n
+        sys.exit(1)
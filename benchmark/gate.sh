@@ -0,0 +1,95 @@
+#!/bin/bash
+
+# Benchmark regression gate, run by "make bench" (see compare.py).
+#
+# Runs the read benchmark (main.c) on an LFS mount and in-process through the
+# LD_PRELOAD shim, and the swift workload (swift.c) on the mount. Samples go
+# to ./results, one number per line, in files named METRIC.STAT:
+#
+#     *.median  throughput (MiB/s, chunks/s), higher is better
+#     *.p99     latency of one pass (ms) or of a swift operation (us, the
+#               p99 of each run), lower is better
+#
+# and are then compared against ./baselines. With BASELINE=1, the results
+# replace the baselines instead. Baselines only mean something on the box
+# that recorded them, so they aren't in the repository: run
+# "make bench-baseline" once before the first "make bench". BENCH_MOUNT=0
+# skips everything that needs a FUSE mount.
+
+# a failing benchmark fails its pipeline, not just the last stage
+set -o pipefail
+
+[ -z $SIZE ] && SIZE=$((16*1024*1024))
+[ -z $DIR ] && DIR="./gate_test"
+[ -z "$CHUNKS" ] && CHUNKS="4096 65536"
+[ -z $RUNS ] && RUNS=10
+[ -z $BENCH_MOUNT ] && BENCH_MOUNT=1
+[ -z $LFS ] && LFS=../lfs
+[ -z $PRELOAD ] && PRELOAD=../liblfs_preload.so
+PATTERN=aaaaaaaa
+
+# daemon on the first core, benchmarks on the others (if any)
+NCPU=$(nproc)
+BENCH_CPUS=$(( NCPU > 1 ? 1 : 0 ))-$(( NCPU > 1 ? NCPU - 1 : 0 ))
+
+if [ "$BASELINE" != 1 ] && [ -z "$(ls ./baselines 2> /dev/null)" ]; then
+	echo "No baselines, run \"make bench-baseline\" on this machine first"
+	exit 1
+fi
+
+gcc -O2 -o main main.c || exit 1
+gcc -O2 -Wall -o swift swift.c -lpthread || exit 1
+
+rm -rf ./results
+mkdir -p ./results ./baselines
+
+# main.c output, "lfs_ms other_ms" per pass, to throughput and pass latency
+split_reads() {
+	awk -v mib=$(($SIZE / 1048576)) -v t=$1.median -v l=$2.p99 \
+		'$1 > 0 { print mib * 1000 / $1 > t; print $1 > l }'
+}
+
+# swift.c output, appended: chunks/s to $1.median, p99 per op to $1_OP.p99
+split_swift() {
+	awk -v m=$1 '/chunks\/s/ { print $(NF - 3) >> (m ".median") }
+		$1 ~ /^(chunk|uncle|binmap)$/ && NF == 6 {
+			print $5 >> (m "_" $1 ".p99") }'
+}
+
+mkdir -p $DIR ${DIR}_real ${DIR}_ref
+truncate -s $SIZE ${DIR}_ref/ref
+
+# in-process, nothing mounted
+for cs in $CHUNKS; do
+	LFS_PREFIX=$DIR LFS_REALSTORE=${DIR}_real LD_PRELOAD=$PRELOAD \
+		taskset -c $BENCH_CPUS ./main $DIR ${PATTERN}_${SIZE}_test $cs ../${DIR}_ref/ref \
+		| (cd results && split_reads preload_read_$cs preload_pass_$cs) || exit 1
+done
+
+if [ $BENCH_MOUNT = 1 ]; then
+	taskset -c 0 $LFS -o realstore=${DIR}_real,kernel_cache $DIR || exit 1
+	truncate -s $SIZE $DIR/${PATTERN}_test
+	for cs in $CHUNKS; do
+		taskset -c $BENCH_CPUS ./main $DIR ${PATTERN}_test $cs ../${DIR}_ref/ref \
+			| (cd results && split_reads mount_read_$cs mount_pass_$cs) \
+			|| FAILED=1
+	done
+	for i in $(seq $RUNS); do
+		taskset -c $BENCH_CPUS ./swift -s $SIZE -o rarest -p 4 $DIR \
+			| (cd results && split_swift swift_seed) || FAILED=1
+		taskset -c $BENCH_CPUS ./swift -s $SIZE -o random -p 4 -l $DIR \
+			| (cd results && split_swift swift_leech) || FAILED=1
+	done
+	sleep 1s
+	fusermount -u $DIR
+	[ -z $FAILED ] || exit 1
+fi
+
+rm -rf $DIR ${DIR}_real ${DIR}_ref
+
+if [ "$BASELINE" = 1 ]; then
+	cp results/* baselines/
+	echo "Baselines updated: $(ls baselines | wc -l) metrics"
+	exit 0
+fi
+./compare.py results baselines
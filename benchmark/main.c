@@ -1,4 +1,5 @@
 #define _LARGEFILE_SOURCE
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdint.h>
@@ -26,7 +27,10 @@ int prepare_file(const char *pathname, off_t size) {
 	return 0;
 }
 
-int read_bm(int fd, int fd2, uint64_t chunk_size) {
+#define MAXCHUNK 65536
+#define PAGESIZE 4096
+
+int read_bm(int fd, int fd2, uint64_t chunk_size, char *buf) {
 	struct stat st;
 	
 	// get file size
@@ -38,7 +42,6 @@ int read_bm(int fd, int fd2, uint64_t chunk_size) {
 	uint64_t cn = st.st_size / chunk_size;
 	struct timeval t1, t2;
     double duration;
-    char buf[65536];
 
     for (j = 0; j < 1000; j++) {
     	// LFS
@@ -93,11 +96,28 @@ int main(int argc, char *argv[]) {
 
 	// system(buffer);
 
-	int fd = open(path, O_RDONLY);
-	int fd2 = open(path2, O_RDONLY);
-	read_bm(fd, fd2, atoi(argv[3]));
+	// optional 5th argument: "direct" opens both files with O_DIRECT
+	int flags = O_RDONLY;
+	if (argc > 5 && strcmp(argv[5], "direct") == 0) {
+		flags |= O_DIRECT;
+	}
+
+	// O_DIRECT needs an aligned buffer
+	char *buf;
+	if (posix_memalign((void **)&buf, PAGESIZE, MAXCHUNK) != 0) {
+		exit(1);
+	}
+
+	int fd = open(path, flags);
+	int fd2 = open(path2, flags);
+	if (fd == -1 || fd2 == -1) {
+		perror("open");
+		exit(1);
+	}
+	read_bm(fd, fd2, atoi(argv[3]), buf);
 	close(fd);
 	close(fd2);
+	free(buf);
 
 	return 0;
 }
\ No newline at end of file
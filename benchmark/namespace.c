@@ -0,0 +1,300 @@
+/*
+ * Namespace benchmark: create, stat, open/close, rename, readdir and unlink
+ * of many files in one directory, by one or more threads.
+ *
+ * Every phase works on all files, split between the threads by index, and
+ * prints one line:
+ *
+ *     files threads op ops/s p50_us p99_us p999_us rss_kb
+ *
+ * where rss_kb is the resident set of the process given with -P (the LFS
+ * daemon) after the phase, or 0. readdir is a single pass by one thread,
+ * its ops are entries and its latencies are per readdir() call.
+ *
+ * Build: gcc -O2 -Wall -o namespace namespace.c -lpthread
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define MAXTHREADS 256
+
+enum { OP_CREATE, OP_STAT, OP_OPEN, OP_RENAME, OP_READDIR, OP_UNLINK,
+       OP_COUNT };
+
+static const char *op_names[OP_COUNT] = {
+	"create", "stat", "open", "rename", "readdir", "unlink"
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned id;
+	int op;
+	uint64_t *ns;	// latencies of this thread's share
+	uint64_t n, cap;
+	int err;
+};
+
+static struct {
+	const char *dir;
+	uint64_t nfiles;
+	unsigned nthreads;
+	int renamed;	// files have their second name
+	pid_t daemon;
+} s;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// data file names, so LFS never stores anything
+static void file_path(char *buf, size_t size, uint64_t i, int renamed)
+{
+	snprintf(buf, size, "%s/aaaaaaaa_0_%llu%s", s.dir, (unsigned long long)i,
+		 renamed ? "_r" : "");
+}
+
+static int one_op(int op, uint64_t i)
+{
+	char path[512], path2[512];
+	struct stat st;
+	int fd;
+
+	file_path(path, sizeof(path), i, s.renamed);
+	switch (op) {
+	case OP_CREATE:
+		if ((fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644)) == -1) {
+			return -1;
+		}
+		return close(fd);
+	case OP_STAT:
+		return stat(path, &st);
+	case OP_OPEN:
+		if ((fd = open(path, O_RDONLY)) == -1) {
+			return -1;
+		}
+		return close(fd);
+	case OP_RENAME:
+		file_path(path2, sizeof(path2), i, !s.renamed);
+		return rename(path, path2);
+	case OP_UNLINK:
+		return unlink(path);
+	}
+	return -1;
+}
+
+static void *worker_run(void *arg)
+{
+	struct worker *w = arg;
+	uint64_t i, t;
+
+	for (i = w->id; i < s.nfiles; i += s.nthreads) {
+		t = now_ns();
+		if (one_op(w->op, i) == -1) {
+			w->err = errno;
+			return NULL;
+		}
+		w->ns[w->n++] = now_ns() - t;
+	}
+	return NULL;
+}
+
+static int readdir_pass(struct worker *w)
+{
+	struct dirent *de;
+	uint64_t t, entries = 0;
+	DIR *d;
+
+	if ((d = opendir(s.dir)) == NULL) {
+		w->err = errno;
+		return -1;
+	}
+	for (;;) {
+		if (w->n == w->cap) {
+			// more entries than files, someone else's
+			w->cap *= 2;
+			if ((w->ns = realloc(w->ns, w->cap * sizeof(*w->ns))) == NULL) {
+				w->err = errno;
+				closedir(d);
+				return -1;
+			}
+		}
+		t = now_ns();
+		de = readdir(d);
+		w->ns[w->n++] = now_ns() - t;
+		if (de == NULL) {
+			break;
+		}
+		entries += (de->d_name[0] != '.');
+	}
+	closedir(d);
+	if (entries < s.nfiles) {
+		fprintf(stderr, "readdir: %llu of %llu files\n",
+			(unsigned long long)entries, (unsigned long long)s.nfiles);
+	}
+	return 0;
+}
+
+static int by_ns(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static long daemon_rss(void)
+{
+	char path[64], line[256];
+	long kb = 0;
+	FILE *f;
+
+	if (s.daemon == 0) {
+		return 0;
+	}
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)s.daemon);
+	if ((f = fopen(path, "r")) == NULL) {
+		return 0;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "VmRSS: %ld", &kb) == 1) {
+			break;
+		}
+	}
+	fclose(f);
+	return kb;
+}
+
+static void phase(struct worker *w, int op)
+{
+	uint64_t t, n = 0, *all, i;
+	unsigned j, nthreads = (op == OP_READDIR) ? 1 : s.nthreads;
+	double secs;
+
+	for (j = 0; j < nthreads; j++) {
+		w[j].op = op;
+		w[j].n = 0;
+	}
+	t = now_ns();
+	if (op == OP_READDIR) {
+		readdir_pass(&w[0]);
+	} else {
+		for (j = 0; j < nthreads; j++) {
+			if (pthread_create(&w[j].thread, NULL, worker_run, &w[j]) != 0) {
+				perror("pthread_create");
+				exit(1);
+			}
+		}
+		for (j = 0; j < nthreads; j++) {
+			pthread_join(w[j].thread, NULL);
+		}
+	}
+	secs = (now_ns() - t) / 1e9;
+
+	for (j = 0; j < nthreads; j++) {
+		if (w[j].err != 0) {
+			fprintf(stderr, "%s: %s\n", op_names[op], strerror(w[j].err));
+			exit(1);
+		}
+		n += w[j].n;
+	}
+	if ((all = malloc(n * sizeof(*all))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0, j = 0; j < nthreads; j++) {
+		memcpy(all + i, w[j].ns, w[j].n * sizeof(*all));
+		i += w[j].n;
+	}
+	qsort(all, n, sizeof(*all), by_ns);
+
+	printf("%llu %u %s %.1lf %.1lf %.1lf %.1lf %ld\n",
+	       (unsigned long long)s.nfiles, s.nthreads, op_names[op],
+	       (op == OP_READDIR ? s.nfiles : n) / secs, all[n / 2] / 1e3,
+	       all[n * 99 / 100] / 1e3, all[n * 999 / 1000] / 1e3, daemon_rss());
+	fflush(stdout);
+	free(all);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options] DIR\n"
+		"    -n N       files (1000)\n"
+		"    -t N       threads (1)\n"
+		"    -P PID     report the RSS of this process (the daemon)\n"
+		"    -k         keep the files, skip the unlink phase\n"
+		"    -c         only create the files (and keep them)\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct worker *w;
+	unsigned j;
+	int c, keep = 0, create = 0;
+
+	s.nfiles = 1000;
+	s.nthreads = 1;
+	while ((c = getopt(argc, argv, "n:t:P:kc")) != -1) {
+		switch (c) {
+		case 'n': s.nfiles = strtoull(optarg, NULL, 0); break;
+		case 't': s.nthreads = atoi(optarg); break;
+		case 'P': s.daemon = atoi(optarg); break;
+		case 'k': keep = 1; break;
+		case 'c': create = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || s.nfiles == 0 || s.nthreads == 0 ||
+	    s.nthreads > MAXTHREADS) {
+		usage(argv[0]);
+	}
+	s.dir = argv[optind];
+
+	if ((w = calloc(s.nthreads, sizeof(*w))) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	for (j = 0; j < s.nthreads; j++) {
+		w[j].id = j;
+		// readdir uses the first one for every entry, plus the end
+		w[j].cap = (j == 0) ? s.nfiles + 3 : s.nfiles / s.nthreads + 1;
+		w[j].ns = malloc(w[j].cap * sizeof(uint64_t));
+		if (w[j].ns == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+	}
+
+	phase(w, OP_CREATE);
+	if (create) {
+		return 0;
+	}
+	phase(w, OP_STAT);
+	phase(w, OP_OPEN);
+	phase(w, OP_READDIR);
+	phase(w, OP_RENAME);
+	s.renamed = 1;
+	if (!keep) {
+		phase(w, OP_UNLINK);
+	}
+
+	return 0;
+}
@@ -0,0 +1,49 @@
+set terminal svg fname 'Helvetica' fsize 9 rounded size 900, 600
+set output "namespace.svg"
+
+# ./times/namespace.dat: files threads op ops/s p50_us p99_us p999_us rss_kb
+# ./times/namespace.mount: files us, to mount a snapshot of that many
+dat = './times/namespace.dat'
+ops = "create stat open rename readdir unlink"
+
+set style line 80 lt rgb "#000000"
+set style line 81 lt rgb "#606060" lw 0.5
+set grid back linestyle 81
+set border 3 back linestyle 80
+set xtics nomirror
+set ytics nomirror
+set logscale x
+set xlabel "Files"
+set key left bottom
+
+set multiplot layout 2, 2 title "Namespace operations"
+
+# the lowest thread count of the run, and the highest
+stats dat u 2 nooutput
+t1 = STATS_min
+tn = STATS_max
+
+set logscale y
+set ylabel "ops/s"
+set title sprintf("Throughput, %d thread(s)", t1)
+plot for [op in ops] dat u 1:($2 == t1 && strcol(3) eq op ? $4 : NaN) \
+     w lp title op
+set title sprintf("Throughput, %d threads", tn)
+plot for [op in ops] dat u 1:($2 == tn && strcol(3) eq op ? $4 : NaN) \
+     w lp title op
+
+set ylabel "p99 latency (us)"
+set title sprintf("Tail latency, %d threads", tn)
+plot for [op in ops] dat u 1:($2 == tn && strcol(3) eq op ? $6 : NaN) \
+     w lp title op
+
+set ylabel "Daemon RSS (KiB)"
+set y2label "Mount to ready (us)"
+set y2tics
+set title "Memory and mount time"
+plot dat u 1:($2 == t1 && strcol(3) eq "create" ? $8 : NaN) \
+     w lp title "RSS after create", \
+     './times/namespace.mount' u 1:2 axes x1y2 \
+     w lp title "mount to ready"
+
+unset multiplot
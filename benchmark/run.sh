@@ -6,14 +6,19 @@
 
 [ -z $SIZE ] && SIZE=${1:-$((1024*1024))}
 [ -z $DIR ] && DIR=${2:-"./test"}
-[ -z $DIR_REAL ] && DIR_REAL=${2:-"./real"}
+[ -z $DIR_REAL ] && DIR_REAL="./real"
 [ -z $PATTERN ] && PATTERN=${3:-"aaaaaaaa"}
 [ -z $LFS ] && LFS=./lfs
+[ -z $PRELOAD ] && PRELOAD=./liblfs_preload.so
 
 echo "File size: $SIZE bytes"
 echo "Directory: $DIR"
 echo "Pattern: $PATTERN"
 
+# main opens its second file relative to $DIR, like the first (so $DIR is one
+# level deep): the same content on the real FS, for comparison
+REF=../$DIR_REAL/${PATTERN}_test
+
 rm ./times/*
 mkdir -p ./times
 
@@ -26,7 +31,7 @@ truncate -s $SIZE $DIR/${PATTERN}_test
 ls -alh $DIR
 cp $DIR/${PATTERN}_test $DIR_REAL
 for cs in 32 40 64 128 256 512 1024 2048 3072 4096 8192 16384 32768 65536; do
-	taskset -c 1 ./main $DIR ${PATTERN}_test $cs $DIR_REAL 1>./times/nokcache.$cs
+	taskset -c 1 ./main $DIR ${PATTERN}_test $cs $REF 1>./times/nokcache.$cs
 done
 sleep 1s
 fusermount -u $DIR
@@ -43,7 +48,24 @@ truncate -s $SIZE $DIR/${PATTERN}_test
 ls -alh $DIR
 cp $DIR/${PATTERN}_test $DIR_REAL
 for cs in 32 40 64 128 256 512 1024 2048 3072 4096 8192 16384 32768 65536; do
-	taskset -c 1 ./main $DIR ${PATTERN}_test $cs $DIR_REAL 1>./times/kcache.$cs
+	taskset -c 1 ./main $DIR ${PATTERN}_test $cs $REF 1>./times/kcache.$cs
+done
+sleep 1s
+fusermount -u $DIR
+rm ${DIR}_real/*
+rm $DIR_REAL/*
+rmdir $DIR ${DIR}_real $DIR_REAL
+
+# LFS and real FS with direct I/O (O_DIRECT needs block-aligned chunks)
+mkdir -p $DIR
+mkdir -p ${DIR}_real
+mkdir -p $DIR_REAL
+taskset -c 0 $LFS -o realstore=${DIR}_real,direct_io $DIR
+truncate -s $SIZE $DIR/${PATTERN}_test
+ls -alh $DIR
+cp $DIR/${PATTERN}_test $DIR_REAL
+for cs in 512 1024 2048 3072 4096 8192 16384 32768 65536; do
+	taskset -c 1 ./main $DIR ${PATTERN}_test $cs $REF direct 1>./times/direct.$cs
 done
 sleep 1s
 fusermount -u $DIR
@@ -51,6 +73,21 @@ rm ${DIR}_real/*
 rm $DIR_REAL/*
 rmdir $DIR ${DIR}_real $DIR_REAL
 
+# LFS served in-process by the LD_PRELOAD shim, nothing mounted (the name
+# gives the size, as the file can't be created by another process)
+mkdir -p $DIR
+mkdir -p ${DIR}_real
+mkdir -p $DIR_REAL
+truncate -s $SIZE $DIR_REAL/${PATTERN}_test
+for cs in 32 40 64 128 256 512 1024 2048 3072 4096 8192 16384 32768 65536; do
+	LFS_PREFIX=$DIR LFS_REALSTORE=${DIR}_real LD_PRELOAD=$PRELOAD \
+		taskset -c 1 ./main $DIR ${PATTERN}_${SIZE}_test $cs $REF 1>./times/preload.$cs
+done
+rm $DIR_REAL/*
+rmdir $DIR ${DIR}_real $DIR_REAL
+
+./stats.py direct > reads.direct.stats
+./stats.py preload > reads.preload.stats
 ./stats.py > reads.stats
 cat reads.stats | head -4 > reads.stats.1
 cat reads.stats | tail -9 > reads.stats.2
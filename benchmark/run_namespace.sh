@@ -0,0 +1,65 @@
+#!/bin/bash
+
+# Namespace operations (see namespace.c) on a fresh LFS mount, from 1K to 10M
+# files, with one and several threads. Results go to ./times/namespace.dat,
+# mount-to-ready times to ./times/namespace.mount, plotted in namespace.svg.
+#
+# Mount to ready is the time until the root answers on a mount started from
+# a snapshot of a store with that many files (restore= option), the snapshot
+# is taken once per file count.
+#
+# Usage: ./run_namespace.sh [dir]
+#
+# You can also export DIR, FILES, THREADS before running
+
+[ -z $DIR ] && DIR=${1:-"./test"}
+[ -z "$FILES" ] && FILES="1000 10000 100000 1000000 10000000"
+[ -z "$THREADS" ] && THREADS="1 8"
+[ -z $LFS ] && LFS=./lfs
+
+[ -x ./namespace ] || gcc -O2 -Wall -o namespace namespace.c -lpthread || exit 1
+
+mkdir -p ./times
+rm -f ./times/namespace.*
+
+# mounts with the given options, returns once the root answers
+mount_ready() {
+	taskset -c 0 $LFS -o realstore=${DIR}_real$1 $DIR || exit 1
+	while ! mountpoint -q $DIR; do
+		sleep 0.001
+	done
+	stat $DIR >/dev/null
+}
+
+TMAX=$(echo $THREADS | tr ' ' '\n' | sort -n | tail -n 1)
+
+for n in $FILES; do
+	mkdir -p $DIR ${DIR}_real
+
+	# a store with n files, kept as a snapshot in realstore
+	mount_ready
+	taskset -c 1-15 ./namespace -n $n -t $TMAX -c $DIR >/dev/null || exit 1
+	setfattr -n user.lfs.snapshot -v namespace_$n $DIR || exit 1
+	fusermount -u $DIR
+
+	start=$(date +%s%N)
+	mount_ready ,restore=namespace_$n
+	echo $n $(( ($(date +%s%N) - start) / 1000 )) >>./times/namespace.mount
+	fusermount -u $DIR
+	rm -rf ${DIR}_real
+
+	for t in $THREADS; do
+		mkdir -p ${DIR}_real
+		mount_ready
+		pid=$(pgrep -n -x $(basename $LFS))
+
+		taskset -c 1-15 ./namespace -n $n -t $t -P $pid $DIR \
+			| tee -a ./times/namespace.dat
+
+		fusermount -u $DIR
+		rm -rf ${DIR}_real
+	done
+	rmdir $DIR
+done
+
+gnuplot namespace.gnuplot
@@ -0,0 +1,43 @@
+#!/bin/bash
+
+# Swift-shaped workload (see swift.c) on LFS and on a real directory, for
+# every ordering and a few peer counts. Results go to ./times/swift.*
+#
+# Usage: ./run_swift.sh [size] [dir]
+#
+# You can also export SIZE, DIR, CHUNK, PEERS before running
+
+[ -z $SIZE ] && SIZE=${1:-$((1024*1024*1024))}
+[ -z $DIR ] && DIR=${2:-"./test"}
+[ -z $DIR_REAL ] && DIR_REAL="./real"
+[ -z $CHUNK ] && CHUNK=8192
+[ -z "$PEERS" ] && PEERS="1 4 16"
+[ -z $LFS ] && LFS=./lfs
+
+[ -x ./swift ] || gcc -O2 -Wall -o swift swift.c -lpthread || exit 1
+
+echo "File size: $SIZE bytes, chunk size: $CHUNK"
+
+mkdir -p ./times
+rm -f ./times/swift.*
+
+mkdir -p $DIR ${DIR}_real $DIR_REAL
+taskset -c 0 $LFS -o realstore=${DIR}_real $DIR
+for fs in lfs real; do
+	[ $fs = lfs ] && d=$DIR || d=$DIR_REAL
+	for mode in seed leech; do
+		[ $mode = leech ] && flag=-l || flag=
+		for order in seq random rarest; do
+			for peers in $PEERS; do
+				taskset -c 1-3 ./swift -s $SIZE -c $CHUNK -o $order \
+					-p $peers $flag $d >>./times/swift.$fs.$mode
+			done
+		done
+	done
+done
+sleep 1s
+fusermount -u $DIR
+rm -f ${DIR}_real/* $DIR_REAL/*
+rmdir $DIR ${DIR}_real $DIR_REAL
+
+grep -h "chunks/s" ./times/swift.*
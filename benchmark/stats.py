@@ -1,6 +1,7 @@
 #!/usr/bin/env python
 
 import os
+import sys
 from numpy import mean, std
 from scipy.stats import cmedian 
 
@@ -8,7 +9,20 @@ DIR = "./times"
 
 #print "Chunk Size, LFS Mean, LFS StdDev, LFS Median, ext4 Mean, ext4 StdDev, ext4 Median, LFS (kcache) Mean, LFS (kcache) StdDev, LFS (kcache) Median"
 
+def chunk_name(cs):
+	return cs if int(cs) < 1024 else str(int(cs)/1024) + "K"
+
 files = sorted(os.listdir(DIR), key=lambda x: int(x.split(".")[1]))
+
+if len(sys.argv) > 1 and sys.argv[1] in ("direct", "preload"):
+	# Chunk Size, LFS Mean, LFS StdDev, LFS Median, ext4 Mean, ext4 StdDev, ext4 Median (all O_DIRECT, or LFS in-process)
+	prefix = sys.argv[1] + "."
+	for filename in [x for x in files if x.startswith(prefix)]:
+		a = [map(float, x.split(" ")) for x in open(os.path.join(DIR, filename)).read().split("\n")[:-1]]
+		a = zip(*a)
+		print ','.join(map(str, [chunk_name(filename[len(prefix):]), mean(a[0]), std(a[0]), cmedian(a[0]), mean(a[1]), std(a[1]), cmedian(a[1])]))
+	sys.exit(0)
+
 files = [x for x in files if x.startswith("nokcache")]
 for filename in files:
 	fn = os.path.join(DIR, filename)
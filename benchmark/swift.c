@@ -0,0 +1,478 @@
+/*
+ * Swift-shaped workload: the I/O a libswift peer does on its three files,
+ * generated synthetically so storage can be compared without a swarm.
+ *
+ * Chunks of the content file are read (seeding) or written (leeching) one
+ * at a time, in sequential, random or rarest-first order. Every chunk comes
+ * with its uncle hashes, 20 byte reads (seeding) or writes (leeching) in the
+ * .mhash, one per tree level. While leeching, the .mbinmap is rewritten every
+ * few chunks, the same header LFS parses followed by the bitmap of chunks
+ * done so far.
+ *
+ * Each of the peers is a thread. Seeding, every peer fetches the whole
+ * content in its own order. Leeching, the peers share one order and each
+ * chunk comes from whichever peer claims it first.
+ *
+ * Works on any directory, LFS or not. Prints chunks/s and latency per kind
+ * of operation.
+ *
+ * Build: gcc -O2 -Wall -o swift swift.c -lpthread
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define HASHSIZE 20	// SHA-1, as in the .mhash
+#define MAXPEERS 256
+
+enum { ORDER_SEQ, ORDER_RANDOM, ORDER_RAREST };
+enum { OP_CHUNK, OP_UNCLE, OP_BINMAP, OP_COUNT };
+
+static const char *op_names[OP_COUNT] = { "chunk", "uncle", "binmap" };
+
+struct lat {
+	uint64_t *ns;
+	size_t n, max;
+};
+
+struct peer {
+	pthread_t thread;
+	unsigned id;
+	uint32_t *order;	// own order when seeding, NULL when leeching
+	uint64_t next;
+	struct lat lat[OP_COUNT];
+	char *buf;
+	int err;
+};
+
+static struct {
+	uint64_t size, chunk, nchunks, limit;
+	unsigned height;	// of the hash tree, leaves are level 0
+	unsigned peers;
+	int order, leech, binmap_every;
+	int fd, hashfd, mapfd;
+	uint32_t *order_shared;
+	uint64_t claimed;	// next index of order_shared, atomic
+	uint64_t done;		// chunks written, for the binmap
+	unsigned char *bitmap;
+	pthread_mutex_t map_lock;
+	char name[256];
+} s;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void lat_add(struct lat *l, uint64_t ns)
+{
+	if (l->n == l->max) {
+		l->max = l->max ? 2 * l->max : 1024;
+		l->ns = realloc(l->ns, l->max * sizeof(*l->ns));
+		if (l->ns == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	l->ns[l->n++] = ns;
+}
+
+static uint64_t xorshift(uint64_t *x)
+{
+	*x ^= *x << 13;
+	*x ^= *x >> 7;
+	*x ^= *x << 17;
+	return *x;
+}
+
+static uint64_t *sort_keys;
+
+static int by_key(const void *a, const void *b)
+{
+	uint64_t ka = sort_keys[*(const uint32_t *)a];
+	uint64_t kb = sort_keys[*(const uint32_t *)b];
+
+	return (ka > kb) - (ka < kb);
+}
+
+/*
+ * Fills order with a permutation of the chunks. Rarest-first gives every
+ * chunk a random availability among the peers (each has it with p = 1/2),
+ * takes the rarest first and breaks ties randomly, like swift picking among
+ * what its neighbours announce.
+ */
+static void make_order(uint32_t *order, uint64_t seed)
+{
+	uint64_t i, j, x = seed * 0x9e3779b97f4a7c15ULL + 1;
+	uint32_t t;
+
+	for (i = 0; i < s.nchunks; i++) {
+		order[i] = i;
+	}
+	if (s.order == ORDER_RANDOM) {
+		for (i = s.nchunks - 1; i > 0; i--) {
+			j = xorshift(&x) % (i + 1);
+			t = order[i];
+			order[i] = order[j];
+			order[j] = t;
+		}
+	} else if (s.order == ORDER_RAREST) {
+		sort_keys = malloc(s.nchunks * sizeof(*sort_keys));
+		if (sort_keys == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		for (i = 0; i < s.nchunks; i++) {
+			uint64_t have = 0, left = s.peers;
+			while (left > 0) {
+				unsigned n = left < 64 ? left : 64;
+				uint64_t r = xorshift(&x);
+				have += __builtin_popcountll(n < 64 ? r & ((1ULL << n) - 1) : r);
+				left -= n;
+			}
+			// availability first, then a random tie break
+			sort_keys[i] = (have << 40) | (xorshift(&x) & ((1ULL << 40) - 1));
+		}
+		qsort(order, s.nchunks, sizeof(*order), by_key);
+		free(sort_keys);
+	}
+}
+
+/*
+ * Uncle hash offsets of chunk i in the .mhash: bins are numbered in order,
+ * node k of level l is bin (2k + 1) * 2^l - 1, and its uncle at each level
+ * is its sibling.
+ */
+static unsigned uncles(uint64_t i, off_t *off)
+{
+	uint64_t k = i;
+	unsigned l;
+
+	for (l = 0; l < s.height; l++, k >>= 1) {
+		off[l] = (off_t)((((k ^ 1) << 1) + 1) << l) - 1;
+		off[l] *= HASHSIZE;
+	}
+	return s.height;
+}
+
+static int timed_io(struct peer *p, int op, int write, int fd, char *buf,
+	size_t size, off_t off)
+{
+	uint64_t t = now_ns();
+	ssize_t r = write ? pwrite(fd, buf, size, off) : pread(fd, buf, size, off);
+
+	lat_add(&p->lat[op], now_ns() - t);
+	if (r == -1) {
+		p->err = errno;
+		return -1;
+	}
+	return 0;
+}
+
+/* Rewrites the .mbinmap after chunk i is done. */
+static int binmap_update(struct peer *p, uint64_t i)
+{
+	char head[256];
+	size_t hl, mapsize = (s.nchunks + 7) / 8;
+	uint64_t t, done;
+	int r = 0;
+
+	pthread_mutex_lock(&s.map_lock);
+	s.bitmap[i / 8] |= 1 << (i % 8);
+	done = ++s.done;
+	if (done % s.binmap_every == 0 || done == s.nchunks) {
+		hl = snprintf(head, sizeof(head), "version 1\nroot hash %040x\n"
+			"chunk size %lu\ncomplete %llu\n", 0, (unsigned long)s.chunk,
+			(unsigned long long)(done == s.nchunks ? s.size :
+			done * s.chunk));
+		t = now_ns();
+		if (pwrite(s.mapfd, head, hl, 0) != (ssize_t)hl ||
+		    pwrite(s.mapfd, s.bitmap, mapsize, hl) != (ssize_t)mapsize ||
+		    ftruncate(s.mapfd, hl + mapsize) == -1) {
+			p->err = errno;
+			r = -1;
+		}
+		lat_add(&p->lat[OP_BINMAP], now_ns() - t);
+	}
+	pthread_mutex_unlock(&s.map_lock);
+
+	return r;
+}
+
+static void *peer_run(void *arg)
+{
+	struct peer *p = arg;
+	off_t off[64];
+	char hash[HASHSIZE];
+	uint64_t idx, i, len;
+	unsigned l, n;
+
+	memset(hash, p->id, sizeof(hash));
+	for (;;) {
+		if (p->order != NULL) {
+			if (p->next >= s.limit) {
+				break;
+			}
+			i = p->order[p->next++];
+		} else {
+			idx = __atomic_fetch_add(&s.claimed, 1, __ATOMIC_RELAXED);
+			if (idx >= s.limit) {
+				break;
+			}
+			i = s.order_shared[idx];
+			p->next++;
+		}
+
+		len = s.chunk;
+		if ((i + 1) * s.chunk > s.size) {
+			len = s.size - i * s.chunk;
+		}
+		n = uncles(i, off);
+		if (s.leech) {
+			// hashes arrive first and are checked, then the chunk is stored
+			for (l = 0; l < n; l++) {
+				if (timed_io(p, OP_UNCLE, 1, s.hashfd, hash, HASHSIZE,
+					     off[l]) == -1) {
+					return NULL;
+				}
+			}
+			if (timed_io(p, OP_CHUNK, 1, s.fd, p->buf, len,
+				     i * s.chunk) == -1 || binmap_update(p, i) == -1) {
+				return NULL;
+			}
+		} else {
+			if (timed_io(p, OP_CHUNK, 0, s.fd, p->buf, len,
+				     i * s.chunk) == -1) {
+				return NULL;
+			}
+			for (l = 0; l < n; l++) {
+				if (timed_io(p, OP_UNCLE, 0, s.hashfd, hash, HASHSIZE,
+					     off[l]) == -1) {
+					return NULL;
+				}
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static int by_ns(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void report(struct peer *peers, double secs)
+{
+	struct lat all;
+	uint64_t chunks = 0, sum;
+	unsigned i, op;
+	size_t j;
+
+	for (i = 0; i < s.peers; i++) {
+		chunks += peers[i].next;
+	}
+	printf("%s %s %s, %u peers: %llu chunks in %.3lf s, %.1lf chunks/s, "
+	       "%.1lf MiB/s\n", s.name, s.leech ? "leech" : "seed",
+	       s.order == ORDER_SEQ ? "seq" : s.order == ORDER_RANDOM ? "random" :
+	       "rarest", s.peers, (unsigned long long)chunks, secs, chunks / secs,
+	       chunks * (double)s.chunk / secs / (1 << 20));
+	printf("%-8s %10s %10s %10s %10s %10s\n", "op", "count", "mean_us",
+	       "p50_us", "p99_us", "max_us");
+
+	for (op = 0; op < OP_COUNT; op++) {
+		memset(&all, 0, sizeof(all));
+		for (i = 0; i < s.peers; i++) {
+			for (j = 0; j < peers[i].lat[op].n; j++) {
+				lat_add(&all, peers[i].lat[op].ns[j]);
+			}
+		}
+		if (all.n == 0) {
+			continue;
+		}
+		qsort(all.ns, all.n, sizeof(*all.ns), by_ns);
+		for (sum = 0, j = 0; j < all.n; j++) {
+			sum += all.ns[j];
+		}
+		printf("%-8s %10zu %10.1lf %10.1lf %10.1lf %10.1lf\n", op_names[op],
+		       all.n, sum / 1e3 / all.n, all.ns[all.n / 2] / 1e3,
+		       all.ns[all.n * 99 / 100] / 1e3, all.ns[all.n - 1] / 1e3);
+		free(all.ns);
+	}
+}
+
+static int open_at(const char *dir, const char *name, const char *ext,
+	int flags)
+{
+	char path[512];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s%s", dir, name, ext);
+	if ((fd = open(path, flags, 0644)) == -1) {
+		perror(path);
+		exit(1);
+	}
+	return fd;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options] DIR\n"
+		"    -s BYTES   content size (1073741824)\n"
+		"    -c BYTES   chunk size (8192)\n"
+		"    -o ORDER   seq, random or rarest (rarest)\n"
+		"    -p N       peers (1)\n"
+		"    -l         leech (write) instead of seed (read)\n"
+		"    -b N       rewrite the .mbinmap every N chunks (64)\n"
+		"    -n N       stop after N chunks per peer (seeding) or in total\n"
+		"    -x HEX     pattern, first 8 hex digits of the name (aaaaaaaa)\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct peer *peers;
+	const char *pattern = "aaaaaaaa", *dir;
+	uint64_t t;
+	struct stat st;
+	unsigned i;
+	int c, flags;
+
+	s.size = 1ULL << 30;
+	s.chunk = 8192;
+	s.order = ORDER_RAREST;
+	s.peers = 1;
+	s.binmap_every = 64;
+	while ((c = getopt(argc, argv, "s:c:o:p:lb:n:x:")) != -1) {
+		switch (c) {
+		case 's': s.size = strtoull(optarg, NULL, 0); break;
+		case 'c': s.chunk = strtoull(optarg, NULL, 0); break;
+		case 'p': s.peers = atoi(optarg); break;
+		case 'l': s.leech = 1; break;
+		case 'b': s.binmap_every = atoi(optarg); break;
+		case 'n': s.limit = strtoull(optarg, NULL, 0); break;
+		case 'x': pattern = optarg; break;
+		case 'o':
+			if (strcmp(optarg, "seq") == 0) {
+				s.order = ORDER_SEQ;
+			} else if (strcmp(optarg, "random") == 0) {
+				s.order = ORDER_RANDOM;
+			} else if (strcmp(optarg, "rarest") == 0) {
+				s.order = ORDER_RAREST;
+			} else {
+				usage(argv[0]);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || s.size == 0 || s.chunk == 0 || s.peers == 0 ||
+	    s.peers > MAXPEERS || s.binmap_every <= 0) {
+		usage(argv[0]);
+	}
+	dir = argv[optind];
+
+	s.nchunks = (s.size + s.chunk - 1) / s.chunk;
+	if (s.nchunks > UINT32_MAX) {
+		fprintf(stderr, "too many chunks\n");
+		exit(1);
+	}
+	while ((1ULL << s.height) < s.nchunks) {
+		s.height++;
+	}
+	if (s.limit == 0 || s.limit > s.nchunks) {
+		s.limit = s.nchunks;
+	}
+
+	// deadbeef_size_chunksize, so LFS knows the pattern and the size
+	snprintf(s.name, sizeof(s.name), "%.8s_%llu_%llu", pattern,
+		 (unsigned long long)s.size, (unsigned long long)s.chunk);
+	flags = s.leech ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR | O_CREAT;
+	s.fd = open_at(dir, s.name, "", flags);
+	s.hashfd = open_at(dir, s.name, ".mhash", O_RDWR | O_CREAT);
+	s.mapfd = open_at(dir, s.name, ".mbinmap", flags);
+	if (!s.leech && fstat(s.fd, &st) == 0 && (uint64_t)st.st_size < s.size &&
+	    ftruncate(s.fd, s.size) == -1) {
+		perror("ftruncate");
+		exit(1);
+	}
+	// the full tree, so uncles are there to read
+	if (ftruncate(s.hashfd, (2 * (1ULL << s.height) - 1) * HASHSIZE) == -1) {
+		perror("ftruncate");
+		exit(1);
+	}
+
+	peers = calloc(s.peers, sizeof(*peers));
+	s.bitmap = calloc((s.nchunks + 7) / 8, 1);
+	pthread_mutex_init(&s.map_lock, NULL);
+	if (peers == NULL || s.bitmap == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < s.peers; i++) {
+		peers[i].id = i;
+		if (posix_memalign((void **)&peers[i].buf, 4096, s.chunk) != 0) {
+			perror("posix_memalign");
+			exit(1);
+		}
+		memset(peers[i].buf, 0xaa, s.chunk);
+		if (!s.leech || i == 0) {
+			uint32_t *order = malloc(s.nchunks * sizeof(*order));
+			if (order == NULL) {
+				perror("malloc");
+				exit(1);
+			}
+			make_order(order, i + 1);
+			if (s.leech) {
+				s.order_shared = order;
+			} else {
+				peers[i].order = order;
+			}
+		}
+	}
+
+	t = now_ns();
+	for (i = 0; i < s.peers; i++) {
+		if (pthread_create(&peers[i].thread, NULL, peer_run, &peers[i]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	for (i = 0; i < s.peers; i++) {
+		pthread_join(peers[i].thread, NULL);
+	}
+	t = now_ns() - t;
+
+	for (i = 0; i < s.peers; i++) {
+		if (peers[i].err != 0) {
+			fprintf(stderr, "peer %u: %s\n", i, strerror(peers[i].err));
+			exit(1);
+		}
+	}
+	report(peers, t / 1e9);
+
+	close(s.fd);
+	close(s.hashfd);
+	close(s.mapfd);
+
+	return 0;
+}
@@ -0,0 +1,215 @@
+/*
+ * Content of LFS files. See content.h.
+ */
+
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "content.h"
+
+#define DEFAULT_RULES "*.mhash=real:*.mbinmap=real"
+
+static const char *class_names[CLASS_COUNT] = {
+    [CLASS_GENERATED] = "generated",
+    [CLASS_REAL]      = "real",
+    [CLASS_RAM]       = "ram",
+    [CLASS_DISCARD]   = "discard",
+};
+
+const char *class_name(int cls)
+{
+    return class_names[cls];
+}
+
+/* Compiles pattern=class of length len into r. Returns 0 or -1. */
+static int rule_parse(struct class_rule *r, const char *s, size_t len)
+{
+    const char *eq = memchr(s, '=', len), *lit = s;
+    size_t plen, llen, i;
+    int c;
+
+    if (eq == NULL || eq == s) {
+        return -1;
+    }
+    llen = plen = eq - s;
+    for (c = 0; c < CLASS_COUNT; c++) {
+        if (strlen(class_names[c]) == len - plen - 1 &&
+            strncmp(eq + 1, class_names[c], len - plen - 1) == 0) {
+            break;
+        }
+    }
+    if (c == CLASS_COUNT) {
+        return -1;
+    }
+    r->cls = c;
+
+    /* only a leading or a trailing '*' makes a literal test */
+    if (s[0] == '*') {
+        r->kind = RULE_SUFFIX;
+        lit = s + 1;
+        llen = plen - 1;
+    } else if (s[plen - 1] == '*') {
+        r->kind = RULE_PREFIX;
+        llen = plen - 1;
+    } else {
+        r->kind = RULE_EXACT;
+    }
+    for (i = 0; i < llen; i++) {
+        if (strchr("*?[\\", lit[i]) != NULL) {
+            r->kind = RULE_GLOB;
+            lit = s;
+            llen = plen;
+            break;
+        }
+    }
+    if ((r->pat = strndup(lit, llen)) == NULL) {
+        return -1;
+    }
+    r->len = llen;
+
+    return 0;
+}
+
+int classes_parse(struct class_rules *cr, const char *spec)
+{
+    const char *specs[2] = { spec, DEFAULT_RULES };
+    const char *s, *end;
+    unsigned i, max = 0;
+
+    cr->rule = NULL;
+    cr->n = 0;
+    for (i = 0; i < 2; i++) {
+        for (s = specs[i]; s != NULL && *s; s = end + (*end != 0)) {
+            end = s + strcspn(s, ":");
+            if (end == s) {
+                continue; /* empty rule */
+            }
+            if (cr->n == max) {
+                struct class_rule *newp;
+                max = 2 * max + 4;
+                if ((newp = realloc(cr->rule, max * sizeof(*newp))) == NULL) {
+                    goto err;
+                }
+                cr->rule = newp;
+            }
+            if (rule_parse(&cr->rule[cr->n], s, end - s) != 0) {
+                goto err;
+            }
+            cr->n++;
+        }
+    }
+
+    return 0;
+
+err:
+    classes_free(cr);
+    return -1;
+}
+
+void classes_free(struct class_rules *cr)
+{
+    unsigned i;
+
+    for (i = 0; i < cr->n; i++) {
+        free(cr->rule[i].pat);
+    }
+    free(cr->rule);
+    cr->rule = NULL;
+    cr->n = 0;
+}
+
+int class_of(const struct class_rules *cr, const char *name)
+{
+    const struct class_rule *r;
+    size_t l = strlen(name);
+    unsigned i;
+
+    for (i = 0; i < cr->n; i++) {
+        r = &cr->rule[i];
+        switch (r->kind) {
+            case RULE_EXACT:
+                if (l == r->len && memcmp(name, r->pat, l) == 0) {
+                    return r->cls;
+                }
+                break;
+            case RULE_PREFIX:
+                if (l >= r->len && memcmp(name, r->pat, r->len) == 0) {
+                    return r->cls;
+                }
+                break;
+            case RULE_SUFFIX:
+                if (l >= r->len &&
+                    memcmp(name + l - r->len, r->pat, r->len) == 0) {
+                    return r->cls;
+                }
+                break;
+            case RULE_GLOB:
+                if (fnmatch(r->pat, name, 0) == 0) {
+                    return r->cls;
+                }
+                break;
+        }
+    }
+
+    return CLASS_GENERATED;
+}
+
+int class_used(const struct class_rules *cr, int cls)
+{
+    unsigned i;
+
+    for (i = 0; i < cr->n; i++) {
+        if (cr->rule[i].cls == cls) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int parse_pattern(const char *s, char *pattern)
+{
+    int i;
+
+    if (strlen(s) < 8) {
+        return -1;
+    }
+
+    for (i = 0; i < 8; i += 2) {
+        if (sscanf(&s[i], "%2hhx", &pattern[i / 2]) != 1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int name_pattern(const char *name, char *pattern)
+{
+    char hex[9];
+
+    strncpy(hex, name, 8);
+    hex[8] = 0;
+
+    return parse_pattern(hex, pattern);
+}
+
+/*
+ * The first period is written byte by byte, then the filled prefix is
+ * doubled with memcpy.
+ */
+void fill_pattern(char *buf, size_t size, const char *pattern, off_t offset)
+{
+    size_t done, n;
+
+    for (done = 0; done < size && done < 4; done++) {
+        buf[done] = pattern[(offset + done) % 4];
+    }
+    while (done < size) {
+        n = (done < size - done) ? done : size - done;
+        memcpy(buf + done, buf, n);
+        done += n;
+    }
+}
@@ -0,0 +1,93 @@
+/*
+ * Content of LFS files, shared by lfs.c and the LD_PRELOAD shim (preload.c).
+ *
+ * Every file belongs to a storage class, picked from its name by mount-time
+ * rules (see classes_parse()):
+ *
+ *     generated  never stored, reads as a 4-byte pattern given by the first
+ *                8 hex digits of the name, repeated from offset 0 (default)
+ *     real       stored on a real filesystem (realstore), e.g. .mhash
+ *     ram        stored in memory (ramstore, a tmpfs directory)
+ *     discard    never stored, reads as zeros
+ *
+ * Writes to generated and discard files only change the size. Files of the
+ * stored classes (real and ram) are the meta files.
+ */
+
+#ifndef LFS_CONTENT_H
+#define LFS_CONTENT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+enum {
+    CLASS_GENERATED,
+    CLASS_REAL,
+    CLASS_RAM,
+    CLASS_DISCARD,
+    CLASS_COUNT,
+};
+
+/* One rule, a name pattern compiled to the cheapest test that does. */
+enum {
+    RULE_EXACT,  /* no wildcard */
+    RULE_PREFIX, /* abc* */
+    RULE_SUFFIX, /* *.abc */
+    RULE_GLOB,   /* anything else, fnmatch() */
+};
+
+struct class_rule {
+    int kind;  /* RULE_* */
+    int cls;   /* CLASS_* */
+    size_t len; /* of the literal part, for prefix and suffix rules */
+    char *pat; /* the literal part, or the whole glob */
+};
+
+struct class_rules {
+    struct class_rule *rule;
+    unsigned n;
+};
+
+/*
+ * Compiles spec, rules separated by ':' (',' separates mount options):
+ *
+ *     *.mptch=real:tmp_*=ram:*_log=discard
+ *
+ * The default rules (*.mhash and *.mbinmap are real) follow the given ones,
+ * which can thus override them. The first matching rule wins, names no rule
+ * matches are generated. spec may be NULL. Returns 0, or -1 if spec is
+ * malformed or out of memory.
+ */
+int classes_parse(struct class_rules *cr, const char *spec);
+
+/* Frees the rules of cr, which is left empty. */
+void classes_free(struct class_rules *cr);
+
+/* Class of the file name. */
+int class_of(const struct class_rules *cr, const char *name);
+
+/* Whether any rule picks cls. */
+int class_used(const struct class_rules *cr, int cls);
+
+/* Whether files of cls keep their content, i.e. are meta files. */
+static inline int class_stored(int cls)
+{
+    return cls == CLASS_REAL || cls == CLASS_RAM;
+}
+
+/* Name of cls, as in rules. */
+const char *class_name(int cls);
+
+/* Parses 8 hex digits of s into pattern. Returns 0, or -1 if malformed. */
+int parse_pattern(const char *s, char *pattern);
+
+/*
+ * Sets the pattern of the data file name. Names without a valid prefix leave
+ * pattern alone and return -1.
+ */
+int name_pattern(const char *name, char *pattern);
+
+/* Fills buf with size bytes of the pattern, as seen from offset. */
+void fill_pattern(char *buf, size_t size, const char *pattern, off_t offset);
+
+#endif /* LFS_CONTENT_H */
@@ -0,0 +1,306 @@
+/*
+ * Storage device emulation for LFS data files. See device.h.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "device.h"
+
+#define NSEC 1000000000ULL
+#define USEC 1000ULL
+
+int dev_profile(struct dev_params *p, const char *name)
+{
+    memset(p, 0, sizeof(*p));
+    p->qd = 1;
+    p->seed = 1;
+
+    if (strcmp(name, "custom") == 0) {
+        /* everything from dev_* options */
+    } else if (strcmp(name, "ssd") == 0) {
+        p->read_lat = 80;
+        p->write_lat = 30;
+        p->lat_dist = DEV_LAT_UNIFORM;
+        p->bandwidth = 500e6;
+        p->burst = 1024 * 1024;
+        p->qd = 32;
+    } else if (strcmp(name, "hdd") == 0) {
+        /* 7200 rpm desktop drive */
+        p->read_lat = 100;
+        p->write_lat = 100;
+        p->lat_dist = DEV_LAT_UNIFORM;
+        p->seek_min = 500;
+        p->seek_max = 15000;
+        p->seek_span = 1e12;
+        p->rotation = 8333;
+        p->bandwidth = 150e6;
+        p->burst = 64 * 1024;
+        p->qd = 1;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void dev_params_set(struct dev_model *dev, const struct dev_params *p)
+{
+    dev->p = *p;
+    if (dev->p.qd == 0) {
+        dev->p.qd = 1;
+    }
+    if (dev->p.qd > DEV_MAXQD) {
+        dev->p.qd = DEV_MAXQD;
+    }
+}
+
+void dev_init(struct dev_model *dev, const struct dev_params *p)
+{
+    memset(dev, 0, sizeof(*dev));
+    dev_params_set(dev, p);
+    dev->rng = p->seed ? p->seed : 1;
+    pthread_mutex_init(&dev->lock, NULL);
+}
+
+void dev_set(struct dev_model *dev, const struct dev_params *p)
+{
+    pthread_mutex_lock(&dev->lock);
+    if (p->seed != dev->p.seed) {
+        dev->rng = p->seed ? p->seed : 1;
+    }
+    dev_params_set(dev, p);
+    pthread_mutex_unlock(&dev->lock);
+}
+
+uint64_t dev_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+/* xorshift64*, uniform in [0, 1). Lock must be held. */
+static double dev_random(struct dev_model *dev)
+{
+    dev->rng ^= dev->rng >> 12;
+    dev->rng ^= dev->rng << 25;
+    dev->rng ^= dev->rng >> 27;
+    return ((dev->rng * 0x2545F4914F6CDD1DULL) >> 11) * 0x1.0p-53;
+}
+
+/* Samples a latency in microseconds. Lock must be held. */
+static double dev_latency(struct dev_model *dev, double mean)
+{
+    switch (dev->p.lat_dist) {
+        case DEV_LAT_UNIFORM:
+            return 2 * mean * dev_random(dev);
+        case DEV_LAT_EXP:
+            return -mean * log(1 - dev_random(dev));
+        default:
+            return mean;
+    }
+}
+
+/* Seek plus rotational delay for a jump of distance bytes, microseconds. */
+static double dev_seek(struct dev_model *dev, off_t distance)
+{
+    double frac, t = 0;
+
+    if (distance == 0) {
+        return 0; /* sequential */
+    }
+    if (dev->p.seek_min > 0) {
+        frac = dev->p.seek_span > 0 ? fabs((double)distance) / dev->p.seek_span
+                                    : 1;
+        if (frac > 1) {
+            frac = 1;
+        }
+        t += dev->p.seek_min + (dev->p.seek_max - dev->p.seek_min) * sqrt(frac);
+    }
+    if (dev->p.rotation > 0) {
+        t += dev->p.rotation * dev_random(dev);
+    }
+
+    return t;
+}
+
+uint64_t dev_submit(struct dev_model *dev, int write, off_t offset,
+    size_t size)
+{
+    uint64_t now = dev_now(), start, done, floor;
+    unsigned i, slot = 0;
+    double svc;
+
+    pthread_mutex_lock(&dev->lock);
+
+    /* wait for the queue slot that frees up first */
+    for (i = 1; i < dev->p.qd; i++) {
+        if (dev->busy[i] < dev->busy[slot]) {
+            slot = i;
+        }
+    }
+    start = dev->busy[slot] > now ? dev->busy[slot] : now;
+
+    svc = dev_latency(dev, write ? dev->p.write_lat : dev->p.read_lat);
+    svc += dev_seek(dev, offset - dev->head);
+    done = start + (uint64_t)(svc * USEC);
+
+    /* token bucket, kept as the time at which the bucket is empty again */
+    if (dev->p.bandwidth > 0) {
+        floor = (uint64_t)(dev->p.burst / dev->p.bandwidth * NSEC);
+        floor = start > floor ? start - floor : 0;
+        if (dev->tb_time < floor) {
+            dev->tb_time = floor;
+        }
+        dev->tb_time += (uint64_t)(size / dev->p.bandwidth * NSEC);
+        if (done < dev->tb_time) {
+            done = dev->tb_time;
+        }
+    }
+
+    dev->busy[slot] = done;
+    dev->head = offset + size;
+
+    pthread_mutex_unlock(&dev->lock);
+
+    return done;
+}
+
+/*
+ * Timer wheel.
+ */
+
+/* Takes due entries of one tick off the wheel. Lock must be held. */
+static void tw_expire(struct timer_wheel *tw, uint64_t tick,
+    struct tw_entry **due)
+{
+    struct tw_entry **pp = &tw->slots[tick % TW_SLOTS], *e;
+
+    while ((e = *pp) != NULL) {
+        if (e->rounds == 0) {
+            *pp = e->next;
+            e->next = *due;
+            *due = e;
+            tw->pending--;
+        } else {
+            e->rounds--;
+            pp = &e->next;
+        }
+    }
+}
+
+static void tw_fire(struct tw_entry *due)
+{
+    struct tw_entry *next;
+
+    for (; due != NULL; due = next) {
+        next = due->next;
+        due->fire(due);
+    }
+}
+
+static void *tw_loop(void *arg)
+{
+    struct timer_wheel *tw = arg;
+    struct tw_entry *due;
+    struct timespec ts;
+    uint64_t next, cur;
+
+    pthread_mutex_lock(&tw->lock);
+    while (!tw->stop) {
+        if (tw->pending == 0) {
+            pthread_cond_wait(&tw->cond, &tw->lock);
+            continue;
+        }
+
+        next = (tw->now_tick + 1) * tw->tick;
+        pthread_mutex_unlock(&tw->lock);
+        ts.tv_sec = next / NSEC;
+        ts.tv_nsec = next % NSEC;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+               == EINTR);
+        pthread_mutex_lock(&tw->lock);
+
+        /* catch up on every tick that passed */
+        due = NULL;
+        cur = dev_now() / tw->tick;
+        while (tw->now_tick < cur) {
+            tw->now_tick++;
+            tw_expire(tw, tw->now_tick, &due);
+        }
+
+        pthread_mutex_unlock(&tw->lock);
+        tw_fire(due);
+        pthread_mutex_lock(&tw->lock);
+    }
+    pthread_mutex_unlock(&tw->lock);
+
+    return NULL;
+}
+
+int tw_start(struct timer_wheel *tw, uint64_t tick_ns)
+{
+    memset(tw, 0, sizeof(*tw));
+    tw->tick = tick_ns;
+    tw->now_tick = dev_now() / tick_ns;
+    pthread_mutex_init(&tw->lock, NULL);
+    pthread_cond_init(&tw->cond, NULL);
+
+    return pthread_create(&tw->thread, NULL, tw_loop, tw);
+}
+
+void tw_add(struct timer_wheel *tw, struct tw_entry *e, uint64_t expires)
+{
+    /* round up, entries never fire early */
+    uint64_t t = (expires + tw->tick - 1) / tw->tick, ticks;
+
+    pthread_mutex_lock(&tw->lock);
+    if (tw->pending == 0) {
+        /* the wheel was idle, bring it up to date */
+        tw->now_tick = dev_now() / tw->tick;
+    }
+    if (t <= tw->now_tick || tw->stop) {
+        /* already due */
+        pthread_mutex_unlock(&tw->lock);
+        e->fire(e);
+        return;
+    }
+
+    ticks = t - tw->now_tick;
+    e->expires = expires;
+    e->rounds = (ticks - 1) / TW_SLOTS;
+    e->next = tw->slots[t % TW_SLOTS];
+    tw->slots[t % TW_SLOTS] = e;
+    if (tw->pending++ == 0) {
+        pthread_cond_signal(&tw->cond);
+    }
+    pthread_mutex_unlock(&tw->lock);
+}
+
+void tw_stop(struct timer_wheel *tw)
+{
+    struct tw_entry *due = NULL;
+    unsigned i;
+
+    pthread_mutex_lock(&tw->lock);
+    tw->stop = 1;
+    pthread_cond_signal(&tw->cond);
+    pthread_mutex_unlock(&tw->lock);
+    pthread_join(tw->thread, NULL);
+
+    /* nobody is waiting anymore, fire the rest right away */
+    for (i = 0; i < TW_SLOTS; i++) {
+        while (tw->slots[i] != NULL) {
+            struct tw_entry *e = tw->slots[i];
+            tw->slots[i] = e->next;
+            e->next = due;
+            due = e;
+        }
+    }
+    tw->pending = 0;
+    tw_fire(due);
+}
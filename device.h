@@ -0,0 +1,104 @@
+/*
+ * Storage device emulation for LFS data files.
+ *
+ * A device model turns every data file operation into a completion time:
+ * per-op latency drawn from a distribution, seek cost growing with the
+ * distance from the previous request (HDD profile), a limited number of
+ * operations in service at once (queue depth) and a token bucket bandwidth
+ * cap. The reply is then parked on a timer wheel until that time, so no FUSE
+ * thread sleeps while a request is "on the device".
+ */
+
+#ifndef LFS_DEVICE_H
+#define LFS_DEVICE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#define DEV_MAXQD 256
+
+enum {
+    DEV_LAT_CONST,   /* always the mean */
+    DEV_LAT_UNIFORM, /* uniform in [0, 2 * mean] */
+    DEV_LAT_EXP,     /* exponential with the given mean */
+};
+
+struct dev_params {
+    double read_lat;   /* mean per-op latency, microseconds */
+    double write_lat;
+    int lat_dist;      /* DEV_LAT_* */
+    double seek_min;   /* track-to-track seek, microseconds, 0 disables */
+    double seek_max;   /* full stroke seek, microseconds */
+    double seek_span;  /* bytes covered by a full stroke */
+    double rotation;   /* full rotation, microseconds, 0 disables */
+    double bandwidth;  /* bytes per second, 0 means unlimited */
+    double burst;      /* token bucket depth, bytes */
+    unsigned qd;       /* operations in service at once */
+    uint64_t seed;     /* for reproducible runs */
+};
+
+struct dev_model {
+    struct dev_params p;
+    pthread_mutex_t lock;
+    uint64_t rng;
+    off_t head;                  /* end of the previous request */
+    uint64_t busy[DEV_MAXQD];    /* per queue slot, busy until (ns) */
+    uint64_t tb_time;            /* token bucket virtual time (ns) */
+};
+
+/* Fills p with a named profile ("ssd" or "hdd"). Returns -1 if unknown. */
+int dev_profile(struct dev_params *p, const char *name);
+
+void dev_init(struct dev_model *dev, const struct dev_params *p);
+
+/*
+ * Changes the parameters of a model in use, between two operations. Busy
+ * queue slots, the head position and the token bucket carry over.
+ */
+void dev_set(struct dev_model *dev, const struct dev_params *p);
+
+/* Monotonic clock, nanoseconds. */
+uint64_t dev_now(void);
+
+/*
+ * Accounts an operation on the device and returns the absolute time (as
+ * dev_now()) at which it completes.
+ */
+uint64_t dev_submit(struct dev_model *dev, int write, off_t offset,
+    size_t size);
+
+/*
+ * Hashed timer wheel.
+ *
+ * Entries are owned by the caller and must stay valid until fired. The fire
+ * callback runs on the wheel thread.
+ */
+#define TW_SLOTS 4096
+
+struct tw_entry {
+    struct tw_entry *next;
+    uint64_t expires;
+    unsigned rounds;
+    void (*fire)(struct tw_entry *e);
+};
+
+struct timer_wheel {
+    struct tw_entry *slots[TW_SLOTS];
+    uint64_t tick;     /* ns per slot */
+    uint64_t now_tick; /* last processed tick */
+    unsigned pending;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+};
+
+int tw_start(struct timer_wheel *tw, uint64_t tick_ns);
+
+void tw_add(struct timer_wheel *tw, struct tw_entry *e, uint64_t expires);
+
+/* Fires everything still pending and stops the wheel thread. */
+void tw_stop(struct timer_wheel *tw);
+
+#endif /* LFS_DEVICE_H */
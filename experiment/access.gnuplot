@@ -0,0 +1,43 @@
+set terminal pngcairo transparent enhanced font "arial,10" fontscale 1.0 size 800, 350
+set title "Request sizes (" . peername . ")"
+set output plotsdir . "/access_sizes_" . peername . ".png"
+
+set style data histograms
+set style histogram clustered gap 1
+set style fill transparent solid 0.65 noborder
+set key left top
+set grid ytics
+
+set logscale y
+set yrange [0.5:]
+set ylabel "Requests (#)"
+set xlabel "Request size, up to (KiB)"
+set xtics rotate by 45 right
+
+plot logdir . "/access_sizes.parsed" using 2:xtic(sprintf("%d", $1/1024)) title "data reads", \
+     '' using 3 title "data writes", \
+     '' using 4 title "meta reads", \
+     '' using 5 title "meta writes"
+
+
+reset
+set terminal pngcairo transparent enhanced font "arial,10" fontscale 1.0 size 800, 700
+set output plotsdir . "/access_heat_" . peername . ".png"
+
+# one row per file, in the order of access_files.parsed
+set palette defined (0 '#FFFFFF', 1 '#A8DA16', 2 '#E69B17', 3 '#D71900')
+set logscale cb
+set cblabel "Requests (#)"
+set xlabel "Offset (1/64 of the file)"
+set ylabel "File (#)"
+set xrange [-0.5:63.5]
+
+set multiplot layout 2,1 title "Access heatmap (" . peername . ")"
+
+set title "reads"
+plot logdir . "/access_heat.parsed" using 1:(column(-2)):($2 > 0 ? $2 : NaN) with image notitle
+
+set title "writes"
+plot logdir . "/access_heat.parsed" using 1:(column(-2)):($3 > 0 ? $3 : NaN) with image notitle
+
+unset multiplot
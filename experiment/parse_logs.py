@@ -2,6 +2,7 @@
 
 import sys
 import os
+import json
 
 def parse_res_usage(orig, parsed=sys.stdout):
     print "Parsing resource usage file"
@@ -54,17 +55,51 @@ def parse_speed(inp, outp):
         if line.startswith("DONE") or line.startswith("done") or line.startswith("SEED"):
             print >>outp, line[:-1]
 
+def parse_access_stats(inp, sizes, heat, files):
+    """Splits a .lfs.stats snapshot into gnuplot data files."""
+    stats = json.load(inp)
+
+    # request sizes, summed by kind of file
+    totals = [[0] * len(stats["size_buckets"]) for k in range(4)]
+    for f in stats["files"]:
+        kind = 2 if f["meta"] else 0
+        for i, n in enumerate(f["read"]["sizes"]):
+            totals[kind][i] += n
+        for i, n in enumerate(f["write"]["sizes"]):
+            totals[kind + 1][i] += n
+    for i, bound in enumerate(stats["size_buckets"]):
+        print >>sizes, bound, " ".join(str(t[i]) for t in totals)
+
+    # one block per file, the block index is the file's line in files
+    for f in stats["files"]:
+        for i in range(stats["heat_buckets"]):
+            print >>heat, i, f["read"]["heat"][i], f["write"]["heat"][i]
+        print >>heat, "\n"
+        print >>files, f["name"], f["read"]["sequential"], \
+            f["read"]["random"], f["write"]["sequential"], \
+            f["write"]["random"]
+
 if __name__ == "__main__":
     if len(sys.argv) < 2:
         print "Usage:", sys.argv[0], "<logs_dir>"
 
     logs_dir = sys.argv[1]
 
+    # sampler.c writes resource_usage.log.parsed itself
     res_usage = os.path.join(logs_dir, "resource_usage.log")
-    with open(res_usage, "r") as o, open(res_usage + ".parsed", "w") as p:
-        parse_res_usage(o, p)
+    if os.path.exists(res_usage):
+        with open(res_usage, "r") as o, open(res_usage + ".parsed", "w") as p:
+            parse_res_usage(o, p)
     
     err_log = os.path.join(logs_dir, "00000.err")
     parsed_speed_log = os.path.join(logs_dir, "speed.parsed")
     with open(err_log, "r") as inp, open(parsed_speed_log, "w") as outp:
         parse_speed(inp, outp)
+
+    access_stats = os.path.join(logs_dir, "access_stats.json")
+    if os.path.exists(access_stats):
+        with open(access_stats, "r") as inp, \
+             open(os.path.join(logs_dir, "access_sizes.parsed"), "w") as s, \
+             open(os.path.join(logs_dir, "access_heat.parsed"), "w") as h, \
+             open(os.path.join(logs_dir, "access_files.parsed"), "w") as f:
+            parse_access_stats(inp, s, h, f)
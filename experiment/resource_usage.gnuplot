@@ -1,3 +1,6 @@
+# sampled=1 for the output of sampler.c, whose fifth column is the time
+if (!exists("sampled")) sampled = 0
+
 set terminal pngcairo transparent enhanced font "arial,10" fontscale 1.0 size 800, 350
 set title "CPU usage (" . peername  .")"
 set output plotsdir . "/cpu_usage_" . peername . ".png"
@@ -12,7 +15,7 @@ set grid
 
 set yrange [0:100]
 set format y "%g %%"
-plot logdir . "/resource_usage.log.parsed" using ($1*100) with filledcurve x1
+plot logdir . "/resource_usage.log.parsed" using (sampled ? $5 : $0):($1*100) with filledcurve x1
 set format y
 
 
@@ -25,7 +28,7 @@ set title "Memory - Virtual Set Size  (" . peername  .")"
 set ylabel "MiB"
 set xlabel "Time in experiment (s)"
 set output plotsdir . "/vsize_" . peername . ".png"
-plot logdir . "/resource_usage.log.parsed" using ($2/1024/1024) with filledcurve x1 lc rgb "#0066CC"
+plot logdir . "/resource_usage.log.parsed" using (sampled ? $5 : $0):($2/1024/1024) with filledcurve x1 lc rgb "#0066CC"
 
 reset
 set style fill transparent solid 0.5 noborder
@@ -36,7 +39,7 @@ set title "Memory - Resident Set Size (" . peername . ")"
 set xlabel "Time in experiment (s)"
 set ylabel "MiB"
 set output plotsdir . "/rss_" . peername . ".png"
-plot logdir . "/resource_usage.log.parsed" using ($3/1024/1024) with filledcurve x1 lc rgb "#00CC00"
+plot logdir . "/resource_usage.log.parsed" using (sampled ? $5 : $0):($3/1024/1024) with filledcurve x1 lc rgb "#00CC00"
 
 reset
 set style fill transparent solid 0.5 noborder
@@ -47,4 +50,16 @@ set title "Aggregate Delayed Block I/O (" . peername . ")"
 set xlabel "Time in experiment (s)"
 set ylabel "Seconds"
 set output plotsdir . "/dblk_" . peername . ".png"
-plot logdir . "/resource_usage.log.parsed" using 4 with filledcurve x1 lc rgb "#FFFF33"
+plot logdir . "/resource_usage.log.parsed" using (sampled ? $5 : $0):4 with filledcurve x1 lc rgb "#FFFF33"
+
+if (sampled) {
+    reset
+    set grid
+    set yrange [0:]
+    set title "Context Switches (" . peername . ")"
+    set xlabel "Time in experiment (s)"
+    set ylabel "Switches/s"
+    set output plotsdir . "/ctxsw_" . peername . ".png"
+    plot logdir . "/resource_usage.log.parsed" using 5:6 with lines lc rgb "#0066CC" title "voluntary", \
+         "" using 5:7 with lines lc rgb "#CC0000" title "involuntary"
+}
@@ -24,6 +24,8 @@
 [ -z $DIR_LFS ] && DIR_LFS=.
 [ -z $TIME ] && TIME=30
 [ -z $FILE_SIZE ] && FILE_SIZE="128GiB"
+# extra LFS mount options, e.g. "device=hdd" to emulate a real disk
+[ -z $LFS_EXTRA_OPTS ] && LFS_EXTRA_OPTS=""
 # ------------------------------------------------------------------------------
 
 echo "Running swift processes for $TIME seconds"
@@ -47,43 +49,63 @@ PLOTS_DIR=$WORKSPACE/plots/$DATE
 PLOTS_DIR_LAST=$WORKSPACE/plots/last
 mkdir -p $LOGS_DIR $PLOTS_DIR $PLOTS_DIR_LAST
 
+# native resource sampler (see sampler.c), every 10 ms, none without gcc
+SAMPLER=$DIR_LFS/experiment/sampler
+[ -x $SAMPLER ] || gcc -O2 -Wall -o $SAMPLER $DIR_LFS/experiment/sampler.c || SAMPLER=
+SAMPLED=$([ -n "$SAMPLER" ] && echo 1 || echo 0)
+
 fusermount -V
 df -h
 
-# start source LFS
-$DIR_LFS/lfs $LFS_SRC_STORE -o fsname=lfssrc,realstore=$LFS_SRC_REALSTORE,big_writes &
+# start source LFS, its snapshots outlive the stores
+LFS_SNAPSHOTS=$WORKSPACE/snapshots
+SEED=seeded_$FILE_SIZE
+mkdir -p $LFS_SNAPSHOTS
+$DIR_LFS/lfs $LFS_SRC_STORE -o fsname=lfssrc,realstore=$LFS_SRC_REALSTORE,snapshots=$LFS_SNAPSHOTS,big_writes${LFS_EXTRA_OPTS:+,$LFS_EXTRA_OPTS} &
 LFS_SRC_PID=$!
 wait $LFS_SRC_PID
 
 # start destination LFS
-$DIR_LFS/lfs $LFS_DST_STORE -o fsname=lfsdst,realstore=$LFS_DST_REALSTORE,big_writes &
+$DIR_LFS/lfs $LFS_DST_STORE -o fsname=lfsdst,realstore=$LFS_DST_REALSTORE,big_writes${LFS_EXTRA_OPTS:+,$LFS_EXTRA_OPTS} &
 LFS_DST_PID=$!
 wait $LFS_DST_PID
 
-# create data file and get precomputed metafiles
-truncate -s $FILE_SIZE $LFS_SRC_STORE/aaaaaaaa_128gb_8192
+# The seeded source store (data file and precomputed meta files) is kept as
+# an LFS snapshot, so later runs restore it in place of downloading and
+# copying everything again. Remove $LFS_SNAPSHOTS/$SEED to reseed.
+if [ -f $LFS_SNAPSHOTS/$SEED/table ]; then
+    setfattr -n user.lfs.restore -v $SEED $LFS_SRC_STORE
+    HASH=$(basename $LFS_SRC_STORE/*.mbinmap .mbinmap)
+else
+    # create data file and get precomputed metafiles
+    truncate -s $FILE_SIZE $LFS_SRC_STORE/aaaaaaaa_128gb_8192
+
+    hexdump -C -n 8192 $LFS_SRC_STORE/aaaaaaaa_128gb_8192
 
-hexdump -C -n 8192 $LFS_SRC_STORE/aaaaaaaa_128gb_8192
+    META_ARCHIVE=$WORKSPACE/meta.tar.gz
+    META_URL=https://dl.dropboxusercontent.com/u/18515377/Tribler/aaaaaaaa_128gb_8192.tar.gz
 
-META_ARCHIVE=$WORKSPACE/meta.tar.gz
-META_URL=https://dl.dropboxusercontent.com/u/18515377/Tribler/aaaaaaaa_128gb_8192.tar.gz
+    ETAG=`awk '/.*etag:.*/ { gsub(/[ \t\n\r]+$/, "", $2); print $2 }' $META_ARCHIVE.headers | tail -1`
+    wget --header="If-None-Match: $ETAG" -S --no-check-certificate -O $META_ARCHIVE $META_URL 2>&1 | tee $META_ARCHIVE.headers
+    mkdir ${META_ARCHIVE}_dir || true
+    tar xzvf $META_ARCHIVE -C ${META_ARCHIVE}_dir || true
+    echo "Copying meta files. Please wait."
+    cp ${META_ARCHIVE}_dir/* $LFS_SRC_STORE || true
 
-ETAG=`awk '/.*etag:.*/ { gsub(/[ \t\n\r]+$/, "", $2); print $2 }' $META_ARCHIVE.headers | tail -1`
-wget --header="If-None-Match: $ETAG" -S --no-check-certificate -O $META_ARCHIVE $META_URL 2>&1 | tee $META_ARCHIVE.headers
-mkdir ${META_ARCHIVE}_dir || true
-tar xzvf $META_ARCHIVE -C ${META_ARCHIVE}_dir || true
-echo "Copying meta files. Please wait."
-cp ${META_ARCHIVE}_dir/* $LFS_SRC_STORE || true
+    hexdump -C -n 60 -s 1597400 $LFS_SRC_STORE/aaaaaaaa_128gb_8192.mhash
 
-hexdump -C -n 60 -s 1597400 $LFS_SRC_STORE/aaaaaaaa_128gb_8192.mhash
+    # LFS serves the root hash as an xattr, fall back to parsing the mbinmap
+    HASH=$(getfattr --only-values -n user.lfs.root_hash $LFS_SRC_STORE/aaaaaaaa_128gb_8192 2>/dev/null ||
+           cat $LFS_SRC_STORE/aaaaaaaa_128gb_8192.mbinmap | grep hash | cut -d " " -f 3)
 
-HASH=$(cat $LFS_SRC_STORE/aaaaaaaa_128gb_8192.mbinmap | grep hash | cut -d " " -f 3)
+    hexdump -C -n 8192 $LFS_SRC_STORE/aaaaaaaa_128gb_8192
 
-hexdump -C -n 8192 $LFS_SRC_STORE/aaaaaaaa_128gb_8192
+    mv $LFS_SRC_STORE/aaaaaaaa_128gb_8192 $LFS_SRC_STORE/$HASH
+    mv $LFS_SRC_STORE/aaaaaaaa_128gb_8192.mbinmap $LFS_SRC_STORE/$HASH.mbinmap
+    mv $LFS_SRC_STORE/aaaaaaaa_128gb_8192.mhash $LFS_SRC_STORE/$HASH.mhash
 
-mv $LFS_SRC_STORE/aaaaaaaa_128gb_8192 $LFS_SRC_STORE/$HASH
-mv $LFS_SRC_STORE/aaaaaaaa_128gb_8192.mbinmap $LFS_SRC_STORE/$HASH.mbinmap
-mv $LFS_SRC_STORE/aaaaaaaa_128gb_8192.mhash $LFS_SRC_STORE/$HASH.mhash
+    setfattr -n user.lfs.snapshot -v $SEED $LFS_SRC_STORE
+fi
 
 ls -alh $LFS_SRC_STORE
 ls -alh $LFS_SRC_REALSTORE
@@ -99,7 +121,16 @@ hexdump -C -n 8192 $LFS_SRC_STORE/$HASH
 mkdir -p $LOGS_DIR/src
 mkdir -p $LOGS_DIR/dst
 
-$DIR_LFS/process_guard.py -c "taskset -c 0 $DIR_SWIFT/swift --uprate 307200 -e $LFS_SRC_STORE -l 1337 -c 10000 -z 8192 --progress" -t $TIME -m $LOGS_DIR/src -o $LOGS_DIR/src &
+# the LFS daemons, for the whole transfer
+if [ -n "$SAMPLER" ]; then
+    for peer in src dst; do
+        mkdir -p $LOGS_DIR/lfs$peer
+        $SAMPLER -p $(pgrep -n -f "fsname=lfs$peer,") -t $((TIME + 10)) \
+            -o $LOGS_DIR/lfs$peer/resource_usage.log.parsed &
+    done
+fi
+
+$DIR_LFS/process_guard.py -c "taskset -c 0 $DIR_SWIFT/swift --uprate 307200 -e $LFS_SRC_STORE -l 1337 -c 10000 -z 8192 --progress" -t $TIME -m $LOGS_DIR/src -o $LOGS_DIR/src ${SAMPLER:+-s $SAMPLER -i 0.01} &
 SWIFT_SRC_PID=$!
 
 echo "Starting destination in 5s..."
@@ -108,7 +139,7 @@ sleep 5s
 # start destination swift
 #$STAP_RUN -R -o $LOGS_DIR/swift.dst.stap.out -c "taskset -c 1 timeout 50s $DIR_SWIFT/swift -o $LFS_DST_STORE -t 127.0.0.1:1337 -h $HASH -z 8192 --progress -D$LOGS_DIR/swift.dst.debug" cpu_io_mem_2.ko >$LOGS_DIR/swift.dst.log 2>&1 &
 touch $LFS_DST_STORE/aaaaaaaa_128gb_8192
-$DIR_LFS/process_guard.py -c "taskset -c 1 $DIR_SWIFT/swift --downrate 307200 -o $LFS_DST_STORE -f aaaaaaaa_128gb_8192 -t 127.0.0.1:1337 -h $HASH -z 8192 --progress" -t $(($TIME-5)) -m $LOGS_DIR/dst -o $LOGS_DIR/dst &
+$DIR_LFS/process_guard.py -c "taskset -c 1 $DIR_SWIFT/swift --downrate 307200 -o $LFS_DST_STORE -f aaaaaaaa_128gb_8192 -t 127.0.0.1:1337 -h $HASH -z 8192 --progress" -t $(($TIME-5)) -m $LOGS_DIR/dst -o $LOGS_DIR/dst ${SAMPLER:+-s $SAMPLER -i 0.01} &
 SWIFT_DST_PID=$!
 
 echo "Waiting for swifts to finish (~${TIME}s)..."
@@ -123,6 +154,10 @@ ls -alh $LFS_SRC_REALSTORE
 ls -alh $LFS_DST_STORE
 ls -alh $LFS_DST_REALSTORE
 
+# per-file access statistics, see stats.h
+cat $LFS_SRC_STORE/.lfs.stats > $LOGS_DIR/src/access_stats.json || true
+cat $LFS_DST_STORE/.lfs.stats > $LOGS_DIR/dst/access_stats.json || true
+
 sleep 10s
 
 # --------- EXPERIMENT END ----------
@@ -149,10 +184,18 @@ $DIR_LFS/experiment/parse_logs.py $LOGS_DIR/src
 $DIR_LFS/experiment/parse_logs.py $LOGS_DIR/dst
 
 # ------------- PLOTTING -------------
-gnuplot -e "logdir='$LOGS_DIR/src';peername='src';plotsdir='$PLOTS_DIR'" $DIR_LFS/experiment/resource_usage.gnuplot
-gnuplot -e "logdir='$LOGS_DIR/dst';peername='dst';plotsdir='$PLOTS_DIR'" $DIR_LFS/experiment/resource_usage.gnuplot
+gnuplot -e "logdir='$LOGS_DIR/src';peername='src';plotsdir='$PLOTS_DIR';sampled=$SAMPLED" $DIR_LFS/experiment/resource_usage.gnuplot
+gnuplot -e "logdir='$LOGS_DIR/dst';peername='dst';plotsdir='$PLOTS_DIR';sampled=$SAMPLED" $DIR_LFS/experiment/resource_usage.gnuplot
+if [ -n "$SAMPLER" ]; then
+    for peer in lfssrc lfsdst; do
+        gnuplot -e "logdir='$LOGS_DIR/$peer';peername='$peer';plotsdir='$PLOTS_DIR';sampled=1" $DIR_LFS/experiment/resource_usage.gnuplot
+    done
+fi
 
 gnuplot -e "logdir='$LOGS_DIR';plotsdir='$PLOTS_DIR'" $DIR_LFS/experiment/speed.gnuplot
 
+gnuplot -e "logdir='$LOGS_DIR/src';peername='src';plotsdir='$PLOTS_DIR'" $DIR_LFS/experiment/access.gnuplot
+gnuplot -e "logdir='$LOGS_DIR/dst';peername='dst';plotsdir='$PLOTS_DIR'" $DIR_LFS/experiment/access.gnuplot
+
 rm $PLOTS_DIR_LAST/*
 cp $PLOTS_DIR/* $PLOTS_DIR_LAST/
@@ -0,0 +1,164 @@
+#!/bin/bash
+
+# Many swift peers on one box: N seeders and M leechers of K files, spread
+# over L LFS mounts, all over loopback. Each peer runs under
+# process_guard.py like in run_experiment.sh. At the end, aggregate download
+# throughput (from the .lfs.stats of every mount), per-peer CPU and per-mount
+# LFS daemon CPU are summarized by swarm_summary.py.
+#
+# With SHARED=1 a single LFS daemon serves all mounts: the first one is
+# started with a control socket and the others are added through it. The
+# daemon's CPU is then reported once, as lfs0.
+#
+# Peer p lives on mount p % L. Every mount starts from the same snapshot of
+# the K seeded files, so seeders find content and meta files in place.
+# Leecher l fetches file l % K from seeder l % N (any swarm member is then
+# found through it) under its own name, so leechers sharing a mount don't
+# collide. Names keep the pattern prefix, so downloaded content still reads
+# back right.
+
+# Machine-specific variables ---------------------------------------------------
+[ -z $WORKSPACE ] && WORKSPACE=.
+[ -z $DIR_SWIFT ] && DIR_SWIFT=.
+[ -z $DIR_LFS ] && DIR_LFS=.
+[ -z $TIME ] && TIME=60
+[ -z $SEEDERS ] && SEEDERS=1
+[ -z $LEECHERS ] && LEECHERS=4
+[ -z $FILES ] && FILES=1
+[ -z $MOUNTS ] && MOUNTS=2
+[ -z $FILE_SIZE ] && FILE_SIZE=$((1024*1024*1024))
+[ -z $CHUNK ] && CHUNK=8192
+# cores for swift peers (round-robin) and for LFS daemons, taskset lists
+[ -z $PEER_CORES ] && PEER_CORES="1-$(($(nproc) - 1))"
+[ -z $LFS_CORES ] && LFS_CORES="0"
+# per peer, bytes/s, empty for no limit
+[ -z $UPRATE ] && UPRATE=""
+[ -z $DOWNRATE ] && DOWNRATE=""
+[ -z $BASE_PORT ] && BASE_PORT=20000
+[ -z $LFS_EXTRA_OPTS ] && LFS_EXTRA_OPTS=""
+# one LFS daemon for all mounts
+[ -z $SHARED ] && SHARED=0
+# ------------------------------------------------------------------------------
+
+# expands a taskset list, e.g. 0-2,5 to 0 1 2 5
+expand_cores() {
+    local r a b
+    for r in ${1//,/ }; do
+        a=${r%-*}
+        b=${r#*-}
+        seq $a $b
+    done
+}
+PEER_CPUS=($(expand_cores $PEER_CORES))
+LFS_CPUS=($(expand_cores $LFS_CORES))
+
+SWARM=$WORKSPACE/swarm
+LFS_SNAPSHOTS=$WORKSPACE/snapshots
+SEED=swarm_${FILES}x${FILE_SIZE}_$CHUNK
+DATE=$(date +'%F-%H-%M')
+LOGS_DIR=$WORKSPACE/logs/swarm-$DATE
+mkdir -p $LFS_SNAPSHOTS $LOGS_DIR
+
+echo "Swarm: $SEEDERS seeders, $LEECHERS leechers, $FILES files of $FILE_SIZE" \
+     "bytes, $MOUNTS mounts, ${TIME}s"
+
+# K distinct contents, one pattern each
+name_of() {
+    printf "%08x_%s_%s" $((0x10000000 + $1)) $FILE_SIZE $CHUNK
+}
+
+# sends a command to the shared daemon, prints the answer
+lfs_control() {
+    python -c 'import socket, sys
+s = socket.socket(socket.AF_UNIX)
+s.connect(sys.argv[1])
+s.sendall(sys.argv[2] + "\n")
+print s.makefile().readline(),' $CONTROL "$1"
+}
+
+for ((i = 0; i < MOUNTS; i++)); do
+    fusermount -u $SWARM/store$i 2>/dev/null
+    rm -rf $SWARM/store$i $SWARM/real$i
+    mkdir -p $SWARM/store$i $SWARM/real$i
+done
+# added mounts are resolved by the daemon, which runs in /
+SWARM=$(cd $SWARM && pwd)
+LFS_SNAPSHOTS=$(cd $LFS_SNAPSHOTS && pwd)
+CONTROL=$SWARM/control
+for ((i = 0; i < MOUNTS; i++)); do
+    opts=fsname=lfsswarm$i,realstore=$SWARM/real$i,snapshots=$LFS_SNAPSHOTS,big_writes${LFS_EXTRA_OPTS:+,$LFS_EXTRA_OPTS}
+    if [ $SHARED -eq 0 ]; then
+        taskset -c ${LFS_CPUS[$((i % ${#LFS_CPUS[@]}))]} $DIR_LFS/lfs $SWARM/store$i -o $opts
+        LFS_PIDS[$i]=$(pgrep -n -f "fsname=lfsswarm$i,")
+    elif [ $i -eq 0 ]; then
+        taskset -c $LFS_CORES $DIR_LFS/lfs $SWARM/store0 -o $opts,control=$CONTROL
+        LFS_PIDS[0]=$(pgrep -n -f "fsname=lfsswarm0,")
+        while [ ! -S $CONTROL ]; do sleep 0.1; done
+    else
+        lfs_control "add $SWARM/store$i $opts"
+    fi
+done
+
+# seed once (swift hashes every file), later runs restore the snapshot
+if [ ! -f $LFS_SNAPSHOTS/$SEED/table ]; then
+    for ((k = 0; k < FILES; k++)); do
+        truncate -s $FILE_SIZE $SWARM/store0/$(name_of $k)
+    done
+    $DIR_LFS/tools/precompute_meta.py $SWARM/store0 $DIR_SWIFT/swift
+    setfattr -n user.lfs.snapshot -v $SEED $SWARM/store0
+fi
+for ((i = 0; i < MOUNTS; i++)); do
+    setfattr -n user.lfs.restore -v $SEED $SWARM/store$i
+done
+for ((k = 0; k < FILES; k++)); do
+    HASHES[$k]=$(getfattr --only-values -n user.lfs.root_hash $SWARM/store0/$(name_of $k))
+    echo "$(name_of $k) ${HASHES[$k]}"
+done
+
+# LFS daemon CPU, utime + stime in ticks
+lfs_ticks() {
+    local i
+    for ((i = 0; i < ${#LFS_PIDS[@]}; i++)); do
+        echo $i $(cut -d " " -f 14,15 /proc/${LFS_PIDS[$i]}/stat)
+    done
+}
+lfs_ticks > $LOGS_DIR/lfs_cpu.start
+
+PIDS=()
+for ((p = 0; p < SEEDERS + LEECHERS; p++)); do
+    store=$SWARM/store$((p % MOUNTS))
+    cpu=${PEER_CPUS[$((p % ${#PEER_CPUS[@]}))]}
+    if ((p < SEEDERS)); then
+        dir=$LOGS_DIR/seeder$p
+        cmd="$DIR_SWIFT/swift ${UPRATE:+--uprate $UPRATE} -e $store -l $((BASE_PORT + p)) -c 10000 -z $CHUNK --progress"
+    else
+        l=$((p - SEEDERS))
+        k=$((l % FILES))
+        dir=$LOGS_DIR/leecher$l
+        touch $store/$(name_of $k)_l$l
+        cmd="$DIR_SWIFT/swift ${DOWNRATE:+--downrate $DOWNRATE} -o $store -f $(name_of $k)_l$l -t 127.0.0.1:$((BASE_PORT + l % SEEDERS)) -h ${HASHES[$k]} -z $CHUNK --progress"
+    fi
+    mkdir -p $dir
+    echo "$cmd" > $dir/command
+    $DIR_LFS/process_guard.py -c "taskset -c $cpu $cmd" -t $TIME -m $dir -o $dir &
+    PIDS+=($!)
+    if ((p == SEEDERS - 1)); then
+        sleep 5s # seeders listen before anyone connects
+    fi
+done
+
+echo "Waiting for peers to finish (~${TIME}s)..."
+wait ${PIDS[@]}
+
+lfs_ticks > $LOGS_DIR/lfs_cpu.end
+for ((i = 0; i < MOUNTS; i++)); do
+    cat $SWARM/store$i/.lfs.stats > $LOGS_DIR/access_stats.$i.json || true
+done
+
+for ((i = 0; i < MOUNTS; i++)); do
+    fusermount -z -u $SWARM/store$i
+done
+sleep 2s
+rm -rf $SWARM
+
+$DIR_LFS/experiment/swarm_summary.py $LOGS_DIR $TIME | tee $LOGS_DIR/summary
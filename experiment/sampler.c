@@ -0,0 +1,461 @@
+/*
+ * Resource sampler: CPU, memory, block I/O delay and context switches of a
+ * few processes (the LFS daemon, the swift peers) every few milliseconds,
+ * cheap enough not to show up in what it measures.
+ *
+ * Every sample is one line, the totals of all processes tracked:
+ *
+ *     cpu vsize rss blkio time vcsw nvcsw procs
+ *
+ * cpu is in CPUs (1.0 is one CPU busy), vsize and rss in bytes, blkio the
+ * time spent waiting for block I/O per second, time in seconds since the
+ * start, vcsw and nvcsw the voluntary and involuntary context switches per
+ * second. The first four columns are those of resource_usage.log.parsed
+ * (see parse_logs.py), so resource_usage.gnuplot plots either.
+ *
+ * Per process and sample, CPU time comes from its CPU clock (nanoseconds,
+ * whole process), memory from one pread() of /proc/PID/stat, the rest from
+ * a taskstats query over netlink (whole process, needs CAP_NET_ADMIN). When
+ * taskstats is unavailable it falls back to /proc/PID/stat and status,
+ * which only count the main thread. Block I/O delays need delay accounting
+ * (delayacct on the kernel command line or kernel.task_delayacct=1).
+ *
+ * Processes are given with -p, or -g tracks the members of a process group
+ * but its leader (process_guard.py), looked up again every second. Exits
+ * when they are all gone, after -t seconds, or on SIGINT/SIGTERM.
+ *
+ * Build: gcc -O2 -Wall -o sampler sampler.c
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/genetlink.h>
+#include <linux/netlink.h>
+#include <linux/taskstats.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#define MAXPROCS 256
+#define NLBUF 2048		// a taskstats reply is ~400 bytes
+#define NLA_DATA(na) ((char *)(na) + NLA_HDRLEN)
+
+struct proc {
+	pid_t pid;
+	int statfd, statusfd;
+	clockid_t clock;
+	// counters at the previous sample
+	uint64_t cpu_ns, blkio_ns, vcsw, nvcsw;
+	int src;		// SRC_* the counters came from
+	int fresh;		// no previous sample yet
+};
+
+// Counter sources, deltas are only taken between samples of the same ones.
+#define SRC_CLOCK 1		// cpu from the process CPU clock, else /proc
+#define SRC_TASKSTATS 2		// blkio and switches from taskstats, else /proc
+
+static struct {
+	struct proc procs[MAXPROCS];
+	unsigned nprocs;
+	pid_t pgid;
+	int seen;		// some process was tracked once
+	int nl;			// taskstats socket, -1 without
+	uint16_t family;
+	uint32_t seq;
+	long page, tick;
+	char buf[NLBUF];	// netlink and /proc reads
+	volatile sig_atomic_t stop;
+} s;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void on_signal(int sig)
+{
+	s.stop = 1;
+}
+
+static int nl_send(uint16_t type, uint8_t cmd, uint16_t attr, const void *data,
+		   uint16_t len)
+{
+	struct {
+		struct nlmsghdr n;
+		struct genlmsghdr g;
+		char attrs[64];
+	} req;
+	struct nlattr *na = (struct nlattr *)req.attrs;
+	struct sockaddr_nl to = { .nl_family = AF_NETLINK };
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_type = type;
+	req.n.nlmsg_flags = NLM_F_REQUEST;
+	req.n.nlmsg_seq = ++s.seq;
+	req.n.nlmsg_pid = getpid();
+	req.g.cmd = cmd;
+	req.g.version = 1;
+	na->nla_type = attr;
+	na->nla_len = NLA_HDRLEN + len;
+	memcpy(NLA_DATA(na), data, len);
+	req.n.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN) + NLA_ALIGN(na->nla_len);
+
+	return sendto(s.nl, &req, req.n.nlmsg_len, 0, (struct sockaddr *)&to,
+		      sizeof(to)) < 0 ? -1 : 0;
+}
+
+// Receives the reply into s.buf, returns its first attribute and the end.
+static struct nlattr *nl_recv(char **end)
+{
+	struct nlmsghdr *n = (struct nlmsghdr *)s.buf;
+	ssize_t len = recv(s.nl, s.buf, sizeof(s.buf), 0);
+
+	if (len < 0 || !NLMSG_OK(n, len) || n->nlmsg_type == NLMSG_ERROR) {
+		return NULL;
+	}
+	*end = (char *)n + n->nlmsg_len;
+	return (struct nlattr *)((char *)NLMSG_DATA(n) + GENL_HDRLEN);
+}
+
+static struct nlattr *nla_next(struct nlattr *na)
+{
+	return (struct nlattr *)((char *)na + NLA_ALIGN(na->nla_len));
+}
+
+static int taskstats_get(pid_t pid, struct taskstats *ts)
+{
+	uint32_t tgid = pid;
+	struct nlattr *na, *nested;
+	char *end;
+
+	if (nl_send(s.family, TASKSTATS_CMD_GET, TASKSTATS_CMD_ATTR_TGID,
+		    &tgid, sizeof(tgid)) == -1 || (na = nl_recv(&end)) == NULL) {
+		return -1;
+	}
+	for (; (char *)na < end; na = nla_next(na)) {
+		if (na->nla_type != TASKSTATS_TYPE_AGGR_TGID) {
+			continue;
+		}
+		nested = (struct nlattr *)NLA_DATA(na);
+		for (; (char *)nested < (char *)na + na->nla_len;
+		     nested = nla_next(nested)) {
+			if (nested->nla_type == TASKSTATS_TYPE_STATS) {
+				// older kernels have a shorter struct
+				size_t len = nested->nla_len - NLA_HDRLEN;
+				memset(ts, 0, sizeof(*ts));
+				memcpy(ts, NLA_DATA(nested),
+				       len < sizeof(*ts) ? len : sizeof(*ts));
+				return 0;
+			}
+		}
+	}
+	return -1;
+}
+
+// Opens the taskstats socket, leaves s.nl at -1 when it is unavailable.
+static void taskstats_open(void)
+{
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+	struct taskstats ts;
+	struct nlattr *na;
+	char *end;
+
+	s.nl = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+	if (s.nl == -1 || bind(s.nl, (struct sockaddr *)&addr, sizeof(addr))) {
+		goto fail;
+	}
+	if (nl_send(GENL_ID_CTRL, CTRL_CMD_GETFAMILY, CTRL_ATTR_FAMILY_NAME,
+		    TASKSTATS_GENL_NAME, sizeof(TASKSTATS_GENL_NAME)) == -1 ||
+	    (na = nl_recv(&end)) == NULL) {
+		goto fail;
+	}
+	for (; (char *)na < end; na = nla_next(na)) {
+		if (na->nla_type == CTRL_ATTR_FAMILY_ID) {
+			s.family = *(uint16_t *)NLA_DATA(na);
+		}
+	}
+	// without CAP_NET_ADMIN the family is there but queries fail
+	if (s.family == 0 || taskstats_get(getpid(), &ts) == -1) {
+		goto fail;
+	}
+	return;
+
+fail:
+	fprintf(stderr, "sampler: no taskstats, main thread only for blkio "
+		"and context switches\n");
+	if (s.nl != -1) {
+		close(s.nl);
+	}
+	s.nl = -1;
+}
+
+static ssize_t proc_read(int fd)
+{
+	ssize_t len = pread(fd, s.buf, sizeof(s.buf) - 1, 0);
+
+	if (len > 0) {
+		s.buf[len] = 0;
+	}
+	return len;
+}
+
+static int tracked(pid_t pid)
+{
+	unsigned i;
+
+	for (i = 0; i < s.nprocs; i++) {
+		if (s.procs[i].pid == pid) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void track(pid_t pid)
+{
+	struct proc *p = &s.procs[s.nprocs];
+	char path[64];
+
+	if (s.nprocs == MAXPROCS || pid == getpid() || tracked(pid)) {
+		return;
+	}
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if ((p->statfd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		return;
+	}
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	p->statusfd = open(path, O_RDONLY | O_CLOEXEC);
+	if (clock_getcpuclockid(pid, &p->clock) != 0) {
+		p->clock = -1;
+	}
+	p->pid = pid;
+	p->fresh = 1;
+	s.nprocs++;
+	s.seen = 1;
+}
+
+static void untrack(unsigned i)
+{
+	close(s.procs[i].statfd);
+	if (s.procs[i].statusfd != -1) {
+		close(s.procs[i].statusfd);
+	}
+	s.procs[i] = s.procs[--s.nprocs];
+}
+
+// Adds the members of the process group but its leader, skipping shells.
+static void scan_group(void)
+{
+	char path[64], comm[32];
+	struct dirent *de;
+	int fd, pgrp;
+	pid_t pid;
+	DIR *d;
+
+	if ((d = opendir("/proc")) == NULL) {
+		return;
+	}
+	while ((de = readdir(d)) != NULL) {
+		pid = atoi(de->d_name);
+		if (pid <= 0 || pid == s.pgid || tracked(pid)) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+		if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+			continue;
+		}
+		if (proc_read(fd) > 0 &&
+		    sscanf(s.buf, "%*d (%31[^)]) %*c %*d %d", comm, &pgrp) == 2 &&
+		    pgrp == s.pgid && strcmp(comm, "sh") != 0) {
+			track(pid);
+		}
+		close(fd);
+	}
+	closedir(d);
+}
+
+struct sample {
+	double cpu, blkio, vcsw, nvcsw;
+	uint64_t vsize, rss;
+};
+
+// Adds process i to the sample, returns -1 if it is gone.
+static int sample_proc(unsigned i, double secs, struct sample *sm)
+{
+	struct proc *p = &s.procs[i];
+	unsigned long long vsize, blkio_ticks;
+	uint64_t cpu_ns, blkio_ns, vcsw, nvcsw;
+	unsigned long utime, stime;
+	struct taskstats ts;
+	struct timespec t;
+	long rss;
+	int src = 0;
+	char *c;
+
+	if (proc_read(p->statfd) <= 0 || (c = strrchr(s.buf, ')')) == NULL) {
+		return -1;
+	}
+	// fields from the state on, see proc(5)
+	if (sscanf(c + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu "
+		   "%*d %*d %*d %*d %*d %*d %*u %llu %ld %*u %*u %*u %*u %*u "
+		   "%*u %*u %*u %*u %*u %*u %*u %*u %*d %*d %*u %*u %llu",
+		   &utime, &stime, &vsize, &rss, &blkio_ticks) != 5) {
+		return -1;
+	}
+	if (p->clock != -1 && clock_gettime(p->clock, &t) == 0) {
+		cpu_ns = t.tv_sec * 1000000000ULL + t.tv_nsec;
+		src |= SRC_CLOCK;
+	} else {
+		cpu_ns = (utime + stime) * (1000000000ULL / s.tick);
+	}
+
+	if (s.nl != -1 && taskstats_get(p->pid, &ts) == 0) {
+		blkio_ns = ts.blkio_delay_total;
+		vcsw = ts.nvcsw;
+		nvcsw = ts.nivcsw;
+		src |= SRC_TASKSTATS;
+	} else {
+		blkio_ns = blkio_ticks * (1000000000ULL / s.tick);
+		vcsw = nvcsw = 0;
+		if (p->statusfd != -1 && proc_read(p->statusfd) > 0) {
+			if ((c = strstr(s.buf, "\nvoluntary_ctxt_switches:"))) {
+				vcsw = strtoull(strchr(c, ':') + 1, NULL, 10);
+			}
+			if ((c = strstr(s.buf, "nonvoluntary_ctxt_switches:"))) {
+				nvcsw = strtoull(strchr(c, ':') + 1, NULL, 10);
+			}
+		}
+	}
+
+	sm->vsize += vsize;
+	sm->rss += (uint64_t)rss * s.page;
+	// a source that failed now counts differently, start over
+	if (!p->fresh && src == p->src) {
+		sm->cpu += (cpu_ns - p->cpu_ns) / 1e9 / secs;
+		sm->blkio += (blkio_ns - p->blkio_ns) / 1e9 / secs;
+		sm->vcsw += (vcsw - p->vcsw) / secs;
+		sm->nvcsw += (nvcsw - p->nvcsw) / secs;
+	}
+	p->cpu_ns = cpu_ns;
+	p->blkio_ns = blkio_ns;
+	p->vcsw = vcsw;
+	p->nvcsw = nvcsw;
+	p->src = src;
+	p->fresh = 0;
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"    -p PID     track this process (repeatable)\n"
+		"    -g PGID    track the members of this process group\n"
+		"    -i MS      sampling interval (10)\n"
+		"    -t SECS    stop after this long (0, never)\n"
+		"    -o FILE    output (stdout)\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t start, last, next, interval_ns = 10000000ULL, t, deadline = 0;
+	static char outbuf[1 << 20];
+	struct timespec wake;
+	struct rusage ru;
+	struct sample sm;
+	unsigned i, nsamples = 0;
+	FILE *out = stdout;
+	int c;
+
+	while ((c = getopt(argc, argv, "p:g:i:t:o:")) != -1) {
+		switch (c) {
+		case 'p': track(atoi(optarg)); break;
+		case 'g': s.pgid = atoi(optarg); break;
+		case 'i': interval_ns = strtod(optarg, NULL) * 1e6; break;
+		case 't': deadline = strtod(optarg, NULL) * 1e9; break;
+		case 'o':
+			if ((out = fopen(optarg, "w")) == NULL) {
+				perror(optarg);
+				exit(1);
+			}
+			break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc || (s.nprocs == 0 && s.pgid == 0) ||
+	    interval_ns == 0) {
+		usage(argv[0]);
+	}
+	// written out a megabyte at a time, or at the end
+	setvbuf(out, outbuf, _IOFBF, sizeof(outbuf));
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	s.page = sysconf(_SC_PAGESIZE);
+	s.tick = sysconf(_SC_CLK_TCK);
+	taskstats_open();
+
+	fprintf(out, "# cpu vsize rss blkio time vcsw nvcsw procs\n");
+	start = last = next = now_ns();
+	if (deadline) {
+		deadline += start;
+	}
+	while (!s.stop) {
+		t = now_ns();
+		if (s.pgid && (nsamples == 0 || t / 1000000000ULL !=
+						 last / 1000000000ULL)) {
+			scan_group();
+		}
+		memset(&sm, 0, sizeof(sm));
+		for (i = 0; i < s.nprocs;) {
+			if (sample_proc(i, (t - last) / 1e9, &sm) == -1) {
+				untrack(i);
+			} else {
+				i++;
+			}
+		}
+		if (nsamples++ > 0) {
+			fprintf(out, "%.4lf %llu %llu %.4lf %.3lf %.0lf %.0lf %u\n",
+				sm.cpu, (unsigned long long)sm.vsize,
+				(unsigned long long)sm.rss, sm.blkio,
+				(t - start) / 1e9, sm.vcsw, sm.nvcsw, s.nprocs);
+		}
+		last = t;
+		if ((s.nprocs == 0 && s.seen) || (deadline && t >= deadline)) {
+			break;
+		}
+
+		// absolute deadlines, so the interval doesn't drift
+		next += interval_ns;
+		if (next < now_ns()) {
+			next = now_ns() + interval_ns;
+		}
+		wake.tv_sec = next / 1000000000ULL;
+		wake.tv_nsec = next % 1000000000ULL;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake,
+				       NULL) == EINTR && !s.stop);
+	}
+	fflush(out);
+
+	getrusage(RUSAGE_SELF, &ru);
+	fprintf(stderr, "sampler: %u samples in %.1lf s, %.2lf%% of a CPU\n",
+		nsamples, (now_ns() - start) / 1e9,
+		(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+		 (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6) * 100 /
+		((now_ns() - start) / 1e9));
+	return 0;
+}
@@ -0,0 +1,71 @@
+#!/usr/bin/env python
+
+"""Summarizes a run_swarm.sh run: throughput, peer CPU and LFS CPU."""
+
+import sys
+import os
+import json
+from glob import glob
+
+def peer_cpu(res_usage, clk_tck):
+    """CPU use of a peer from its resource_usage.log, as a fraction of a core."""
+    first = {}
+    last = {}
+    for line in open(res_usage).readlines():
+        parts = line.split(" ")
+        pid = parts[1]
+        t = float(parts[0])
+        ticks = float(parts[14]) + float(parts[15])
+        if pid not in first:
+            first[pid] = (t, ticks)
+        last[pid] = (t, ticks)
+    if not first:
+        return 0.0
+    start = min(t for (t, ticks) in first.values())
+    end = max(t for (t, ticks) in last.values())
+    used = sum(last[pid][1] - first[pid][1] for pid in last)
+    return used / clk_tck / (end - start) if end > start else 0.0
+
+def leeched_bytes(stats):
+    """Bytes written to downloaded content files of one mount."""
+    total = 0
+    for f in stats["files"]:
+        if not f["meta"] and "_l" in f["name"]:
+            total += f["write"]["bytes"]
+    return total
+
+if __name__ == "__main__":
+    if len(sys.argv) < 3:
+        print "Usage:", sys.argv[0], "<logs_dir> <seconds>"
+        sys.exit(1)
+
+    logs_dir = sys.argv[1]
+    secs = float(sys.argv[2])
+    try:
+        clk_tck = float(os.sysconf(os.sysconf_names['SC_CLK_TCK']))
+    except (AttributeError, KeyError):
+        clk_tck = 100.0
+
+    total = 0
+    for path in sorted(glob(os.path.join(logs_dir, "access_stats.*.json"))):
+        with open(path) as f:
+            total += leeched_bytes(json.load(f))
+    print "aggregate download: %.1f MiB/s (%d bytes)" % \
+        (total / secs / 2 ** 20, total)
+
+    for kind in ("seeder", "leecher"):
+        dirs = glob(os.path.join(logs_dir, kind + "*"))
+        dirs.sort(key=lambda d: int(d[len(os.path.join(logs_dir, kind)):]))
+        for d in dirs:
+            res_usage = os.path.join(d, "resource_usage.log")
+            if os.path.exists(res_usage):
+                print "%s cpu: %.1f%%" % (os.path.basename(d),
+                                         100 * peer_cpu(res_usage, clk_tck))
+
+    start = dict((l.split()[0], l.split()[1:]) for l in
+                 open(os.path.join(logs_dir, "lfs_cpu.start")))
+    for l in open(os.path.join(logs_dir, "lfs_cpu.end")):
+        mount, ticks = l.split()[0], l.split()[1:]
+        if mount in start and len(ticks) == 2 and len(start[mount]) == 2:
+            used = sum(map(float, ticks)) - sum(map(float, start[mount]))
+            print "lfs%s cpu: %.1f%%" % (mount, 100 * used / clk_tck / secs)
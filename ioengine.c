@@ -0,0 +1,463 @@
+/*
+ * Asynchronous engine for realstore (meta file) I/O. See ioengine.h.
+ */
+
+#define _GNU_SOURCE /* statx */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ioengine.h"
+
+/*
+ * A blocking call the ring can't make, on this kernel or at all. With the
+ * ring running it is made on a helper thread, else by the caller.
+ */
+struct io_job {
+    struct io_req *r;
+    int op;             /* IO_JOB_* */
+    int fd, fd2;        /* or directories */
+    const char *path, *path2;
+    off_t length;
+    struct io_job *next;
+};
+
+enum { IO_JOB_UNLINKAT, IO_JOB_RENAMEAT, IO_JOB_FTRUNCATE };
+
+static int io_job_run(const struct io_job *j)
+{
+    int res = -1;
+
+    switch (j->op) {
+        case IO_JOB_UNLINKAT:
+            res = unlinkat(j->fd, j->path, 0);
+            break;
+        case IO_JOB_RENAMEAT:
+            res = renameat(j->fd, j->path, j->fd2, j->path2);
+            break;
+        case IO_JOB_FTRUNCATE:
+            res = ftruncate(j->fd, j->length);
+            break;
+    }
+
+    return (res == -1) ? -errno : res;
+}
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+
+#define IO_BATCH_MAX 32 /* queued requests submitted even within a batch */
+#define IO_ERROR_WAIT 100000 /* us before waiting again after an error */
+
+static struct io_uring ring;
+static pthread_mutex_t sq_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned pending; /* queued but not submitted, under sq_lock */
+static __thread int batching;
+static pthread_t cq_thread;
+static int running;
+static int has_unlinkat, has_renameat; /* Linux 5.11, else jobs */
+
+static pthread_t job_thread;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static struct io_job *jobs, **jobs_tail = &jobs;
+static struct io_job job_stop; /* queued last by io_job_stop() */
+
+/* Hands everything queued to the kernel. sq_lock must be held. */
+static void io_submit_pending(void)
+{
+    if (pending > 0) {
+        io_uring_submit(&ring);
+        pending = 0;
+    }
+}
+
+/*
+ * Completions are reaped in batches and dispatched from here. A NULL user
+ * data marks the shutdown request from io_stop().
+ */
+static void *io_loop(void *arg)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head, n;
+    int stop = 0, res;
+
+    while (!stop) {
+        if ((res = io_uring_wait_cqe(&ring, &cqe)) == -EINTR) {
+            continue;
+        }
+        if (res != 0) {
+            /* requests in flight still need their completions, so go on */
+            fprintf(stderr, "io_uring wait: %s\n", strerror(-res));
+            usleep(IO_ERROR_WAIT);
+            continue;
+        }
+
+        n = 0;
+        io_batch_begin();
+        io_uring_for_each_cqe(&ring, head, cqe) {
+            struct io_req *r = io_uring_cqe_get_data(cqe);
+            if (r == NULL) {
+                stop = 1;
+            } else {
+                r->done(r, cqe->res);
+            }
+            n++;
+        }
+        io_uring_cq_advance(&ring, n);
+        io_batch_end();
+    }
+
+    return NULL;
+}
+
+static void io_job_push(struct io_job *j)
+{
+    j->next = NULL;
+    pthread_mutex_lock(&job_lock);
+    *jobs_tail = j;
+    jobs_tail = &j->next;
+    pthread_cond_signal(&job_cond);
+    pthread_mutex_unlock(&job_lock);
+}
+
+/* Hands a copy of j to the helper thread. Returns 0, or -1 to run it inline. */
+static int io_job_queue(const struct io_job *j)
+{
+    struct io_job *c;
+
+    if (!running || (c = malloc(sizeof(*c))) == NULL) {
+        return -1;
+    }
+    *c = *j;
+    io_job_push(c);
+
+    return 0;
+}
+
+/* The helper thread, jobs run one at a time in queue order. */
+static void *io_job_loop(void *arg)
+{
+    struct io_job *j;
+
+    for (;;) {
+        pthread_mutex_lock(&job_lock);
+        while (jobs == NULL) {
+            pthread_cond_wait(&job_cond, &job_lock);
+        }
+        j = jobs;
+        if ((jobs = j->next) == NULL) {
+            jobs_tail = &jobs;
+        }
+        pthread_mutex_unlock(&job_lock);
+
+        if (j == &job_stop) {
+            break;
+        }
+        j->r->done(j->r, io_job_run(j));
+        free(j);
+    }
+
+    return NULL;
+}
+
+/* Runs the jobs queued so far and stops the helper thread. */
+static void io_job_stop(void)
+{
+    io_job_push(&job_stop);
+    pthread_join(job_thread, NULL);
+}
+
+/* Returns a free SQE with sq_lock held, or NULL if the ring is not up. */
+static struct io_uring_sqe *io_get_sqe(void)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!running) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&sq_lock);
+    while ((sqe = io_uring_get_sqe(&ring)) == NULL) {
+        /* full, push what's queued to the kernel and retry */
+        io_uring_submit(&ring);
+        pending = 0;
+    }
+
+    return sqe;
+}
+
+/* Queues the SQE, submits unless batching, and drops sq_lock. */
+static void io_put_sqe(struct io_uring_sqe *sqe, struct io_req *r)
+{
+    io_uring_sqe_set_data(sqe, r);
+    if (++pending >= IO_BATCH_MAX || !batching) {
+        io_submit_pending();
+    }
+    pthread_mutex_unlock(&sq_lock);
+}
+
+/* Opcodes the engine submits, READ and up need Linux 5.6. */
+static const int io_ops[] = {
+    IORING_OP_READ, IORING_OP_WRITE, IORING_OP_OPENAT, IORING_OP_STATX,
+    IORING_OP_FSYNC, IORING_OP_NOP
+};
+
+/*
+ * Whether the kernel of the ring supports every opcode in io_ops. Notes the
+ * optional ones too.
+ */
+static int io_probe(void)
+{
+    struct io_uring_probe *probe;
+    unsigned i;
+    int ok = 1;
+
+    if ((probe = io_uring_get_probe_ring(&ring)) == NULL) {
+        return 0; /* older than 5.6 */
+    }
+    for (i = 0; i < sizeof(io_ops) / sizeof(io_ops[0]); i++) {
+        if (!io_uring_opcode_supported(probe, io_ops[i])) {
+            ok = 0;
+        }
+    }
+    has_unlinkat = io_uring_opcode_supported(probe, IORING_OP_UNLINKAT);
+    has_renameat = io_uring_opcode_supported(probe, IORING_OP_RENAMEAT);
+    io_uring_free_probe(probe);
+
+    return ok;
+}
+
+int io_start(unsigned depth, int sqpoll)
+{
+    struct io_uring_params params;
+    int r;
+
+    memset(&params, 0, sizeof(params));
+    if (sqpoll) {
+        /* the kernel polls the SQ, submissions need no syscall */
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = 1000;
+    }
+    if ((r = io_uring_queue_init_params(depth, &ring, &params)) < 0) {
+        return r;
+    }
+    if (!io_probe()) {
+        io_uring_queue_exit(&ring);
+        return -EOPNOTSUPP;
+    }
+    if ((r = pthread_create(&job_thread, NULL, io_job_loop, NULL)) != 0) {
+        io_uring_queue_exit(&ring);
+        return -r;
+    }
+    if ((r = pthread_create(&cq_thread, NULL, io_loop, NULL)) != 0) {
+        io_job_stop();
+        io_uring_queue_exit(&ring);
+        return -r;
+    }
+    running = 1;
+
+    return 0;
+}
+
+void io_stop(void)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!running) {
+        return;
+    }
+
+    /* completions are ordered after everything submitted before the NOP */
+    sqe = io_get_sqe();
+    io_uring_prep_nop(sqe);
+    sqe->flags |= IOSQE_IO_DRAIN;
+    io_put_sqe(sqe, NULL);
+    pthread_join(cq_thread, NULL);
+
+    /* jobs queued by the last completions, requests they make run inline */
+    running = 0;
+    io_job_stop();
+    io_uring_queue_exit(&ring);
+}
+
+int io_async(void)
+{
+    return running;
+}
+
+void io_batch_begin(void)
+{
+    batching = 1;
+}
+
+void io_batch_end(void)
+{
+    batching = 0;
+    if (running) {
+        pthread_mutex_lock(&sq_lock);
+        io_submit_pending();
+        pthread_mutex_unlock(&sq_lock);
+    }
+}
+
+#else /* !HAVE_LIBURING */
+
+int io_start(unsigned depth, int sqpoll)
+{
+    return -ENOSYS;
+}
+
+void io_stop(void)
+{
+}
+
+int io_async(void)
+{
+    return 0;
+}
+
+void io_batch_begin(void)
+{
+}
+
+void io_batch_end(void)
+{
+}
+
+#endif /* HAVE_LIBURING */
+
+/*
+ * Request helpers. Each one falls back to the plain syscall when the ring is
+ * not running.
+ */
+
+static inline void io_sync_done(struct io_req *r, ssize_t res)
+{
+    r->done(r, res < 0 ? -errno : (int)res);
+}
+
+void io_read(struct io_req *r, int fd, void *buf, size_t size, off_t off)
+{
+#ifdef HAVE_LIBURING
+    struct io_uring_sqe *sqe = io_get_sqe();
+    if (sqe != NULL) {
+        io_uring_prep_read(sqe, fd, buf, size, off);
+        io_put_sqe(sqe, r);
+        return;
+    }
+#endif
+    io_sync_done(r, pread(fd, buf, size, off));
+}
+
+void io_write(struct io_req *r, int fd, const void *buf, size_t size,
+    off_t off)
+{
+#ifdef HAVE_LIBURING
+    struct io_uring_sqe *sqe = io_get_sqe();
+    if (sqe != NULL) {
+        io_uring_prep_write(sqe, fd, buf, size, off);
+        io_put_sqe(sqe, r);
+        return;
+    }
+#endif
+    io_sync_done(r, pwrite(fd, buf, size, off));
+}
+
+void io_openat(struct io_req *r, int dirfd, const char *path, int flags,
+    mode_t mode)
+{
+#ifdef HAVE_LIBURING
+    struct io_uring_sqe *sqe = io_get_sqe();
+    if (sqe != NULL) {
+        io_uring_prep_openat(sqe, dirfd, path, flags, mode);
+        io_put_sqe(sqe, r);
+        return;
+    }
+#endif
+    io_sync_done(r, openat(dirfd, path, flags, mode));
+}
+
+void io_statx(struct io_req *r, int dirfd, const char *path,
+    struct statx *stx)
+{
+#ifdef HAVE_LIBURING
+    struct io_uring_sqe *sqe = io_get_sqe();
+    if (sqe != NULL) {
+        io_uring_prep_statx(sqe, dirfd, path, 0, STATX_BASIC_STATS, stx);
+        io_put_sqe(sqe, r);
+        return;
+    }
+#endif
+    io_sync_done(r, statx(dirfd, path, 0, STATX_BASIC_STATS, stx));
+}
+
+void io_fsync(struct io_req *r, int fd, int datasync)
+{
+#ifdef HAVE_LIBURING
+    struct io_uring_sqe *sqe = io_get_sqe();
+    if (sqe != NULL) {
+        io_uring_prep_fsync(sqe, fd, datasync ? IORING_FSYNC_DATASYNC : 0);
+        io_put_sqe(sqe, r);
+        return;
+    }
+#endif
+    io_sync_done(r, datasync ? fdatasync(fd) : fsync(fd));
+}
+
+void io_unlinkat(struct io_req *r, int dirfd, const char *path)
+{
+    struct io_job j = {
+        .r = r, .op = IO_JOB_UNLINKAT, .fd = dirfd, .path = path
+    };
+#ifdef HAVE_LIBURING
+    struct io_uring_sqe *sqe;
+    if (has_unlinkat && (sqe = io_get_sqe()) != NULL) {
+        io_uring_prep_unlinkat(sqe, dirfd, path, 0);
+        io_put_sqe(sqe, r);
+        return;
+    }
+    if (io_job_queue(&j) == 0) {
+        return;
+    }
+#endif
+    r->done(r, io_job_run(&j));
+}
+
+void io_renameat(struct io_req *r, int olddirfd, const char *oldpath,
+    int newdirfd, const char *newpath)
+{
+    struct io_job j = {
+        .r = r, .op = IO_JOB_RENAMEAT, .fd = olddirfd, .path = oldpath,
+        .fd2 = newdirfd, .path2 = newpath
+    };
+#ifdef HAVE_LIBURING
+    struct io_uring_sqe *sqe;
+    if (has_renameat && (sqe = io_get_sqe()) != NULL) {
+        io_uring_prep_renameat(sqe, olddirfd, oldpath, newdirfd, newpath, 0);
+        io_put_sqe(sqe, r);
+        return;
+    }
+    if (io_job_queue(&j) == 0) {
+        return;
+    }
+#endif
+    r->done(r, io_job_run(&j));
+}
+
+void io_ftruncate(struct io_req *r, int fd, off_t length)
+{
+    struct io_job j = {
+        .r = r, .op = IO_JOB_FTRUNCATE, .fd = fd, .length = length
+    };
+#ifdef HAVE_LIBURING
+    /* no opcode before Linux 6.9, always a job */
+    if (io_job_queue(&j) == 0) {
+        return;
+    }
+#endif
+    r->done(r, io_job_run(&j));
+}
@@ -0,0 +1,68 @@
+/*
+ * Asynchronous engine for realstore (meta file) I/O.
+ *
+ * Requests are submitted to an io_uring ring and completed from a dedicated
+ * thread, which calls back into LFS to send the FUSE reply. FUSE threads only
+ * queue work and never wait for the disk. When LFS is built without liburing
+ * or the engine is not started, every call runs synchronously and the
+ * callback fires before it returns.
+ */
+
+#ifndef LFS_IOENGINE_H
+#define LFS_IOENGINE_H
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * Embed this as the first member of the request context. done() receives the
+ * syscall result, or a negative errno.
+ */
+struct io_req {
+    void (*done)(struct io_req *r, int res);
+};
+
+/*
+ * Starts the ring. Returns 0, or -errno if io_uring or one of the operations
+ * used is not available, in which case requests stay synchronous.
+ */
+int io_start(unsigned depth, int sqpoll);
+
+/* Waits for in-flight requests and stops the completion thread. */
+void io_stop(void);
+
+/* Whether requests are asynchronous. */
+int io_async(void);
+
+/*
+ * Submission batching. Between io_batch_begin() and io_batch_end() requests
+ * of the calling thread are only queued, and io_batch_end() submits all that
+ * are queued, of every thread, with one syscall. FUSE workers batch what they
+ * queue until they run out of requests, see workers.h, and the completion
+ * thread what its callbacks queue. Elsewhere requests are submitted at once.
+ */
+void io_batch_begin(void);
+void io_batch_end(void);
+
+/* Buffers and paths must stay valid until done() is called. */
+void io_read(struct io_req *r, int fd, void *buf, size_t size, off_t off);
+void io_write(struct io_req *r, int fd, const void *buf, size_t size,
+    off_t off);
+void io_openat(struct io_req *r, int dirfd, const char *path, int flags,
+    mode_t mode);
+void io_statx(struct io_req *r, int dirfd, const char *path,
+    struct statx *stx);
+void io_fsync(struct io_req *r, int fd, int datasync);
+
+/*
+ * Where the ring has no opcode for these (unlinkat and renameat before Linux
+ * 5.11, ftruncate always) a helper thread of the engine makes the call, and
+ * done() is called from there.
+ */
+void io_unlinkat(struct io_req *r, int dirfd, const char *path);
+void io_renameat(struct io_req *r, int olddirfd, const char *oldpath,
+    int newdirfd, const char *newpath);
+void io_ftruncate(struct io_req *r, int fd, off_t length);
+
+#endif /* LFS_IOENGINE_H */
@@ -8,569 +8,4408 @@
  * deadbeef_size_chunksize (where deadbeef is the pattern). The pattern, the
  * size and the chunksize uniquelly identify a libswift roothash and other
  * metadata (which can be precomputed).
- * 
+ *
+ * Which names are stored, and where, is a policy: name rules given at mount
+ * (classes= option) put every file in a storage class, see content.h. The
+ * class is resolved once, when the file is created, and forwarded files of
+ * the ram class live in a tmpfs directory instead of realstore.
+ *
+ * LFS uses the low-level FUSE API. Every file gets a stable inode number
+ * (which is also its FUSE node id) and stable timestamps, so the kernel can
+ * cache attributes and entries. Whenever LFS changes a file behind the
+ * kernel's back, it sends an explicit invalidation notification.
+ *
+ * The page cache policy is chosen per open: generated data files keep their
+ * cached pages (content at an offset never changes), meta files only while
+ * nobody writes them (see the meta_cache option).
+ *
+ * Optionally, data files can be made to behave like a real disk (device=
+ * option): replies are held back by a device model, see device.h.
+ *
+ * Meta files are accessed with *at() calls relative to the realstore (or
+ * ramstore) directory. Their fds are shared by all opens and cached while
+ * idle, with an LRU bound (max_fds option).
+ *
+ * The whole store (file table and meta file contents) can be saved as a named
+ * snapshot and restored later, see snapshot_take().
+ *
+ * Reads and writes of every file are counted (sizes, offsets, sequential or
+ * random, see stats.h). The virtual file .lfs.stats in the root, not listed
+ * by readdir, serves a JSON snapshot of the counters. With the perf option it
+ * also has hardware counters per FUSE operation and internal phase, see
+ * perf.h.
+ *
+ * One process can serve several mountpoints, each with its own namespace,
+ * realstore and options. Mounts are added and removed at runtime through a
+ * control socket (control= option), and share the worker pool, the realstore
+ * I/O engine and the per-thread generator buffers, see l_mount_add().
+ *
+ * Most options of a mount (cache policy and timeouts, device model, log file,
+ * limits) can be changed while it serves requests, and the statistics reset,
+ * see l_set().
+ *
  * Usage: ./lfs -o [fuse options],realstore=PATH <mountpoint>
  */
 
+#define _GNU_SOURCE /* O_DIRECT */
 #define FUSE_USE_VERSION 26 /* new API */
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <dirent.h>
 #include <stdio.h>
-#include <libgen.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <stddef.h>
 #include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "uthash.h"
+#include "device.h"
+#include "ioengine.h"
+#include "probes.h"
+#include "workers.h"
+#include "stats.h"
+#include "perf.h"
+#include "content.h"
 
 #define MAXPATHLEN 50
-#define MAXREALPATHLEN 256
 #define MAXMETAPATHLEN 32
 
-#define VERSION "0.1 beta"
+#define MAXNOTIFIES 1024 /* pending kernel notifications */
+#define MAXPREFILL (1024 * 1024) /* cap on pages stored ahead of a reader */
+#define PAGESIZE 4096
+#define DEVICE_TICK 100000 /* timer wheel resolution, ns */
+#define DEFAULT_IO_DEPTH 256
+#define DEFAULT_TREE_LAYERS 8 /* of .mhash trees read ahead, see tree_open() */
+
+#define XATTR_CLONE "user.lfs.clone" /* set, makes a file a copy of another */
+#define XATTR_HOLES "user.lfs.holes" /* get, holes of a data file */
+#define MAXHASHLEN 65 /* hex root hash, up to SHA-256 */
+
+#define SNAP_DIR ".lfs-snapshots" /* default snapshot library, in realstore */
+#define XATTR_SNAPSHOTS "user.lfs.snapshots" /* get on the root, names */
+#define XATTR_SNAPSHOT "user.lfs.snapshot"   /* set on the root, take */
+#define XATTR_RESTORE "user.lfs.restore"     /* set on the root */
+#define XATTR_DROP "user.lfs.drop"           /* set on the root */
+
+#define XATTR_SET "user.lfs.set"           /* set on the root, see l_set() */
+#define XATTR_SETTINGS "user.lfs.settings" /* get on the root */
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+#define STATS_NAME ".lfs.stats" /* virtual, access statistics as JSON */
+#define STATS_INO (FUSE_ROOT_ID + 1)
+
+#define DEFAULT_ATTR_TIMEOUT 3600.0
+#define DEFAULT_ENTRY_TIMEOUT 3600.0
+#define DEFAULT_NEGATIVE_TIMEOUT 1.0
 
-struct l_file { 
-    char path[MAXPATHLEN];
+#define VERSION "0.2 beta"
+
+/* Swift metadata of a data file, see swift_refresh(). */
+struct l_swift {
+    fuse_ino_t ino;            /* .mbinmap parsed, 0 if none */
+    unsigned long wseq;        /* of the .mbinmap when parsed */
+    char root_hash[MAXHASHLEN];
+    unsigned long chunk_size;
+    unsigned long long complete; /* bytes */
+};
+
+struct l_file {
+    char name[MAXPATHLEN]; /* no leading slash, we only have the root */
+    fuse_ino_t ino;
     off_t size;
-    int fd;
-    int realfd; /* if stored on real fs */
+    int cls;               /* storage class, CLASS_* of content.h */
+    int meta;              /* stored (real or ram class), see store_fd() */
+    int realfd;            /* on real fs, cached while idle, see meta_fd() */
+    unsigned nopen;        /* opens sharing realfd */
+    struct l_file *lru_prev, *lru_next; /* on the idle fd list */
+    unsigned long wseq;    /* bumped by every change of a meta file */
+    unsigned long synced;  /* wseq made durable by the last commit */
+    struct l_sync *sync_leader; /* during a commit, see l_sync_loop() */
+    struct l_extent *ext;  /* zeroed ranges of a data file, see ext_set() */
+    struct l_tree *tree;   /* its .mhash, once linked, see tree_open() */
+    unsigned next;
+    struct l_swift swift;  /* see swift_refresh() */
+    char pattern[4];
+    struct io_stats stats; /* updated without the lock, see stats.h */
+    unsigned long nlookup; /* kernel references, see l_forget() */
+    int unlinked;
+    unsigned cache_gen;    /* bumped when the kernel's copy may be stale */
+    unsigned open_gen;     /* cache_gen at the last open */
+    unsigned nwriters;     /* opens with write access */
+    off_t read_next;       /* end of the last read, to detect sequential */
+    off_t prefill_end;     /* kernel cache seeded up to here */
+    struct timespec atime;
+    struct timespec mtime;
+    struct timespec ctime;
+    UT_hash_handle hh;     /* by name */
+    UT_hash_handle hh_ino; /* by inode number */
+};
+
+/* A zeroed range of a data file. */
+enum {
+    EXT_HOLE, /* punched, not allocated */
+    EXT_ZERO, /* allocated zeros (zero range, or fallocate past EOF) */
+};
+
+struct l_extent {
+    off_t start, end;
+    int type;
+};
+
+/* Pending kernel cache notification. */
+enum {
+    NOTIFY_INVAL_INODE, /* drop attributes and data of ino at [off, len) */
+    NOTIFY_INVAL_ENTRY, /* drop root dir entry name */
+    NOTIFY_STORE,       /* store pattern pages of ino at [off, off + len) */
+};
+
+struct l_notify {
+    int type;
+    fuse_ino_t ino;
+    char name[MAXPATHLEN];
+    off_t off, len;
     char pattern[4];
-    UT_hash_handle hh;
+};
+
+/* How a group commit makes meta files durable. */
+enum {
+    SYNC_AUTO, /* per file, or the whole fs for large groups */
+    SYNC_FILE, /* fdatasync/fsync every file of the group */
+    SYNC_FS,   /* one syncfs of realstore */
+};
+
+/* Page cache policy for meta files. */
+enum {
+    META_CACHE_NONE,   /* drop cached pages at every open */
+    META_CACHE_AUTO,   /* keep them while nobody modifies the file */
+    META_CACHE_DIRECT, /* like auto, but writers bypass the cache */
+};
+
+/* Profiled operations and phases, see the perf option. */
+enum {
+    L_OP_LOOKUP,
+    L_OP_FORGET,
+    L_OP_FORGET_MULTI,
+    L_OP_GETATTR,
+    L_OP_SETATTR,
+    L_OP_UNLINK,
+    L_OP_OPEN,
+    L_OP_READ,
+    L_OP_WRITE,
+    L_OP_FLUSH,
+    L_OP_RELEASE,
+    L_OP_FSYNC,
+    L_OP_FALLOCATE,
+    L_OP_SETXATTR,
+    L_OP_GETXATTR,
+    L_OP_LISTXATTR,
+    L_OP_OPENDIR,
+    L_OP_READDIR,
+    L_OP_RELEASEDIR,
+    L_OP_FSYNCDIR,
+    L_OP_ACCESS,
+    L_OP_CREATE,
+    L_OP_RENAME,
+    L_OP_GETLK,
+    L_OP_SETLK,
+    L_NOPS
+};
+
+static const char *const l_op_names[L_NOPS] = {
+    "lookup", "forget", "forget_multi", "getattr", "setattr", "unlink",
+    "open", "read", "write", "flush", "release", "fsync", "fallocate",
+    "setxattr", "getxattr", "listxattr", "opendir", "readdir", "releasedir",
+    "fsyncdir", "access", "create", "rename", "getlk", "setlk"
+};
+
+enum {
+    L_PHASE_LOOKUP,    /* file table */
+    L_PHASE_FILL,      /* generated data */
+    L_PHASE_REALSTORE, /* meta file I/O, the submission if asynchronous */
+    L_NPHASES
+};
+
+static const char *const l_phase_names[L_NPHASES] = {
+    "lookup", "fill", "realstore"
 };
 
 struct l_state {
-    struct l_file *files; /* hash table holding l_file structs */
+    struct l_file *files;  /* hash table holding l_file structs, by name */
+    struct l_file *inodes; /* same structs, by inode number */
+    pthread_mutex_t lock;  /* protects both tables */
+    fuse_ino_t next_ino;
     char *metadir;
+    int metafd; /* metadir, meta files are accessed relative to it */
+    char *ramdir;   /* ram class files, a tmpfs directory */
+    int ramfd;
+    struct class_rules classes; /* name to class, see class_of() */
+    char *classes_opt;
+    char *snapdir;  /* snapshot library, see snapshot_take() */
+    int snapfd;
+    char *restore;  /* snapshot to start from */
     unsigned nfiles;
-    void *log_file; /* first a string, then a FILE* */
+    void *log_file; /* first a string, then a FILE*, NULL when not logging */
+    FILE *log_stream; /* kept open once opened, see log_reopen() */
+    char *log_path;
+    uid_t uid;
+    gid_t gid;
+    struct timespec root_time;
+    double attr_timeout;
+    double entry_timeout;
+    double negative_timeout;
+    int kernel_cache; /* always keep page cache between opens */
+    int direct_io;    /* bypass page cache for all opens */
+    int meta_cache;   /* META_CACHE_* */
+    char *meta_cache_opt;
+    unsigned long prefill; /* bytes to seed ahead of sequential readers */
+    unsigned tree_layers;  /* of the hash tree read ahead at open */
+    struct io_mix mix;     /* data and meta requests, see stats.h */
+    int perf;              /* hardware counters, see perf.h */
+    struct perf_slot perf_ops[L_NOPS];
+    struct perf_slot perf_phases[L_NPHASES];
+    struct fuse_chan *chan;
+
+    /* meta file fd cache, protected by lock */
+    unsigned nfds;    /* realfds currently open */
+    unsigned max_fds; /* idle ones are closed above this */
+    struct l_file *lru_head, *lru_tail; /* idle realfds, oldest first */
+
+    /* notification queue, drained by l_notify_loop() */
+    struct l_notify notifies[MAXNOTIFIES];
+    unsigned notify_head, notify_tail;
+    int notify_stop;
+    pthread_mutex_t notify_lock;
+    pthread_cond_t notify_cond;
+    pthread_t notify_thread;
+
+    /* group commit queue, drained by l_sync_loop() */
+    struct l_sync *sync_queue;
+    unsigned sync_inflight;
+    int sync_stop;
+    pthread_mutex_t sync_lock;
+    pthread_cond_t sync_cond;
+    pthread_t sync_thread;
+    int sync_mode;            /* SYNC_* */
+    char *sync_mode_opt;
+    double commit_interval;   /* ms, 0 commits as soon as possible */
+    int sync_on_close;        /* flush behaves like fsync */
+    unsigned long commits, commit_reqs;
+    uint64_t commit_ns, commit_max_ns;
+
+    /* storage emulation for data files, see device.h */
+    char *device;
+    char *dev_lat_dist;
+    struct dev_params dev_opts; /* overrides, negative when unset */
+    int dev_enabled;
+    struct dev_model dev;
+    struct timer_wheel wheel;
+
+    /* request loop, libfuse's unless workers.n is set, see workers.h */
+    struct worker_opts workers;
+    char *worker_cpus;
+
+    /* realstore I/O engine, see ioengine.h */
+    char *io_engine;
+    unsigned io_depth;
+    int io_sqpoll;
+    unsigned long io_inflight; /* requests of this mount in the engine */
+
+    /* mounts, see l_mount_add() */
+    char *control;
+    char *mountpoint;
+    struct fuse_session *se;
+    struct l_state *next;
 };
 
-/* Global var holding FS configuration. */
-struct l_state l_data;
+/*
+ * FS state and configuration, one per mountpoint. Code refers to the mount it
+ * works for as l_data: workers select it before every request (l_enter()),
+ * the other threads of a mount and I/O completions when they start. Threads
+ * that never select one, e.g. libfuse's own request loop, serve the mount of
+ * the command line.
+ */
+static struct l_state l_first;
+static __thread struct l_state *l_cur = &l_first;
+#define l_data (*l_cur)
 
 #define l_log(...) do { \
-                    if (l_data.log_file) { \
-                     fprintf(l_data.log_file, __VA_ARGS__); \
-                     fflush(l_data.log_file); \
+                    FILE *l_logf = __atomic_load_n(&l_data.log_file, \
+                                                   __ATOMIC_RELAXED); \
+                    if (l_logf) { \
+                     fprintf(l_logf, __VA_ARGS__); \
+                     fflush(l_logf); \
                     } \
                    } while (0)
 
-static inline char *gnu_basename(char *path)
+/*
+ * Hardware counters of the enclosing block, for the FUSE operation or
+ * internal phase, when the mount is profiled (perf.h). The scope ends with the
+ * block, whichever way it is left.
+ */
+#define L_PERF(slot) \
+    struct perf_scope l_perf __attribute__((cleanup(perf_end))); \
+    perf_begin(&l_perf, l_data.perf ? (slot) : NULL)
+#define L_PERF_OP(op) L_PERF(&l_data.perf_ops[L_OP_##op])
+#define L_PERF_PHASE(phase) L_PERF(&l_data.perf_phases[L_PHASE_##phase])
+#define L_PERF_CALL(phase, call) do { L_PERF_PHASE(phase); call; } while (0)
+
+/*
+ * Replies. Every one fires the reply probe, see probes.h.
+ */
+static inline void l_reply_err(fuse_req_t req, int err)
 {
-    char *base = strrchr(path, '/');
-    return base ? base+1 : path;
+    L_PROBE2(reply, req, -err);
+    fuse_reply_err(req, err);
 }
 
-static inline unsigned int is_meta_file(const char *path)
+static inline void l_reply_none(fuse_req_t req)
 {
-    size_t l = strlen(path);
-    unsigned int r = 0;
-    
-    if (l >= 6) {
-        r |= (strcmp(path + l - 6, ".mhash") == 0);
-    }
-    
-    if (l >= 8) {
-        r |= (strcmp(path + l - 8, ".mbinmap") == 0);
-    }
+    L_PROBE2(reply, req, 0);
+    fuse_reply_none(req);
+}
 
-    return r;
+static inline void l_reply_buf(fuse_req_t req, const char *buf, size_t size)
+{
+    L_PROBE2(reply, req, size);
+    fuse_reply_buf(req, buf, size);
 }
 
-static inline int parse_pattern(const char *s, char *array)
+static inline void l_reply_write(fuse_req_t req, size_t count)
 {
-    if (strlen(s) < 8) {
-        return -1;
-    }
+    L_PROBE2(reply, req, count);
+    fuse_reply_write(req, count);
+}
 
-    int i;
-    for (i = 0; i < 8; i += 2) {
-        if (sscanf(&s[i], "%2hhx", &array[i / 2]) != 1) {
-            return -1;
-        }
-    }
-    
-    return 0;
+static inline void l_reply_xattr(fuse_req_t req, size_t count)
+{
+    L_PROBE2(reply, req, count);
+    fuse_reply_xattr(req, count);
+}
+
+static inline void l_reply_attr(fuse_req_t req, const struct stat *attr,
+    double attr_timeout)
+{
+    L_PROBE2(reply, req, 0);
+    fuse_reply_attr(req, attr, attr_timeout);
+}
+
+static inline void l_reply_entry(fuse_req_t req,
+    const struct fuse_entry_param *e)
+{
+    L_PROBE2(reply, req, e->ino);
+    fuse_reply_entry(req, e);
+}
+
+static inline void l_reply_open(fuse_req_t req,
+    const struct fuse_file_info *fi)
+{
+    L_PROBE2(reply, req, 0);
+    fuse_reply_open(req, fi);
+}
+
+static inline void l_reply_create(fuse_req_t req,
+    const struct fuse_entry_param *e, const struct fuse_file_info *fi)
+{
+    L_PROBE2(reply, req, e->ino);
+    fuse_reply_create(req, e, fi);
 }
 
 /*
- * Predefined attributes - we don't care about most of these.
+ * Zeroed ranges.
+ *
+ * Data files are the pattern everywhere except in a short sorted list of
+ * extents that read as zeros, so fallocate and friends only touch metadata.
+ * Lock must be held for all of these.
  */
-int l_getattr(const char *path, struct stat *stbuf)
-{
-    struct l_file *file;
 
-    if (strcmp(path, "/") == 0) {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
+/* Sets [start, end) to type, or back to the pattern if type is -1. */
+static int ext_set(struct l_file *file, off_t start, off_t end, int type)
+{
+    struct l_extent *ext, *e;
+    unsigned i, n = 0;
+    int added = (type < 0);
 
+    if (start >= end) {
         return 0;
     }
+    if ((ext = malloc((file->next + 2) * sizeof(*ext))) == NULL) {
+        return -ENOMEM;
+    }
 
-    /* find it */
-    HASH_FIND_STR(l_data.files, path, file);
-    if (file == NULL) {
-        return -ENOENT;
+    for (i = 0; i < file->next; i++) {
+        e = &file->ext[i];
+        if (e->end <= start || e->start >= end) {
+            if (!added && e->start >= end) {
+                ext[n++] = (struct l_extent){ start, end, type };
+                added = 1;
+            }
+            ext[n++] = *e;
+            continue;
+        }
+        /* overlaps, keep what sticks out on either side */
+        if (e->start < start) {
+            ext[n++] = (struct l_extent){ e->start, start, e->type };
+        }
+        if (!added) {
+            ext[n++] = (struct l_extent){ start, end, type };
+            added = 1;
+        }
+        if (e->end > end) {
+            ext[n++] = (struct l_extent){ end, e->end, e->type };
+        }
+    }
+    if (!added) {
+        ext[n++] = (struct l_extent){ start, end, type };
     }
 
-    if (is_meta_file(path)) {
-        /* delegate to real fs */
-        char *pathcopy = strdup(path);
-        char *bn = gnu_basename(pathcopy);
-        char realpath[MAXREALPATHLEN];
-        snprintf(realpath, MAXREALPATHLEN, "%s/%s", l_data.metadir, bn);
-        int r = stat(realpath, stbuf);
-        free(pathcopy);
+    /* merge neighbours of the same type */
+    for (i = 1, e = ext; i < n; i++) {
+        if (ext[i].start == e->end && ext[i].type == e->type) {
+            e->end = ext[i].end;
+        } else {
+            *++e = ext[i];
+        }
+    }
+    n = (n > 0) ? e - ext + 1 : 0;
 
-        return r;
-    } else {
-        time_t now = time(NULL);
+    free(file->ext);
+    file->ext = (n > 0) ? ext : NULL;
+    file->next = n;
+    if (n == 0) {
+        free(ext);
+    }
 
-        stbuf->st_dev = 0;
-        stbuf->st_ino = 0;
-        stbuf->st_mode = S_IFREG | S_IRWXU | S_IRWXG | S_IRWXO;
-        stbuf->st_nlink = 1;
-        stbuf->st_uid = getuid();
-        stbuf->st_gid = getgid();
-        stbuf->st_rdev = 0;
-        stbuf->st_blksize = 512;
-        stbuf->st_atime = now;
-        stbuf->st_mtime = now;
-        stbuf->st_ctime = now;
-        stbuf->st_size = file->size;
-        stbuf->st_blocks = stbuf->st_size / 512;
-        
-        return 0;
+    return 0;
+}
+
+/* Drops everything past length. */
+static void ext_trunc(struct l_file *file, off_t length)
+{
+    while (file->next > 0 && file->ext[file->next - 1].start >= length) {
+        file->next--;
+    }
+    if (file->next > 0 && file->ext[file->next - 1].end > length) {
+        file->ext[file->next - 1].end = length;
     }
 }
 
-/*
- * Removes the file.
- */
-int l_unlink(const char *path)
+/* Turns holes in [start, end) into allocated zeros. */
+static int ext_alloc(struct l_file *file, off_t start, off_t end)
 {
-    struct l_file *file;
-    int r = 0;
+    unsigned i;
+    int r;
 
-    /* find it */
-    HASH_FIND_STR(l_data.files, path, file);
-    if (file == NULL) {
-        return -ENOENT;
+    if (start >= end) {
+        return 0;
     }
-
-    /* remove meta files from real storage */
-    if (is_meta_file(path)) {
-        char *pathcopy = strdup(path);
-        char *bn = gnu_basename(pathcopy);
-        char realpath[MAXREALPATHLEN];
-        snprintf(realpath, MAXREALPATHLEN, "%s/%s", l_data.metadir, bn);
-        r = unlink(realpath);
-        free(pathcopy);
+    for (i = 0; i < file->next; i++) {
+        struct l_extent e = file->ext[i];
+        if (e.type != EXT_HOLE || e.end <= start || e.start >= end) {
+            continue;
+        }
+        r = ext_set(file, e.start > start ? e.start : start,
+                    e.end < end ? e.end : end, EXT_ZERO);
+        if (r != 0) {
+            return r;
+        }
+        i = -1; /* the list changed, start over */
     }
 
-    HASH_DEL(l_data.files, file);
-    free(file);
-
-    return r; /* r is always 0 when file is not meta */
+    return 0;
 }
 
-/*
- * Changes file size.
- */
-int l_truncate(const char *path, off_t length)
+/* Zeroes the parts of buf, holding the file at offset, that are extents. */
+static void ext_fill(const struct l_file *file, char *buf, size_t size,
+    off_t offset)
 {
-    struct l_file *file;
-    
-    /* find it */
-    HASH_FIND_STR(l_data.files, path, file);
-    if (file == NULL) {
-        return -ENOENT;
+    off_t s, t, end = offset + size;
+    unsigned i;
+
+    for (i = 0; i < file->next && file->ext[i].start < end; i++) {
+        s = file->ext[i].start > offset ? file->ext[i].start : offset;
+        t = file->ext[i].end < end ? file->ext[i].end : end;
+        if (s < t) {
+            memset(buf + (s - offset), 0, t - s);
+        }
     }
-    
-    if (is_meta_file(path)) {
-        /* delegate to real fs */
-        char *pathcopy = strdup(path);
-        char *bn = gnu_basename(pathcopy);
-        char realpath[MAXREALPATHLEN];
-        snprintf(realpath, MAXREALPATHLEN, "%s/%s", l_data.metadir, bn);
-        int r = truncate(realpath, length);
-        free(pathcopy);
+}
 
-        return r;
-    } else {
-        file->size = length;
+/* Bytes of the file that are not allocated. */
+static off_t ext_holes(const struct l_file *file)
+{
+    off_t n = 0;
+    unsigned i;
 
-        return 0;
+    for (i = 0; i < file->next && file->ext[i].start < file->size; i++) {
+        if (file->ext[i].type == EXT_HOLE) {
+            n += (file->ext[i].end < file->size ? file->ext[i].end
+                                                : file->size)
+                 - file->ext[i].start;
+        }
     }
+
+    return n;
 }
 
 /*
- * Opens a file.
- *
- * O_CREAT and O_EXCL are guaranteed to not be passed to this. The file will
- * exist when this is called. O_TRUNC might be present when atomic_o_trunc is
- * specified on a kernel version of 2.6.24 or later.
+ * Per-thread page-aligned buffer, grown as needed and reused between
+ * requests.
  */
-int l_open(const char *path, struct fuse_file_info *fi)
-{
-    struct l_file *file;
+static __thread char *scratch;
+static __thread size_t scratch_size;
 
-    l_log("opening file %s ", path);
+static char *scratch_buf(size_t size)
+{
+    void *p;
 
-    /* find it */
-    HASH_FIND_STR(l_data.files, path, file);
-    if (file == NULL) {
-        return -ENOENT;
+    if (size <= scratch_size) {
+        return scratch;
+    }
+    size = (size + PAGESIZE - 1) & ~((size_t)PAGESIZE - 1);
+    if (posix_memalign(&p, PAGESIZE, size) != 0) {
+        return NULL;
     }
+    free(scratch);
+    scratch = p;
+    scratch_size = size;
 
-    l_log("(file exists)\n");
-    
-    if (is_meta_file(path)) {
-        /* delegate to real fs */
-        char *pathcopy = strdup(path);
-        char *bn = gnu_basename(pathcopy);
-        char realpath[MAXREALPATHLEN];
-        snprintf(realpath, MAXREALPATHLEN, "%s/%s", l_data.metadir, bn);
+    return scratch;
+}
 
-        int fd;
-        if ((fd = open(realpath, O_RDWR)) == -1) {
-            return -errno;
-        }
-        file->realfd = fd;
-        free(pathcopy);
+static inline void l_now(struct timespec *ts)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+}
 
-        return 0;
-    } else {
-        if (fi->flags & O_TRUNC)
-            file->size = 0;
+/* Callers must hold l_data.lock for the lookup helpers. */
+static inline struct l_file *find_name(const char *name)
+{
+    struct l_file *file;
+    L_PERF_PHASE(LOOKUP);
+    HASH_FIND_STR(l_data.files, name, file);
+    L_PROBE3(hash_lookup, name, file ? file->ino : 0, file != NULL);
+    return file;
+}
 
-        /* This is it. We don't care about access rights. */
-        return 0;
-    }
+static inline struct l_file *find_ino(fuse_ino_t ino)
+{
+    struct l_file *file;
+    L_PERF_PHASE(LOOKUP);
+    HASH_FIND(hh_ino, l_data.inodes, &ino, sizeof(ino), file);
+    L_PROBE3(hash_lookup, NULL, ino, file != NULL);
+    return file;
+}
+
+/* Directory holding the content of a meta file. */
+static inline int store_fd(const struct l_file *file)
+{
+    return (file->cls == CLASS_RAM) ? l_data.ramfd : l_data.metafd;
 }
 
 /*
- * Reads file.
- *
- * Iteratively returns a byte from a 4-byte preset pattern.
+ * Meta file descriptors. Lock must be held for all of these.
  *
- * TODO(vladum): Handle direct_io.
+ * A meta file has at most one fd on the real fs, opened relative to store_fd()
+ * and shared by all opens of the file. When the last open is released the fd
+ * stays cached on an LRU list, so reopening is free. Once more than max_fds
+ * are open, the least recently used idle ones are closed.
  */
-int l_read(const char *path, char *buf, size_t size, off_t offset,
-    struct fuse_file_info *fi)
+static void fd_lru_remove(struct l_file *file)
 {
-    struct l_file *file;
-    
-    /* find it */
-    HASH_FIND_STR(l_data.files, path, file);
-    if (file == NULL) {
-        return -ENOENT;
+    if (file->lru_prev != NULL) {
+        file->lru_prev->lru_next = file->lru_next;
+    } else {
+        l_data.lru_head = file->lru_next;
     }
-
-    if (is_meta_file(path)) {
-        /* delegate to real fs */
-        return pread(file->realfd, buf, size, offset);
+    if (file->lru_next != NULL) {
+        file->lru_next->lru_prev = file->lru_prev;
     } else {
-        int i, j;
-        for (i = 0; i < size; i++) {
-            if (offset + i >= file->size) {
-                /* Fill remaining buffer with 0s. */
-                for (j = i; j < size; j++)
-                    buf[j] = 0x00;
-
-                /* Return bytes read so far. */
-                return i;
-            } else {
-                buf[i] = file->pattern[(offset + i) % 4];
-            }
-        }
+        l_data.lru_tail = file->lru_prev;
     }
-
-    /* EOF was not encountered. */
-    return size;
+    file->lru_prev = file->lru_next = NULL;
 }
 
-/*
- * Write.
- * 
- * All writes, except the ones on .mhash and .mbinmap, are ignored (only the
- * size is changed).
- */
-int l_write(const char *path, const char *buf, size_t size, off_t offset,
-    struct fuse_file_info *fi)
+static void fd_lru_append(struct l_file *file)
 {
-    struct l_file *file;
-    //l_log("%ld bytes at %ld ", size, offset);
-    /* find it */
-    HASH_FIND_STR(l_data.files, path, file);
-    if (file == NULL) {
-        return -ENOENT;
-    }
-    
-    //l_log("(file was found)\n");
-
-    if (is_meta_file(path)) {
-        /* delegate to real fs */
-        return pwrite(file->realfd, buf, size, offset);
+    file->lru_prev = l_data.lru_tail;
+    file->lru_next = NULL;
+    if (l_data.lru_tail != NULL) {
+        l_data.lru_tail->lru_next = file;
     } else {
-        if (file->size < offset + size) {
-            file->size = offset + size;
-        }
-
-        return size;
+        l_data.lru_head = file;
     }
+    l_data.lru_tail = file;
 }
 
-int l_flush(const char *path, struct fuse_file_info *fi)
+static void fd_close(struct l_file *file)
 {
-    /* Nothing to flush, so this always succeeds. */
-    return 0;
+    if (file->nopen == 0) {
+        fd_lru_remove(file);
+    }
+    close(file->realfd);
+    l_data.nfds--;
+    L_PROBE3(fd_close, file->name, file->realfd, l_data.nfds);
+    file->realfd = -1;
 }
 
-/*
- * Release.
- */
-int l_release(const char *path, struct fuse_file_info *fi)
+static void fd_trim(void)
 {
-    struct l_file *file;
+    while (l_data.nfds > l_data.max_fds && l_data.lru_head != NULL) {
+        fd_close(l_data.lru_head);
+    }
+}
 
-    /* find it */
-    HASH_FIND_STR(l_data.files, path, file);
-    if (file == NULL) {
-        return -ENOENT;
+/* Takes a freshly opened fd, or closes it if another open won the race. */
+static void meta_fd_set(struct l_file *file, int fd)
+{
+    if (file->realfd != -1) {
+        close(fd);
+        return;
     }
-    
-    if (is_meta_file(path)) {
-        /* delegate to real fs */
-        return close(file->realfd);
+
+    fd_trim();
+    file->realfd = fd;
+    l_data.nfds++;
+    L_PROBE3(fd_open, file->name, fd, l_data.nfds);
+    if (file->nopen == 0) {
+        fd_lru_append(file);
     }
-     
-    /* Nothing to do for release() and the return value is ignored. */
-    return 0;
 }
 
-int l_getxattr(const char *path, const char *name, char *value, size_t size)
+/* Returns the realfd, opening it if needed, or -errno. */
+static int meta_fd(struct l_file *file)
 {
-    return -ENODATA;
+    int fd;
+
+    if (file->realfd == -1) {
+        if ((fd = openat(store_fd(file), file->name, O_RDWR)) == -1) {
+            return -errno;
+        }
+        meta_fd_set(file, fd);
+    }
+
+    return file->realfd;
 }
 
-int l_opendir(const char *path, struct fuse_file_info *fi)
+/* Pins the realfd for an open. */
+static void meta_fd_hold(struct l_file *file)
 {
-    /* We only have one dir - the root. */
-    if (strcmp(path, "/") == 0)
-        return 0;
-    else
-        return -ENOENT;
+    if (file->nopen++ == 0 && file->realfd != -1) {
+        fd_lru_remove(file);
+    }
 }
 
-int l_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
-    struct fuse_file_info *fi)
+static void meta_fd_put(struct l_file *file)
 {
-    if (strcmp(path, "/") != 0)
-        return -ENOENT;
+    if (--file->nopen > 0 || file->realfd == -1) {
+        return;
+    }
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+    fd_lru_append(file);
+    if (file->unlinked) {
+        fd_close(file); /* nobody can open it again */
+    }
+    fd_trim();
+}
 
-    struct l_file *files = l_data.files, *f, *tmp;
-    HASH_ITER(hh, files, f, tmp) {
-        filler(buf, f->path + 1, NULL, 0);
+static void free_file(struct l_file *file)
+{
+    HASH_DELETE(hh_ino, l_data.inodes, file);
+    if (file->realfd != -1) {
+        fd_close(file);
     }
+    free(file->ext);
+    free(file->tree);
+    free(file);
+}
 
-    return 0;
+/*
+ * Kernel notifications.
+ *
+ * Notifications can't be sent from the request that caused them (the kernel
+ * might hold locks the notification needs), so they are queued and sent from
+ * a separate thread.
+ */
+static void l_notify(const struct l_notify *n)
+{
+    pthread_mutex_lock(&l_data.notify_lock);
+    if (l_data.notify_tail - l_data.notify_head == MAXNOTIFIES) {
+        /* Full, drop the oldest. Entries still expire after the timeouts. */
+        l_log("notification queue full\n");
+        l_data.notify_head++;
+    }
+    l_data.notifies[l_data.notify_tail % MAXNOTIFIES] = *n;
+    l_data.notify_tail++;
+    pthread_cond_signal(&l_data.notify_cond);
+    pthread_mutex_unlock(&l_data.notify_lock);
 }
 
-void l_destroy(void *userdata)
+static inline void l_inval_range(fuse_ino_t ino, off_t off, off_t len)
 {
-    struct l_file *files = ((struct l_state *)userdata)->files;
-    struct l_file *f, *tmp;
+    struct l_notify n = {
+        .type = NOTIFY_INVAL_INODE, .ino = ino, .off = off, .len = len
+    };
+    l_notify(&n);
+}
 
-    /* Remove all files in the hashtable. */
-    HASH_ITER(hh, files, f, tmp) {
-        if (f->realfd != -1) {
-            close(f->realfd);
-        }
-        HASH_DEL(files, f);
-        free(f);
-    }
+static inline void l_inval_inode(fuse_ino_t ino)
+{
+    l_inval_range(ino, 0, 0); /* len 0 means everything */
 }
 
-int l_access(const char *path, int mode)
+static inline void l_inval_entry(const char *name)
 {
-    /* We trust everybody. */
-    return 0;
+    struct l_notify n = { .type = NOTIFY_INVAL_ENTRY };
+    strncpy(n.name, name, MAXPATHLEN - 1);
+    l_notify(&n);
 }
 
 /*
- * Creates a file.
+ * Seeds the kernel page cache with generated content.
  */
-int l_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+static inline void l_store(struct l_file *file, off_t off, off_t len)
 {
-    struct l_file *file;
+    struct l_notify n = {
+        .type = NOTIFY_STORE, .ino = file->ino, .off = off, .len = len
+    };
+    memcpy(n.pattern, file->pattern, 4);
+    l_notify(&n);
+}
 
-    l_log("creating file %s ", path);
+static void send_store(const struct l_notify *n, char *buf)
+{
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(n->len);
+
+    fill_pattern(buf, n->len, n->pattern, n->off);
+    bufv.buf[0].mem = buf;
+    fuse_lowlevel_notify_store(l_data.chan, n->ino, n->off, &bufv, 0);
+}
+
+static void *l_notify_loop(void *arg)
+{
+    struct l_notify n;
+    char *buf;
+
+    l_cur = arg;
+    pthread_mutex_lock(&l_data.notify_lock);
+    for (;;) {
+        while (l_data.notify_head == l_data.notify_tail &&
+               !l_data.notify_stop) {
+            pthread_cond_wait(&l_data.notify_cond, &l_data.notify_lock);
+        }
+        if (l_data.notify_head == l_data.notify_tail) {
+            break; /* stopping and nothing left */
+        }
+        n = l_data.notifies[l_data.notify_head % MAXNOTIFIES];
+        l_data.notify_head++;
+        pthread_mutex_unlock(&l_data.notify_lock);
+
+        /* -ENOENT just means the kernel didn't have it cached. */
+        switch (n.type) {
+            case NOTIFY_INVAL_INODE:
+                fuse_lowlevel_notify_inval_inode(l_data.chan, n.ino, n.off,
+                    n.len);
+                break;
+            case NOTIFY_INVAL_ENTRY:
+                fuse_lowlevel_notify_inval_entry(l_data.chan, FUSE_ROOT_ID,
+                    n.name, strlen(n.name));
+                break;
+            case NOTIFY_STORE:
+                /* sized per store, prefill may change at runtime */
+                if ((buf = scratch_buf(n.len)) != NULL) {
+                    send_store(&n, buf);
+                }
+                break;
+        }
+
+        pthread_mutex_lock(&l_data.notify_lock);
+    }
+    pthread_mutex_unlock(&l_data.notify_lock);
+
+    free(scratch);
+
+    return NULL;
+}
+
+/*
+ * Predefined attributes - we don't care about most of these. Everything here
+ * is stable between calls, so the kernel is free to cache it.
+ */
+static int file_stat(struct l_file *file, struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(*stbuf));
+
+    if (file->meta) {
+        /* delegate to real fs */
+        int r = (file->realfd != -1)
+                ? fstat(file->realfd, stbuf)
+                : fstatat(store_fd(file), file->name, stbuf, 0);
+        if (r == -1) {
+            return -errno;
+        }
+        stbuf->st_ino = file->ino;
+        stbuf->st_nlink = 1;
+    } else {
+        stbuf->st_dev = 0;
+        stbuf->st_ino = file->ino;
+        stbuf->st_mode = S_IFREG | S_IRWXU | S_IRWXG | S_IRWXO;
+        stbuf->st_nlink = 1;
+        stbuf->st_uid = l_data.uid;
+        stbuf->st_gid = l_data.gid;
+        stbuf->st_rdev = 0;
+        stbuf->st_blksize = 512;
+        stbuf->st_atim = file->atime;
+        stbuf->st_mtim = file->mtime;
+        stbuf->st_ctim = file->ctime;
+        stbuf->st_size = file->size;
+        stbuf->st_blocks = (stbuf->st_size - ext_holes(file)) / 512;
+    }
+
+    return 0;
+}
+
+static void root_stat(struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_ino = FUSE_ROOT_ID;
+    stbuf->st_mode = S_IFDIR | 0755;
+    stbuf->st_nlink = 2;
+    stbuf->st_uid = l_data.uid;
+    stbuf->st_gid = l_data.gid;
+    stbuf->st_atim = l_data.root_time;
+    stbuf->st_mtim = l_data.root_time;
+    stbuf->st_ctim = l_data.root_time;
+}
+
+/*
+ * The statistics file. Every open takes a snapshot, which reads return in
+ * slices, so its size is unknown and it is always opened with direct_io.
+ */
+static void stats_stat(struct stat *stbuf)
+{
+    root_stat(stbuf);
+    stbuf->st_ino = STATS_INO;
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+}
+
+static void stats_open(fuse_req_t req, struct fuse_file_info *fi)
+{
+    struct stats_buf *b;
+    struct l_file *f, *tmp;
+    int r;
+
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        l_reply_err(req, EACCES);
+        return;
+    }
+    if ((b = malloc(sizeof(*b))) == NULL) {
+        l_reply_err(req, ENOMEM);
+        return;
+    }
+
+    r = stats_begin(b, &l_data.mix);
+    pthread_mutex_lock(&l_data.lock);
+    HASH_ITER(hh, l_data.files, f, tmp) {
+        if (r == 0 && stats_used(&f->stats)) {
+            r = stats_file(b, f->name, f->ino, class_name(f->cls), f->meta,
+                f->size, &f->stats);
+        }
+    }
+    pthread_mutex_unlock(&l_data.lock);
+    if (r == 0 && l_data.perf) {
+        r = stats_section(b, "perf_ops");
+        r |= perf_json(b, l_op_names, l_data.perf_ops, L_NOPS);
+        r |= stats_section(b, "perf_phases");
+        r |= perf_json(b, l_phase_names, l_data.perf_phases, L_NPHASES);
+    }
+    r |= stats_end(b);
+
+    if (r != 0) {
+        free(b->data);
+        free(b);
+        l_reply_err(req, ENOMEM);
+        return;
+    }
+
+    fi->fh = (uintptr_t)b;
+    fi->direct_io = 1;
+    l_reply_open(req, fi);
+}
+
+static void stats_read(fuse_req_t req, size_t size, off_t offset,
+    struct fuse_file_info *fi)
+{
+    struct stats_buf *b = (struct stats_buf *)(uintptr_t)fi->fh;
+
+    if (offset < b->len) {
+        size_t n = b->len - offset;
+        l_reply_buf(req, b->data + offset, n < size ? n : size);
+    } else {
+        l_reply_buf(req, NULL, 0);
+    }
+}
+
+static void stats_release(fuse_req_t req, struct fuse_file_info *fi)
+{
+    struct stats_buf *b = (struct stats_buf *)(uintptr_t)fi->fh;
+
+    free(b->data);
+    free(b);
+    l_reply_err(req, 0);
+}
+
+/* Name of an open file for probes, fi->fh is no l_file for STATS_INO. */
+static inline const char *open_name(fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    return (ino == STATS_INO) ? STATS_NAME :
+        ((struct l_file *)(uintptr_t)fi->fh)->name;
+}
+
+/*
+ * Counts a read or write in the access statistics. The lock is not needed,
+ * a size changing meanwhile only shifts the heatmap bucket.
+ */
+static void file_account(struct l_file *file, int dir, off_t off,
+    size_t size)
+{
+    stats_add(&file->stats, dir, off, size, file->meta ? 0 : file->size);
+    stats_mix(&l_data.mix, dir, file->meta);
+}
+
+/* Fills an entry reply and takes a kernel reference. Lock must be held. */
+static int fill_entry(struct l_file *file, struct fuse_entry_param *e)
+{
+    int r;
+
+    memset(e, 0, sizeof(*e));
+    if ((r = file_stat(file, &e->attr)) != 0) {
+        return r;
+    }
+    e->ino = file->ino;
+    e->attr_timeout = l_data.attr_timeout;
+    e->entry_timeout = l_data.entry_timeout;
+    file->nlookup++;
+
+    return 0;
+}
+
+void l_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct l_file *file;
+    struct fuse_entry_param e;
+    int r;
+
+    L_OP(lookup, req, parent, name, 0, 0);
+    L_PERF_OP(LOOKUP);
+
+    if (parent != FUSE_ROOT_ID) {
+        l_reply_err(req, ENOENT);
+        return;
+    }
+    if (strcmp(name, STATS_NAME) == 0) {
+        memset(&e, 0, sizeof(e));
+        stats_stat(&e.attr);
+        e.ino = STATS_INO;
+        e.attr_timeout = l_data.attr_timeout;
+        e.entry_timeout = l_data.entry_timeout;
+        l_reply_entry(req, &e);
+        return;
+    }
+
+    pthread_mutex_lock(&l_data.lock);
+    file = find_name(name);
+    if (file == NULL) {
+        pthread_mutex_unlock(&l_data.lock);
+
+        if (l_data.negative_timeout > 0) {
+            /* cache the negative entry */
+            memset(&e, 0, sizeof(e));
+            e.entry_timeout = l_data.negative_timeout;
+            l_reply_entry(req, &e);
+        } else {
+            l_reply_err(req, ENOENT);
+        }
+        return;
+    }
+    r = fill_entry(file, &e);
+    pthread_mutex_unlock(&l_data.lock);
+
+    if (r != 0) {
+        l_reply_err(req, -r);
+    } else {
+        l_reply_entry(req, &e);
+    }
+}
+
+static void forget_one(fuse_ino_t ino, unsigned long nlookup)
+{
+    struct l_file *file = find_ino(ino);
+    if (file == NULL) {
+        return;
+    }
+
+    file->nlookup -= (nlookup < file->nlookup ? nlookup : file->nlookup);
+    if (file->nlookup == 0 && file->unlinked) {
+        free_file(file);
+    }
+}
+
+/*
+ * The kernel dropped references to an inode. Unlinked files are kept around
+ * until then.
+ */
+void l_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    L_OP(forget, req, ino, NULL, 0, nlookup);
+    L_PERF_OP(FORGET);
+
+    pthread_mutex_lock(&l_data.lock);
+    forget_one(ino, nlookup);
+    pthread_mutex_unlock(&l_data.lock);
+
+    l_reply_none(req);
+}
+
+void l_forget_multi(fuse_req_t req, size_t count,
+    struct fuse_forget_data *forgets)
+{
+    size_t i;
+
+    L_OP(forget_multi, req, 0, NULL, 0, count);
+    L_PERF_OP(FORGET_MULTI);
+
+    pthread_mutex_lock(&l_data.lock);
+    for (i = 0; i < count; i++) {
+        forget_one(forgets[i].ino, forgets[i].nlookup);
+    }
+    pthread_mutex_unlock(&l_data.lock);
+
+    l_reply_none(req);
+}
+
+/*
+ * A meta file request handed to the I/O engine. The reply is sent from the
+ * completion callback.
+ */
+struct l_io {
+    struct io_req ior; /* first, the engine hands it back */
+    struct l_state *mnt;
+    fuse_req_t req;
+    struct l_file *file;
+    fuse_ino_t ino;
+    struct fuse_file_info fi;
+    off_t offset;
+    char name[MAXPATHLEN]; /* copied, the file may be renamed meanwhile */
+    struct statx stx;
+    struct stat attr;      /* setattr */
+    int to_set;
+    void (*next)(struct l_io *io, int fd); /* see meta_fd_async() */
+    char data[];
+};
+
+static struct l_io *l_io_new(fuse_req_t req, struct l_file *file,
+    size_t datasize, void (*done)(struct io_req *, int))
+{
+    struct l_io *io = malloc(sizeof(*io) + datasize);
+
+    if (io != NULL) {
+        io->ior.done = done;
+        io->mnt = l_cur;
+        io->req = req;
+        io->file = file;
+        __atomic_fetch_add(&l_data.io_inflight, 1, __ATOMIC_RELAXED);
+    }
+
+    return io;
+}
+
+/* Completions run on the engine's thread, which serves every mount. */
+static inline struct l_io *l_io_done(struct io_req *ior)
+{
+    struct l_io *io = (struct l_io *)ior;
+
+    l_cur = io->mnt;
+    return io;
+}
+
+static void l_io_free(struct l_io *io)
+{
+    __atomic_fetch_sub(&io->mnt->io_inflight, 1, __ATOMIC_RELEASE);
+    free(io);
+}
+
+static void meta_fd_open_done(struct io_req *ior, int res)
+{
+    struct l_io *io = l_io_done(ior);
+
+    if (res >= 0) {
+        pthread_mutex_lock(&l_data.lock);
+        if (io->file->realfd == -1) {
+            meta_fd_set(io->file, res);
+            res = -1;
+        }
+        pthread_mutex_unlock(&l_data.lock);
+        if (res != -1) {
+            close(res); /* opened meanwhile by someone else */
+        }
+        res = io->file->realfd; /* pinned */
+    }
+    io->next(io, res);
+}
+
+/*
+ * Pins the realfd of io's meta file, like an open, and calls next with it or
+ * -errno. If it isn't cached it is opened through the engine first. Lock must
+ * be held, it is dropped; next runs without it. The caller unpins with
+ * meta_fd_put(), also on error.
+ */
+static void meta_fd_async(struct l_io *io, void (*next)(struct l_io *, int))
+{
+    struct l_file *file = io->file;
+    int fd = file->realfd, dfd = store_fd(file);
+
+    meta_fd_hold(file);
+    io->next = next;
+    strcpy(io->name, file->name);
+    pthread_mutex_unlock(&l_data.lock);
+
+    if (fd != -1) {
+        next(io, fd);
+        return;
+    }
+    io->ior.done = meta_fd_open_done;
+    L_PROBE4(meta_delegate, "open", io->name, 0, 0);
+    L_PERF_CALL(REALSTORE, io_openat(&io->ior, dfd, io->name, O_RDWR, 0));
+}
+
+static void statx_to_stat(const struct statx *stx, struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_mode = stx->stx_mode;
+    stbuf->st_nlink = stx->stx_nlink;
+    stbuf->st_uid = stx->stx_uid;
+    stbuf->st_gid = stx->stx_gid;
+    stbuf->st_size = stx->stx_size;
+    stbuf->st_blksize = stx->stx_blksize;
+    stbuf->st_blocks = stx->stx_blocks;
+    stbuf->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    stbuf->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    stbuf->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    stbuf->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    stbuf->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    stbuf->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+static void meta_getattr_done(struct io_req *ior, int res)
+{
+    struct l_io *io = l_io_done(ior);
+    struct stat stbuf;
+
+    if (res < 0) {
+        l_reply_err(io->req, -res);
+    } else {
+        statx_to_stat(&io->stx, &stbuf);
+        stbuf.st_ino = io->ino;
+        stbuf.st_nlink = 1;
+        l_reply_attr(io->req, &stbuf, l_data.attr_timeout);
+    }
+    l_io_free(io);
+}
+
+void l_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct l_file *file;
+    struct stat stbuf;
+    struct l_io *io;
+    int r, dfd;
+
+    L_OP(getattr, req, ino, NULL, 0, 0);
+    L_PERF_OP(GETATTR);
+
+    if (ino == FUSE_ROOT_ID || ino == STATS_INO) {
+        if (ino == FUSE_ROOT_ID) {
+            root_stat(&stbuf);
+        } else {
+            stats_stat(&stbuf);
+        }
+        l_reply_attr(req, &stbuf, l_data.attr_timeout);
+        return;
+    }
+
+    /* find it */
+    pthread_mutex_lock(&l_data.lock);
+    file = find_ino(ino);
+    if (file != NULL && file->meta && file->realfd == -1) {
+        /* delegate to real fs, without holding the lock */
+        if ((io = l_io_new(req, file, 0, meta_getattr_done)) == NULL) {
+            pthread_mutex_unlock(&l_data.lock);
+            l_reply_err(req, ENOMEM);
+            return;
+        }
+        io->ino = ino;
+        strcpy(io->name, file->name);
+        dfd = store_fd(file); /* file may be gone once unlocked */
+        pthread_mutex_unlock(&l_data.lock);
+
+        L_PROBE4(meta_delegate, "getattr", io->name, 0, 0);
+        L_PERF_CALL(REALSTORE, io_statx(&io->ior, dfd, io->name, &io->stx));
+        return;
+    }
+    r = (file == NULL) ? -ENOENT : file_stat(file, &stbuf);
+    pthread_mutex_unlock(&l_data.lock);
+
+    if (r != 0) {
+        l_reply_err(req, -r);
+    } else {
+        l_reply_attr(req, &stbuf, l_data.attr_timeout);
+    }
+}
+
+/*
+ * Takes the file out of the namespace. It is freed once the kernel forgets
+ * it. Lock must be held.
+ */
+static void file_remove(struct l_file *file)
+{
+    HASH_DELETE(hh, l_data.files, file);
+    l_data.nfiles--;
+    file->unlinked = 1;
+    if (file->realfd != -1 && file->nopen == 0) {
+        fd_close(file); /* nobody can open it again */
+    }
+    l_now(&file->ctime);
+    if (file->nlookup == 0) {
+        free_file(file);
+    }
+}
+
+static void meta_unlink_done(struct io_req *ior, int res)
+{
+    struct l_io *io = l_io_done(ior);
+    struct l_file *file;
+
+    if (res == -ENOENT) {
+        res = 0; /* gone already is fine */
+    }
+    if (res == 0) {
+        pthread_mutex_lock(&l_data.lock);
+        /* unless a snapshot restore replaced it meanwhile */
+        if ((file = find_name(io->name)) != NULL && file->ino == io->ino) {
+            file_remove(file);
+        }
+        pthread_mutex_unlock(&l_data.lock);
+    }
+    /* on failure the file stays, like on a real fs */
+    l_reply_err(io->req, -res);
+    l_io_free(io);
+}
+
+/*
+ * Removes the file. Meta files are removed from the real fs through the
+ * engine, and from the table once that succeeded.
+ */
+void l_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct l_file *file;
+
+    L_OP(unlink, req, parent, name, 0, 0);
+    L_PERF_OP(UNLINK);
+
+    if (strcmp(name, STATS_NAME) == 0) {
+        l_reply_err(req, EPERM);
+        return;
+    }
+
+    pthread_mutex_lock(&l_data.lock);
+
+    /* find it */
+    file = find_name(name);
+    if (parent != FUSE_ROOT_ID || file == NULL) {
+        pthread_mutex_unlock(&l_data.lock);
+        l_reply_err(req, ENOENT);
+        return;
+    }
+
+    if (file->meta) {
+        /* the reply comes from meta_unlink_done() */
+        struct l_io *io = l_io_new(req, file, 0, meta_unlink_done);
+        int dfd = store_fd(file);
+
+        if (io == NULL) {
+            pthread_mutex_unlock(&l_data.lock);
+            l_reply_err(req, ENOMEM);
+            return;
+        }
+        io->ino = file->ino;
+        strcpy(io->name, name);
+        pthread_mutex_unlock(&l_data.lock);
+
+        L_PROBE4(meta_delegate, "unlink", io->name, 0, 0);
+        L_PERF_CALL(REALSTORE, io_unlinkat(&io->ior, dfd, io->name));
+        return;
+    }
+
+    file_remove(file);
+
+    pthread_mutex_unlock(&l_data.lock);
+
+    l_reply_err(req, 0);
+}
+
+/* After a meta file is truncated, or a data file's size changes. */
+static void file_resized(struct l_file *file)
+{
+    file->cache_gen++;
+    file->wseq++;
+    file->prefill_end = 0;
+}
+
+/*
+ * Changes the size of a data file. Lock must be held. Meta files are
+ * truncated through the engine, see l_setattr().
+ */
+static void file_truncate(struct l_file *file, off_t length)
+{
+    /* pages past the new end are gone, whatever the kernel thinks */
+    l_inval_range(file->ino, length < file->size ? length : file->size, 0);
+    ext_trunc(file, length);
+    file->size = length;
+    l_now(&file->mtime);
+    file->ctime = file->mtime;
+    file_resized(file);
+}
+
+/*
+ * Swift metadata of a data file, parsed from the head of its .mbinmap:
+ *
+ *     version 1
+ *     root hash 1b9c...
+ *     chunk size 8192
+ *     complete 137438953472
+ *
+ * It is reparsed only when the .mbinmap changes, and read without the lock:
+ * the result is kept only if the .mbinmap didn't change meanwhile, else the
+ * next call parses it again. Lock must not be held.
+ */
+static void swift_refresh(fuse_ino_t ino)
+{
+    char name[MAXPATHLEN + 8], buf[PAGESIZE], *line, *save;
+    struct l_file *file, *m;
+    struct l_swift sw;
+    ssize_t n = -1;
+    int dfd, fd;
+
+    pthread_mutex_lock(&l_data.lock);
+    if ((file = find_ino(ino)) == NULL || file->meta) {
+        pthread_mutex_unlock(&l_data.lock);
+        return;
+    }
+    snprintf(name, sizeof(name), "%s.mbinmap", file->name);
+    m = (strlen(name) < MAXPATHLEN) ? find_name(name) : NULL;
+    if (m == NULL || (m->ino == file->swift.ino &&
+                      m->wseq == file->swift.wseq)) {
+        if (m == NULL) {
+            file->swift.ino = 0;
+        }
+        pthread_mutex_unlock(&l_data.lock);
+        return; /* none, or still valid */
+    }
+    memset(&sw, 0, sizeof(sw));
+    sw.ino = m->ino;
+    sw.wseq = m->wseq;
+    dfd = store_fd(m);
+    pthread_mutex_unlock(&l_data.lock);
+
+    if ((fd = openat(dfd, name, O_RDONLY)) != -1) {
+        n = pread(fd, buf, sizeof(buf) - 1, 0);
+        close(fd);
+    }
+    if (n >= 0) {
+        buf[n] = 0;
+        for (line = strtok_r(buf, "\n", &save); line != NULL;
+             line = strtok_r(NULL, "\n", &save)) {
+            sscanf(line, "root hash %64s", sw.root_hash);
+            sscanf(line, "chunk size %lu", &sw.chunk_size);
+            sscanf(line, "complete %llu", &sw.complete);
+        }
+    }
+
+    pthread_mutex_lock(&l_data.lock);
+    file = find_ino(ino);
+    m = find_name(name);
+    if (file != NULL && m != NULL && m->ino == sw.ino && m->wseq == sw.wseq) {
+        if (n < 0) {
+            memset(&sw, 0, sizeof(sw)); /* unreadable, try again next time */
+        }
+        file->swift = sw;
+    }
+    pthread_mutex_unlock(&l_data.lock);
+}
+
+/* Chunk size from the .mbinmap, or from the name (pattern_size_chunk). */
+static unsigned long chunk_size(const struct l_file *file)
+{
+    const char *p = strrchr(file->name, '_');
+
+    if (file->swift.chunk_size > 0) {
+        return file->swift.chunk_size;
+    }
+    return (p != NULL) ? strtoul(p + 1, NULL, 10) : 0;
+}
+
+/*
+ * Hash tree prefetch.
+ *
+ * Swift keeps the hash tree of a data file in its .mhash, one hash per bin in
+ * bin order: node o of layer l (chunks are layer 0) is bin (2o + 1) * 2^l - 1.
+ * Serving chunk c takes the hashes of its uncles, the siblings of the nodes
+ * on the path from c to the root, which are scattered all over the .mhash.
+ *
+ * So a data file is linked to its .mhash when it is opened, and the realstore
+ * is asked to read ahead (POSIX_FADV_WILLNEED) the top tree_prefetch layers of
+ * the tree, or the whole .mhash if it is small. Every read of the data file
+ * then asks for the pages holding the uncle paths of the chunks it covers and
+ * of as many chunks after them, so the hash reads swift does next find them
+ * in the page cache. A bitmap remembers the pages asked for, it is updated
+ * without the lock.
+ */
+#define TREE_HASH_SIZE 20    /* SHA-1, unless the root hash says otherwise */
+#define TREE_WHOLE 256       /* pages, smaller .mhash files are read whole */
+#define TREE_MAXPAGES 256    /* pages asked for at once */
+
+struct l_tree {
+    fuse_ino_t mhash;        /* the .mhash it was linked to */
+    unsigned hash_size;
+    unsigned long chunk;
+    unsigned long nchunks;
+    unsigned height;         /* layers above the chunks */
+    unsigned long npages;
+    unsigned char done[];    /* pages asked for, one bit each */
+};
+
+/* The tree of the data file, once linked, or NULL. No lock needed. */
+static inline struct l_tree *tree_of(struct l_file *file)
+{
+    return __atomic_load_n(&file->tree, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Links a data file to its .mhash, with the swift metadata as last refreshed.
+ * Lock must be held.
+ */
+static struct l_tree *tree_link(struct l_file *file)
+{
+    char name[MAXPATHLEN + 8];
+    struct l_file *m;
+    struct l_tree *t;
+    unsigned long chunk, nchunks, npages;
+    unsigned hs = TREE_HASH_SIZE, h = 0;
+
+    snprintf(name, sizeof(name), "%s.mhash", file->name);
+    m = (strlen(name) < MAXPATHLEN) ? find_name(name) : NULL;
+    if (m == NULL || m->cls != CLASS_REAL) {
+        return NULL; /* not hashed yet, or nothing to read ahead */
+    }
+    if ((chunk = chunk_size(file)) == 0 || file->size == 0) {
+        return NULL;
+    }
+    if (strlen(file->swift.root_hash) >= 2 * TREE_HASH_SIZE) {
+        hs = strlen(file->swift.root_hash) / 2;
+    }
+    nchunks = (file->size + chunk - 1) / chunk;
+    while ((1UL << h) < nchunks) {
+        h++;
+    }
+    npages = (((2UL << h) - 1) * hs + PAGESIZE - 1) / PAGESIZE;
+
+    if ((t = calloc(1, sizeof(*t) + (npages + 7) / 8)) == NULL) {
+        return NULL;
+    }
+    t->mhash = m->ino;
+    t->hash_size = hs;
+    t->chunk = chunk;
+    t->nchunks = nchunks;
+    t->height = h;
+    t->npages = npages;
+    __atomic_store_n(&file->tree, t, __ATOMIC_RELEASE);
+
+    return t;
+}
+
+/*
+ * Marks a page as asked for and adds it to pages, unless it was already.
+ * Returns 0 once pages is full.
+ */
+static inline int tree_mark_page(struct l_tree *t, unsigned long page,
+    unsigned long *pages, unsigned *n)
+{
+    unsigned char bit = 1 << (page % 8), *p = &t->done[page / 8];
+
+    if (page >= t->npages || (__atomic_load_n(p, __ATOMIC_RELAXED) & bit)) {
+        return 1;
+    }
+    if (*n == TREE_MAXPAGES) {
+        return 0; /* a later read asks for it */
+    }
+    if (!(__atomic_fetch_or(p, bit, __ATOMIC_RELAXED) & bit)) {
+        pages[(*n)++] = page;
+    }
+    return 1;
+}
+
+/* Same for the page holding the hash of bin. */
+static inline int tree_mark(struct l_tree *t, unsigned long bin,
+    unsigned long *pages, unsigned *n)
+{
+    return tree_mark_page(t, bin * t->hash_size / PAGESIZE, pages, n);
+}
+
+static int by_page(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Asks the realstore to read the pages of the .mhash, in ranges. */
+static void tree_fetch(struct l_file *file, struct l_tree *t,
+    unsigned long *pages, unsigned n)
+{
+    struct l_file *m;
+    unsigned i, j;
+    int fd = -1;
+
+    /* a copy of the fd, the cache may close the shared one meanwhile */
+    pthread_mutex_lock(&l_data.lock);
+    m = find_ino(t->mhash);
+    if (m != NULL && !m->unlinked && meta_fd(m) >= 0) {
+        fd = fcntl(m->realfd, F_DUPFD_CLOEXEC, 0);
+    }
+    pthread_mutex_unlock(&l_data.lock);
+    if (fd == -1) {
+        return;
+    }
+
+    qsort(pages, n, sizeof(*pages), by_page);
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && pages[j] == pages[j - 1] + 1; j++);
+        posix_fadvise(fd, (off_t)pages[i] * PAGESIZE,
+                      (off_t)(j - i) * PAGESIZE, POSIX_FADV_WILLNEED);
+    }
+    close(fd);
+    L_PROBE3(tree_prefetch, file->name, t->mhash, n);
+}
+
+/* On open of a data file: links it and reads the top of the tree. */
+static void tree_open(struct l_file *file)
+{
+    unsigned long pages[TREE_MAXPAGES], o, last;
+    struct l_tree *t;
+    unsigned n = 0;
+    int l, low;
+
+    if (l_data.tree_layers == 0) {
+        return;
+    }
+    if ((t = tree_of(file)) == NULL) {
+        swift_refresh(file->ino);
+        pthread_mutex_lock(&l_data.lock);
+        if ((t = tree_of(file)) == NULL) {
+            t = tree_link(file);
+        }
+        pthread_mutex_unlock(&l_data.lock);
+        if (t == NULL) {
+            return;
+        }
+    }
+
+    if (t->npages <= TREE_WHOLE) {
+        for (o = 0; o < t->npages; o++) {
+            tree_mark_page(t, o, pages, &n);
+        }
+    } else {
+        low = (int)t->height - (int)l_data.tree_layers + 1;
+        for (l = t->height; l >= 0 && l >= low; l--) {
+            last = (t->nchunks - 1) >> l;
+            for (o = 0; o <= last; o++) {
+                if (!tree_mark(t, ((2 * o + 1) << l) - 1, pages, &n)) {
+                    break;
+                }
+            }
+        }
+    }
+    if (n > 0) {
+        tree_fetch(file, t, pages, n);
+    }
+}
+
+/* On a read of a data file: the uncle paths of its chunks, and of the next. */
+static void tree_read(struct l_file *file, off_t offset, size_t size)
+{
+    unsigned long pages[TREE_MAXPAGES], c, first, last, o;
+    struct l_tree *t = tree_of(file);
+    unsigned n = 0, l;
+
+    if (t == NULL || size == 0) {
+        return;
+    }
+    first = offset / t->chunk;
+    last = (offset + size - 1) / t->chunk;
+    last += last - first + 1; /* as much ahead */
+    if (last >= t->nchunks) {
+        last = t->nchunks - 1;
+    }
+
+    for (c = first; c <= last && n < TREE_MAXPAGES; c++) {
+        tree_mark(t, 2 * c, pages, &n);
+        for (l = 0; l < t->height; l++) {
+            o = (c >> l) ^ 1;
+            if (!tree_mark(t, ((2 * o + 1) << l) - 1, pages, &n)) {
+                break;
+            }
+        }
+    }
+    if (n > 0) {
+        tree_fetch(file, t, pages, n);
+    }
+}
+
+/*
+ * Picks the page cache policy for an open. Lock must be held.
+ *
+ * Generated content never changes for a given offset, so data files keep
+ * their cached pages unless LFS truncated or discarded writes since the last
+ * open. Meta files follow the meta_cache option.
+ */
+static void cache_policy(struct l_file *file, struct fuse_file_info *fi)
+{
+    int writing = (fi->flags & O_ACCMODE) != O_RDONLY;
+    int unchanged = (file->cache_gen == file->open_gen);
+
+    file->open_gen = file->cache_gen;
+    if (writing) {
+        file->nwriters++;
+    }
+
+    if (l_data.kernel_cache) {
+        fi->keep_cache = 1;
+    } else if (!file->meta) {
+        fi->keep_cache = unchanged;
+    } else {
+        switch (l_data.meta_cache) {
+            case META_CACHE_DIRECT:
+                if (writing) {
+                    fi->direct_io = 1;
+                    break;
+                }
+                /* fall through */
+            case META_CACHE_AUTO:
+                fi->keep_cache = unchanged && file->nwriters == 0;
+                break;
+        }
+    }
+
+    if (l_data.direct_io || (fi->flags & O_DIRECT)) {
+        /* bypass the page cache for this open */
+        fi->direct_io = 1;
+        fi->keep_cache = 0;
+    }
+
+    if (!fi->keep_cache) {
+        /* the kernel drops the cache, so there is nothing seeded anymore */
+        file->prefill_end = 0;
+    }
+}
+
+/*
+ * Seeds the kernel cache ahead of a sequential reader at pos. Lock must be
+ * held.
+ */
+static void prefill(struct l_file *file, off_t pos)
+{
+    off_t start, end;
+
+    if (file->prefill_end >= pos + (off_t)l_data.prefill / 2) {
+        return; /* still far enough ahead */
+    }
+    if (file->next > 0) {
+        return; /* stores are pattern only */
+    }
+
+    start = (file->prefill_end > pos ? file->prefill_end : pos);
+    start &= ~((off_t)PAGESIZE - 1);
+    end = pos + l_data.prefill;
+    if (end > file->size) {
+        end = file->size;
+    }
+    if (end <= start) {
+        return;
+    }
+
+    file->prefill_end = end;
+    l_store(file, start, end - start);
+}
+
+/*
+ * Changes timestamps. Lock must be held.
+ */
+static int file_utimens(struct l_file *file, struct stat *attr, int to_set)
+{
+    struct timespec tv[2];
+
+    tv[0].tv_nsec = UTIME_OMIT;
+    tv[1].tv_nsec = UTIME_OMIT;
+    if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+        tv[0].tv_nsec = UTIME_NOW;
+    else if (to_set & FUSE_SET_ATTR_ATIME)
+        tv[0] = attr->st_atim;
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+        tv[1].tv_nsec = UTIME_NOW;
+    else if (to_set & FUSE_SET_ATTR_MTIME)
+        tv[1] = attr->st_mtim;
+
+    if (file->meta) {
+        /* delegate to real fs */
+        if (utimensat(store_fd(file), file->name, tv, 0) == -1) {
+            return -errno;
+        }
+    } else {
+        struct timespec now;
+        l_now(&now);
+        if (tv[0].tv_nsec != UTIME_OMIT)
+            file->atime = (tv[0].tv_nsec == UTIME_NOW) ? now : tv[0];
+        if (tv[1].tv_nsec != UTIME_OMIT)
+            file->mtime = (tv[1].tv_nsec == UTIME_NOW) ? now : tv[1];
+        file->ctime = now;
+    }
+
+    return 0;
+}
+
+/*
+ * Changes the timestamps once the size is done, r is how that went, and
+ * replies. Lock must be held, it is dropped.
+ */
+static void setattr_reply(fuse_req_t req, struct l_file *file,
+    struct stat *attr, int to_set, int r)
+{
+    struct stat stbuf;
+
+    if (r == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME |
+            FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW))) {
+        r = file_utimens(file, attr, to_set);
+    }
+    if (r == 0) {
+        r = file_stat(file, &stbuf);
+    }
+
+    pthread_mutex_unlock(&l_data.lock);
+
+    if (r != 0) {
+        l_reply_err(req, -r);
+    } else {
+        l_reply_attr(req, &stbuf, l_data.attr_timeout);
+    }
+}
+
+static void setattr_truncated(struct io_req *ior, int res)
+{
+    struct l_io *io = l_io_done(ior);
+
+    pthread_mutex_lock(&l_data.lock);
+    meta_fd_put(io->file);
+    if (res == 0) {
+        file_resized(io->file);
+    }
+    setattr_reply(io->req, io->file, &io->attr, io->to_set, res);
+    l_io_free(io);
+}
+
+static void setattr_truncate(struct l_io *io, int fd)
+{
+    if (fd < 0) {
+        setattr_truncated(&io->ior, fd);
+        return;
+    }
+    io->ior.done = setattr_truncated;
+    L_PROBE4(meta_delegate, "truncate", io->name, io->offset, 0);
+    io_ftruncate(&io->ior, fd, io->offset);
+}
+
+/*
+ * Changes size (truncate and ftruncate) and timestamps. We don't care about
+ * owners and access rights. Meta files are truncated through the engine,
+ * setattr_reply() finishes once that's done.
+ */
+void l_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+    struct fuse_file_info *fi)
+{
+    struct l_file *file;
+    struct l_io *io;
+    int r = 0;
+
+    L_OP(setattr, req, ino, NULL, attr->st_size, to_set);
+    L_PERF_OP(SETATTR);
+
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        l_reply_err(req, ENOSYS);
+        return;
+    }
+
+    pthread_mutex_lock(&l_data.lock);
+
+    /* find it */
+    file = find_ino(ino);
+    if (file == NULL) {
+        r = -ENOENT;
+    }
+    if (r == 0 && (to_set & FUSE_SET_ATTR_SIZE) && file->meta) {
+        if ((io = l_io_new(req, file, 0, NULL)) == NULL) {
+            pthread_mutex_unlock(&l_data.lock);
+            l_reply_err(req, ENOMEM);
+            return;
+        }
+        io->offset = attr->st_size;
+        io->attr = *attr;
+        io->to_set = to_set;
+        meta_fd_async(io, setattr_truncate);
+        return;
+    }
+    if (r == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+        file_truncate(file, attr->st_size);
+    }
+
+    setattr_reply(req, file, attr, to_set, r);
+}
+
+static void meta_open_done(struct io_req *ior, int res)
+{
+    struct l_io *io = l_io_done(ior);
+
+    if (res < 0) {
+        l_reply_err(io->req, -res);
+        l_io_free(io);
+        return;
+    }
+
+    pthread_mutex_lock(&l_data.lock);
+    meta_fd_set(io->file, res);
+    meta_fd_hold(io->file);
+    cache_policy(io->file, &io->fi);
+    pthread_mutex_unlock(&l_data.lock);
+
+    io->fi.fh = (uintptr_t)io->file;
+    l_reply_open(io->req, &io->fi);
+    l_io_free(io);
+}
+
+/*
+ * Opens a file.
+ *
+ * O_CREAT and O_EXCL are guaranteed to not be passed to this. The file will
+ * exist when this is called. O_TRUNC might be present when atomic_o_trunc is
+ * specified on a kernel version of 2.6.24 or later.
+ */
+void l_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct l_file *file;
+
+    L_OP(open, req, ino, NULL, 0, fi->flags);
+    L_PERF_OP(OPEN);
+
+    if (ino == STATS_INO) {
+        stats_open(req, fi);
+        return;
+    }
+
+    pthread_mutex_lock(&l_data.lock);
+
+    /* find it */
+    file = find_ino(ino);
+    if (file == NULL) {
+        pthread_mutex_unlock(&l_data.lock);
+        l_reply_err(req, ENOENT);
+        return;
+    }
+
+    l_log("opening file %s (file exists)\n", file->name);
+
+    if (file->meta && file->realfd == -1) {
+        /* delegate to real fs, the reply comes from meta_open_done() */
+        struct l_io *io = l_io_new(req, file, 0, meta_open_done);
+        int dfd = store_fd(file); /* file may be gone once unlocked */
+
+        if (io == NULL) {
+            pthread_mutex_unlock(&l_data.lock);
+            l_reply_err(req, ENOMEM);
+            return;
+        }
+        io->fi = *fi;
+        strcpy(io->name, file->name);
+        pthread_mutex_unlock(&l_data.lock);
+
+        L_PROBE4(meta_delegate, "open", io->name, 0, 0);
+        L_PERF_CALL(REALSTORE, io_openat(&io->ior, dfd, io->name, O_RDWR, 0));
+        return;
+    } else if (file->meta) {
+        /* share the cached fd */
+        meta_fd_hold(file);
+    } else {
+        if (fi->flags & O_TRUNC) {
+            file_truncate(file, 0);
+        }
+
+        /* This is it. We don't care about access rights. */
+    }
+
+    cache_policy(file, fi);
+
+    pthread_mutex_unlock(&l_data.lock);
+
+    fi->fh = (uintptr_t)file;
+    l_reply_open(req, fi);
+
+    if (!file->meta) {
+        tree_open(file); /* swift reads the hashes next */
+    }
+}
+
+/* A read or write reply waiting for the emulated device. */
+struct l_delayed {
+    struct tw_entry e; /* first, the wheel hands it back */
+    fuse_req_t req;
+    int write;
+    ssize_t r;
+    char data[];
+};
+
+static void delayed_fire(struct tw_entry *e)
+{
+    struct l_delayed *d = (struct l_delayed *)e;
+
+    if (d->write) {
+        l_reply_write(d->req, d->r);
+    } else {
+        l_reply_buf(d->req, d->data, d->r);
+    }
+    free(d);
+}
+
+/*
+ * Replies to a data file read (buf holds r bytes) or write (r bytes written),
+ * right away or when the emulated device would have completed it.
+ */
+static void reply_device(fuse_req_t req, int write, off_t offset,
+    const char *buf, ssize_t r)
+{
+    if (l_data.dev_enabled) {
+        uint64_t done = dev_submit(&l_data.dev, write, offset, r);
+        struct l_delayed *d;
+
+        if (done > dev_now() + DEVICE_TICK / 2 &&
+            (d = malloc(sizeof(*d) + (write ? 0 : r))) != NULL) {
+            d->e.fire = delayed_fire;
+            d->req = req;
+            d->write = write;
+            d->r = r;
+            if (!write) {
+                memcpy(d->data, buf, r);
+            }
+            tw_add(&l_data.wheel, &d->e, done);
+            return;
+        }
+    }
+
+    if (write) {
+        l_reply_write(req, r);
+    } else {
+        l_reply_buf(req, buf, r);
+    }
+}
+
+static void meta_read_done(struct io_req *ior, int res)
+{
+    struct l_io *io = l_io_done(ior);
+
+    if (res < 0) {
+        l_reply_err(io->req, -res);
+    } else {
+        l_reply_buf(io->req, io->data, res);
+    }
+    l_io_free(io);
+}
+
+/*
+ * Reads file.
+ *
+ * Returns a 4-byte preset pattern. Requests of any size and alignment are
+ * served, which is what direct_io needs: short reads only happen at EOF and
+ * return just the bytes before it.
+ */
+void l_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+    struct fuse_file_info *fi)
+{
+    struct l_file *file = (struct l_file *)(uintptr_t)fi->fh;
+    off_t fsize;
+    char *buf;
+    size_t r;
+
+    L_OP(read, req, ino, open_name(ino, fi), offset, size);
+    L_PERF_OP(READ);
+
+    if (ino == STATS_INO) {
+        stats_read(req, size, offset, fi);
+        return;
+    }
+    file_account(file, STATS_READ, offset, size);
+
+    if (file->meta) {
+        /* delegate to real fs, the reply comes from meta_read_done() */
+        struct l_io *io = l_io_new(req, file, size, meta_read_done);
+        if (io == NULL) {
+            l_reply_err(req, ENOMEM);
+            return;
+        }
+        L_PROBE4(meta_delegate, "read", file->name, offset, size);
+        L_PERF_CALL(REALSTORE, io_read(&io->ior, file->realfd, io->data,
+            size, offset));
+        return;
+    }
+
+    if ((buf = scratch_buf(size)) == NULL) {
+        l_reply_err(req, ENOMEM);
+        return;
+    }
+
+    /* Return bytes read before EOF. */
+    fsize = file->size;
+    r = (offset >= fsize) ? 0 : (fsize - offset < size ? fsize - offset : size);
+    {
+        L_PERF_PHASE(FILL);
+        fill_pattern(buf, r, file->pattern, offset);
+        L_PROBE3(pattern_fill, ino, offset, r);
+        if (file->next > 0) {
+            pthread_mutex_lock(&l_data.lock);
+            ext_fill(file, buf, r, offset);
+            pthread_mutex_unlock(&l_data.lock);
+        }
+    }
+
+    if (l_data.prefill > 0 && r > 0) {
+        pthread_mutex_lock(&l_data.lock);
+        if (offset == file->read_next) {
+            prefill(file, offset + r);
+        }
+        file->read_next = offset + r;
+        pthread_mutex_unlock(&l_data.lock);
+    }
+
+    reply_device(req, 0, offset, buf, r);
+    tree_read(file, offset, r);
+}
+
+static void meta_write_done(struct io_req *ior, int res)
+{
+    struct l_io *io = l_io_done(ior);
+
+    if (res < 0) {
+        l_reply_err(io->req, -res);
+        l_io_free(io);
+        return;
+    }
+
+    pthread_mutex_lock(&l_data.lock);
+    io->file->cache_gen++;
+    io->file->wseq++;
+    pthread_mutex_unlock(&l_data.lock);
+    if (io->fi.direct_io) {
+        /* bypassed the cache, so other openers may have stale pages */
+        l_inval_range(io->file->ino, io->offset, res);
+    }
+
+    l_reply_write(io->req, res);
+    l_io_free(io);
+}
+
+/*
+ * Write.
+ *
+ * All writes, except the ones on meta files (.mhash, .mbinmap and whatever
+ * else the classes= rules store), are ignored (only the size is changed).
+ */
+void l_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+    off_t offset, struct fuse_file_info *fi)
+{
+    struct l_file *file = (struct l_file *)(uintptr_t)fi->fh;
+
+    L_OP(write, req, ino, file->name, offset, size);
+    L_PERF_OP(WRITE);
+
+    file_account(file, STATS_WRITE, offset, size);
+
+    if (file->meta) {
+        /*
+         * Delegate to real fs. The request buffer is reused as soon as we
+         * return, so the data is copied.
+         */
+        struct l_io *io = l_io_new(req, file, size, meta_write_done);
+        if (io == NULL) {
+            l_reply_err(req, ENOMEM);
+            return;
+        }
+        memcpy(io->data, buf, size);
+        io->offset = offset;
+        io->fi = *fi;
+        L_PROBE4(meta_delegate, "write", file->name, offset, size);
+        L_PERF_CALL(REALSTORE, io_write(&io->ior, file->realfd, io->data,
+            size, offset));
+    } else {
+        pthread_mutex_lock(&l_data.lock);
+        if (file->size < offset + size) {
+            file->size = offset + size;
+        }
+        /* the written bytes are discarded, cached pages no longer match */
+        if (file->next > 0) {
+            /* back to the pattern, like any written range (best effort) */
+            ext_set(file, offset, offset + size, -1);
+        }
+        file->cache_gen++;
+        file->prefill_end = 0;
+        l_now(&file->mtime);
+        file->ctime = file->mtime;
+        pthread_mutex_unlock(&l_data.lock);
+        /* and opens keeping their cache would read the written bytes back */
+        l_inval_range(file->ino, offset, size);
+
+        reply_device(req, 1, offset, NULL, size);
+    }
+}
+
+/*
+ * Group commit.
+ *
+ * fsync requests on meta files are queued and served by l_sync_loop() in
+ * groups: every file in a group is synced once, and all requests of the group
+ * are replied to together. Requests that arrive while a commit is running
+ * form the next group, so under load many fsyncs share one disk flush.
+ */
+#define SYNCFS_FILES 32 /* SYNC_AUTO uses syncfs from this many files */
+
+struct l_sync {
+    struct io_req ior;     /* first, the engine hands it back */
+    struct l_state *mnt;
+    fuse_req_t req;
+    struct l_file *file;   /* NULL for realstore itself */
+    int fd;
+    int datasync;
+    int res;
+    unsigned long wseq;    /* what the sync covers, leaders only */
+    struct l_sync *leader; /* entry that syncs the same file */
+    struct l_sync *next;
+};
+
+static void sync_done(struct io_req *ior, int res)
+{
+    struct l_sync *s = (struct l_sync *)ior;
+
+    l_cur = s->mnt;
+    s->res = res;
+    pthread_mutex_lock(&l_data.sync_lock);
+    if (--l_data.sync_inflight == 0) {
+        pthread_cond_broadcast(&l_data.sync_cond);
+    }
+    pthread_mutex_unlock(&l_data.sync_lock);
+}
+
+/* Picks one leader per file. Returns the number of leaders. */
+static unsigned sync_group(struct l_sync *group)
+{
+    struct l_sync *s, *dir = NULL, *leader;
+    unsigned n = 0;
+
+    pthread_mutex_lock(&l_data.lock);
+    for (s = group; s != NULL; s = s->next) {
+        leader = (s->file != NULL) ? s->file->sync_leader : dir;
+        if (leader == NULL) {
+            s->leader = s;
+            if (s->file != NULL) {
+                s->file->sync_leader = s;
+                s->wseq = s->file->wseq;
+            } else {
+                dir = s;
+            }
+            n++;
+        } else {
+            s->leader = leader;
+            leader->datasync &= s->datasync;
+        }
+    }
+    for (s = group; s != NULL; s = s->next) {
+        if (s->file != NULL) {
+            s->file->sync_leader = NULL;
+        }
+    }
+    pthread_mutex_unlock(&l_data.lock);
+
+    return n;
+}
+
+static void sync_commit(struct l_sync *group)
+{
+    struct l_sync *s, *next;
+    unsigned nreq = 0, nsync = sync_group(group);
+    uint64_t start = dev_now(), lat;
+    int res;
+
+    if (l_data.sync_mode == SYNC_FS ||
+        (l_data.sync_mode == SYNC_AUTO && nsync >= SYNCFS_FILES)) {
+        res = (syncfs(l_data.metafd) == -1) ? -errno : 0;
+        for (s = group; s != NULL; s = s->next) {
+            s->res = res;
+        }
+    } else {
+        /* all at once, the engine runs them in parallel */
+        pthread_mutex_lock(&l_data.sync_lock);
+        l_data.sync_inflight = nsync;
+        pthread_mutex_unlock(&l_data.sync_lock);
+        for (s = group; s != NULL; s = s->next) {
+            if (s->leader == s) {
+                L_PERF_CALL(REALSTORE, io_fsync(&s->ior, s->fd,
+                    s->datasync));
+            }
+        }
+        pthread_mutex_lock(&l_data.sync_lock);
+        while (l_data.sync_inflight > 0) {
+            pthread_cond_wait(&l_data.sync_cond, &l_data.sync_lock);
+        }
+        pthread_mutex_unlock(&l_data.sync_lock);
+    }
+    lat = dev_now() - start;
+
+    pthread_mutex_lock(&l_data.lock);
+    for (s = group; s != NULL; s = s->next) {
+        if (s->leader == s && s->file != NULL && s->res == 0 &&
+            s->wseq > s->file->synced) {
+            s->file->synced = s->wseq;
+        }
+    }
+    pthread_mutex_unlock(&l_data.lock);
+
+    for (s = group; s != NULL; s = s->next) {
+        l_reply_err(s->req, -s->leader->res);
+        nreq++;
+    }
+    for (s = group; s != NULL; s = next) {
+        next = s->next;
+        free(s);
+    }
+
+    l_data.commits++;
+    l_data.commit_reqs += nreq;
+    l_data.commit_ns += lat;
+    if (lat > l_data.commit_max_ns) {
+        l_data.commit_max_ns = lat;
+    }
+    L_PROBE3(commit, nreq, nsync, lat);
+    l_log("commit: %u requests, %u files, %.3f ms\n", nreq, nsync, lat / 1e6);
+}
+
+static void *l_sync_loop(void *arg)
+{
+    struct l_sync *group;
+    struct timespec ts;
+    uint64_t next = 0;
+
+    l_cur = arg;
+    pthread_mutex_lock(&l_data.sync_lock);
+    for (;;) {
+        while (l_data.sync_queue == NULL && !l_data.sync_stop) {
+            pthread_cond_wait(&l_data.sync_cond, &l_data.sync_lock);
+        }
+        if (l_data.sync_queue == NULL) {
+            break; /* stopped and drained */
+        }
+
+        if (!l_data.sync_stop && dev_now() < next) {
+            /* at most one commit per interval, let the group grow */
+            pthread_mutex_unlock(&l_data.sync_lock);
+            ts.tv_sec = next / 1000000000ULL;
+            ts.tv_nsec = next % 1000000000ULL;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+                   == EINTR);
+            pthread_mutex_lock(&l_data.sync_lock);
+        }
+
+        group = l_data.sync_queue;
+        l_data.sync_queue = NULL;
+        pthread_mutex_unlock(&l_data.sync_lock);
+
+        next = dev_now() + (uint64_t)(l_data.commit_interval * 1e6);
+        sync_commit(group);
+
+        pthread_mutex_lock(&l_data.sync_lock);
+    }
+    pthread_mutex_unlock(&l_data.sync_lock);
+
+    return NULL;
+}
+
+/* Queues a sync of file (NULL for realstore) on fd for the next commit. */
+static void sync_queue(fuse_req_t req, struct l_file *file, int fd,
+    int datasync)
+{
+    struct l_sync *s = calloc(1, sizeof(*s));
+
+    if (s == NULL) {
+        l_reply_err(req, ENOMEM);
+        return;
+    }
+    s->ior.done = sync_done;
+    s->mnt = l_cur;
+    s->req = req;
+    s->file = file;
+    s->fd = fd;
+    s->datasync = datasync;
+
+    pthread_mutex_lock(&l_data.sync_lock);
+    s->next = l_data.sync_queue;
+    l_data.sync_queue = s;
+    pthread_cond_broadcast(&l_data.sync_cond);
+    pthread_mutex_unlock(&l_data.sync_lock);
+}
+
+static void sync_file(fuse_req_t req, struct l_file *file, int datasync)
+{
+    int clean;
+
+    pthread_mutex_lock(&l_data.lock);
+    clean = file->cls != CLASS_REAL || file->synced == file->wseq;
+    pthread_mutex_unlock(&l_data.lock);
+
+    if (clean) {
+        /* only realstore files can be made durable, or already are */
+        l_reply_err(req, 0);
+        return;
+    }
+    sync_queue(req, file, file->realfd, datasync);
+}
+
+void l_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct l_file *file = (struct l_file *)(uintptr_t)fi->fh;
+
+    L_OP(flush, req, ino, open_name(ino, fi), 0, 0);
+    L_PERF_OP(FLUSH);
+
+    if (l_data.sync_on_close && ino != STATS_INO) {
+        sync_file(req, file, 0);
+        return;
+    }
+
+    /* Nothing to flush, so this always succeeds. */
+    l_reply_err(req, 0);
+}
+
+void l_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+    struct fuse_file_info *fi)
+{
+    struct l_file *file = (struct l_file *)(uintptr_t)fi->fh;
+
+    L_OP(fsync, req, ino, open_name(ino, fi), 0, datasync);
+    L_PERF_OP(FSYNC);
+
+    if (ino == STATS_INO) {
+        l_reply_err(req, 0);
+        return;
+    }
+    sync_file(req, file, datasync);
+}
+
+/*
+ * Release.
+ */
+void l_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct l_file *file = (struct l_file *)(uintptr_t)fi->fh;
+
+    L_OP(release, req, ino, open_name(ino, fi), 0, 0);
+    L_PERF_OP(RELEASE);
+
+    if (ino == STATS_INO) {
+        stats_release(req, fi);
+        return;
+    }
+
+    pthread_mutex_lock(&l_data.lock);
+    if ((fi->flags & O_ACCMODE) != O_RDONLY && file->nwriters > 0) {
+        file->nwriters--;
+    }
+    if (file->meta) {
+        /* the fd stays cached */
+        meta_fd_put(file);
+    }
+    pthread_mutex_unlock(&l_data.lock);
+
+    /* The return value is ignored. */
+    l_reply_err(req, 0);
+}
+
+/*
+ * Preallocates, punches holes and zeroes ranges. Data files only change
+ * their extent list, meta files are delegated.
+ */
+void l_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+    off_t length, struct fuse_file_info *fi)
+{
+    struct l_file *file = (struct l_file *)(uintptr_t)fi->fh;
+    off_t end = offset + length;
+    int r = 0;
+
+    L_OP(fallocate, req, ino, file->name, offset, length);
+    L_PERF_OP(FALLOCATE);
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+                 FALLOC_FL_ZERO_RANGE)) {
+        l_reply_err(req, EOPNOTSUPP);
+        return;
+    }
+    /* as Linux: holes keep the size, and are not also zeroed ranges */
+    if ((mode & FALLOC_FL_PUNCH_HOLE) &&
+        (!(mode & FALLOC_FL_KEEP_SIZE) || (mode & FALLOC_FL_ZERO_RANGE))) {
+        l_reply_err(req, EINVAL);
+        return;
+    }
+
+    if (file->meta) {
+        /* delegate to real fs, the fd is pinned by the open */
+        L_PROBE4(meta_delegate, "fallocate", file->name, offset, length);
+        if (fallocate(file->realfd, mode, offset, length) == -1) {
+            r = -errno;
+        } else {
+            pthread_mutex_lock(&l_data.lock);
+            file->cache_gen++;
+            file->wseq++;
+            pthread_mutex_unlock(&l_data.lock);
+        }
+        l_reply_err(req, -r);
+        return;
+    }
+
+    pthread_mutex_lock(&l_data.lock);
+
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > file->size) {
+        /* like a real fs, the new space reads as zeros */
+        r = ext_set(file, file->size, end, EXT_ZERO);
+        if (r == 0) {
+            file->size = end;
+        }
+    }
+    if (end > file->size) {
+        end = file->size; /* nothing is kept past EOF */
+    }
+    if (r == 0) {
+        if (mode & FALLOC_FL_PUNCH_HOLE) {
+            r = ext_set(file, offset, end, EXT_HOLE);
+        } else if (mode & FALLOC_FL_ZERO_RANGE) {
+            r = ext_set(file, offset, end, EXT_ZERO);
+        } else {
+            r = ext_alloc(file, offset, end);
+        }
+    }
+
+    if (r == 0 && (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))) {
+        l_inval_range(file->ino, offset, length);
+        file->cache_gen++;
+        file->prefill_end = 0;
+    }
+    l_now(&file->mtime);
+    file->ctime = file->mtime;
+
+    pthread_mutex_unlock(&l_data.lock);
+
+    l_reply_err(req, -r);
+}
+
+/*
+ * Makes file a copy of src: same pattern, size and zeroed ranges. Lock must
+ * be held.
+ */
+static int file_clone(struct l_file *file, const struct l_file *src)
+{
+    struct l_extent *ext = NULL;
+
+    if (src->next > 0) {
+        if ((ext = malloc(src->next * sizeof(*ext))) == NULL) {
+            return -ENOMEM;
+        }
+        memcpy(ext, src->ext, src->next * sizeof(*ext));
+    }
+    free(file->ext);
+    file->ext = ext;
+    file->next = src->next;
+    memcpy(file->pattern, src->pattern, sizeof(file->pattern));
+    file->size = src->size;
+
+    /* the whole content changed */
+    l_inval_inode(file->ino);
+    file->cache_gen++;
+    file->prefill_end = 0;
+    l_now(&file->mtime);
+    file->ctime = file->mtime;
+
+    return 0;
+}
+
+/*
+ * Snapshots.
+ *
+ * A snapshot is a directory in the snapshot library (snapshots= option,
+ * realstore/.lfs-snapshots by default) holding a copy of every meta file
+ * and a table of all files:
+ *
+ *     lfs-snapshot 1
+ *     M name                                       meta file, copied
+ *     D size pattern atime mtime ctime n [start end type]... name
+ *
+ * Meta files are copied with FICLONE, which shares their blocks on
+ * filesystems with reflinks (btrfs, XFS): taking or restoring a snapshot
+ * costs a few metadata operations per file, whatever the content size.
+ * Elsewhere copy_file_range does a real copy. Data files are just their
+ * table line. Stores sharing a library can restore each other's snapshots,
+ * which clones a store.
+ *
+ * Managed through extended attributes of the root directory:
+ *
+ *     setfattr -n user.lfs.snapshot -v NAME mnt   take
+ *     setfattr -n user.lfs.restore -v NAME mnt    replace the store with it
+ *     setfattr -n user.lfs.drop -v NAME mnt       delete
+ *     getfattr -n user.lfs.snapshots mnt          list, one per line
+ *
+ * or restored at mount (restore= option). Meta file writes in flight while
+ * a snapshot is taken may or may not make it in, so quiesce the store first.
+ */
+#define SNAP_MAGIC "lfs-snapshot 1"
+#define SNAP_TABLE "table"
+
+/* Copies the rest of in to out. Returns 0, or -1 and errno. */
+static ssize_t copy_fd(int in, int out)
+{
+    char buf[65536];
+    ssize_t n, w, done;
+
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        for (done = 0; done < n; done += w) {
+            if ((w = write(out, buf + done, n - done)) == -1) {
+                return -1;
+            }
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Copies a file between directories, sharing blocks where the filesystem
+ * can, and keeps its timestamps. Returns 0 or -errno.
+ */
+static int reflink_at(int sdir, const char *sname, int ddir, const char *dname)
+{
+    struct timespec tv[2];
+    struct stat st;
+    ssize_t n = 1;
+    int in, out, r = 0;
+
+    if ((in = openat(sdir, sname, O_RDONLY)) == -1) {
+        return -errno;
+    }
+    if ((out = openat(ddir, dname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        r = -errno;
+        close(in);
+        return r;
+    }
+
+    if (ioctl(out, FICLONE, in) == -1) {
+        /* no reflinks here (or across filesystems), copy in the kernel */
+        while (n > 0) {
+            n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0);
+        }
+        if (n == -1 && (errno == EXDEV || errno == EINVAL ||
+                        errno == EOPNOTSUPP)) {
+            /* not between these filesystems (e.g. tmpfs), copy by hand */
+            n = copy_fd(in, out);
+        }
+        if (n == -1) {
+            r = -errno;
+        }
+    }
+    if (r == 0 && fstat(in, &st) == 0) {
+        tv[0] = st.st_atim;
+        tv[1] = st.st_mtim;
+        futimens(out, tv);
+    }
+
+    close(in);
+    if (close(out) == -1 && r == 0) {
+        r = -errno;
+    }
+
+    return r;
+}
+
+static int snapshot_name_ok(const char *snap)
+{
+    return snap[0] != 0 && strchr(snap, '/') == NULL &&
+           strcmp(snap, ".") != 0 && strcmp(snap, "..") != 0;
+}
+
+/* Deletes a snapshot. Returns 0 or -errno. */
+static int snapshot_drop(const char *snap)
+{
+    struct dirent *de;
+    DIR *d;
+    int dfd;
+
+    if ((dfd = openat(l_data.snapfd, snap, O_RDONLY | O_DIRECTORY)) == -1) {
+        return -errno;
+    }
+    if ((d = fdopendir(dfd)) == NULL) {
+        close(dfd);
+        return -errno;
+    }
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+            unlinkat(dfd, de->d_name, 0);
+        }
+    }
+    closedir(d);
+
+    return (unlinkat(l_data.snapfd, snap, AT_REMOVEDIR) == -1) ? -errno : 0;
+}
+
+static void snapshot_line(FILE *t, const struct l_file *file)
+{
+    unsigned i;
+
+    fprintf(t, "D %lld %02hhx%02hhx%02hhx%02hhx %lld.%09ld %lld.%09ld "
+            "%lld.%09ld %u", (long long)file->size, file->pattern[0],
+            file->pattern[1], file->pattern[2], file->pattern[3],
+            (long long)file->atime.tv_sec, file->atime.tv_nsec,
+            (long long)file->mtime.tv_sec, file->mtime.tv_nsec,
+            (long long)file->ctime.tv_sec, file->ctime.tv_nsec, file->next);
+    for (i = 0; i < file->next; i++) {
+        fprintf(t, " %lld %lld %d", (long long)file->ext[i].start,
+                (long long)file->ext[i].end, file->ext[i].type);
+    }
+    fprintf(t, " %s\n", file->name);
+}
+
+/* A meta file to copy into a snapshot, noted under the lock. */
+struct snap_meta {
+    char name[MAXPATHLEN];
+    int dirfd;          /* its store */
+    unsigned long wseq; /* when noted, or last copied */
+};
+
+#define SNAP_COPY_TRIES 3 /* of a meta file written to while being copied */
+
+/*
+ * Copies a meta file into the snapshot dfd without the lock, again if it
+ * changed meanwhile. Returns 1 if copied, 0 if the file is gone, or -errno.
+ */
+static int snapshot_copy(struct snap_meta *m, int dfd)
+{
+    struct l_file *f;
+    unsigned i;
+    int r, changed;
+
+    for (i = 0; i < SNAP_COPY_TRIES; i++) {
+        r = reflink_at(m->dirfd, m->name, dfd, m->name);
+
+        pthread_mutex_lock(&l_data.lock);
+        f = find_name(m->name);
+        changed = (f == NULL || !f->meta) ? -1 : (f->wseq != m->wseq);
+        if (changed == 1) {
+            m->wseq = f->wseq;
+        }
+        pthread_mutex_unlock(&l_data.lock);
+
+        if (changed == -1) {
+            unlinkat(dfd, m->name, 0); /* unlinked or renamed meanwhile */
+            return 0;
+        }
+        if (r != 0) {
+            return r;
+        }
+        if (!changed) {
+            return 1;
+        }
+    }
+
+    return -EBUSY;
+}
+
+/*
+ * Saves the current state as snap. Only the table is taken under the lock,
+ * meta files are copied after, so requests go on meanwhile. Returns 0 or
+ * -errno.
+ */
+static int snapshot_take(const char *snap)
+{
+    struct l_file *f, *tmp;
+    struct snap_meta *metas = NULL, *newp;
+    unsigned nmeta = 0, max = 0, i;
+    char *table = NULL;
+    size_t len;
+    FILE *t, *mt;
+    int dfd, fd, r = 0;
+
+    if (mkdirat(l_data.snapfd, snap, 0755) == -1) {
+        return -errno;
+    }
+    if ((dfd = openat(l_data.snapfd, snap, O_RDONLY | O_DIRECTORY)) == -1) {
+        r = -errno;
+        unlinkat(l_data.snapfd, snap, AT_REMOVEDIR);
+        return r;
+    }
+    fd = openat(dfd, SNAP_TABLE, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd == -1 || (t = fdopen(fd, "w")) == NULL) {
+        r = -errno;
+        if (fd != -1) {
+            close(fd);
+        }
+        close(dfd);
+        snapshot_drop(snap);
+        return r;
+    }
+
+    fprintf(t, SNAP_MAGIC "\n");
+    if ((mt = open_memstream(&table, &len)) == NULL) {
+        r = -ENOMEM;
+        goto out;
+    }
+    pthread_mutex_lock(&l_data.lock);
+    HASH_ITER(hh, l_data.files, f, tmp) {
+        if (!f->meta) {
+            snapshot_line(mt, f);
+            continue;
+        }
+        if (nmeta == max) {
+            max = max ? max * 2 : 64;
+            if ((newp = realloc(metas, max * sizeof(*metas))) == NULL) {
+                r = -ENOMEM;
+                break;
+            }
+            metas = newp;
+        }
+        strcpy(metas[nmeta].name, f->name);
+        metas[nmeta].dirfd = store_fd(f);
+        metas[nmeta].wseq = f->wseq;
+        nmeta++;
+    }
+    pthread_mutex_unlock(&l_data.lock);
+    if (fclose(mt) != 0 && r == 0) {
+        r = -ENOMEM;
+    }
+
+    for (i = 0; i < nmeta && r >= 0; i++) {
+        if ((r = snapshot_copy(&metas[i], dfd)) == 1) {
+            fprintf(t, "M %s\n", metas[i].name);
+        }
+    }
+    if (r >= 0) {
+        r = 0;
+        fwrite(table, 1, len, t);
+    }
+
+out:
+    if ((fflush(t) != 0 || fsync(fileno(t)) == -1) && r == 0) {
+        r = -errno;
+    }
+    fclose(t);
+    close(dfd);
+    if (r != 0) {
+        snapshot_drop(snap);
+    }
+    free(metas);
+    free(table);
+
+    return r;
+}
+
+/* Parses a data file line. Returns the name in line, or NULL. */
+static char *snapshot_parse(char *line, struct l_file *file)
+{
+    long long size, sec[3], start, end;
+    long nsec[3];
+    char pattern[9];
+    unsigned i;
+    int n, type;
+
+    if (sscanf(line, "D %lld %8s %lld.%ld %lld.%ld %lld.%ld %u %n", &size,
+               pattern, &sec[0], &nsec[0], &sec[1], &nsec[1], &sec[2],
+               &nsec[2], &file->next, &n) != 9 ||
+        parse_pattern(pattern, file->pattern) != 0 || file->next > (1 << 20)) {
+        return NULL;
+    }
+    line += n;
+    file->size = size;
+    file->atime.tv_sec = sec[0];
+    file->atime.tv_nsec = nsec[0];
+    file->mtime.tv_sec = sec[1];
+    file->mtime.tv_nsec = nsec[1];
+    file->ctime.tv_sec = sec[2];
+    file->ctime.tv_nsec = nsec[2];
+
+    if (file->next > 0 &&
+        (file->ext = malloc(file->next * sizeof(*file->ext))) == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < file->next; i++) {
+        if (sscanf(line, "%lld %lld %d %n", &start, &end, &type, &n) != 3) {
+            return NULL;
+        }
+        file->ext[i].start = start;
+        file->ext[i].end = end;
+        file->ext[i].type = type;
+        line += n;
+    }
+
+    return line;
+}
+
+/* Where a restored meta file waits in its store until swapped in. */
+static void snapshot_tmpname(char *buf, size_t size, const char *name)
+{
+    snprintf(buf, size, ".lfs-restore.%s", name);
+}
+
+/*
+ * Adds the file of a table line to the table being restored, copying a meta
+ * file to its temporary name. Runs without the lock.
+ */
+static int snapshot_load(int dfd, char *line, struct l_file **table)
+{
+    char tmpname[MAXPATHLEN + 16];
+    struct l_file *file = calloc(1, sizeof(*file)), *dup;
+    char *name = NULL;
+    int r = -EINVAL;
+
+    if (file == NULL) {
+        return -ENOMEM;
+    }
+    file->realfd = -1;
+
+    if (strncmp(line, "M ", 2) == 0) {
+        name = line + 2;
+        file->meta = 1;
+    } else {
+        name = snapshot_parse(line, file);
+    }
+    if (name != NULL) {
+        /* by today's rules, the content must still be stored or not */
+        file->cls = class_of(&l_data.classes, name);
+    }
+    if (name != NULL && strlen(name) < MAXPATHLEN &&
+        class_stored(file->cls) == file->meta) {
+        HASH_FIND_STR(*table, name, dup);
+        r = (dup == NULL) ? 0 : -EINVAL;
+    }
+    if (r == 0 && file->meta) {
+        L_PROBE4(meta_delegate, "restore", name, 0, 0);
+        snapshot_tmpname(tmpname, sizeof(tmpname), name);
+        r = reflink_at(dfd, name, store_fd(file), tmpname);
+        file->wseq++;
+    }
+    if (r != 0) {
+        free(file->ext);
+        free(file);
+        return r;
+    }
+
+    strcpy(file->name, name);
+    HASH_ADD_STR(*table, name, file);
+
+    return 0;
+}
+
+/* Drops a table that won't be restored, with its copied meta files. */
+static void snapshot_discard(struct l_file *table)
+{
+    char tmpname[MAXPATHLEN + 16];
+    struct l_file *f, *tmp;
+
+    HASH_ITER(hh, table, f, tmp) {
+        HASH_DELETE(hh, table, f);
+        if (f->meta) {
+            snapshot_tmpname(tmpname, sizeof(tmpname), f->name);
+            unlinkat(store_fd(f), tmpname, 0);
+        }
+        free(f->ext);
+        free(f);
+    }
+}
+
+/* A meta file of the store being replaced, noted under the lock. */
+struct snap_old {
+    char name[MAXPATHLEN];
+    int dirfd;          /* its store */
+    fuse_ino_t ino;
+    int state;          /* OLD_* */
+    UT_hash_handle hh;
+};
+
+enum {
+    OLD_KEPT,   /* untouched */
+    OLD_LINKED, /* also at its old name, the restored file replaces it */
+    OLD_MOVED   /* only at its old name */
+};
+
+/* Where a replaced meta file waits until the restore is done or undone. */
+static void snapshot_oldname(char *buf, size_t size, const char *name)
+{
+    snprintf(buf, size, ".lfs-old.%s", name);
+}
+
+/* Notes the meta files of the store. Returns their number, or -errno. */
+static int snapshot_olds(struct snap_old **olds)
+{
+    struct l_file *f, *tmp;
+    struct snap_old *o;
+    int n = 0;
+
+    HASH_ITER(hh, l_data.files, f, tmp) {
+        if (!f->meta) {
+            continue;
+        }
+        if ((o = calloc(1, sizeof(*o))) == NULL) {
+            return -ENOMEM;
+        }
+        strcpy(o->name, f->name);
+        o->dirfd = store_fd(f);
+        o->ino = f->ino;
+        HASH_ADD_STR(*olds, name, o);
+        n++;
+    }
+
+    return n;
+}
+
+/* Whether the store still has the n meta files noted. Lock must be held. */
+static int snapshot_olds_same(struct snap_old *olds, int n)
+{
+    struct l_file *f, *tmp;
+    struct snap_old *o;
+
+    HASH_ITER(hh, l_data.files, f, tmp) {
+        if (!f->meta) {
+            continue;
+        }
+        HASH_FIND_STR(olds, f->name, o);
+        if (o == NULL || o->ino != f->ino || n-- == 0) {
+            return 0;
+        }
+    }
+
+    return n == 0;
+}
+
+/*
+ * Puts the restored meta files of table in place. The old ones are kept at
+ * their old name until snapshot_done(), or put back by snapshot_undo() up to
+ * *stop, the first restored file not in place (NULL if all are). Returns 0
+ * or -errno. Runs without the lock.
+ */
+static int snapshot_place(struct l_file *table, struct snap_old *olds,
+    struct l_file **stop)
+{
+    char name[MAXPATHLEN + 16];
+    struct l_file *f, *tmp, *nf;
+    struct snap_old *o, *otmp;
+
+    *stop = table;
+    HASH_ITER(hh, olds, o, otmp) {
+        snapshot_oldname(name, sizeof(name), o->name);
+        HASH_FIND_STR(table, o->name, nf);
+        if (nf != NULL && nf->meta && store_fd(nf) == o->dirfd) {
+            /* renaming the restored one over it keeps open fds on it */
+            unlinkat(o->dirfd, name, 0);
+            if (linkat(o->dirfd, o->name, o->dirfd, name, 0) == -1) {
+                return -errno;
+            }
+            o->state = OLD_LINKED;
+        } else {
+            if (renameat(o->dirfd, o->name, o->dirfd, name) == -1) {
+                return -errno;
+            }
+            o->state = OLD_MOVED;
+        }
+    }
+    HASH_ITER(hh, table, f, tmp) {
+        *stop = f;
+        if (f->meta) {
+            snapshot_tmpname(name, sizeof(name), f->name);
+            if (renameat(store_fd(f), name, store_fd(f), f->name) == -1) {
+                return -errno;
+            }
+        }
+    }
+    *stop = NULL;
+
+    return 0;
+}
+
+/* Puts back the old meta files, see snapshot_place(). */
+static void snapshot_undo(struct l_file *table, struct l_file *stop,
+    struct snap_old *olds)
+{
+    char name[MAXPATHLEN + 16];
+    struct l_file *f, *tmp;
+    struct snap_old *o, *otmp;
+
+    HASH_ITER(hh, table, f, tmp) {
+        if (f == stop) {
+            break;
+        }
+        HASH_FIND_STR(olds, f->name, o);
+        if (f->meta && (o == NULL || o->state != OLD_LINKED)) {
+            unlinkat(store_fd(f), f->name, 0);
+        }
+    }
+    HASH_ITER(hh, olds, o, otmp) {
+        if (o->state != OLD_KEPT) {
+            snapshot_oldname(name, sizeof(name), o->name);
+            renameat(o->dirfd, name, o->dirfd, o->name);
+        }
+    }
+}
+
+/* Deletes the old meta files once replaced, and frees olds. */
+static void snapshot_done(struct snap_old *olds, int replaced)
+{
+    char name[MAXPATHLEN + 16];
+    struct snap_old *o, *otmp;
+
+    HASH_ITER(hh, olds, o, otmp) {
+        HASH_DELETE(hh, olds, o);
+        if (replaced && o->state != OLD_KEPT) {
+            snapshot_oldname(name, sizeof(name), o->name);
+            unlinkat(o->dirfd, name, 0);
+        }
+        free(o);
+    }
+}
+
+/*
+ * Replaces the whole store with snap. Open files keep working, like
+ * unlinked ones. notify is 0 before the kernel knows anything. The new table
+ * is built and its meta files put in place without the lock, the old ones
+ * are kept aside until the tables are swapped under it. Returns 0 or -errno,
+ * the store is then unchanged; -EBUSY if meta files were created or removed
+ * during the restore.
+ */
+static int snapshot_restore(const char *snap, int notify)
+{
+    struct l_file *f, *tmp, *stop, *table = NULL;
+    struct snap_old *olds = NULL;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    FILE *t = NULL;
+    int dfd, fd, nold, r = 0;
+
+    if ((dfd = openat(l_data.snapfd, snap, O_RDONLY | O_DIRECTORY)) == -1) {
+        return -errno;
+    }
+    if ((fd = openat(dfd, SNAP_TABLE, O_RDONLY)) == -1 ||
+        (t = fdopen(fd, "r")) == NULL) {
+        r = -errno;
+        if (fd != -1) {
+            close(fd);
+        }
+        close(dfd);
+        return r;
+    }
+    if (getline(&line, &cap, t) == -1 ||
+        strcmp(line, SNAP_MAGIC "\n") != 0) {
+        r = -EINVAL;
+    }
+
+    while (r == 0 && (len = getline(&line, &cap, t)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[len - 1] = 0;
+        }
+        r = snapshot_load(dfd, line, &table);
+    }
+    if (r == 0) {
+        pthread_mutex_lock(&l_data.lock);
+        nold = snapshot_olds(&olds);
+        pthread_mutex_unlock(&l_data.lock);
+        if (nold < 0) {
+            r = nold;
+        } else if ((r = snapshot_place(table, olds, &stop)) != 0) {
+            snapshot_undo(table, stop, olds);
+        }
+    }
+    if (r == 0) {
+        pthread_mutex_lock(&l_data.lock);
+        if (!snapshot_olds_same(olds, nold)) {
+            pthread_mutex_unlock(&l_data.lock);
+            snapshot_undo(table, NULL, olds);
+            r = -EBUSY;
+        }
+    }
+    if (r != 0) {
+        snapshot_done(olds, 0);
+        snapshot_discard(table);
+        goto out;
+    }
+
+    /* the lock is still held, only the tables change from here */
+    HASH_ITER(hh, l_data.files, f, tmp) {
+        if (notify) {
+            l_inval_entry(f->name);
+        }
+        file_remove(f);
+    }
+    HASH_ITER(hh, table, f, tmp) {
+        HASH_DELETE(hh, table, f);
+        f->ino = ++(l_data.next_ino);
+        l_data.nfiles++;
+        L_PROBE2(file_create, f->name, f->ino);
+        HASH_ADD_STR(l_data.files, name, f);
+        HASH_ADD(hh_ino, l_data.inodes, ino, sizeof(f->ino), f);
+        if (notify) {
+            l_inval_entry(f->name); /* may be cached as negative */
+        }
+    }
+    pthread_mutex_unlock(&l_data.lock);
+    snapshot_done(olds, 1);
+
+out:
+    free(line);
+    fclose(t);
+    close(dfd);
+
+    return r;
+}
+
+/* Lists snapshots into a malloc'd buffer. Returns the length, or -errno. */
+static int snapshot_list(char **value)
+{
+    struct dirent *de;
+    size_t len = 0, max = 0, n;
+    char *buf = NULL, *newp;
+    DIR *d;
+    int fd;
+
+    if ((fd = openat(l_data.snapfd, ".", O_RDONLY | O_DIRECTORY)) == -1) {
+        return -errno;
+    }
+    if ((d = fdopendir(fd)) == NULL) {
+        close(fd);
+        return -errno;
+    }
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+        n = strlen(de->d_name) + 1;
+        if (len + n > max) {
+            max = 2 * max + n;
+            if ((newp = realloc(buf, max)) == NULL) {
+                free(buf);
+                closedir(d);
+                return -ENOMEM;
+            }
+            buf = newp;
+        }
+        memcpy(buf + len, de->d_name, n - 1);
+        buf[len + n - 1] = '\n';
+        len += n;
+    }
+    closedir(d);
+    *value = buf;
+
+    return len;
+}
+
+/* Snapshot attributes of the root directory. */
+static int snapshot_xattr(const char *name, const char *snap)
+{
+    if (l_data.snapfd == -1) {
+        return -ENOTSUP;
+    }
+    if (!snapshot_name_ok(snap)) {
+        return -EINVAL;
+    }
+
+    if (strcmp(name, XATTR_SNAPSHOT) == 0) {
+        return snapshot_take(snap);
+    } else if (strcmp(name, XATTR_RESTORE) == 0) {
+        return snapshot_restore(snap, 1);
+    } else if (strcmp(name, XATTR_DROP) == 0) {
+        return snapshot_drop(snap);
+    }
+
+    return -ENOTSUP;
+}
+
+/*
+ * Runtime settings. Most options of a mount can be changed while it serves
+ * requests, through extended attributes of the root directory:
+ *
+ *     setfattr -n user.lfs.set -v OPTIONS mnt   change, OPTIONS as for -o
+ *     getfattr -n user.lfs.settings mnt         current ones, as OPTIONS
+ *
+ * or the set and get commands of the control socket. These are the timeouts,
+ * kernel_cache, direct_io, meta_cache, prefill, tree_prefetch, max_fds (idle
+ * fds above it are closed right away), commit_interval, sync_on_close, perf,
+ * the dev_* parameters of an emulated device (not device= itself), and:
+ *
+ *     logfile=PATH|none  log to another file, or stop logging
+ *     reset_stats        zero the counters of .lfs.stats
+ *
+ * Flags take =0 to turn them off. A change is checked as a whole and applied
+ * only if all of it is valid. Each setting then switches with a single store,
+ * the device model between two of its operations: requests in flight finish
+ * with the values they read, and none is held back.
+ */
+enum {
+    SET_LOGFILE,
+    SET_RESET_STATS,
+};
+
+struct l_set {
+    struct l_state s; /* first, options are parsed into a copy of the mount */
+    int log_set;
+    char *log_path;   /* NULL for none */
+    int reset_stats;
+};
+
+static struct fuse_opt l_set_opts[] = {
+    { "attr_timeout=%lf", offsetof(struct l_state, attr_timeout), 0 },
+    { "entry_timeout=%lf", offsetof(struct l_state, entry_timeout), 0 },
+    { "negative_timeout=%lf", offsetof(struct l_state, negative_timeout), 0 },
+    { "kernel_cache", offsetof(struct l_state, kernel_cache), 1 },
+    { "kernel_cache=%i", offsetof(struct l_state, kernel_cache), 0 },
+    { "direct_io", offsetof(struct l_state, direct_io), 1 },
+    { "direct_io=%i", offsetof(struct l_state, direct_io), 0 },
+    { "meta_cache=%s", offsetof(struct l_state, meta_cache_opt), 0 },
+    { "prefill=%lu", offsetof(struct l_state, prefill), 0 },
+    { "tree_prefetch=%u", offsetof(struct l_state, tree_layers), 0 },
+    { "max_fds=%u", offsetof(struct l_state, max_fds), 0 },
+    { "commit_interval=%lf", offsetof(struct l_state, commit_interval), 0 },
+    { "sync_on_close", offsetof(struct l_state, sync_on_close), 1 },
+    { "sync_on_close=%i", offsetof(struct l_state, sync_on_close), 0 },
+    { "perf", offsetof(struct l_state, perf), 1 },
+    { "perf=%i", offsetof(struct l_state, perf), 0 },
+    { "dev_read_lat=%lf", offsetof(struct l_state, dev_opts.read_lat), 0 },
+    { "dev_write_lat=%lf", offsetof(struct l_state, dev_opts.write_lat), 0 },
+    { "dev_lat_dist=%s", offsetof(struct l_state, dev_lat_dist), 0 },
+    { "dev_seek_min=%lf", offsetof(struct l_state, dev_opts.seek_min), 0 },
+    { "dev_seek_max=%lf", offsetof(struct l_state, dev_opts.seek_max), 0 },
+    { "dev_rotation=%lf", offsetof(struct l_state, dev_opts.rotation), 0 },
+    { "dev_bw=%lf", offsetof(struct l_state, dev_opts.bandwidth), 0 },
+    { "dev_burst=%lf", offsetof(struct l_state, dev_opts.burst), 0 },
+    { "dev_qd=%u", offsetof(struct l_state, dev_opts.qd), 0 },
+    { "dev_seed=%lu", offsetof(struct l_state, dev_opts.seed), 0 },
+    FUSE_OPT_KEY("logfile=", SET_LOGFILE),
+    FUSE_OPT_KEY("reset_stats", SET_RESET_STATS),
+    FUSE_OPT_END
+};
+
+static const char *const l_meta_cache_names[] = {
+    [META_CACHE_NONE] = "none",
+    [META_CACHE_AUTO] = "auto",
+    [META_CACHE_DIRECT] = "direct",
+};
+
+static const char *const l_lat_dist_names[] = {
+    [DEV_LAT_CONST] = "const",
+    [DEV_LAT_UNIFORM] = "uniform",
+    [DEV_LAT_EXP] = "exp",
+};
+
+static pthread_mutex_t l_set_lock = PTHREAD_MUTEX_INITIALIZER; /* all mounts */
+
+/* Index of name in names, or -1. */
+static int name_index(const char *const *names, int n, const char *name)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* META_CACHE_* of a meta_cache option, or -1. */
+static int meta_cache_policy(const char *opt)
+{
+    return name_index(l_meta_cache_names, 3, opt);
+}
+
+/* Unset dev_qd and dev_seed, any value of theirs but these can be set. */
+#define DEV_QD_UNSET ((unsigned)-1)
+#define DEV_SEED_UNSET ((uint64_t)-1)
+
+/* Marks all dev_* overrides unset. */
+static void dev_opts_unset(struct dev_params *o)
+{
+    memset(o, 0, sizeof(*o));
+    o->qd = DEV_QD_UNSET;
+    o->seed = DEV_SEED_UNSET;
+    o->read_lat = -1;
+    o->write_lat = -1;
+    o->seek_min = -1;
+    o->seek_max = -1;
+    o->rotation = -1;
+    o->bandwidth = -1;
+    o->burst = -1;
+}
+
+/* Whether any dev_* override is set, dist is the dev_lat_dist option. */
+static int dev_overridden(const struct dev_params *o, const char *dist)
+{
+    struct dev_params unset;
+
+    dev_opts_unset(&unset);
+    return dist != NULL || memcmp(o, &unset, sizeof(unset)) != 0;
+}
+
+/*
+ * Applies the dev_* overrides that are set to p. Returns 0, or -1 if dist
+ * (NULL to keep p's) is unknown.
+ */
+static int dev_override(struct dev_params *p, const struct dev_params *o,
+    const char *dist)
+{
+    if (o->read_lat >= 0) p->read_lat = o->read_lat;
+    if (o->write_lat >= 0) p->write_lat = o->write_lat;
+    if (o->seek_min >= 0) p->seek_min = o->seek_min;
+    if (o->seek_max >= 0) p->seek_max = o->seek_max;
+    if (o->rotation >= 0) p->rotation = o->rotation;
+    if (o->bandwidth >= 0) p->bandwidth = o->bandwidth;
+    if (o->burst >= 0) p->burst = o->burst;
+    if (o->qd != DEV_QD_UNSET) p->qd = o->qd;
+    if (o->seed != DEV_SEED_UNSET) p->seed = o->seed;
+    if (dist != NULL &&
+        (p->lat_dist = name_index(l_lat_dist_names, 3, dist)) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Points the log at path, or stops it if path is NULL. Loggers may hold the
+ * stream, so it is never closed while mounted: a new file takes the place of
+ * the old one under the same FILE. Returns 0, or -errno.
+ */
+static int log_reopen(const char *path)
+{
+    FILE *f = l_data.log_stream;
+    int fd;
+
+    if (path == NULL) {
+        __atomic_store_n(&l_data.log_file, NULL, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (f == NULL) {
+        if ((f = fopen(path, "w")) == NULL) {
+            return -errno;
+        }
+        l_data.log_stream = f;
+    } else {
+        if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1) {
+            return -errno;
+        }
+        flockfile(f);
+        fflush(f);
+        dup2(fd, fileno(f));
+        funlockfile(f);
+        close(fd);
+    }
+    __atomic_store_n(&l_data.log_file, f, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* Zeroes the counters served by .lfs.stats. */
+static void stats_reset_all(void)
+{
+    struct l_file *f, *tmp;
+
+    pthread_mutex_lock(&l_data.lock);
+    HASH_ITER(hh, l_data.files, f, tmp) {
+        stats_reset(&f->stats);
+    }
+    pthread_mutex_unlock(&l_data.lock);
+    stats_mix_reset(&l_data.mix);
+    perf_reset(l_data.perf_ops, L_NOPS);
+    perf_reset(l_data.perf_phases, L_NPHASES);
+}
+
+static int l_set_proc(void *data, const char *arg, int key,
+    struct fuse_args *outargs)
+{
+    struct l_set *set = data;
+
+    switch (key) {
+        case SET_LOGFILE:
+            arg += strlen("logfile=");
+            free(set->log_path);
+            set->log_path = NULL;
+            set->log_set = 1;
+            if (strcmp(arg, "none") != 0 &&
+                (set->log_path = strdup(arg)) == NULL) {
+                return -1;
+            }
+            return 0;
+        case SET_RESET_STATS:
+            set->reset_stats = 1;
+            return 0;
+        default:
+            return -1; /* unknown, or fixed at mount */
+    }
+}
+
+#define L_STORE(field) \
+    __atomic_store(&l_data.field, &s->field, __ATOMIC_RELAXED)
+
+/* Changes settings of the current mount. Returns NULL, or what went wrong. */
+static const char *l_set(char *opts)
+{
+    char *argv[] = { "lfs", "-o", opts };
+    struct fuse_args args = FUSE_ARGS_INIT(3, argv);
+    struct l_set *set = calloc(1, sizeof(*set));
+    struct l_state *s = &set->s;
+    struct dev_params p;
+    const char *err = NULL;
+    int meta_cache, dev, r;
+
+    if (set == NULL) {
+        return strerror(ENOMEM);
+    }
+    pthread_mutex_lock(&l_set_lock);
+    memcpy(s, &l_data, sizeof(*s)); /* only the settings are used */
+    s->meta_cache_opt = NULL;
+    s->dev_lat_dist = NULL;
+    dev_opts_unset(&s->dev_opts);
+
+    /* check everything first, nothing changes if anything is wrong */
+    if (fuse_opt_parse(&args, set, l_set_opts, l_set_proc) == -1) {
+        err = "bad options, or not changeable while mounted";
+        goto out;
+    }
+    meta_cache = l_data.meta_cache;
+    if (s->meta_cache_opt != NULL &&
+        (meta_cache = meta_cache_policy(s->meta_cache_opt)) == -1) {
+        err = "unknown meta_cache policy";
+        goto out;
+    }
+    p = l_data.dev.p;
+    if (dev_override(&p, &s->dev_opts, s->dev_lat_dist) != 0) {
+        err = "unknown latency distribution";
+        goto out;
+    }
+    dev = dev_overridden(&s->dev_opts, s->dev_lat_dist);
+    if (dev && !l_data.dev_enabled) {
+        err = "no device emulation, see the device option";
+        goto out;
+    }
+    if (s->max_fds == 0) {
+        err = "max_fds must be at least 1";
+        goto out;
+    }
+    if (s->perf && !l_data.perf && (r = perf_check()) != 0) {
+        err = strerror(-r);
+        goto out;
+    }
+    if (s->prefill > MAXPREFILL) {
+        s->prefill = MAXPREFILL;
+    }
+    s->prefill &= ~((unsigned long)PAGESIZE - 1);
+    /* the last that can fail */
+    if (set->log_set && !(l_data.log_file != NULL && set->log_path != NULL &&
+                          strcmp(set->log_path, l_data.log_path) == 0)) {
+        if ((r = log_reopen(set->log_path)) != 0) {
+            err = strerror(-r);
+            goto out;
+        }
+        free(l_data.log_path);
+        l_data.log_path = set->log_path;
+        set->log_path = NULL;
+        l_log("log started\n");
+    }
+
+    L_STORE(attr_timeout);
+    L_STORE(entry_timeout);
+    L_STORE(negative_timeout);
+    L_STORE(kernel_cache);
+    L_STORE(direct_io);
+    __atomic_store_n(&l_data.meta_cache, meta_cache, __ATOMIC_RELAXED);
+    L_STORE(prefill);
+    L_STORE(tree_layers);
+    L_STORE(commit_interval);
+    L_STORE(sync_on_close);
+    L_STORE(perf);
+    pthread_mutex_lock(&l_data.lock);
+    l_data.max_fds = s->max_fds;
+    fd_trim();
+    pthread_mutex_unlock(&l_data.lock);
+    if (dev) {
+        dev_set(&l_data.dev, &p);
+    }
+    if (set->reset_stats) {
+        stats_reset_all();
+    }
+    l_log("settings changed: %s\n", opts);
+
+out:
+    pthread_mutex_unlock(&l_set_lock);
+    fuse_opt_free_args(&args);
+    free(s->meta_cache_opt);
+    free(s->dev_lat_dist);
+    free(set->log_path);
+    free(set);
+    return err;
+}
+
+/*
+ * The settings of the current mount, as options for l_set(). Returns the
+ * length, or -errno.
+ */
+static ssize_t l_settings(char **value)
+{
+    const struct dev_params *p = &l_data.dev.p;
+    size_t len;
+    FILE *f;
+
+    if ((f = open_memstream(value, &len)) == NULL) {
+        return -ENOMEM;
+    }
+    pthread_mutex_lock(&l_set_lock);
+    fprintf(f, "attr_timeout=%g,entry_timeout=%g,negative_timeout=%g,"
+        "kernel_cache=%d,direct_io=%d,meta_cache=%s,prefill=%lu,"
+        "tree_prefetch=%u,max_fds=%u,commit_interval=%g,sync_on_close=%d,"
+        "perf=%d,logfile=%s", l_data.attr_timeout, l_data.entry_timeout,
+        l_data.negative_timeout, l_data.kernel_cache, l_data.direct_io,
+        l_meta_cache_names[l_data.meta_cache], l_data.prefill,
+        l_data.tree_layers, l_data.max_fds, l_data.commit_interval,
+        l_data.sync_on_close, l_data.perf,
+        l_data.log_file != NULL ? l_data.log_path : "none");
+    if (l_data.dev_enabled) {
+        fprintf(f, ",dev_read_lat=%g,dev_write_lat=%g,dev_lat_dist=%s,"
+            "dev_seek_min=%g,dev_seek_max=%g,dev_rotation=%g,dev_bw=%g,"
+            "dev_burst=%g,dev_qd=%u,dev_seed=%lu", p->read_lat, p->write_lat,
+            l_lat_dist_names[p->lat_dist], p->seek_min, p->seek_max,
+            p->rotation, p->bandwidth, p->burst, p->qd,
+            (unsigned long)p->seed);
+    }
+    pthread_mutex_unlock(&l_set_lock);
+    if (fclose(f) != 0) {
+        free(*value);
+        return -ENOMEM;
+    }
+
+    return len;
+}
+
+/* The settings attribute of the root directory. */
+static int set_xattr(const char *value, size_t size)
+{
+    char *opts = strndup(value, size);
+    const char *err;
+
+    if (opts == NULL) {
+        return -ENOMEM;
+    }
+    if ((err = l_set(opts)) != NULL) {
+        fprintf(stderr, "%s %s: %s\n", XATTR_SET, opts, err);
+    }
+    free(opts);
+
+    return err != NULL ? -EINVAL : 0;
+}
+
+/*
+ * "user.lfs.clone" set to the name of another data file clones it, which
+ * takes the place of copy_file_range (not in this FUSE API):
+ *
+ *     setfattr -n user.lfs.clone -v deadbeef_src deadbeef_dst
+ *
+ * On the root directory, the snapshot and settings attributes are set
+ * instead.
+ */
+void l_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+    const char *value, size_t size, int flags)
+{
+    struct l_file *file, *src;
+    char srcname[MAXPATHLEN];
+    int r;
+
+    L_OP(setxattr, req, ino, name, 0, size);
+    L_PERF_OP(SETXATTR);
+
+    if (ino == FUSE_ROOT_ID && strcmp(name, XATTR_SET) == 0) {
+        l_reply_err(req, -set_xattr(value, size));
+        return;
+    }
+    if (ino == FUSE_ROOT_ID) {
+        if (strcmp(name, XATTR_SNAPSHOT) != 0 &&
+            strcmp(name, XATTR_RESTORE) != 0 && strcmp(name, XATTR_DROP) != 0) {
+            l_reply_err(req, ENOTSUP);
+            return;
+        }
+        if (size >= MAXPATHLEN) {
+            l_reply_err(req, ENAMETOOLONG);
+            return;
+        }
+        memcpy(srcname, value, size);
+        srcname[size] = 0;
+        l_reply_err(req, -snapshot_xattr(name, srcname));
+        return;
+    }
+    if (strcmp(name, XATTR_CLONE) != 0) {
+        l_reply_err(req, ENOTSUP);
+        return;
+    }
+    if (size >= MAXPATHLEN) {
+        l_reply_err(req, ENAMETOOLONG);
+        return;
+    }
+    memcpy(srcname, value, size);
+    srcname[size] = 0;
+
+    pthread_mutex_lock(&l_data.lock);
+    file = find_ino(ino);
+    src = find_name(srcname);
+    if (file == NULL || src == NULL) {
+        r = -ENOENT;
+    } else if (file->meta || src->meta) {
+        r = -EINVAL; /* real content, nothing to share */
+    } else if (file == src) {
+        r = 0;
+    } else {
+        r = file_clone(file, src);
+    }
+    pthread_mutex_unlock(&l_data.lock);
+
+    l_reply_err(req, -r);
+}
+
+/*
+ * Virtual extended attributes of data files, served from LFS state and the
+ * cached swift metadata, so tools need neither to read nor to hash anything.
+ */
+enum {
+    XA_HOLES, /* "start end" lines, as SEEK_DATA/SEEK_HOLE would see it */
+    XA_ROOT_HASH,
+    XA_CHUNK_SIZE,
+    XA_CHUNKS,
+    XA_GENERATOR,
+    XA_COMPLETE,
+    XA_COUNT
+};
+
+static const char *l_xattrs[XA_COUNT] = {
+    [XA_HOLES]      = XATTR_HOLES,
+    [XA_ROOT_HASH]  = "user.lfs.root_hash",
+    [XA_CHUNK_SIZE] = "user.lfs.chunk_size",
+    [XA_CHUNKS]     = "user.lfs.chunks",
+    [XA_GENERATOR]  = "user.lfs.generator",
+    [XA_COMPLETE]   = "user.lfs.complete",
+};
+
+/*
+ * Formats attribute xa of a data file into a malloc'd buffer. Returns the
+ * length, or -errno. Lock must be held, and swift_refresh() called before.
+ */
+static int xattr_value(struct l_file *file, int xa, char **value)
+{
+    char *buf;
+    size_t max = 128, len = 0;
+    unsigned long cs;
+    unsigned i;
+
+    if (xa == XA_HOLES) {
+        max = file->next * 42 + 1; /* two 20 digit numbers, space, newline */
+    } else if (xa == XA_ROOT_HASH || xa == XA_COMPLETE) {
+        if (file->swift.ino == 0 ||
+            (xa == XA_ROOT_HASH && file->swift.root_hash[0] == 0)) {
+            return -ENODATA; /* swift didn't run on it yet */
+        }
+    }
+    if ((buf = malloc(max)) == NULL) {
+        return -ENOMEM;
+    }
+
+    switch (xa) {
+        case XA_HOLES:
+            for (i = 0; i < file->next; i++) {
+                if (file->ext[i].type == EXT_HOLE) {
+                    len += snprintf(buf + len, max - len, "%lld %lld\n",
+                                    (long long)file->ext[i].start,
+                                    (long long)file->ext[i].end);
+                }
+            }
+            break;
+        case XA_ROOT_HASH:
+            len = snprintf(buf, max, "%s", file->swift.root_hash);
+            break;
+        case XA_CHUNK_SIZE:
+            len = snprintf(buf, max, "%lu", chunk_size(file));
+            break;
+        case XA_CHUNKS:
+            cs = chunk_size(file);
+            len = snprintf(buf, max, "%llu", cs == 0 ? 0ULL :
+                           ((unsigned long long)file->size + cs - 1) / cs);
+            break;
+        case XA_GENERATOR:
+            len = snprintf(buf, max, "pattern %02hhx%02hhx%02hhx%02hhx",
+                           file->pattern[0], file->pattern[1],
+                           file->pattern[2], file->pattern[3]);
+            break;
+        case XA_COMPLETE:
+            len = snprintf(buf, max, "%.2f", file->size == 0 ? 100.0 :
+                           100.0 * file->swift.complete / file->size);
+            break;
+    }
+    *value = buf;
+
+    return len;
+}
+
+/* Replies with value, following the size protocol. */
+static void reply_xattr(fuse_req_t req, const char *value, size_t len,
+    size_t size)
+{
+    if (size == 0) {
+        l_reply_xattr(req, len);
+    } else if (size < len) {
+        l_reply_err(req, ERANGE);
+    } else {
+        l_reply_buf(req, value, len);
+    }
+}
+
+void l_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+{
+    struct l_file *file;
+    char *value;
+    int xa, r;
+
+    L_OP(getxattr, req, ino, name, 0, size);
+    L_PERF_OP(GETXATTR);
+
+    if (ino == FUSE_ROOT_ID) {
+        if (strcmp(name, XATTR_SETTINGS) == 0) {
+            r = l_settings(&value);
+        } else if (strcmp(name, XATTR_SNAPSHOTS) != 0) {
+            r = -ENODATA;
+        } else if (l_data.snapfd == -1) {
+            r = -ENOTSUP;
+        } else {
+            r = snapshot_list(&value);
+        }
+        if (r < 0) {
+            l_reply_err(req, -r);
+            return;
+        }
+        reply_xattr(req, value, r, size);
+        free(value);
+        return;
+    }
+
+    for (xa = 0; xa < XA_COUNT; xa++) {
+        if (strcmp(name, l_xattrs[xa]) == 0) {
+            break;
+        }
+    }
+    if (xa == XA_COUNT) {
+        l_reply_err(req, ENODATA);
+        return;
+    }
+    if (xa == XA_ROOT_HASH || xa == XA_COMPLETE) {
+        swift_refresh(ino);
+    }
+
+    pthread_mutex_lock(&l_data.lock);
+    file = find_ino(ino);
+    if (file == NULL || file->meta) {
+        r = -ENODATA;
+    } else {
+        r = xattr_value(file, xa, &value);
+    }
+    pthread_mutex_unlock(&l_data.lock);
+
+    if (r < 0) {
+        l_reply_err(req, -r);
+        return;
+    }
+    reply_xattr(req, value, r, size);
+    free(value);
+}
+
+/* Lists the attributes getxattr would return for the file. */
+void l_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+    struct l_file *file;
+    char buf[512];
+    size_t len = 0;
+    int xa;
+
+    L_OP(listxattr, req, ino, NULL, 0, size);
+    L_PERF_OP(LISTXATTR);
+
+    if (ino == FUSE_ROOT_ID) {
+        strcpy(buf, XATTR_SETTINGS);
+        len = sizeof(XATTR_SETTINGS);
+        if (l_data.snapfd != -1) {
+            strcpy(buf + len, XATTR_SNAPSHOTS);
+            len += sizeof(XATTR_SNAPSHOTS);
+        }
+    }
+
+    swift_refresh(ino);
+    pthread_mutex_lock(&l_data.lock);
+    file = find_ino(ino);
+    if (file != NULL && !file->meta) {
+        for (xa = 0; xa < XA_COUNT; xa++) {
+            if ((xa == XA_ROOT_HASH && file->swift.root_hash[0] == 0) ||
+                (xa == XA_COMPLETE && file->swift.ino == 0)) {
+                continue;
+            }
+            strcpy(buf + len, l_xattrs[xa]);
+            len += strlen(l_xattrs[xa]) + 1;
+        }
+    }
+    pthread_mutex_unlock(&l_data.lock);
+
+    reply_xattr(req, buf, len, size);
+}
+
+/* Directory listing, built at opendir and served in slices by readdir. */
+struct l_dirbuf {
+    char *p;
+    size_t size;
+};
+
+static int dirbuf_add(fuse_req_t req, struct l_dirbuf *b, const char *name,
+    fuse_ino_t ino)
+{
+    struct stat stbuf;
+    size_t oldsize = b->size;
+    char *newp;
+
+    b->size += fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+    if ((newp = realloc(b->p, b->size)) == NULL) {
+        return -ENOMEM;
+    }
+    b->p = newp;
+    memset(&stbuf, 0, sizeof(stbuf));
+    stbuf.st_ino = ino;
+    fuse_add_direntry(req, b->p + oldsize, b->size - oldsize, name, &stbuf,
+        b->size);
+
+    return 0;
+}
+
+void l_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct l_dirbuf *b;
+    struct l_file *f, *tmp;
+    int r = 0;
+
+    L_OP(opendir, req, ino, NULL, 0, 0);
+    L_PERF_OP(OPENDIR);
+
+    /* We only have one dir - the root. */
+    if (ino != FUSE_ROOT_ID) {
+        l_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    if ((b = calloc(1, sizeof(*b))) == NULL) {
+        l_reply_err(req, ENOMEM);
+        return;
+    }
+
+    r |= dirbuf_add(req, b, ".", FUSE_ROOT_ID);
+    r |= dirbuf_add(req, b, "..", FUSE_ROOT_ID);
+
+    pthread_mutex_lock(&l_data.lock);
+    HASH_ITER(hh, l_data.files, f, tmp) {
+        if ((r |= dirbuf_add(req, b, f->name, f->ino)) != 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&l_data.lock);
+
+    if (r != 0) {
+        free(b->p);
+        free(b);
+        l_reply_err(req, ENOMEM);
+        return;
+    }
+
+    fi->fh = (uintptr_t)b;
+    l_reply_open(req, fi);
+}
+
+void l_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+    struct fuse_file_info *fi)
+{
+    struct l_dirbuf *b = (struct l_dirbuf *)(uintptr_t)fi->fh;
+
+    L_OP(readdir, req, ino, NULL, offset, size);
+    L_PERF_OP(READDIR);
+
+    if (offset < b->size) {
+        size_t n = b->size - offset;
+        l_reply_buf(req, b->p + offset, n < size ? n : size);
+    } else {
+        l_reply_buf(req, NULL, 0);
+    }
+}
+
+void l_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct l_dirbuf *b = (struct l_dirbuf *)(uintptr_t)fi->fh;
+
+    L_OP(releasedir, req, ino, NULL, 0, 0);
+    L_PERF_OP(RELEASEDIR);
+
+    free(b->p);
+    free(b);
+    l_reply_err(req, 0);
+}
+
+/*
+ * Makes names of meta files durable. Data files have nothing to sync, but a
+ * commit of realstore is cheap enough to not track what changed.
+ */
+void l_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+    struct fuse_file_info *fi)
+{
+    L_OP(fsyncdir, req, ino, NULL, 0, datasync);
+    L_PERF_OP(FSYNCDIR);
+
+    sync_queue(req, NULL, l_data.metafd, datasync);
+}
+
+void l_destroy(void *userdata)
+{
+    struct l_state *data = (struct l_state *)userdata;
+    struct l_state *prev = l_cur;
+    struct l_file *f, *tmp;
+
+    /* free_file() works on l_data, which may be another mount's here */
+    l_cur = data;
+
+    /* Remove all files in the hashtables. */
+    HASH_ITER(hh, data->files, f, tmp) {
+        HASH_DELETE(hh, data->files, f);
+    }
+    HASH_ITER(hh_ino, data->inodes, f, tmp) {
+        free_file(f);
+    }
+
+    l_cur = prev;
+}
+
+void l_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+    L_OP(access, req, ino, NULL, 0, mask);
+    L_PERF_OP(ACCESS);
+
+    /* We trust everybody. */
+    l_reply_err(req, 0);
+}
+
+/* Adds a new file to the tables. Lock must be held. */
+static void file_add(struct l_file *file)
+{
+    file->ino = ++(l_data.next_ino);
+    l_data.nfiles++;
+    L_PROBE2(file_create, file->name, file->ino);
+    HASH_ADD_STR(l_data.files, name, file);
+    HASH_ADD(hh_ino, l_data.inodes, ino, sizeof(file->ino), file);
+}
+
+/*
+ * Replies to a create of a file with its realfd pinned, r is how getting
+ * that went. Lock must be held, it is dropped.
+ */
+static void create_reply(fuse_req_t req, struct l_file *file,
+    struct fuse_file_info *fi, int r)
+{
+    struct fuse_entry_param e;
+
+    if (r == 0) {
+        r = fill_entry(file, &e);
+    }
+    if (r == 0) {
+        cache_policy(file, fi);
+    } else if (file->meta) {
+        meta_fd_put(file);
+    }
+    pthread_mutex_unlock(&l_data.lock);
+
+    if (r != 0) {
+        l_reply_err(req, -r);
+        return;
+    }
+    fi->fh = (uintptr_t)file;
+    l_reply_create(req, &e, fi);
+}
+
+/* A new meta file was created on the real fs, or not. */
+static void create_new_done(struct io_req *ior, int res)
+{
+    struct l_io *io = l_io_done(ior);
+    struct l_file *file = io->file;
+
+    if (res < 0) {
+        l_log("%s\n", strerror(-res));
+        free(file);
+        l_reply_err(io->req, -res);
+        l_io_free(io);
+        return;
+    }
+
+    pthread_mutex_lock(&l_data.lock);
+    if (find_name(file->name) != NULL) {
+        /* created meanwhile, by a snapshot restore */
+        pthread_mutex_unlock(&l_data.lock);
+        close(res);
+        free(file);
+        l_reply_err(io->req, EEXIST);
+        l_io_free(io);
+        return;
+    }
+    meta_fd_set(file, res);
+    meta_fd_hold(file);
+    file->wseq++;
+    file_add(file);
+    create_reply(io->req, file, &io->fi, 0);
+    l_io_free(io);
+}
+
+static void create_truncated(struct io_req *ior, int res)
+{
+    struct l_io *io = l_io_done(ior);
+
+    pthread_mutex_lock(&l_data.lock);
+    if (res == 0 && (io->fi.flags & O_TRUNC)) {
+        file_resized(io->file);
+    }
+    create_reply(io->req, io->file, &io->fi, res);
+    l_io_free(io);
+}
+
+/* Truncates an existing meta file opened by create, if asked to. */
+static void create_truncate(struct l_io *io, int fd)
+{
+    if (fd < 0 || !(io->fi.flags & O_TRUNC)) {
+        create_truncated(&io->ior, fd < 0 ? fd : 0);
+        return;
+    }
+    io->ior.done = create_truncated;
+    L_PROBE4(meta_delegate, "truncate", io->name, 0, 0);
+    io_ftruncate(&io->ior, fd, 0);
+}
+
+/*
+ * Creates a file. Meta files are created, or opened and truncated, through
+ * the engine, and create_reply() replies once that's done.
+ */
+void l_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+    mode_t mode, struct fuse_file_info *fi)
+{
+    struct l_file *file;
+    struct l_io *io;
+
+    L_OP(create, req, parent, name, 0, mode);
+    L_PERF_OP(CREATE);
+
+    l_log("creating file %s ", name);
+
+    if (parent != FUSE_ROOT_ID) {
+        l_reply_err(req, ENOENT);
+        return;
+    }
+    if (strlen(name) >= MAXPATHLEN) {
+        l_reply_err(req, ENAMETOOLONG);
+        return;
+    }
+    if (strcmp(name, STATS_NAME) == 0) {
+        l_reply_err(req, EPERM);
+        return;
+    }
+
+    pthread_mutex_lock(&l_data.lock);
 
     /* find it */
-    HASH_FIND_STR(l_data.files, path, file);
+    file = find_name(name);
     if (file != NULL) {
         if ((fi->flags & O_CREAT) && (fi->flags & O_EXCL)) {
             /* File already exists. */
-            return -EEXIST;
+            pthread_mutex_unlock(&l_data.lock);
+            l_reply_err(req, EEXIST);
+            return;
         }
     }
 
-    l_log("(file didn't exist)\n");
-    
     if (file == NULL) {
-        file = (struct l_file *)malloc(sizeof(*file));
-        file->size = 0;
-        strcpy(file->path, path);
-
-        if (is_meta_file(path)) {
-            /* delegate to real fs */
-            char *pathcopy = strdup(path);
-            char *bn = gnu_basename(pathcopy);
-            char realpath[MAXREALPATHLEN];
-            snprintf(realpath, MAXREALPATHLEN, "%s/%s", l_data.metadir, bn);
-            free(pathcopy);
-            int fd;
-            l_log("realpath: %s\n", realpath);
-            if ((fd = open(realpath, O_CREAT | O_RDWR | O_TRUNC, mode)) != -1) {
-                HASH_ADD_STR(l_data.files, path, file);
-                file->realfd = fd;
-                return fi->fh;
-            } else {
-                l_log("%s\n", strerror(errno));
-                return -errno;
+        l_log("(file didn't exist)\n");
+
+        file = (struct l_file *)calloc(1, sizeof(*file));
+        if (file == NULL) {
+            pthread_mutex_unlock(&l_data.lock);
+            l_reply_err(req, ENOMEM);
+            return;
+        }
+        strcpy(file->name, name);
+        file->cls = class_of(&l_data.classes, name);
+        file->meta = class_stored(file->cls);
+        file->realfd = -1;
+        l_now(&file->mtime);
+        file->atime = file->ctime = file->mtime;
+
+        if (file->meta) {
+            /* delegate to real fs, the reply comes from create_new_done() */
+            int dfd = store_fd(file);
+
+            if ((io = l_io_new(req, file, 0, create_new_done)) == NULL) {
+                pthread_mutex_unlock(&l_data.lock);
+                free(file);
+                l_reply_err(req, ENOMEM);
+                return;
             }
-        } else {
-            HASH_ADD_STR(l_data.files, path, file);
+            io->fi = *fi;
+            pthread_mutex_unlock(&l_data.lock);
+
+            L_PROBE4(meta_delegate, "create", file->name, 0, 0);
+            L_PERF_CALL(REALSTORE, io_openat(&io->ior, dfd, file->name,
+                O_CREAT | O_RDWR | O_TRUNC, mode));
+            return;
+        } else if (file->cls == CLASS_GENERATED) {
+            /* TODO(vladum): Check error code. */
+            name_pattern(name, file->pattern);
+        } /* discarded files keep the zero pattern */
+
+        file_add(file);
+    } else if (file->meta) {
+        /* delegate to real fs, the reply comes from create_truncated() */
+        if ((io = l_io_new(req, file, 0, NULL)) == NULL) {
+            pthread_mutex_unlock(&l_data.lock);
+            l_reply_err(req, ENOMEM);
+            return;
+        }
+        io->fi = *fi;
+        meta_fd_async(io, create_truncate);
+        return;
+    } else {
+        /*
+         * Reset size. The kernel has no way of knowing the content of an
+         * existing inode changed, so drop whatever it has cached.
+         */
+        file_truncate(file, 0);
+        l_inval_inode(file->ino);
+    }
+
+    create_reply(req, file, fi, 0);
+}
+
+/* Gives the file its new name, the inode stays the same. Lock must be held. */
+static void file_rename(struct l_file *file, const char *new)
+{
+    char old[MAXPATHLEN];
+
+    strcpy(old, file->name);
+    HASH_DELETE(hh, l_data.files, file);
+    strcpy(file->name, new);
+    HASH_ADD_STR(l_data.files, name, file);
+    l_now(&file->ctime);
+    L_PROBE3(file_rename, old, new, file->ino);
+}
 
-            file->fd = ++(l_data.nfiles);
-            char pattern[9];
-            strncpy(pattern, path + 1, 8);
-            pattern[8] = 0;
-            /* TODO(vladum): Check error code. */
-            parse_pattern(pattern, file->pattern);
+static void meta_rename_done(struct io_req *ior, int res)
+{
+    struct l_io *io = l_io_done(ior);
+    struct l_file *file;
+
+    if (res < 0) {
+        l_log("%s\n", strerror(-res));
+    } else {
+        pthread_mutex_lock(&l_data.lock);
+        file = find_name(io->name);
+        if (file != NULL && file->ino == io->ino &&
+            find_name(io->data) == NULL) {
+            file_rename(file, io->data);
+        } else {
+            res = -ESTALE; /* a snapshot restore got in between */
         }
+        pthread_mutex_unlock(&l_data.lock);
     }
-
-    /* Reset size. */
-    file->size = 0;
-
-    return fi->fh;
+    l_reply_err(io->req, -res);
+    l_io_free(io);
 }
 
-int l_rename(const char *old, const char *new)
+/*
+ * Renames a file. Meta files are renamed on the real fs through the engine
+ * first. The kernel serializes changes to the directory, so only a snapshot
+ * restore can change the names meanwhile.
+ */
+void l_rename(fuse_req_t req, fuse_ino_t parent, const char *old,
+    fuse_ino_t newparent, const char *new)
 {
     struct l_file *file;
+    struct l_io *io;
+    int dfd;
+
+    L_OP(rename, req, parent, old, 0, 0);
+    L_PERF_OP(RENAME);
 
     l_log("rename old: %s new: %s", old, new);
 
+    if (parent != FUSE_ROOT_ID || newparent != FUSE_ROOT_ID) {
+        l_reply_err(req, ENOENT);
+        return;
+    }
+    if (strlen(new) >= MAXPATHLEN) {
+        l_reply_err(req, ENAMETOOLONG);
+        return;
+    }
+    if (strcmp(old, STATS_NAME) == 0 || strcmp(new, STATS_NAME) == 0) {
+        l_reply_err(req, EPERM);
+        return;
+    }
+
+    pthread_mutex_lock(&l_data.lock);
+
     /* find new one */
-    HASH_FIND_STR(l_data.files, new, file);
+    file = find_name(new);
     if (file != NULL) {
-        return -EEXIST;
+        pthread_mutex_unlock(&l_data.lock);
+        l_reply_err(req, EEXIST);
+        return;
     }
 
     /* find old one */
-    HASH_FIND_STR(l_data.files, old, file);
+    file = find_name(old);
     if (file == NULL) {
-        return -ENOENT;
+        pthread_mutex_unlock(&l_data.lock);
+        l_reply_err(req, ENOENT);
+        return;
     }
 
-
-    if ((is_meta_file(old) && !is_meta_file(new)) ||
-        (is_meta_file(new) && !is_meta_file(old))) {
-        /* do not rename metafiles to non-meta and reversed */
-        return -EINVAL;
+    if (class_of(&l_data.classes, new) != file->cls) {
+        /* the content would have to move, e.g. metafiles to non-meta */
+        pthread_mutex_unlock(&l_data.lock);
+        l_reply_err(req, EINVAL);
+        return;
     }
 
-    if (is_meta_file(old) && is_meta_file(new)) {
-        /* delegate to real fs */
-        char *oldcopy = strdup(old);
-        char *newcopy = strdup(new);
-        char *bnold = gnu_basename(oldcopy);
-        char *bnnew = gnu_basename(newcopy);
-        char realold[MAXREALPATHLEN], realnew[MAXREALPATHLEN];
-        snprintf(realold, MAXREALPATHLEN, "%s/%s", l_data.metadir, bnold);
-        snprintf(realnew, MAXREALPATHLEN, "%s/%s", l_data.metadir, bnnew);
-        free(oldcopy);
-        free(newcopy);
-
-        l_log("realpaths old: %s new: %s\n", realold, realnew);
-
-        int r = rename(realold, realnew);
-        if (r == -1) {
-            l_log("%s\n", strerror(errno));
-            return -errno;
+    if (file->meta) {
+        /* delegate to real fs, a cached fd stays valid */
+        if ((io = l_io_new(req, file, strlen(new) + 1,
+                           meta_rename_done)) == NULL) {
+            pthread_mutex_unlock(&l_data.lock);
+            l_reply_err(req, ENOMEM);
+            return;
         }
-    }
+        io->ino = file->ino;
+        strcpy(io->name, old);
+        strcpy(io->data, new);
+        dfd = store_fd(file);
+        pthread_mutex_unlock(&l_data.lock);
 
-    /* change path in files list */
-    struct l_file *newfile;
-    newfile = (struct l_file *)malloc(sizeof(*newfile));
-    strcpy(newfile->path, new);
-    HASH_ADD_STR(l_data.files, path, newfile);
+        L_PROBE4(meta_delegate, "rename", io->name, 0, 0);
+        L_PERF_CALL(REALSTORE, io_renameat(&io->ior, dfd, io->name, dfd,
+            io->data));
+        return;
+    }
 
-    newfile->fd = file->fd;
-    newfile->size = file->size;
-    newfile->realfd = file->realfd;
-    strncpy(newfile->pattern, file->pattern, 4);
+    file_rename(file, new);
 
-    HASH_DEL(l_data.files, file);
-    free(file);
+    pthread_mutex_unlock(&l_data.lock);
 
-    return 0;
+    l_reply_err(req, 0);
 }
 
-int l_ftruncate(const char *path, off_t length, struct fuse_file_info *fi)
+void l_getlk(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi,
+    struct flock *lock)
 {
-    /* Same as truncate for this filesystem. */
-    return l_truncate(path, length);
-}
+    L_OP(getlk, req, ino, NULL, 0, 0);
+    L_PERF_OP(GETLK);
 
-int l_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
-{
-    /* Same as getattr for this filesystem. */
-    return l_getattr(path, stbuf);
+    l_reply_err(req, EINVAL);
 }
 
-int l_lock(const char *path, struct fuse_file_info *fi, int cmd,
-    struct flock *locks)
+void l_setlk(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi,
+    struct flock *lock, int sleep)
 {
-    return -EINVAL;
+    L_OP(setlk, req, ino, NULL, 0, 0);
+    L_PERF_OP(SETLK);
+
+    l_reply_err(req, EINVAL);
 }
 
-void *l_init(struct fuse_conn_info *conn)
+void l_init(void *userdata, struct fuse_conn_info *conn)
 {
-    return NULL;
 }
 
-struct fuse_operations l_ops = {
-    .getattr     = l_getattr,
-    .unlink      = l_unlink,
-    .truncate    = l_truncate,
-    .open        = l_open,
-    .read        = l_read,
-    .write       = l_write,
-    .flush       = l_flush,
-    .release     = l_release,
-    .getxattr    = l_getxattr,
-    .opendir     = l_opendir,
-    .readdir     = l_readdir,
-    .destroy     = l_destroy,
-    .access      = l_access,
-    .create      = l_create,
-    .ftruncate   = l_ftruncate,
-    .fgetattr    = l_fgetattr,
-    .lock        = l_lock,
-    .init        = l_init,
-    .rename      = l_rename,
+struct fuse_lowlevel_ops l_ops = {
+    .lookup       = l_lookup,
+    .forget       = l_forget,
+    .forget_multi = l_forget_multi,
+    .getattr      = l_getattr,
+    .setattr      = l_setattr,
+    .unlink       = l_unlink,
+    .open         = l_open,
+    .read         = l_read,
+    .write        = l_write,
+    .flush        = l_flush,
+    .release      = l_release,
+    .fsync        = l_fsync,
+    .setxattr     = l_setxattr,
+    .getxattr     = l_getxattr,
+    .listxattr    = l_listxattr,
+    .opendir      = l_opendir,
+    .readdir      = l_readdir,
+    .releasedir   = l_releasedir,
+    .fsyncdir     = l_fsyncdir,
+    .destroy      = l_destroy,
+    .access       = l_access,
+    .create       = l_create,
+    .getlk        = l_getlk,
+    .setlk        = l_setlk,
+    .init         = l_init,
+    .rename       = l_rename,
+    .fallocate    = l_fallocate,
     /* TODO(vladum): Add the new functions? */
 };
 
@@ -581,7 +4420,42 @@ enum {
 
 static struct fuse_opt l_opts[] = {
     { "realstore=%s", offsetof(struct l_state, metadir), 0 },
+    { "ramstore=%s", offsetof(struct l_state, ramdir), 0 },
+    { "classes=%s", offsetof(struct l_state, classes_opt), 0 },
+    { "snapshots=%s", offsetof(struct l_state, snapdir), 0 },
+    { "restore=%s", offsetof(struct l_state, restore), 0 },
+    { "max_fds=%u", offsetof(struct l_state, max_fds), 0 },
+    { "sync_mode=%s", offsetof(struct l_state, sync_mode_opt), 0 },
+    { "commit_interval=%lf", offsetof(struct l_state, commit_interval), 0 },
+    { "sync_on_close", offsetof(struct l_state, sync_on_close), 1 },
     { "logfile=%s", offsetof(struct l_state, log_file), 0 },
+    { "perf", offsetof(struct l_state, perf), 1 },
+    { "attr_timeout=%lf", offsetof(struct l_state, attr_timeout), 0 },
+    { "entry_timeout=%lf", offsetof(struct l_state, entry_timeout), 0 },
+    { "negative_timeout=%lf", offsetof(struct l_state, negative_timeout), 0 },
+    { "kernel_cache", offsetof(struct l_state, kernel_cache), 1 },
+    { "direct_io", offsetof(struct l_state, direct_io), 1 },
+    { "meta_cache=%s", offsetof(struct l_state, meta_cache_opt), 0 },
+    { "prefill=%lu", offsetof(struct l_state, prefill), 0 },
+    { "tree_prefetch=%u", offsetof(struct l_state, tree_layers), 0 },
+    { "device=%s", offsetof(struct l_state, device), 0 },
+    { "dev_read_lat=%lf", offsetof(struct l_state, dev_opts.read_lat), 0 },
+    { "dev_write_lat=%lf", offsetof(struct l_state, dev_opts.write_lat), 0 },
+    { "dev_lat_dist=%s", offsetof(struct l_state, dev_lat_dist), 0 },
+    { "dev_seek_min=%lf", offsetof(struct l_state, dev_opts.seek_min), 0 },
+    { "dev_seek_max=%lf", offsetof(struct l_state, dev_opts.seek_max), 0 },
+    { "dev_rotation=%lf", offsetof(struct l_state, dev_opts.rotation), 0 },
+    { "dev_bw=%lf", offsetof(struct l_state, dev_opts.bandwidth), 0 },
+    { "dev_burst=%lf", offsetof(struct l_state, dev_opts.burst), 0 },
+    { "dev_qd=%u", offsetof(struct l_state, dev_opts.qd), 0 },
+    { "dev_seed=%lu", offsetof(struct l_state, dev_opts.seed), 0 },
+    { "workers=%u", offsetof(struct l_state, workers.n), 0 },
+    { "worker_cpus=%s", offsetof(struct l_state, worker_cpus), 0 },
+    { "noclone_fd", offsetof(struct l_state, workers.clone), 0 },
+    { "control=%s", offsetof(struct l_state, control), 0 },
+    { "io_engine=%s", offsetof(struct l_state, io_engine), 0 },
+    { "io_depth=%u", offsetof(struct l_state, io_depth), 0 },
+    { "io_sqpoll", offsetof(struct l_state, io_sqpoll), 1 },
     FUSE_OPT_KEY("-V",             KEY_VERSION),
     FUSE_OPT_KEY("--version",      KEY_VERSION),
     FUSE_OPT_KEY("-h",             KEY_HELP),
@@ -603,27 +4477,280 @@ static int l_opt_proc(void *data, const char *arg, int k, struct fuse_args *oa)
                 "\n"
                 "LFS options:\n"
                 "    -o realstore=PATH      real dir for libswift meta files\n"
+                "    -o classes=RULES       storage classes by name, e.g. "
+                                           "*.mptch=real:tmp_*=ram\n"
+                "                           (generated, real, ram or "
+                                           "discard)\n"
+                "    -o ramstore=PATH       tmpfs dir for ram class files "
+                                           "(new in /dev/shm)\n"
+                "    -o snapshots=PATH      snapshot library (realstore/"
+                                           SNAP_DIR ")\n"
+                "    -o restore=NAME        start from a snapshot\n"
+                "    -o max_fds=N           meta file fds kept open (half "
+                                           "of RLIMIT_NOFILE)\n"
+                "    -o sync_mode=MODE      meta file group commit: auto "
+                                           "(default), file or fs\n"
+                "    -o commit_interval=MS  minimum time between group "
+                                           "commits (0)\n"
+                "    -o sync_on_close       make meta files durable on "
+                                           "close\n"
                 "    -o logfile=PATH        optional log file\n"
-                "\n", oa->argv[0]);
+                "    -o perf                hardware counters per operation "
+                                           "in " STATS_NAME "\n"
+                "    -o attr_timeout=T      attribute cache timeout (%.0lf s)\n"
+                "    -o entry_timeout=T     name lookup cache timeout "
+                                           "(%.0lf s)\n"
+                "    -o negative_timeout=T  negative lookup cache timeout "
+                                           "(%.0lf s)\n"
+                "    -o kernel_cache        always keep page cache between "
+                                           "opens\n"
+                "    -o direct_io           bypass page cache (also per open "
+                                           "with O_DIRECT)\n"
+                "    -o meta_cache=POLICY   meta file caching: none, auto "
+                                           "(default) or direct\n"
+                "    -o prefill=BYTES       seed page cache ahead of "
+                                           "sequential readers\n"
+                "    -o tree_prefetch=N     .mhash tree layers read ahead at "
+                                           "open, 0 disables (%u)\n"
+                "\n"
+                "storage emulation for data files:\n"
+                "    -o device=PROFILE      ssd, hdd or custom\n"
+                "    -o dev_read_lat=US     mean read latency\n"
+                "    -o dev_write_lat=US    mean write latency\n"
+                "    -o dev_lat_dist=DIST   const, uniform or exp\n"
+                "    -o dev_seek_min=US     track-to-track seek\n"
+                "    -o dev_seek_max=US     full stroke seek\n"
+                "    -o dev_rotation=US     full rotation\n"
+                "    -o dev_bw=BYTES        bandwidth per second\n"
+                "    -o dev_burst=BYTES     token bucket depth\n"
+                "    -o dev_qd=N            queue depth\n"
+                "    -o dev_seed=N          random seed\n"
+                "\n"
+                "request handling:\n"
+                "    -o workers=N           fixed pool of N workers instead "
+                                           "of libfuse's\n"
+                "    -o worker_cpus=LIST    pin workers round-robin, e.g. "
+                                           "0-3:6\n"
+                "    -o noclone_fd          workers share one /dev/fuse fd\n"
+                "    -o control=PATH        socket to add and remove more "
+                                           "mounts, served by one\n"
+                "                           pool of workers (one per CPU "
+                                           "by default)\n"
+                "\n"
+                "realstore I/O:\n"
+                "    -o io_engine=ENGINE    uring (default if built in) or "
+                                           "sync\n"
+                "    -o io_depth=N          io_uring queue depth (%u)\n"
+                "    -o io_sqpoll           kernel-side submission polling\n"
+                "\n", oa->argv[0], DEFAULT_ATTR_TIMEOUT, DEFAULT_ENTRY_TIMEOUT,
+                DEFAULT_NEGATIVE_TIMEOUT, DEFAULT_TREE_LAYERS,
+                DEFAULT_IO_DEPTH);
             fuse_opt_add_arg(oa, "-ho");
-            fuse_main(oa->argc, oa->argv, &l_ops, NULL);
+            fuse_parse_cmdline(oa, NULL, NULL, NULL);
+            fuse_mount(NULL, oa);
             exit(1);
 
         case KEY_VERSION:
              fprintf(stderr, "LFS version %s\n", VERSION);
-             fuse_opt_add_arg(oa, "--version");
-             fuse_main(oa->argc, oa->argv, &l_ops, NULL);
+             fprintf(stderr, "FUSE library version %d.%d\n",
+                 fuse_version() / 10, fuse_version() % 10);
              exit(0);
     }
     return 1;
 }
 
-static struct fuse *l_setup(struct fuse_args *args,
-                            const struct fuse_operations *op, size_t op_size,
-                            char **mountpoint, int *multithreaded)
+/* Defaults of the current mount, before its options are parsed. */
+static void l_defaults(void)
+{
+    l_data.attr_timeout = DEFAULT_ATTR_TIMEOUT;
+    l_data.entry_timeout = DEFAULT_ENTRY_TIMEOUT;
+    l_data.negative_timeout = DEFAULT_NEGATIVE_TIMEOUT;
+    l_data.io_depth = DEFAULT_IO_DEPTH;
+    l_data.tree_layers = DEFAULT_TREE_LAYERS;
+    l_data.workers.clone = 1;
+    dev_opts_unset(&l_data.dev_opts);
+    l_data.metafd = -1;
+    l_data.ramfd = -1;
+    l_data.snapfd = -1;
+    l_data.next_ino = STATS_INO; /* files start after it */
+    l_data.uid = getuid();
+    l_data.gid = getgid();
+    l_now(&l_data.root_time);
+    pthread_mutex_init(&l_data.lock, NULL);
+    pthread_mutex_init(&l_data.notify_lock, NULL);
+    pthread_cond_init(&l_data.notify_cond, NULL);
+    pthread_mutex_init(&l_data.sync_lock, NULL);
+    pthread_cond_init(&l_data.sync_cond, NULL);
+}
+
+/*
+ * Checks the options of the current mount and opens its stores. Returns 0, or
+ * -1 after printing what is wrong.
+ */
+static int l_configure(void)
+{
+    int res;
+
+    /* Get and open log file. */
+    if (l_data.log_file != NULL) {
+        printf("Logging to file: %s\n", (char *)l_data.log_file);
+        l_data.log_path = l_data.log_file;
+        l_data.log_file = l_data.log_stream = fopen(l_data.log_path, "w");
+        l_log("log started\n");
+    }
+
+    /* Get and resolve libswift meta files dir. */
+    if (l_data.metadir == NULL) {
+        fprintf(stderr, "Path for libswift meta files not specified. "
+                        "Please use -o realstore=PATH option.\n");
+        return -1;
+    }
+    l_data.metadir = realpath(l_data.metadir, NULL);
+    if (l_data.metadir == NULL) {
+        perror("Failed to resolve realstore path.");
+        return -1;
+    }
+    l_data.metafd = open(l_data.metadir, O_RDONLY | O_DIRECTORY);
+    if (l_data.metafd == -1) {
+        perror("Failed to open realstore.");
+        return -1;
+    }
+    printf("Libswift metadir: %s\n", l_data.metadir);
+
+    /* Storage classes. */
+    if (classes_parse(&l_data.classes, l_data.classes_opt) != 0) {
+        fprintf(stderr, "Bad classes: %s\n", l_data.classes_opt);
+        return -1;
+    }
+    if (class_used(&l_data.classes, CLASS_RAM)) {
+        if (l_data.ramdir == NULL) {
+            char tmpl[] = "/dev/shm/lfs-XXXXXX";
+            l_data.ramdir = (mkdtemp(tmpl) != NULL) ? strdup(tmpl) : NULL;
+        }
+        if (l_data.ramdir != NULL) {
+            mkdir(l_data.ramdir, 0755);
+            l_data.ramfd = open(l_data.ramdir, O_RDONLY | O_DIRECTORY);
+        }
+        if (l_data.ramfd == -1) {
+            perror("Failed to open ramstore.");
+            return -1;
+        }
+        printf("Ram class files in: %s\n", l_data.ramdir);
+    }
+    printf("Storage class rules: %u\n", l_data.classes.n);
+
+    /* Snapshots. */
+    if (l_data.snapdir != NULL) {
+        mkdir(l_data.snapdir, 0755);
+        l_data.snapfd = open(l_data.snapdir, O_RDONLY | O_DIRECTORY);
+    } else {
+        mkdirat(l_data.metafd, SNAP_DIR, 0755);
+        l_data.snapfd = openat(l_data.metafd, SNAP_DIR,
+                               O_RDONLY | O_DIRECTORY);
+    }
+    if (l_data.snapfd == -1) {
+        perror("Snapshots disabled, can't open the snapshot library");
+    }
+    if (l_data.restore != NULL) {
+        int r = (l_data.snapfd == -1) ? -ENOTSUP :
+                snapshot_restore(l_data.restore, 0);
+        if (r != 0) {
+            fprintf(stderr, "Failed to restore snapshot %s: %s\n",
+                l_data.restore, strerror(-r));
+            return -1;
+        }
+        printf("Restored snapshot %s: %u files\n", l_data.restore,
+            l_data.nfiles);
+    }
+    if (l_data.max_fds == 0) {
+        /* leave room for the channel, logs and whatever libfuse needs */
+        struct rlimit rl;
+        getrlimit(RLIMIT_NOFILE, &rl);
+        l_data.max_fds = (rl.rlim_cur == RLIM_INFINITY) ? 65536
+                                                        : rl.rlim_cur / 2;
+    }
+    printf("Meta file fd cache: %u\n", l_data.max_fds);
+    printf("Cache timeouts: attr %.1lfs, entry %.1lfs, negative %.1lfs\n",
+        l_data.attr_timeout, l_data.entry_timeout, l_data.negative_timeout);
+
+    /* Page cache policy. */
+    l_data.meta_cache = (l_data.meta_cache_opt == NULL) ? META_CACHE_AUTO :
+                        meta_cache_policy(l_data.meta_cache_opt);
+    if (l_data.meta_cache == -1) {
+        fprintf(stderr, "Unknown meta_cache policy: %s\n",
+            l_data.meta_cache_opt);
+        return -1;
+    }
+    if (l_data.prefill > MAXPREFILL) {
+        l_data.prefill = MAXPREFILL;
+    }
+    l_data.prefill &= ~((unsigned long)PAGESIZE - 1);
+
+    /* Request loop. */
+    if (l_data.workers.n > MAXWORKERS) {
+        l_data.workers.n = MAXWORKERS;
+    }
+    if (l_data.worker_cpus != NULL) {
+        int n = workers_parse_cpus(l_data.worker_cpus, l_data.workers.cpus,
+                                   MAXWORKERS);
+        if (n <= 0) {
+            fprintf(stderr, "Bad worker_cpus: %s\n", l_data.worker_cpus);
+            return -1;
+        }
+        l_data.workers.ncpus = n;
+    }
+
+    /* Group commit. */
+    if (l_data.sync_mode_opt == NULL ||
+        strcmp(l_data.sync_mode_opt, "auto") == 0) {
+        l_data.sync_mode = SYNC_AUTO;
+    } else if (strcmp(l_data.sync_mode_opt, "file") == 0) {
+        l_data.sync_mode = SYNC_FILE;
+    } else if (strcmp(l_data.sync_mode_opt, "fs") == 0) {
+        l_data.sync_mode = SYNC_FS;
+    } else {
+        fprintf(stderr, "Unknown sync_mode: %s\n", l_data.sync_mode_opt);
+        return -1;
+    }
+
+    /* Storage emulation. */
+    if (l_data.device != NULL && strcmp(l_data.device, "none") != 0) {
+        struct dev_params p, *o = &l_data.dev_opts;
+
+        if (dev_profile(&p, l_data.device) == -1) {
+            fprintf(stderr, "Unknown device profile: %s\n", l_data.device);
+            return -1;
+        }
+        if (dev_override(&p, o, l_data.dev_lat_dist) != 0) {
+            fprintf(stderr, "Unknown latency distribution: %s\n",
+                l_data.dev_lat_dist);
+            return -1;
+        }
+
+        dev_init(&l_data.dev, &p);
+        l_data.dev_enabled = 1;
+        printf("Emulating %s device: read %.0lfus, write %.0lfus, "
+               "seek %.0lf-%.0lfus, %.0lf B/s, qd %u\n", l_data.device,
+               p.read_lat, p.write_lat, p.seek_min, p.seek_max, p.bandwidth,
+               p.qd);
+    }
+
+    if (l_data.perf && (res = perf_check()) != 0) {
+        fprintf(stderr, "Hardware counters unavailable: %s (see "
+            "/proc/sys/kernel/perf_event_paranoid)\n", strerror(-res));
+        return -1;
+    }
+
+    return 0;
+}
+
+static struct fuse_session *l_setup(struct fuse_args *args,
+                                    const struct fuse_lowlevel_ops *op,
+                                    size_t op_size, char **mountpoint,
+                                    int *multithreaded)
 {
     struct fuse_chan *ch;
-    struct fuse *fuse;
+    struct fuse_session *se = NULL;
     int foreground;
     int res;
 
@@ -637,51 +4764,460 @@ static struct fuse *l_setup(struct fuse_args *args,
         goto err_free;
     }
 
-    fuse = fuse_new(ch, args, op, op_size, &l_data);
+    se = fuse_lowlevel_new(args, op, op_size, &l_data);
     fuse_opt_free_args(args);
-    if (fuse == NULL)
+    if (se == NULL)
         goto err_unmount;
 
+    fuse_session_add_chan(se, ch);
+    l_data.chan = ch;
+
     res = fuse_daemonize(foreground);
     if (res == -1)
-        goto err_unmount;
+        goto err_session;
 
-    res = fuse_set_signal_handlers(fuse_get_session(fuse));
+    res = fuse_set_signal_handlers(se);
     if (res == -1)
-        goto err_unmount;
+        goto err_session;
 
-    return fuse;
+    return se;
 
+err_session:
+    fuse_session_remove_chan(ch);
+    fuse_session_destroy(se);
 err_unmount:
     fuse_unmount(*mountpoint, ch);
-    if (fuse)
-        fuse_destroy(fuse);
 err_free:
     free(*mountpoint);
     return NULL;
 }
 
+static void l_teardown(struct fuse_session *se, char *mountpoint)
+{
+    struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
+
+    fuse_session_remove_chan(ch);
+    fuse_session_destroy(se);
+    fuse_unmount(mountpoint, ch);
+    free(mountpoint);
+}
+
+/* Starts the threads of the current mount. */
+static void l_mount_start(void)
+{
+    pthread_create(&l_data.notify_thread, NULL, l_notify_loop, l_cur);
+    pthread_create(&l_data.sync_thread, NULL, l_sync_loop, l_cur);
+    if (l_data.dev_enabled) {
+        tw_start(&l_data.wheel, DEVICE_TICK);
+    }
+}
+
+/*
+ * Stops the threads of the current mount, once it gets no more requests.
+ * Delayed replies and notifications are flushed, the channel must be up.
+ */
+static void l_mount_stop(void)
+{
+    while (__atomic_load_n(&l_data.io_inflight, __ATOMIC_ACQUIRE) > 0) {
+        usleep(1000);
+    }
+
+    pthread_mutex_lock(&l_data.sync_lock);
+    l_data.sync_stop = 1;
+    pthread_cond_broadcast(&l_data.sync_cond);
+    pthread_mutex_unlock(&l_data.sync_lock);
+    pthread_join(l_data.sync_thread, NULL);
+    if (l_data.commits > 0) {
+        printf("Group commits: %lu, %lu requests, latency avg %.3f ms, "
+               "max %.3f ms\n", l_data.commits, l_data.commit_reqs,
+               l_data.commit_ns / 1e6 / l_data.commits,
+               l_data.commit_max_ns / 1e6);
+    }
+    if (l_data.dev_enabled) {
+        tw_stop(&l_data.wheel);
+    }
+    pthread_mutex_lock(&l_data.notify_lock);
+    l_data.notify_stop = 1;
+    pthread_cond_signal(&l_data.notify_cond);
+    pthread_mutex_unlock(&l_data.notify_lock);
+    pthread_join(l_data.notify_thread, NULL);
+}
+
+/* Closes what l_configure() opened for the current mount. */
+static void l_mount_close(void)
+{
+    if (l_data.metafd != -1) {
+        close(l_data.metafd);
+    }
+    if (l_data.ramfd != -1) {
+        close(l_data.ramfd);
+    }
+    if (l_data.snapfd != -1) {
+        close(l_data.snapfd);
+    }
+    if (l_data.log_stream != NULL) {
+        fclose(l_data.log_stream);
+    }
+    free(l_data.log_path);
+    classes_free(&l_data.classes);
+    free(l_data.metadir);
+}
+
+/*
+ * Mounts served next to the one of the command line.
+ *
+ * The control socket (control= option) takes one command per line:
+ *
+ *     add MOUNTPOINT [OPTIONS]  serve another mount, OPTIONS as for -o, e.g.
+ *                               realstore=PATH,classes=RULES (absolute
+ *                               paths, the daemon runs in /)
+ *     remove MOUNTPOINT         unmount an added one
+ *     list                      mountpoint, realstore and file count of each
+ *     set MOUNTPOINT OPTIONS    change settings of any mount, see l_set()
+ *     get MOUNTPOINT            its settings, as OPTIONS
+ *
+ * and answers every command with a line "ok" or "error: REASON", after the
+ * lines of list and get. Clients are served one at a time.
+ *
+ * An added mount starts from the defaults, not from the options of the first
+ * one. All mounts share the worker pool and the realstore I/O engine (their
+ * options are taken from the command line), and with them the per-thread
+ * buffers generated content is produced in, so a mount only costs its file
+ * table and the threads that notify the kernel and commit syncs.
+ */
+static struct workers *l_pool;
+static struct l_state *l_mounts; /* added, only the control thread changes it */
+
+static void l_enter(void *mount)
+{
+    l_cur = mount;
+}
+
+static struct l_state *l_mount_find(const char *mountpoint)
+{
+    struct l_state *m;
+
+    for (m = l_mounts; m != NULL; m = m->next) {
+        if (strcmp(m->mountpoint, mountpoint) == 0) {
+            break;
+        }
+    }
+
+    return m;
+}
+
+/* Returns NULL, or what went wrong. */
+static const char *l_mount_add(const char *mountpoint, char *opts)
+{
+    char *argv[] = { "lfs", "-o", opts };
+    struct fuse_args args = FUSE_ARGS_INIT(opts != NULL ? 3 : 1, argv);
+    struct l_state *m = calloc(1, sizeof(*m));
+    struct fuse_chan *ch;
+    const char *err = NULL;
+
+    if (m == NULL) {
+        return strerror(ENOMEM);
+    }
+    l_cur = m;
+    l_defaults();
+    if (fuse_opt_parse(&args, m, l_opts, l_opt_proc) == -1) {
+        err = "bad options";
+        goto err_free;
+    }
+    if (l_configure() != 0) {
+        err = "bad options, see the daemon's output";
+        goto err_close;
+    }
+
+    m->mountpoint = strdup(mountpoint);
+    ch = fuse_mount(m->mountpoint, &args);
+    if (ch == NULL) {
+        err = "can't mount";
+        goto err_close;
+    }
+    m->se = fuse_lowlevel_new(&args, &l_ops, sizeof(l_ops), m);
+    if (m->se == NULL) {
+        fuse_unmount(m->mountpoint, ch);
+        err = "bad FUSE options";
+        goto err_close;
+    }
+    fuse_session_add_chan(m->se, ch);
+    m->chan = ch;
+
+    l_mount_start();
+    if (workers_add(l_pool, m->se, l_enter, m) != 0) {
+        l_mount_stop();
+        l_teardown(m->se, m->mountpoint);
+        m->mountpoint = NULL;
+        err = "can't serve it";
+        goto err_close;
+    }
+    m->next = l_mounts;
+    l_mounts = m;
+    printf("Mountpoint: %s\n", m->mountpoint);
+    fuse_opt_free_args(&args);
+    l_cur = &l_first;
+
+    return NULL;
+
+err_close:
+    l_mount_close();
+    free(m->mountpoint);
+err_free:
+    fuse_opt_free_args(&args);
+    free(m);
+    l_cur = &l_first;
+    return err;
+}
+
+static void l_mount_remove(struct l_state *m)
+{
+    struct l_state **p;
+
+    for (p = &l_mounts; *p != m; p = &(*p)->next);
+    *p = m->next;
+
+    workers_remove(l_pool, m->se);
+    l_cur = m;
+    l_mount_stop();
+    l_teardown(m->se, m->mountpoint); /* frees the files, see l_destroy() */
+    l_mount_close();
+    l_cur = &l_first;
+    free(m);
+}
+
+static void l_control_cmd(int fd, char *line)
+{
+    char *save, *cmd, *arg, *opts, *value;
+    struct l_state *m;
+    const char *err = NULL;
+    ssize_t len;
+
+    cmd = strtok_r(line, " \t\r", &save);
+    arg = strtok_r(NULL, " \t\r", &save);
+    opts = strtok_r(NULL, " \t\r", &save);
+    if (cmd == NULL) {
+        return;
+    }
+
+    if (strcmp(cmd, "list") == 0) {
+        dprintf(fd, "%s %s %u\n", l_first.mountpoint, l_first.metadir,
+            l_first.nfiles);
+        for (m = l_mounts; m != NULL; m = m->next) {
+            dprintf(fd, "%s %s %u%s\n", m->mountpoint, m->metadir, m->nfiles,
+                fuse_session_exited(m->se) ? " unmounted" : "");
+        }
+    } else if (strcmp(cmd, "add") == 0 && arg != NULL) {
+        if (arg[0] != '/') {
+            err = "mountpoint must be absolute"; /* the daemon runs in / */
+        } else if (strcmp(arg, l_first.mountpoint) == 0 || l_mount_find(arg)) {
+            err = "already mounted";
+        } else {
+            err = l_mount_add(arg, opts);
+        }
+    } else if (strcmp(cmd, "remove") == 0 && arg != NULL) {
+        if ((m = l_mount_find(arg)) == NULL) {
+            err = "not an added mount";
+        } else {
+            l_mount_remove(m);
+        }
+    } else if ((strcmp(cmd, "set") == 0 && opts != NULL) ||
+               (strcmp(cmd, "get") == 0 && arg != NULL)) {
+        m = (strcmp(arg, l_first.mountpoint) == 0) ? &l_first :
+            l_mount_find(arg);
+        if (m == NULL) {
+            err = "not mounted";
+        } else if (cmd[0] == 's') {
+            l_cur = m;
+            err = l_set(opts);
+            l_cur = &l_first;
+        } else {
+            l_cur = m;
+            len = l_settings(&value);
+            l_cur = &l_first;
+            if (len < 0) {
+                err = strerror(-len);
+            } else {
+                dprintf(fd, "%s\n", value);
+                free(value);
+            }
+        }
+    } else {
+        err = "usage: add MOUNTPOINT [OPTIONS] | remove MOUNTPOINT | "
+              "set MOUNTPOINT OPTIONS | get MOUNTPOINT | list";
+    }
+
+    if (err != NULL) {
+        dprintf(fd, "error: %s\n", err);
+    } else {
+        dprintf(fd, "ok\n");
+    }
+}
+
+/* Only cancelled while waiting for a client or a command, see l_serve(). */
+static void *l_control_loop(void *arg)
+{
+    int sfd = (intptr_t)arg, fd;
+    char buf[4096], *nl;
+    size_t len;
+    ssize_t r;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    for (;;) {
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        fd = accept4(sfd, NULL, NULL, SOCK_CLOEXEC);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (fd == -1) {
+            continue;
+        }
+
+        len = 0;
+        for (;;) {
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+            r = read(fd, buf + len, sizeof(buf) - 1 - len);
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+            if (r <= 0) {
+                break;
+            }
+            len += r;
+            buf[len] = 0;
+            while ((nl = strchr(buf, '\n')) != NULL) {
+                *nl = 0;
+                l_control_cmd(fd, buf);
+                len -= nl + 1 - buf;
+                memmove(buf, nl + 1, len + 1);
+            }
+            if (len == sizeof(buf) - 1) {
+                dprintf(fd, "error: line too long\n");
+                break;
+            }
+        }
+        if (r == 0 && len > 0) {
+            l_control_cmd(fd, buf); /* last line without a newline */
+        }
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static int l_control_listen(const char *path)
+{
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(sa.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+        return -1;
+    }
+    unlink(path); /* left over by a previous run */
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 ||
+        listen(fd, 16) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Serves the first mount, and those added through the control socket, with
+ * one worker pool until the first one exits. Returns 0, or -1 on error.
+ */
+static int l_serve(struct fuse_session *se)
+{
+    pthread_t control;
+    sigset_t all, old;
+    int sfd;
+
+    if (l_data.workers.n == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        l_data.workers.n = (n < 1) ? 1 : (n > MAXWORKERS) ? MAXWORKERS : n;
+    }
+    if ((sfd = l_control_listen(l_data.control)) == -1) {
+        perror("Failed to open the control socket");
+        return -1;
+    }
+    if ((l_pool = workers_start(&l_data.workers)) == NULL ||
+        workers_add(l_pool, se, l_enter, l_cur) != 0) {
+        fprintf(stderr, "Failed to start the workers\n");
+        if (l_pool != NULL) {
+            workers_stop(l_pool);
+        }
+        close(sfd);
+        return -1;
+    }
+    printf("Control socket: %s\n", l_data.control);
+
+    /* signals are left to this thread, like in the workers */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_create(&control, NULL, l_control_loop, (void *)(intptr_t)sfd);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    workers_wait(l_pool, se);
+
+    pthread_cancel(control);
+    pthread_join(control, NULL);
+    close(sfd);
+    unlink(l_data.control);
+    while (l_mounts != NULL) {
+        l_mount_remove(l_mounts);
+    }
+    workers_remove(l_pool, se);
+    workers_stop(l_pool);
+    fuse_session_reset(se);
+
+    return 0;
+}
+
 static int l_main(struct fuse_args *args)
 {
     char *mountpoint;
     int multithreaded;
-    struct fuse *fuse;
+    struct fuse_session *se;
     int res;
 
-    fuse = l_setup(args, &l_ops, sizeof(l_ops), &mountpoint, &multithreaded);
-    if (fuse == NULL) {
+    se = l_setup(args, &l_ops, sizeof(l_ops), &mountpoint, &multithreaded);
+    if (se == NULL) {
         return 1;
     }
+    l_data.se = se;
+    l_data.mountpoint = mountpoint;
 
     printf ("Mountpoint: %s\n", mountpoint);
 
-    if (multithreaded) {
-        res = fuse_loop_mt(fuse);
+    if (l_data.io_engine == NULL || strcmp(l_data.io_engine, "uring") == 0) {
+        res = io_start(l_data.io_depth, l_data.io_sqpoll);
+        if (res < 0) {
+            fprintf(stderr, "io_uring not available (%s), realstore I/O "
+                            "is synchronous\n", strerror(-res));
+        }
+    }
+    /* one submission for what a worker queues between waits */
+    l_data.workers.busy = io_batch_begin;
+    l_data.workers.idle = io_batch_end;
+    l_mount_start();
+
+    if (l_data.control != NULL) {
+        res = l_serve(se);
+    } else if (l_data.workers.n > 0) {
+        res = workers_loop(se, &l_data.workers);
+    } else if (multithreaded) {
+        res = fuse_session_loop_mt(se);
     } else {
-        res = fuse_loop(fuse);
+        res = fuse_session_loop(se);
     }
 
-    fuse_teardown(fuse, mountpoint);
+    l_mount_stop();
+    io_stop();
+
+    fuse_remove_signal_handlers(se);
+    l_teardown(se, mountpoint);
     if (res == -1) {
         return 1;
     }
@@ -698,27 +5234,11 @@ int main(int argc, char *argv[])
 
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
+    l_defaults();
     fuse_opt_parse(&args, &l_data, l_opts, l_opt_proc);
-
-    /* Get and open log file. */
-    if (l_data.log_file != NULL) {
-        printf("Logging to file: %s\n", (char *)l_data.log_file);
-        l_data.log_file = fopen(l_data.log_file, "w");
-        l_log("log started\n");
-    }
-
-    /* Get and resolve libswift meta files dir. */
-    if (l_data.metadir == NULL) {
-        fprintf(stderr, "Path for libswift meta files not specified. "
-                        "Please use -o realstore=PATH option.\n");
-        exit(1);
-    }
-    l_data.metadir = realpath(l_data.metadir, NULL);
-    if (l_data.metadir == NULL) {
-        perror("Failed to resolve realstore path.");
+    if (l_configure() != 0) {
         exit(1);
     }
-    printf("Libswift metadir: %s\n", l_data.metadir);
 
     /* FUSE */
     return l_main(&args);
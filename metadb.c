@@ -0,0 +1,645 @@
+/*
+ * Indexed container of precomputed swift metadata. See metadb.h.
+ *
+ * Not thread-safe: a handle caches the last record header it read.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "metadb.h"
+
+#define MDB_MAGIC "LFSMDB1"  /* with the NUL, 8 bytes */
+#define MDB_IDX_MAGIC "LFSIDX1"
+#define MDB_REC_MAGIC 0x5242444d /* "MDBR" */
+#define MDB_ALIGN 8
+
+struct mdb_header {
+    char magic[8];
+    uint64_t end;  /* of the last commit, its footer ends there */
+};
+
+struct mdb_footer {
+    char magic[8];
+    uint64_t index; /* offset of the slots */
+    uint64_t slots; /* a power of 2 */
+    uint64_t count; /* keys */
+};
+
+struct mdb_slot {
+    uint64_t hash;
+    uint64_t rec; /* 0 if free, the header is there */
+};
+
+/* Head of a record. Frame tables and frames follow. */
+struct mdb_rec {
+    uint32_t magic;
+    uint32_t nblobs;
+    char pattern[MDB_PATTERN];
+    uint64_t size;
+    uint32_t chunk;
+    uint32_t frame; /* uncompressed bytes per frame */
+    uint64_t len;   /* of the whole record */
+    struct {
+        uint64_t size;  /* uncompressed */
+        uint64_t table; /* nframes + 1 frame offsets, from the record */
+    } blob[MDB_MAXBLOBS];
+};
+
+struct metadb {
+    int fd;
+    int writable;
+    uint64_t end;  /* committed */
+    uint64_t tail; /* where the next record goes */
+    struct mdb_footer foot;
+    void *map;     /* the index of the last commit */
+    size_t maplen;
+    struct mdb_slot *slots;
+
+    /* records added since the last commit, oldest first */
+    struct mdb_slot *added;
+    unsigned nadded, maxadded;
+
+    struct mdb_rec cache; /* header of cache_rec */
+    int64_t cache_rec;
+};
+
+static inline uint64_t align_up(uint64_t x)
+{
+    return (x + MDB_ALIGN - 1) & ~(uint64_t)(MDB_ALIGN - 1);
+}
+
+/* FNV-1a of the key. */
+static uint64_t key_hash(const char *pattern, uint64_t size, uint32_t chunk)
+{
+    unsigned char buf[MDB_PATTERN + sizeof(size) + sizeof(chunk)];
+    uint64_t h = 0xcbf29ce484222325ULL;
+    unsigned i;
+
+    memset(buf, 0, MDB_PATTERN);
+    strncpy((char *)buf, pattern, MDB_PATTERN);
+    memcpy(buf + MDB_PATTERN, &size, sizeof(size));
+    memcpy(buf + MDB_PATTERN + sizeof(size), &chunk, sizeof(chunk));
+    for (i = 0; i < sizeof(buf); i++) {
+        h = (h ^ buf[i]) * 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+static int full_pread(int fd, void *buf, size_t len, uint64_t off)
+{
+    ssize_t r;
+
+    while (len > 0) {
+        if ((r = pread(fd, buf, len, off)) <= 0) {
+            return (r == 0) ? -EIO : -errno;
+        }
+        buf = (char *)buf + r;
+        len -= r;
+        off += r;
+    }
+
+    return 0;
+}
+
+static int full_pwrite(int fd, const void *buf, size_t len, uint64_t off)
+{
+    ssize_t r;
+
+    while (len > 0) {
+        if ((r = pwrite(fd, buf, len, off)) < 0) {
+            return -errno;
+        }
+        buf = (const char *)buf + r;
+        len -= r;
+        off += r;
+    }
+
+    return 0;
+}
+
+static const struct mdb_rec *rec_header(struct metadb *db, int64_t rec)
+{
+    if (db->cache_rec == rec) {
+        return &db->cache;
+    }
+    db->cache_rec = -1;
+    if (rec <= 0 || full_pread(db->fd, &db->cache, sizeof(db->cache), rec) ||
+        db->cache.magic != MDB_REC_MAGIC || db->cache.nblobs > MDB_MAXBLOBS) {
+        return NULL;
+    }
+    db->cache_rec = rec;
+
+    return &db->cache;
+}
+
+static int key_equal(struct metadb *db, int64_t rec, const char *pattern,
+    uint64_t size, uint32_t chunk)
+{
+    const struct mdb_rec *r = rec_header(db, rec);
+
+    return r != NULL && r->size == size && r->chunk == chunk &&
+           strncmp(r->pattern, pattern, MDB_PATTERN) == 0;
+}
+
+/* Maps the index the footer points to. */
+static int map_index(struct metadb *db)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t start = db->foot.index & ~(uint64_t)(page - 1);
+
+    db->maplen = db->foot.index + db->foot.slots * sizeof(struct mdb_slot) -
+                 start;
+    db->map = mmap(NULL, db->maplen, PROT_READ, MAP_SHARED, db->fd, start);
+    if (db->map == MAP_FAILED) {
+        db->map = NULL;
+        return -errno;
+    }
+    db->slots = (struct mdb_slot *)((char *)db->map +
+                                    (db->foot.index - start));
+
+    return 0;
+}
+
+struct metadb *metadb_open(const char *path, int writable)
+{
+    struct metadb *db = calloc(1, sizeof(*db));
+    struct mdb_header h;
+    struct stat st;
+    int err = EINVAL;
+
+    if (db == NULL) {
+        return NULL;
+    }
+    db->cache_rec = -1;
+    db->writable = writable;
+    db->fd = open(path, (writable ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC,
+                  0644);
+    if (db->fd == -1 || fstat(db->fd, &st) == -1) {
+        err = errno;
+        goto err;
+    }
+
+    if (st.st_size == 0 && writable) {
+        memset(&h, 0, sizeof(h));
+        strcpy(h.magic, MDB_MAGIC);
+        h.end = sizeof(h);
+        if ((err = -full_pwrite(db->fd, &h, sizeof(h), 0)) != 0) {
+            goto err;
+        }
+        st.st_size = sizeof(h);
+    } else if (full_pread(db->fd, &h, sizeof(h), 0) != 0 ||
+               memcmp(h.magic, MDB_MAGIC, sizeof(h.magic)) != 0 ||
+               h.end < sizeof(h) || h.end > (uint64_t)st.st_size) {
+        err = EINVAL;
+        goto err;
+    }
+    db->end = db->tail = h.end;
+
+    if (h.end > sizeof(h)) {
+        if (full_pread(db->fd, &db->foot, sizeof(db->foot),
+                       h.end - sizeof(db->foot)) != 0 ||
+            memcmp(db->foot.magic, MDB_IDX_MAGIC, sizeof(db->foot.magic))) {
+            err = EINVAL;
+            goto err;
+        }
+        if ((err = -map_index(db)) != 0) {
+            goto err;
+        }
+    }
+    if (writable && (uint64_t)st.st_size > h.end &&
+        ftruncate(db->fd, h.end) == -1) {
+        err = errno;
+        goto err;
+    }
+
+    return db;
+
+err:
+    metadb_close(db);
+    errno = err;
+    return NULL;
+}
+
+void metadb_close(struct metadb *db)
+{
+    if (db->map != NULL) {
+        munmap(db->map, db->maplen);
+    }
+    if (db->fd != -1) {
+        close(db->fd);
+    }
+    free(db->added);
+    free(db);
+}
+
+int64_t metadb_count(struct metadb *db)
+{
+    return db->foot.count;
+}
+
+int64_t metadb_find(struct metadb *db, const char *pattern, uint64_t size,
+    uint32_t chunk)
+{
+    uint64_t h = key_hash(pattern, size, chunk), i, mask;
+    unsigned j;
+
+    for (j = db->nadded; j-- > 0;) {
+        if (db->added[j].hash == h &&
+            key_equal(db, db->added[j].rec, pattern, size, chunk)) {
+            return db->added[j].rec;
+        }
+    }
+    if (db->slots == NULL) {
+        return -ENOENT;
+    }
+
+    mask = db->foot.slots - 1;
+    for (i = h & mask; db->slots[i].rec != 0; i = (i + 1) & mask) {
+        if (db->slots[i].hash == h &&
+            key_equal(db, db->slots[i].rec, pattern, size, chunk)) {
+            return db->slots[i].rec;
+        }
+    }
+
+    return -ENOENT;
+}
+
+int64_t metadb_blob_size(struct metadb *db, int64_t rec, unsigned blob)
+{
+    const struct mdb_rec *r = rec_header(db, rec);
+
+    if (r == NULL) {
+        return -EIO;
+    }
+    if (blob >= r->nblobs) {
+        return -EINVAL;
+    }
+
+    return r->blob[blob].size;
+}
+
+int metadb_key(struct metadb *db, int64_t rec, char *pattern, uint64_t *size,
+    uint32_t *chunk)
+{
+    const struct mdb_rec *r = rec_header(db, rec);
+
+    if (r == NULL) {
+        return -EIO;
+    }
+    memcpy(pattern, r->pattern, MDB_PATTERN);
+    pattern[MDB_PATTERN] = 0;
+    *size = r->size;
+    *chunk = r->chunk;
+
+    return 0;
+}
+
+int64_t metadb_read(struct metadb *db, int64_t rec, unsigned blob, void *buf,
+    uint64_t len, uint64_t off)
+{
+    const struct mdb_rec *r = rec_header(db, rec);
+    uint64_t *table = NULL, f, first, last, fstart, flen, size, frame;
+    char *comp = NULL, *tmp = NULL, *dst;
+    uLongf dlen;
+    int64_t res;
+
+    if (r == NULL) {
+        return -EIO;
+    }
+    if (blob >= r->nblobs) {
+        return -EINVAL;
+    }
+    size = r->blob[blob].size;
+    frame = r->frame;
+    if (off >= size || len == 0) {
+        return 0;
+    }
+    if (len > size - off) {
+        len = size - off;
+    }
+
+    /* only the part of the frame table covering the range */
+    first = off / frame;
+    last = (off + len - 1) / frame;
+    table = malloc((last - first + 2) * sizeof(*table));
+    comp = malloc(compressBound(frame));
+    tmp = malloc(frame);
+    if (table == NULL || comp == NULL || tmp == NULL) {
+        res = -ENOMEM;
+        goto out;
+    }
+    res = full_pread(db->fd, table, (last - first + 2) * sizeof(*table),
+                     rec + r->blob[blob].table + first * sizeof(*table));
+    if (res != 0) {
+        goto out;
+    }
+
+    for (f = first; f <= last; f++) {
+        fstart = f * frame;
+        flen = (size - fstart < frame) ? size - fstart : frame;
+        /* whole frames inflate in place, the ends through tmp */
+        dst = (fstart >= off && fstart + flen <= off + len) ?
+              (char *)buf + (fstart - off) : tmp;
+        res = full_pread(db->fd, comp, table[f - first + 1] - table[f - first],
+                         rec + table[f - first]);
+        if (res != 0) {
+            goto out;
+        }
+        dlen = flen;
+        if (uncompress((Bytef *)dst, &dlen, (Bytef *)comp,
+                       table[f - first + 1] - table[f - first]) != Z_OK ||
+            dlen != flen) {
+            res = -EIO;
+            goto out;
+        }
+        if (dst == tmp) {
+            uint64_t from = (off > fstart) ? off - fstart : 0;
+            uint64_t to = (off + len < fstart + flen) ? off + len - fstart
+                                                      : flen;
+            memcpy((char *)buf + (fstart + from - off), tmp + from, to - from);
+        }
+    }
+    res = len;
+
+out:
+    free(table);
+    free(comp);
+    free(tmp);
+    return res;
+}
+
+int64_t metadb_next(struct metadb *db, uint64_t *pos)
+{
+    while (db->slots != NULL && *pos < db->foot.slots) {
+        if (db->slots[(*pos)++].rec != 0) {
+            return db->slots[*pos - 1].rec;
+        }
+    }
+
+    return -ENOENT;
+}
+
+/* Remembers a record appended at rec, for the next commit. */
+static int add_slot(struct metadb *db, uint64_t hash, int64_t rec)
+{
+    if (db->nadded == db->maxadded) {
+        unsigned max = 2 * db->maxadded + 64;
+        struct mdb_slot *newp = realloc(db->added, max * sizeof(*newp));
+        if (newp == NULL) {
+            return -ENOMEM;
+        }
+        db->added = newp;
+        db->maxadded = max;
+    }
+    db->added[db->nadded].hash = hash;
+    db->added[db->nadded].rec = rec;
+    db->nadded++;
+
+    return 0;
+}
+
+int metadb_add(struct metadb *db, const char *pattern, uint64_t size,
+    uint32_t chunk, unsigned nblobs, const void *const *blobs,
+    const uint64_t *sizes)
+{
+    struct mdb_rec *r;
+    uint64_t len, nframes, f, flen, *table;
+    uLongf clen;
+    char *buf;
+    unsigned b;
+    int res;
+
+    if (!db->writable) {
+        return -EBADF;
+    }
+    if (nblobs > MDB_MAXBLOBS || strlen(pattern) > MDB_PATTERN) {
+        return -EINVAL;
+    }
+
+    /* worst case size, frames don't grow much */
+    len = sizeof(*r);
+    for (b = 0; b < nblobs; b++) {
+        nframes = (sizes[b] + MDB_FRAME - 1) / MDB_FRAME;
+        len += (nframes + 1) * sizeof(uint64_t) +
+               nframes * compressBound(MDB_FRAME);
+    }
+    if ((buf = calloc(1, len)) == NULL) {
+        return -ENOMEM;
+    }
+
+    r = (struct mdb_rec *)buf;
+    r->magic = MDB_REC_MAGIC;
+    r->nblobs = nblobs;
+    memcpy(r->pattern, pattern, strlen(pattern)); /* calloc()ed, padded */
+    r->size = size;
+    r->chunk = chunk;
+    r->frame = MDB_FRAME;
+    len = sizeof(*r);
+    for (b = 0; b < nblobs; b++) {
+        nframes = (sizes[b] + MDB_FRAME - 1) / MDB_FRAME;
+        r->blob[b].size = sizes[b];
+        r->blob[b].table = len;
+        table = (uint64_t *)(buf + len);
+        len += (nframes + 1) * sizeof(uint64_t);
+        for (f = 0; f < nframes; f++) {
+            table[f] = len;
+            flen = sizes[b] - f * MDB_FRAME;
+            if (flen > MDB_FRAME) {
+                flen = MDB_FRAME;
+            }
+            clen = compressBound(MDB_FRAME);
+            if (compress2((Bytef *)buf + len, &clen,
+                          (const Bytef *)blobs[b] + f * MDB_FRAME, flen,
+                          Z_DEFAULT_COMPRESSION) != Z_OK) {
+                free(buf);
+                return -EIO;
+            }
+            len += clen;
+        }
+        table[nframes] = len;
+        len = align_up(len); /* keeps the next table aligned */
+    }
+    r->len = len;
+
+    res = full_pwrite(db->fd, buf, len, db->tail);
+    free(buf);
+    if (res == 0) {
+        res = add_slot(db, key_hash(pattern, size, chunk), db->tail);
+    }
+    if (res == 0) {
+        db->tail += len;
+    }
+
+    return res;
+}
+
+/* Puts rec in the table, replacing the record of the same key. */
+static int index_insert(struct metadb *db, struct mdb_slot *slots,
+    uint64_t mask, uint64_t hash, int64_t rec)
+{
+    const struct mdb_rec *r;
+    char pattern[MDB_PATTERN];
+    uint64_t i, size;
+    uint32_t chunk;
+
+    for (i = hash & mask; slots[i].rec != 0; i = (i + 1) & mask) {
+        if (slots[i].hash != hash) {
+            continue;
+        }
+        if ((r = rec_header(db, rec)) == NULL) {
+            return -EIO;
+        }
+        memcpy(pattern, r->pattern, MDB_PATTERN);
+        size = r->size;
+        chunk = r->chunk;
+        if (key_equal(db, slots[i].rec, pattern, size, chunk)) {
+            slots[i].rec = rec;
+            return 0;
+        }
+    }
+    slots[i].hash = hash;
+    slots[i].rec = rec;
+
+    return 1;
+}
+
+int metadb_commit(struct metadb *db)
+{
+    struct mdb_slot *slots;
+    struct mdb_footer foot;
+    struct mdb_header h;
+    uint64_t n, i, mask;
+    int res = 0;
+
+    if (!db->writable) {
+        return -EBADF;
+    }
+    if (db->nadded == 0) {
+        return 0;
+    }
+
+    /* at most half full, so probes stay short */
+    n = db->foot.count + db->nadded;
+    for (foot.slots = 16; foot.slots < 2 * n; foot.slots *= 2);
+    if ((slots = calloc(foot.slots, sizeof(*slots))) == NULL) {
+        return -ENOMEM;
+    }
+    mask = foot.slots - 1;
+    foot.count = 0;
+    for (i = 0; db->slots != NULL && i < db->foot.slots && res >= 0; i++) {
+        if (db->slots[i].rec != 0) {
+            res = index_insert(db, slots, mask, db->slots[i].hash,
+                               db->slots[i].rec);
+            foot.count += (res > 0);
+        }
+    }
+    for (i = 0; i < db->nadded && res >= 0; i++) {
+        res = index_insert(db, slots, mask, db->added[i].hash,
+                           db->added[i].rec);
+        foot.count += (res > 0);
+    }
+
+    memcpy(foot.magic, MDB_IDX_MAGIC, sizeof(foot.magic));
+    foot.index = align_up(db->tail);
+    if (res >= 0) {
+        res = full_pwrite(db->fd, slots, foot.slots * sizeof(*slots),
+                          foot.index);
+    }
+    free(slots);
+    if (res >= 0) {
+        res = full_pwrite(db->fd, &foot, sizeof(foot),
+                          foot.index + foot.slots * sizeof(*slots));
+    }
+    if (res >= 0 && fdatasync(db->fd) == -1) {
+        res = -errno;
+    }
+    if (res < 0) {
+        return res; /* the header still points to the last commit */
+    }
+
+    /* the commit point */
+    memset(&h, 0, sizeof(h));
+    strcpy(h.magic, MDB_MAGIC);
+    h.end = foot.index + foot.slots * sizeof(*slots) + sizeof(foot);
+    if ((res = full_pwrite(db->fd, &h, sizeof(h), 0)) != 0) {
+        return res;
+    }
+    if (fdatasync(db->fd) == -1) {
+        return -errno;
+    }
+
+    if (db->map != NULL) {
+        munmap(db->map, db->maplen);
+        db->map = NULL;
+        db->slots = NULL;
+    }
+    db->foot = foot;
+    db->end = db->tail = h.end;
+    db->nadded = 0;
+
+    return map_index(db);
+}
+
+int metadb_compact(const char *src, const char *dst)
+{
+    struct metadb *s, *d;
+    const struct mdb_rec *r;
+    uint64_t pos = 0, hash;
+    int64_t rec;
+    char *buf;
+    int fd, res = 0;
+
+    if ((fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   0644)) == -1) {
+        return -errno;
+    }
+    close(fd);
+    if ((s = metadb_open(src, 0)) == NULL) {
+        return -errno;
+    }
+    if ((d = metadb_open(dst, 1)) == NULL) {
+        res = -errno;
+        metadb_close(s);
+        return res;
+    }
+
+    /* records don't point outside themselves, they are copied as they are */
+    while (res == 0 && (rec = metadb_next(s, &pos)) > 0) {
+        if ((r = rec_header(s, rec)) == NULL) {
+            res = -EIO;
+            break;
+        }
+        hash = key_hash(r->pattern, r->size, r->chunk);
+        if ((buf = malloc(r->len)) == NULL) {
+            res = -ENOMEM;
+            break;
+        }
+        res = full_pread(s->fd, buf, r->len, rec);
+        if (res == 0) {
+            res = full_pwrite(d->fd, buf, r->len, d->tail);
+        }
+        if (res == 0) {
+            res = add_slot(d, hash, d->tail);
+        }
+        if (res == 0) {
+            d->tail += r->len;
+        }
+        free(buf);
+    }
+    if (res == 0) {
+        res = metadb_commit(d);
+    }
+
+    metadb_close(s);
+    metadb_close(d);
+    return res;
+}
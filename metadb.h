@@ -0,0 +1,95 @@
+/*
+ * Indexed container of precomputed swift metadata, see tools/metadb.py.
+ *
+ * For every key (pattern, size, chunk size) the file holds a few blobs, the
+ * contents of the meta files of that content: .mbinmap and .mhash. Blobs are
+ * compressed in independent frames (zlib, MDB_FRAME bytes each before
+ * compression), so a range of a blob is read by inflating only the frames it
+ * covers. An open addressing hash table of the keys finds a record with one
+ * probe on average, whatever the size of the database.
+ *
+ * Layout, integers in host order (little-endian):
+ *
+ *     header   magic, end of the last commit
+ *     records  appended by every commit
+ *     index    hash table of (key hash, record offset), written by a commit
+ *     footer   where the index is, ends the commit
+ *
+ * A commit appends its records, then a new index of all keys (the latest
+ * record of a key wins) and its footer, and only then moves the end in the
+ * header, so a crash loses the uncommitted records but never the database.
+ * Superseded records and indexes stay until metadb_compact().
+ *
+ * Functions returning int return 0 or a count, or -errno.
+ */
+
+#ifndef LFS_METADB_H
+#define LFS_METADB_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MDB_PATTERN 8       /* hex digits of a key's pattern */
+#define MDB_MAXBLOBS 4      /* per record */
+#define MDB_FRAME 65536     /* uncompressed bytes per frame */
+
+struct metadb;
+
+/*
+ * Opens the database at path. With writable, creates it if missing and
+ * drops what a crash left after the last commit. Returns NULL with errno set
+ * on failure (EINVAL: not a database).
+ */
+struct metadb *metadb_open(const char *path, int writable);
+
+/* Closes db. Additions not committed are lost. */
+void metadb_close(struct metadb *db);
+
+/* Keys in the last commit. */
+int64_t metadb_count(struct metadb *db);
+
+/*
+ * Record of the key, committed or added since, as an opaque handle for the
+ * functions below. Returns -ENOENT if there is none.
+ */
+int64_t metadb_find(struct metadb *db, const char *pattern, uint64_t size,
+    uint32_t chunk);
+
+/* Uncompressed size of blob of the record, or -errno. */
+int64_t metadb_blob_size(struct metadb *db, int64_t rec, unsigned blob);
+
+/*
+ * Reads up to len bytes of blob at off into buf, inflating only the frames
+ * needed. Returns the bytes read, 0 past the end, or -errno.
+ */
+int64_t metadb_read(struct metadb *db, int64_t rec, unsigned blob, void *buf,
+    uint64_t len, uint64_t off);
+
+/* Key of the record: pattern (MDB_PATTERN + 1 bytes), size and chunk. */
+int metadb_key(struct metadb *db, int64_t rec, char *pattern, uint64_t *size,
+    uint32_t *chunk);
+
+/*
+ * Iterates over the committed records: start with *pos = 0, every call
+ * returns the next record, or -ENOENT at the end.
+ */
+int64_t metadb_next(struct metadb *db, uint64_t *pos);
+
+/*
+ * Adds (or replaces) the blobs of a key, appended and visible to
+ * metadb_find() right away, durable after metadb_commit().
+ */
+int metadb_add(struct metadb *db, const char *pattern, uint64_t size,
+    uint32_t chunk, unsigned nblobs, const void *const *blobs,
+    const uint64_t *sizes);
+
+/* Makes the additions durable. */
+int metadb_commit(struct metadb *db);
+
+/*
+ * Writes a copy of the database at src to dst with only the live records and
+ * a single index, offline: nothing else may write src meanwhile.
+ */
+int metadb_compact(const char *src, const char *dst);
+
+#endif /* LFS_METADB_H */
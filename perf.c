@@ -0,0 +1,254 @@
+/*
+ * Hardware counter self-profiling. See perf.h.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "perf.h"
+
+#define L_ADD(p, n) __atomic_fetch_add(p, n, __ATOMIC_RELAXED)
+#define L_LOAD(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+    const char *name;
+} events[PERF_COUNTERS] = {
+    [PERF_CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,
+        "cycles" },
+    [PERF_INSTRUCTIONS] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,
+        "instructions" },
+    [PERF_L1D_MISSES] = { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), "l1d_misses" },
+    [PERF_LLC_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,
+        "llc_misses" },
+    [PERF_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES,
+        "branch_misses" },
+};
+
+/* Counters of a thread, the first one leads the group. */
+struct perf_thread {
+    int state; /* 0 not opened yet, 1 open, -errno if they can't be */
+    int fd[PERF_COUNTERS];
+    struct perf_event_mmap_page *page[PERF_COUNTERS];
+    unsigned nopen;
+    int slot[PERF_COUNTERS]; /* counter of the i-th value of a group read */
+};
+
+static __thread struct perf_thread pt;
+static pthread_key_t pt_key;
+static pthread_once_t pt_once = PTHREAD_ONCE_INIT;
+
+static void thread_close(void *arg)
+{
+    struct perf_thread *t = arg;
+    unsigned i;
+
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        if (t->page[i] != NULL) {
+            munmap(t->page[i], sysconf(_SC_PAGESIZE));
+        }
+        if (t->fd[i] != -1) {
+            close(t->fd[i]);
+        }
+    }
+    t->state = 0;
+}
+
+static void key_create(void)
+{
+    pthread_key_create(&pt_key, thread_close);
+}
+
+static int event_open(unsigned c, int group, int user_only)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[c].type;
+    attr.config = events[c].config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = user_only;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static int thread_open(struct perf_thread *t)
+{
+    int user_only = 0;
+    unsigned i;
+
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        t->fd[i] = -1;
+        t->page[i] = NULL;
+    }
+    /* kernel time too if perf_event_paranoid allows */
+    if ((t->fd[0] = event_open(0, -1, 0)) == -1) {
+        user_only = 1;
+        if ((t->fd[0] = event_open(0, -1, 1)) == -1) {
+            return -errno;
+        }
+    }
+    t->slot[0] = 0;
+    t->nopen = 1;
+    for (i = 1; i < PERF_COUNTERS; i++) {
+        /* missing ones, e.g. in VMs, stay 0 */
+        if ((t->fd[i] = event_open(i, t->fd[0], user_only)) != -1) {
+            t->slot[t->nopen++] = i;
+        }
+    }
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        if (t->fd[i] != -1) {
+            t->page[i] = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ,
+                MAP_SHARED, t->fd[i], 0);
+            if (t->page[i] == MAP_FAILED) {
+                t->page[i] = NULL;
+            }
+        }
+    }
+
+    pthread_once(&pt_once, key_create);
+    pthread_setspecific(pt_key, t);
+
+    return 1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * User space read of an event running on this CPU, see the comments of
+ * struct perf_event_mmap_page. Returns -1 if it can't be read that way.
+ */
+static int page_read(struct perf_event_mmap_page *pc, uint64_t *v)
+{
+    uint32_t seq, idx, lo, hi;
+    int64_t pmc;
+    uint64_t count;
+
+    do {
+        seq = pc->lock;
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        idx = pc->index;
+        if (!pc->cap_user_rdpmc || idx == 0) {
+            return -1;
+        }
+        count = pc->offset;
+        __asm__ volatile("rdpmc" : "=a" (lo), "=d" (hi) : "c" (idx - 1));
+        pmc = (int64_t)((uint64_t)hi << 32 | lo) << (64 - pc->pmc_width);
+        count += pmc >> (64 - pc->pmc_width);
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    } while (pc->lock != seq);
+
+    *v = count;
+    return 0;
+}
+#else
+static int page_read(struct perf_event_mmap_page *pc, uint64_t *v)
+{
+    return -1;
+}
+#endif
+
+int perf_check(void)
+{
+    if (pt.state == 0) {
+        pt.state = thread_open(&pt);
+    }
+
+    return pt.state < 0 ? pt.state : 0;
+}
+
+int perf_read(uint64_t *v)
+{
+    uint64_t buf[1 + PERF_COUNTERS];
+    unsigned i;
+
+    if (pt.state == 0) {
+        pt.state = thread_open(&pt);
+    }
+    if (pt.state < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        v[i] = 0;
+        if (pt.fd[i] != -1 && (pt.page[i] == NULL ||
+                               page_read(pt.page[i], &v[i]) != 0)) {
+            break;
+        }
+    }
+    if (i == PERF_COUNTERS) {
+        return 0;
+    }
+
+    /* some counter isn't on the PMU right now, ask the kernel */
+    if (read(pt.fd[0], buf, sizeof(buf)) < (ssize_t)sizeof(uint64_t)) {
+        return -1;
+    }
+    memset(v, 0, PERF_COUNTERS * sizeof(*v));
+    for (i = 0; i < buf[0] && i < pt.nopen; i++) {
+        v[pt.slot[i]] = buf[1 + i];
+    }
+
+    return 0;
+}
+
+void perf_add(struct perf_scope *s)
+{
+    uint64_t end[PERF_COUNTERS];
+    unsigned i;
+
+    if (perf_read(end) != 0) {
+        return;
+    }
+    L_ADD(&s->slot->calls, 1);
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        L_ADD(&s->slot->counts[i], end[i] - s->start[i]);
+    }
+}
+
+void perf_reset(struct perf_slot *slots, unsigned n)
+{
+    unsigned i, c;
+
+    for (i = 0; i < n; i++) {
+        __atomic_store_n(&slots[i].calls, 0, __ATOMIC_RELAXED);
+        for (c = 0; c < PERF_COUNTERS; c++) {
+            __atomic_store_n(&slots[i].counts[c], 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+int perf_json(struct stats_buf *b, const char *const *names,
+    const struct perf_slot *slots, unsigned n)
+{
+    unsigned long calls, cycles;
+    unsigned i, c, nused = 0;
+    int r = stats_printf(b, "{");
+
+    for (i = 0; i < n && r == 0; i++) {
+        if ((calls = L_LOAD(&slots[i].calls)) == 0) {
+            continue;
+        }
+        r = stats_printf(b, "%s\n    \"%s\": {\"calls\": %lu", nused++ ? "," :
+            "", names[i], calls);
+        for (c = 0; c < PERF_COUNTERS && r == 0; c++) {
+            r = stats_printf(b, ", \"%s\": %lu", events[c].name,
+                L_LOAD(&slots[i].counts[c]));
+        }
+        cycles = L_LOAD(&slots[i].counts[PERF_CYCLES]);
+        r |= stats_printf(b, ", \"ipc\": %.2f}", cycles ? (double)
+            L_LOAD(&slots[i].counts[PERF_INSTRUCTIONS]) / cycles : 0.0);
+    }
+
+    return r ? -1 : stats_printf(b, "\n  }");
+}
@@ -0,0 +1,81 @@
+/*
+ * Hardware counter self-profiling, opt-in (-o perf).
+ *
+ * Every thread that runs a profiled scope opens its own group of counters
+ * with perf_event_open(): cycles, instructions, L1 data cache read misses,
+ * last level cache misses and branch misses, of user and kernel time where
+ * perf_event_paranoid allows it and of user time only otherwise. A scope
+ * reads them when it starts and adds the difference to its slot when it
+ * ends. LFS has a slot per FUSE operation and one per internal phase, and
+ * phases run inside operations, so an operation's counts include those of
+ * its phases.
+ *
+ * Counters are read with rdpmc from each event's mmapped page where the
+ * kernel allows it (x86), with a single read() of the group otherwise.
+ * Counters a CPU doesn't have stay 0. Slots are updated with relaxed
+ * atomics, like stats.h.
+ */
+
+#ifndef LFS_PERF_H
+#define LFS_PERF_H
+
+#include <stdint.h>
+
+#include "stats.h"
+
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_COUNTERS
+};
+
+struct perf_slot {
+    unsigned long calls;
+    unsigned long counts[PERF_COUNTERS];
+};
+
+struct perf_scope {
+    struct perf_slot *slot; /* NULL when not profiling */
+    uint64_t start[PERF_COUNTERS];
+};
+
+/*
+ * Opens the counters of the calling thread, to find out early whether
+ * profiling works here. Returns 0, or -errno.
+ */
+int perf_check(void);
+
+/* Reads the counters of the calling thread. Returns 0, or -1. */
+int perf_read(uint64_t *v);
+
+/* Starts a scope counting for slot, nothing if slot is NULL. */
+static inline void perf_begin(struct perf_scope *s, struct perf_slot *slot)
+{
+    s->slot = (slot != NULL && perf_read(s->start) == 0) ? slot : NULL;
+}
+
+/* Adds the counts of a scope to its slot. */
+void perf_add(struct perf_scope *s);
+
+/* Ends a scope. Takes a pointer, so it can be a cleanup attribute. */
+static inline void perf_end(struct perf_scope *s)
+{
+    if (s->slot != NULL) {
+        perf_add(s);
+    }
+}
+
+/* Zeroes n slots, scopes ending meanwhile may count in either period. */
+void perf_reset(struct perf_slot *slots, unsigned n);
+
+/*
+ * Writes the slots used as a JSON object, names[i] the key of slots[i], see
+ * stats_section().
+ */
+int perf_json(struct stats_buf *b, const char *const *names,
+    const struct perf_slot *slots, unsigned n);
+
+#endif /* LFS_PERF_H */
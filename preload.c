@@ -0,0 +1,656 @@
+/*
+ * LD_PRELOAD shim serving LFS files in-process, without FUSE.
+ *
+ * Paths in the LFS_PREFIX directory behave as in a mounted LFS (see
+ * content.h), with the storage classes of LFS_CLASSES (same syntax as the
+ * classes= mount option): meta files are opened in LFS_REALSTORE instead
+ * (ram class ones in LFS_RAMSTORE, if set), data files get a placeholder fd
+ * (on /dev/null) whose reads are generated and whose writes only change the
+ * size. Every other path and fd goes to libc untouched.
+ *
+ * Only open, read, pread, write, pwrite, lseek, fstat and close (and their 64
+ * bit and fortified variants) know about data files, so a data fd handed to
+ * anything else (mmap, dup, sendfile...) behaves like /dev/null. Relative
+ * paths, and a relative prefix, are made absolute with the current directory
+ * and then matched literally.
+ *
+ * Data files live as long as the process, like they live as long as the
+ * mount in LFS. Opening one that doesn't exist creates it when O_CREAT is
+ * given, or when the name tells the size (deadbeef_128gb_8192).
+ *
+ * Usage: LFS_PREFIX=/path/to/store LFS_REALSTORE=/path/to/real \
+ *        LD_PRELOAD=./liblfs_preload.so swift ...
+ */
+
+#define _GNU_SOURCE /* RTLD_NEXT, off64_t */
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "uthash.h"
+#include "content.h"
+
+#define MAXFDS (1 << 20) /* cap on the fd table, whatever RLIMIT_NOFILE says */
+
+#ifndef _STAT_VER
+#define _STAT_VER 1 /* x86_64, only needed before glibc 2.33 */
+#endif
+
+struct p_file {
+    char name[NAME_MAX + 1];
+    off_t size;
+    char pattern[4];
+    struct timespec mtime;
+    UT_hash_handle hh;
+};
+
+/* An open data file. */
+struct p_fd {
+    struct p_file *file;
+    off_t pos;
+    int flags;
+};
+
+static struct {
+    char prefix[PATH_MAX];    /* no trailing slash, empty when disabled */
+    size_t prefix_len;
+    char realstore[PATH_MAX];
+    char ramstore[PATH_MAX];  /* realstore if not set */
+    struct class_rules classes;
+    struct p_file *files;     /* by name */
+    struct p_fd **fds;        /* by fd, NULL for fds we don't serve */
+    unsigned nfds;
+    pthread_mutex_t lock;     /* protects all of the above after init */
+
+    int (*open)(const char *, int, ...);
+    int (*open64)(const char *, int, ...);
+    ssize_t (*read)(int, void *, size_t);
+    ssize_t (*pread)(int, void *, size_t, off_t);
+    ssize_t (*pread64)(int, void *, size_t, off64_t);
+    ssize_t (*write)(int, const void *, size_t);
+    ssize_t (*pwrite)(int, const void *, size_t, off_t);
+    ssize_t (*pwrite64)(int, const void *, size_t, off64_t);
+    off_t (*lseek)(int, off_t, int);
+    off64_t (*lseek64)(int, off64_t, int);
+    int (*fstat)(int, struct stat *);
+    int (*fstat64)(int, struct stat64 *);
+    int (*fxstat)(int, int, struct stat *);
+    int (*fxstat64)(int, int, struct stat64 *);
+    int (*close)(int);
+} p;
+
+static pthread_once_t p_once = PTHREAD_ONCE_INIT;
+
+/* Returns path, or path made absolute in buf. NULL if it doesn't fit. */
+static const char *abs_path(const char *path, char *buf, size_t size)
+{
+    if (path[0] == '/') {
+        return path;
+    }
+
+    while (path[0] == '.' && path[1] == '/') {
+        path += 2;
+    }
+    if (getcwd(buf, size) == NULL ||
+        strlen(buf) + 1 + strlen(path) >= size) {
+        return NULL;
+    }
+    strcat(buf, "/");
+    strcat(buf, path);
+
+    return buf;
+}
+
+static void p_init(void)
+{
+    const char *prefix = getenv("LFS_PREFIX");
+    const char *realstore = getenv("LFS_REALSTORE");
+    const char *ramstore = getenv("LFS_RAMSTORE");
+    char buf[PATH_MAX];
+    struct rlimit rl;
+
+    p.open = dlsym(RTLD_NEXT, "open");
+    p.open64 = dlsym(RTLD_NEXT, "open64");
+    p.read = dlsym(RTLD_NEXT, "read");
+    p.pread = dlsym(RTLD_NEXT, "pread");
+    p.pread64 = dlsym(RTLD_NEXT, "pread64");
+    p.write = dlsym(RTLD_NEXT, "write");
+    p.pwrite = dlsym(RTLD_NEXT, "pwrite");
+    p.pwrite64 = dlsym(RTLD_NEXT, "pwrite64");
+    p.lseek = dlsym(RTLD_NEXT, "lseek");
+    p.lseek64 = dlsym(RTLD_NEXT, "lseek64");
+    p.fstat = dlsym(RTLD_NEXT, "fstat");     /* glibc 2.33 and later */
+    p.fstat64 = dlsym(RTLD_NEXT, "fstat64");
+    p.fxstat = dlsym(RTLD_NEXT, "__fxstat"); /* before that */
+    p.fxstat64 = dlsym(RTLD_NEXT, "__fxstat64");
+    p.close = dlsym(RTLD_NEXT, "close");
+    pthread_mutex_init(&p.lock, NULL);
+
+    if (prefix == NULL || (prefix = abs_path(prefix, buf, sizeof(buf))) ==
+        NULL) {
+        return;
+    }
+    if (realstore == NULL || strlen(realstore) >= sizeof(p.realstore)) {
+        fprintf(stderr, "lfs preload: LFS_REALSTORE not set, disabled\n");
+        return;
+    }
+
+    if (ramstore == NULL) {
+        ramstore = realstore;
+    }
+    if (strlen(ramstore) >= sizeof(p.ramstore) ||
+        classes_parse(&p.classes, getenv("LFS_CLASSES")) != 0) {
+        fprintf(stderr, "lfs preload: bad LFS_RAMSTORE or LFS_CLASSES, "
+                "disabled\n");
+        return;
+    }
+
+    p.nfds = MAXFDS;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < MAXFDS) {
+        p.nfds = rl.rlim_cur;
+    }
+    if ((p.fds = calloc(p.nfds, sizeof(*p.fds))) == NULL) {
+        return;
+    }
+
+    strcpy(p.prefix, prefix);
+    strcpy(p.realstore, realstore);
+    strcpy(p.ramstore, ramstore);
+    p.prefix_len = strlen(p.prefix);
+    while (p.prefix_len > 1 && p.prefix[p.prefix_len - 1] == '/') {
+        p.prefix[--p.prefix_len] = 0;
+    }
+}
+
+/*
+ * Returns the LFS file name of path (pointing into buf or path), or NULL if
+ * path is not in the prefix directory.
+ */
+static const char *lfs_name(const char *path, char *buf, size_t size)
+{
+    const char *name;
+
+    pthread_once(&p_once, p_init);
+    if (p.prefix_len == 0 || path == NULL) {
+        return NULL;
+    }
+
+    if ((path = abs_path(path, buf, size)) == NULL) {
+        return NULL;
+    }
+    if (strncmp(path, p.prefix, p.prefix_len) != 0 ||
+        path[p.prefix_len] != '/') {
+        return NULL;
+    }
+    for (name = path + p.prefix_len; *name == '/'; name++) {
+    }
+    if (*name == 0 || strchr(name, '/') != NULL) {
+        return NULL; /* the directory itself, or a subdirectory */
+    }
+
+    return name;
+}
+
+/*
+ * Size of a data file from its name, deadbeef_size_chunksize, where size may
+ * end in kb, mb, gb or tb (binary). Returns -1 if there is none.
+ */
+static off_t name_size(const char *name)
+{
+    static const char units[] = "kmgt";
+    unsigned long long size;
+    const char *u;
+    char *end;
+
+    if (strlen(name) < 10 || name[8] != '_') {
+        return -1;
+    }
+    size = strtoull(name + 9, &end, 10);
+    if (end == name + 9) {
+        return -1;
+    }
+    if (*end != 0 && (u = strchr(units, *end | 0x20)) != NULL &&
+        (end[1] | 0x20) == 'b') {
+        size <<= 10 * (u - units + 1);
+        end += 2;
+    }
+
+    return (*end == 0 || *end == '_') ? (off_t)size : -1;
+}
+
+static struct p_fd *vfd(int fd)
+{
+    pthread_once(&p_once, p_init);
+    if (fd < 0 || (unsigned)fd >= p.nfds) {
+        return NULL;
+    }
+
+    return __atomic_load_n(&p.fds[fd], __ATOMIC_ACQUIRE);
+}
+
+static int data_open(const char *name, int flags, int cls)
+{
+    struct p_file *file;
+    struct p_fd *f;
+    off_t size;
+    int fd;
+
+    if (strlen(name) > NAME_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((f = calloc(1, sizeof(*f))) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pthread_mutex_lock(&p.lock);
+    HASH_FIND_STR(p.files, name, file);
+    if (file != NULL && (flags & O_CREAT) && (flags & O_EXCL)) {
+        errno = EEXIST;
+        goto err;
+    }
+    if (file == NULL) {
+        size = name_size(name);
+        if (!(flags & O_CREAT) && size < 0) {
+            errno = ENOENT;
+            goto err;
+        }
+        if ((file = calloc(1, sizeof(*file))) == NULL) {
+            errno = ENOMEM;
+            goto err;
+        }
+        strcpy(file->name, name);
+        file->size = (size < 0 || (flags & O_CREAT)) ? 0 : size;
+        if (cls == CLASS_GENERATED) {
+            name_pattern(name, file->pattern);
+        } /* discarded files read as zeros */
+        clock_gettime(CLOCK_REALTIME, &file->mtime);
+        HASH_ADD_STR(p.files, name, file);
+    }
+    if ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY) {
+        file->size = 0;
+        clock_gettime(CLOCK_REALTIME, &file->mtime);
+    }
+
+    /* a real fd, so numbers stay unique and unknown calls are harmless */
+    if ((fd = p.open("/dev/null", O_RDWR | (flags & O_CLOEXEC))) == -1) {
+        goto err;
+    }
+    if ((unsigned)fd >= p.nfds) {
+        p.close(fd);
+        errno = EMFILE;
+        goto err;
+    }
+    f->file = file;
+    f->flags = flags;
+    __atomic_store_n(&p.fds[fd], f, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&p.lock);
+
+    return fd;
+
+err:
+    pthread_mutex_unlock(&p.lock);
+    free(f);
+    return -1;
+}
+
+static int p_open(int (*real)(const char *, int, ...), const char *path,
+    int flags, mode_t mode)
+{
+    char buf[PATH_MAX], meta[PATH_MAX];
+    const char *name = lfs_name(path, buf, sizeof(buf));
+    int cls;
+
+    if (name == NULL) {
+        return real(path, flags, mode);
+    }
+    cls = class_of(&p.classes, name);
+    if (!class_stored(cls)) {
+        return data_open(name, flags, cls);
+    }
+
+    /* delegate to the real fs, the fd is then libc's */
+    if (snprintf(meta, sizeof(meta), "%s/%s",
+                 cls == CLASS_RAM ? p.ramstore : p.realstore, name) >=
+        (int)sizeof(meta)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return real(meta, flags, mode);
+}
+
+static mode_t open_mode(int flags, va_list ap)
+{
+    return (flags & (O_CREAT | O_TMPFILE)) ? va_arg(ap, mode_t) : 0;
+}
+
+int open(const char *path, int flags, ...)
+{
+    va_list ap;
+    mode_t mode;
+
+    va_start(ap, flags);
+    mode = open_mode(flags, ap);
+    va_end(ap);
+    pthread_once(&p_once, p_init);
+
+    return p_open(p.open, path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...)
+{
+    va_list ap;
+    mode_t mode;
+
+    va_start(ap, flags);
+    mode = open_mode(flags, ap);
+    va_end(ap);
+    pthread_once(&p_once, p_init);
+
+    return p_open(p.open64, path, flags, mode);
+}
+
+/* Reads count bytes at pos. Returns bytes read, or -1 with errno set. */
+static ssize_t data_read(struct p_fd *f, void *buf, size_t count, off_t pos)
+{
+    off_t size;
+    size_t r;
+
+    if ((f->flags & O_ACCMODE) == O_WRONLY) {
+        errno = EBADF;
+        return -1;
+    }
+    if (pos < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&p.lock);
+    size = f->file->size;
+    pthread_mutex_unlock(&p.lock);
+
+    /* the pattern never changes, so no need to hold the lock */
+    r = (pos >= size) ? 0 : (size - pos < count ? size - pos : count);
+    fill_pattern(buf, r, f->file->pattern, pos);
+
+    return r;
+}
+
+/* Writes are discarded, only the size changes. Lock must be held. */
+static ssize_t data_write(struct p_fd *f, size_t count, off_t pos)
+{
+    struct p_file *file = f->file;
+
+    if ((f->flags & O_ACCMODE) == O_RDONLY) {
+        errno = EBADF;
+        return -1;
+    }
+    if (pos < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (file->size < pos + (off_t)count) {
+        file->size = pos + count;
+    }
+    clock_gettime(CLOCK_REALTIME, &file->mtime);
+
+    return count;
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+    struct p_fd *f = vfd(fd);
+    off_t pos, size;
+
+    if (f == NULL) {
+        return p.read(fd, buf, count);
+    }
+
+    /* claim the range first, concurrent reads of one fd get distinct ones */
+    pthread_mutex_lock(&p.lock);
+    pos = f->pos;
+    size = f->file->size;
+    if ((f->flags & O_ACCMODE) != O_WRONLY && pos < size) {
+        f->pos += (size - pos < (off_t)count) ? size - pos : (off_t)count;
+    }
+    pthread_mutex_unlock(&p.lock);
+
+    return data_read(f, buf, count, pos);
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+{
+    struct p_fd *f = vfd(fd);
+
+    return f ? data_read(f, buf, count, offset) :
+        p.pread(fd, buf, count, offset);
+}
+
+ssize_t pread64(int fd, void *buf, size_t count, off64_t offset)
+{
+    struct p_fd *f = vfd(fd);
+
+    return f ? data_read(f, buf, count, offset) :
+        p.pread64(fd, buf, count, offset);
+}
+
+/*
+ * What _FORTIFY_SOURCE builds call when the buffer size is known. libc's own
+ * would go to its read directly, bypassing the ones above.
+ */
+extern void __chk_fail(void) __attribute__((noreturn));
+
+ssize_t __read_chk(int fd, void *buf, size_t count, size_t buflen)
+{
+    if (count > buflen) {
+        __chk_fail();
+    }
+    return read(fd, buf, count);
+}
+
+ssize_t __pread_chk(int fd, void *buf, size_t count, off_t offset,
+                    size_t buflen)
+{
+    if (count > buflen) {
+        __chk_fail();
+    }
+    return pread(fd, buf, count, offset);
+}
+
+ssize_t __pread64_chk(int fd, void *buf, size_t count, off64_t offset,
+                      size_t buflen)
+{
+    if (count > buflen) {
+        __chk_fail();
+    }
+    return pread64(fd, buf, count, offset);
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+    struct p_fd *f = vfd(fd);
+    ssize_t r;
+
+    if (f == NULL) {
+        return p.write(fd, buf, count);
+    }
+
+    pthread_mutex_lock(&p.lock);
+    if (f->flags & O_APPEND) {
+        f->pos = f->file->size;
+    }
+    if ((r = data_write(f, count, f->pos)) > 0) {
+        f->pos += r;
+    }
+    pthread_mutex_unlock(&p.lock);
+
+    return r;
+}
+
+static ssize_t p_pwrite(struct p_fd *f, size_t count, off_t offset)
+{
+    ssize_t r;
+
+    pthread_mutex_lock(&p.lock);
+    r = data_write(f, count, offset);
+    pthread_mutex_unlock(&p.lock);
+
+    return r;
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+    struct p_fd *f = vfd(fd);
+
+    return f ? p_pwrite(f, count, offset) : p.pwrite(fd, buf, count, offset);
+}
+
+ssize_t pwrite64(int fd, const void *buf, size_t count, off64_t offset)
+{
+    struct p_fd *f = vfd(fd);
+
+    return f ? p_pwrite(f, count, offset) :
+        p.pwrite64(fd, buf, count, offset);
+}
+
+/* Data files have no holes, like in LFS without fallocate. */
+static off_t p_lseek(struct p_fd *f, off_t offset, int whence)
+{
+    off_t pos = -1;
+
+    pthread_mutex_lock(&p.lock);
+    switch (whence) {
+        case SEEK_SET:
+            pos = offset;
+            break;
+        case SEEK_CUR:
+            pos = f->pos + offset;
+            break;
+        case SEEK_END:
+            pos = f->file->size + offset;
+            break;
+        case SEEK_DATA:
+        case SEEK_HOLE:
+            if (offset >= f->file->size) {
+                pthread_mutex_unlock(&p.lock);
+                errno = ENXIO;
+                return -1;
+            }
+            pos = (whence == SEEK_DATA) ? offset : f->file->size;
+            break;
+    }
+    if (pos < 0) {
+        pthread_mutex_unlock(&p.lock);
+        errno = EINVAL;
+        return -1;
+    }
+    f->pos = pos;
+    pthread_mutex_unlock(&p.lock);
+
+    return pos;
+}
+
+off_t lseek(int fd, off_t offset, int whence)
+{
+    struct p_fd *f = vfd(fd);
+
+    return f ? p_lseek(f, offset, whence) : p.lseek(fd, offset, whence);
+}
+
+off64_t lseek64(int fd, off64_t offset, int whence)
+{
+    struct p_fd *f = vfd(fd);
+
+    return f ? p_lseek(f, offset, whence) : p.lseek64(fd, offset, whence);
+}
+
+static void data_stat(struct p_fd *f, struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_ino = (uintptr_t)f->file;
+    stbuf->st_mode = S_IFREG | 0666;
+    stbuf->st_nlink = 1;
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    stbuf->st_blksize = 4096;
+
+    pthread_mutex_lock(&p.lock);
+    stbuf->st_size = f->file->size;
+    stbuf->st_atim = stbuf->st_mtim = stbuf->st_ctim = f->file->mtime;
+    pthread_mutex_unlock(&p.lock);
+    stbuf->st_blocks = stbuf->st_size / 512;
+}
+
+/* struct stat64 is struct stat on 64 bit, and LFS needs 64 bit offsets */
+int fstat(int fd, struct stat *stbuf)
+{
+    struct p_fd *f = vfd(fd);
+
+    if (f == NULL) {
+        return p.fstat ? p.fstat(fd, stbuf) : p.fxstat(_STAT_VER, fd, stbuf);
+    }
+    data_stat(f, stbuf);
+    return 0;
+}
+
+int fstat64(int fd, struct stat64 *stbuf)
+{
+    struct p_fd *f = vfd(fd);
+
+    if (f == NULL) {
+        return p.fstat64 ? p.fstat64(fd, stbuf) :
+            p.fxstat64(_STAT_VER, fd, stbuf);
+    }
+    data_stat(f, (struct stat *)stbuf);
+    return 0;
+}
+
+int __fxstat(int ver, int fd, struct stat *stbuf)
+{
+    struct p_fd *f = vfd(fd);
+
+    if (f == NULL) {
+        return p.fxstat(ver, fd, stbuf);
+    }
+    data_stat(f, stbuf);
+    return 0;
+}
+
+int __fxstat64(int ver, int fd, struct stat64 *stbuf)
+{
+    struct p_fd *f = vfd(fd);
+
+    if (f == NULL) {
+        return p.fxstat64(ver, fd, stbuf);
+    }
+    data_stat(f, (struct stat *)stbuf);
+    return 0;
+}
+
+int close(int fd)
+{
+    struct p_fd *f = vfd(fd);
+
+    if (f != NULL) {
+        pthread_mutex_lock(&p.lock);
+        __atomic_store_n(&p.fds[fd], NULL, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&p.lock);
+        free(f);
+    }
+
+    return p.close(fd);
+}
@@ -0,0 +1,49 @@
+/*
+ * USDT static probes of LFS, provider "lfs".
+ *
+ * With <sys/sdt.h> (systemtap-sdt-dev) every probe is a single NOP plus an ELF
+ * note, so they stay in production builds and cost nothing until a tracer
+ * attaches. Without it they compile to nothing.
+ *
+ * Every FUSE handler fires op_<name>(req, ino, name, offset, size) on entry
+ * and every reply fires reply(req, result), wherever it is sent from (the
+ * I/O engine, the device wheel, group commit), so the pair gives the full
+ * request latency. ino is the parent for name based ops, name may be NULL.
+ *
+ * Internal decision points:
+ *
+ *     pattern_fill(ino, offset, size)        generated content served
+ *     meta_delegate(op, name, offset, size)  forwarded to realstore
+ *     hash_lookup(name, ino, hit)            file table lookup
+ *     file_create(name, ino)
+ *     file_rename(old, new, ino)
+ *     fd_open(name, fd, nfds)                meta fd cache miss
+ *     fd_close(name, fd, nfds)               meta fd cache eviction
+ *     tree_prefetch(name, mhash_ino, pages)  .mhash pages read ahead
+ *     commit(requests, files, latency_ns)    group commit done
+ *
+ * See stap/lfs_ops.stp and stap/lfs_ops.bt.
+ */
+
+#ifndef LFS_PROBES_H
+#define LFS_PROBES_H
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define L_PROBE2(n, a, b)             DTRACE_PROBE2(lfs, n, a, b)
+#define L_PROBE3(n, a, b, c)          DTRACE_PROBE3(lfs, n, a, b, c)
+#define L_PROBE4(n, a, b, c, d)       DTRACE_PROBE4(lfs, n, a, b, c, d)
+#define L_PROBE5(n, a, b, c, d, e)    DTRACE_PROBE5(lfs, n, a, b, c, d, e)
+#else
+#define L_PROBE2(n, a, b)             do { } while (0)
+#define L_PROBE3(n, a, b, c)          do { } while (0)
+#define L_PROBE4(n, a, b, c, d)       do { } while (0)
+#define L_PROBE5(n, a, b, c, d, e)    do { } while (0)
+#endif
+
+/* Handler entry. */
+#define L_OP(op, req, ino, name, off, size) \
+    L_PROBE5(op_##op, req, ino, name, (long long)(off), (long long)(size))
+
+#endif /* LFS_PROBES_H */
@@ -170,13 +170,22 @@ class ResourceMonitor(object):
 
 
 class ProcessMonitor(object):
-    def __init__(self, commands, timeout, interval, output_dir=None, monitor_dir=None):
+    def __init__(self, commands, timeout, interval, output_dir=None, monitor_dir=None, sampler=None):
         self.start_time = time()
         self.end_time = self.start_time + timeout if timeout else 0 # Do not time out if time_limit is 0.
         self._interval = interval
 
         self._rm = ResourceMonitor(output_dir, commands)
-        if monitor_dir:
+        self.sampler = None
+        if monitor_dir and sampler:
+            # experiment/sampler.c samples the whole group, we only watch the processes
+            self.sampler = subprocess.Popen([sampler, "-g", str(getpgrp()),
+                "-i", str(interval * 1000),
+                "-o", monitor_dir + "/resource_usage.log.parsed"], close_fds=True)
+            self._rm.ignore_pid_list.append(self.sampler.pid)
+            self._interval = max(interval, 1.0)
+            self.monitor_file = None
+        elif monitor_dir:
             self.monitor_file = open(monitor_dir + "/resource_usage.log", "w", (1024 ** 2) * 10)  # Set the file's buffering to 10MB
         else:
             self.monitor_file = None
@@ -188,6 +197,9 @@ class ProcessMonitor(object):
         self.stopping = True
         if self.monitor_file:
             self.monitor_file.close()
+        if self.sampler and self.sampler.poll() is None:
+            self.sampler.terminate()  # flushes its output
+            self.sampler.wait()
         self._rm.terminate()
 
     def _termTrap(self, *argv):
@@ -266,6 +278,10 @@ if __name__ == "__main__":
                       action ="store",
                       help   ="Sample monitoring stats and check processes/threads every FLOAT seconds"
                       )
+    parser.add_option("-s", "--sampler",
+                      metavar='SAMPLER',
+                      help   ="Sample resource usage with this native sampler (experiment/sampler.c) instead, every --interval seconds; it writes resource_usage.log.parsed in --monitor-dir."
+                      )
     (options, args) = parser.parse_args()
     if not (options.commands_file or options.commands):
         parser.error("Please specify at least one of --command or --commands-file (run with -h to see command usage).")
@@ -280,7 +296,7 @@ if __name__ == "__main__":
     if not commands:
         parser.error("Could not collect a list of commands to run.\nMake sure that the commands file is not empty or has all the lines commented out.")
 
-    pm = ProcessMonitor(commands,  options.timeout, options.interval, options.output_dir, options.monitor_dir)
+    pm = ProcessMonitor(commands,  options.timeout, options.interval, options.output_dir, options.monitor_dir, options.sampler)
     try:
         pm.monitoring_loop()
 
@@ -0,0 +1,242 @@
+/*
+ * Per-file access statistics. See stats.h.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "stats.h"
+
+#define L_ADD(p) __atomic_fetch_add(p, 1, __ATOMIC_RELAXED)
+#define L_LOAD(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define L_ZERO(p) __atomic_store_n(p, 0, __ATOMIC_RELAXED)
+
+static unsigned size_bucket(size_t size)
+{
+    unsigned b = 0;
+
+    while (b < STATS_SIZES - 1 && size > ((size_t)512 << b)) {
+        b++;
+    }
+
+    return b;
+}
+
+void stats_add(struct io_stats *s, int dir, off_t off, size_t size,
+    off_t fsize)
+{
+    off_t end = off + size, prev, scale;
+    unsigned b;
+
+    L_ADD(&s->sizes[dir][size_bucket(size)]);
+    __atomic_fetch_add(&s->bytes[dir], size, __ATOMIC_RELAXED);
+
+    if (__atomic_exchange_n(&s->next[dir], end, __ATOMIC_RELAXED) == off) {
+        L_ADD(&s->seq[dir]);
+    } else {
+        L_ADD(&s->random[dir]);
+    }
+
+    /* raise the high mark, without losing a concurrent raise */
+    prev = L_LOAD(&s->end);
+    while (end > prev && !__atomic_compare_exchange_n(&s->end, &prev, end, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    scale = (end > prev ? end : prev);
+    if (fsize > scale) {
+        scale = fsize;
+    }
+    b = (scale > 0) ? off * STATS_HEAT / scale : 0;
+    L_ADD(&s->heat[dir][b < STATS_HEAT ? b : STATS_HEAT - 1]);
+}
+
+void stats_mix(struct io_mix *m, int dir, int meta)
+{
+    int last = __atomic_exchange_n(&m->last[dir], 1 + meta, __ATOMIC_RELAXED);
+
+    if (last != 0) {
+        L_ADD(&m->trans[dir][last - 1][meta]);
+    }
+}
+
+static void zero(unsigned long *v, size_t n)
+{
+    while (n-- > 0) {
+        L_ZERO(v++);
+    }
+}
+
+void stats_reset(struct io_stats *s)
+{
+    int d;
+
+    for (d = 0; d < 2; d++) {
+        zero(s->sizes[d], STATS_SIZES);
+        zero(s->heat[d], STATS_HEAT);
+        L_ZERO(&s->seq[d]);
+        L_ZERO(&s->random[d]);
+        L_ZERO(&s->bytes[d]);
+        L_ZERO(&s->next[d]);
+    }
+    L_ZERO(&s->end);
+}
+
+void stats_mix_reset(struct io_mix *m)
+{
+    zero(&m->trans[0][0][0], 8);
+    L_ZERO(&m->last[STATS_READ]);
+    L_ZERO(&m->last[STATS_WRITE]);
+}
+
+int stats_used(const struct io_stats *s)
+{
+    return L_LOAD(&s->seq[STATS_READ]) + L_LOAD(&s->random[STATS_READ]) +
+        L_LOAD(&s->seq[STATS_WRITE]) + L_LOAD(&s->random[STATS_WRITE]) > 0;
+}
+
+static int buf_vprintf(struct stats_buf *b, const char *fmt, va_list ap)
+{
+    va_list aq;
+    char *newp;
+    int n;
+
+    for (;;) {
+        va_copy(aq, ap);
+        n = vsnprintf(b->data + b->len, b->size - b->len, fmt, aq);
+        va_end(aq);
+        if (n < 0) {
+            return -1;
+        }
+        if (b->len + n < b->size) {
+            b->len += n;
+            return 0;
+        }
+        /* doesn't fit, with its terminating zero */
+        if ((newp = realloc(b->data, b->size * 2 + n + 1)) == NULL) {
+            return -1;
+        }
+        b->data = newp;
+        b->size = b->size * 2 + n + 1;
+    }
+}
+
+static int buf_printf(struct stats_buf *b, const char *fmt, ...)
+{
+    va_list ap;
+    int r;
+
+    va_start(ap, fmt);
+    r = buf_vprintf(b, fmt, ap);
+    va_end(ap);
+
+    return r;
+}
+
+static int buf_string(struct stats_buf *b, const char *s)
+{
+    int r = buf_printf(b, "\"");
+
+    for (; *s && r == 0; s++) {
+        if (*s == '"' || *s == '\\') {
+            r = buf_printf(b, "\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            r = buf_printf(b, "\\u%04x", *s);
+        } else {
+            r = buf_printf(b, "%c", *s);
+        }
+    }
+
+    return r ? r : buf_printf(b, "\"");
+}
+
+static int buf_array(struct stats_buf *b, const unsigned long *v, unsigned n)
+{
+    unsigned i;
+    int r = buf_printf(b, "[");
+
+    for (i = 0; i < n && r == 0; i++) {
+        r = buf_printf(b, "%s%lu", i ? ", " : "", L_LOAD(&v[i]));
+    }
+
+    return r ? r : buf_printf(b, "]");
+}
+
+int stats_begin(struct stats_buf *b, const struct io_mix *m)
+{
+    static const char *dirs[2] = { "read", "write" };
+    unsigned i;
+    int d, r;
+
+    b->len = b->nfiles = b->nsections = 0;
+    b->size = 4096;
+    if ((b->data = malloc(b->size)) == NULL) {
+        return -1;
+    }
+
+    r = buf_printf(b, "{\n  \"size_buckets\": [");
+    for (i = 0; i < STATS_SIZES && r == 0; i++) {
+        r = buf_printf(b, "%s%zu", i ? ", " : "", (size_t)512 << i);
+    }
+    r |= buf_printf(b, "],\n  \"heat_buckets\": %d,\n  \"transitions\": {",
+        STATS_HEAT);
+    for (d = 0; d < 2 && r == 0; d++) {
+        r = buf_printf(b, "%s\n    \"%s\": {\"data_data\": %lu, "
+            "\"data_meta\": %lu, \"meta_data\": %lu, \"meta_meta\": %lu}",
+            d ? "," : "", dirs[d],
+            L_LOAD(&m->trans[d][0][0]), L_LOAD(&m->trans[d][0][1]),
+            L_LOAD(&m->trans[d][1][0]), L_LOAD(&m->trans[d][1][1]));
+    }
+    r |= buf_printf(b, "\n  },\n  \"files\": [");
+
+    return r ? -1 : 0;
+}
+
+int stats_file(struct stats_buf *b, const char *name, unsigned long ino,
+    const char *cls, int meta, off_t size, const struct io_stats *s)
+{
+    static const char *dirs[2] = { "read", "write" };
+    int d, r;
+
+    r = buf_printf(b, "%s\n    {\"name\": ", b->nfiles++ ? "," : "");
+    r |= buf_string(b, name);
+    r |= buf_printf(b, ", \"ino\": %lu, \"class\": \"%s\", \"meta\": %s, "
+        "\"size\": %lld", ino, cls, meta ? "true" : "false", (long long)size);
+    for (d = 0; d < 2 && r == 0; d++) {
+        r = buf_printf(b, ",\n     \"%s\": {\"bytes\": %lu, "
+            "\"sequential\": %lu, \"random\": %lu,\n      \"sizes\": ",
+            dirs[d], L_LOAD(&s->bytes[d]), L_LOAD(&s->seq[d]),
+            L_LOAD(&s->random[d]));
+        r |= buf_array(b, s->sizes[d], STATS_SIZES);
+        r |= buf_printf(b, ",\n      \"heat\": ");
+        r |= buf_array(b, s->heat[d], STATS_HEAT);
+        r |= buf_printf(b, "}");
+    }
+    r |= buf_printf(b, "}");
+
+    return r ? -1 : 0;
+}
+
+int stats_end(struct stats_buf *b)
+{
+    return buf_printf(b, "%s\n}\n", b->nsections ? "" : "\n  ]");
+}
+
+int stats_section(struct stats_buf *b, const char *name)
+{
+    /* the first one closes the files */
+    return buf_printf(b, "%s,\n  \"%s\": ", b->nsections++ ? "" : "\n  ]",
+        name);
+}
+
+int stats_printf(struct stats_buf *b, const char *fmt, ...)
+{
+    va_list ap;
+    int r;
+
+    va_start(ap, fmt);
+    r = buf_vprintf(b, fmt, ap);
+    va_end(ap);
+
+    return r;
+}
@@ -0,0 +1,91 @@
+/*
+ * Per-file access statistics.
+ *
+ * Every read and write is counted, separately for each direction, in a log2
+ * histogram of request sizes, in a coarse heatmap of offsets and as either a
+ * sequential or a random transition. Across all files, LFS also counts how
+ * requests alternate between data and meta files, e.g. content reads and
+ * .mhash reads of swift.
+ *
+ * Counters are updated with relaxed atomics and no lock, so a snapshot taken
+ * while requests run may be off by the requests in flight, but nothing is
+ * lost. Snapshots are JSON, see stats_begin().
+ */
+
+#ifndef LFS_STATS_H
+#define LFS_STATS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define STATS_SIZES 14 /* bucket i counts sizes up to 512 << i, last is open */
+#define STATS_HEAT 64  /* offset buckets, each 1/64 of the file */
+
+enum {
+    STATS_READ,
+    STATS_WRITE,
+};
+
+struct io_stats {
+    unsigned long sizes[2][STATS_SIZES];
+    unsigned long heat[2][STATS_HEAT];
+    unsigned long seq[2];    /* started where the previous one ended */
+    unsigned long random[2];
+    unsigned long bytes[2];
+    off_t next[2];           /* end of the previous request */
+    off_t end;               /* highest end seen, scales the heatmap */
+};
+
+/* Alternation between data and meta file requests. */
+struct io_mix {
+    int last[2];                  /* 0 none yet, else 1 + meta */
+    unsigned long trans[2][2][2]; /* [dir][from meta][to meta] */
+};
+
+/*
+ * Counts a request of dir (STATS_READ or STATS_WRITE). Heatmap buckets are
+ * fractions of fsize, or of the highest offset accessed so far if that is
+ * larger (pass 0 when the size isn't known).
+ */
+void stats_add(struct io_stats *s, int dir, off_t off, size_t size,
+    off_t fsize);
+
+void stats_mix(struct io_mix *m, int dir, int meta);
+
+/*
+ * Zeroes the counters while requests may still be counted: one in flight
+ * lands in either the old or the new period.
+ */
+void stats_reset(struct io_stats *s);
+void stats_mix_reset(struct io_mix *m);
+
+/* Growing JSON buffer. */
+struct stats_buf {
+    char *data;
+    size_t len, size;
+    unsigned nfiles;
+    unsigned nsections;
+};
+
+/*
+ * A snapshot is stats_begin(), stats_file() for every file of interest and
+ * stats_end(). All return 0, or -1 when out of memory. Either way the
+ * buffer is freed with free(b->data).
+ */
+int stats_begin(struct stats_buf *b, const struct io_mix *m);
+int stats_file(struct stats_buf *b, const char *name, unsigned long ino,
+    const char *cls, int meta, off_t size, const struct io_stats *s);
+int stats_end(struct stats_buf *b);
+
+/*
+ * Sections of other modules follow the files: stats_section() starts one
+ * with key name, and its value is written with stats_printf().
+ */
+int stats_section(struct stats_buf *b, const char *name);
+int stats_printf(struct stats_buf *b, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* Whether the file saw any request. */
+int stats_used(const struct io_stats *s);
+
+#endif /* LFS_STATS_H */
@@ -3,6 +3,8 @@
 from base64 import b64decode, b64encode
 from zlib import compress, decompress
 from struct import pack, unpack
+import ctypes
+import os
 
 SWIFTBINARY = "./swift"
 
@@ -112,16 +114,184 @@ class NoStateCompressedMetaDB(BinaryMetaDB):
     def persist(self):
         pass
 
+# Native indexed container, see metadb.h. Lookups stay O(1) and load nothing
+# up front, whatever the size of the database.
+NATIVE_MAGIC = "LFSMDB1\0"
+NATIVE_LIB = os.environ.get("LFS_METADB_LIB", os.path.join(
+    os.path.dirname(os.path.abspath(__file__)), "..", "liblfs_metadb.so"))
+BLOBS = 2 # mbinmap, mhash
+
+_lib = None
+
+def native_lib():
+    """The ctypes handle of liblfs_metadb.so, or None if it isn't built."""
+    global _lib
+    if _lib is None and os.path.exists(NATIVE_LIB):
+        lib = ctypes.CDLL(NATIVE_LIB, use_errno=True)
+        c_db, i64, u64 = ctypes.c_void_p, ctypes.c_int64, ctypes.c_uint64
+        for (name, res, args) in [
+                ("metadb_open", c_db, [ctypes.c_char_p, ctypes.c_int]),
+                ("metadb_close", None, [c_db]),
+                ("metadb_count", i64, [c_db]),
+                ("metadb_find", i64, [c_db, ctypes.c_char_p, u64,
+                    ctypes.c_uint32]),
+                ("metadb_blob_size", i64, [c_db, i64, ctypes.c_uint]),
+                ("metadb_read", i64, [c_db, i64, ctypes.c_uint,
+                    ctypes.c_char_p, u64, u64]),
+                ("metadb_key", ctypes.c_int, [c_db, i64, ctypes.c_char_p,
+                    ctypes.POINTER(u64), ctypes.POINTER(ctypes.c_uint32)]),
+                ("metadb_next", i64, [c_db, ctypes.POINTER(u64)]),
+                ("metadb_add", ctypes.c_int, [c_db, ctypes.c_char_p, u64,
+                    ctypes.c_uint32, ctypes.c_uint,
+                    ctypes.POINTER(ctypes.c_char_p), ctypes.POINTER(u64)]),
+                ("metadb_commit", ctypes.c_int, [c_db]),
+                ("metadb_compact", ctypes.c_int, [ctypes.c_char_p,
+                    ctypes.c_char_p])]:
+            f = getattr(lib, name)
+            f.restype = res
+            f.argtypes = args
+        _lib = lib
+    return _lib
+
+def _check(res, what):
+    if res < 0:
+        raise IOError(-res, "%s: %s" % (what, os.strerror(-res)))
+    return res
+
+class NativeDict(object):
+    """Dict-like view of a native database, blobs are read on access."""
+
+    def __init__(self, filename, writable):
+        self.lib = native_lib()
+        self.handle = self.lib.metadb_open(filename, int(writable))
+        if not self.handle:
+            err = ctypes.get_errno()
+            raise IOError(err, "%s: %s" % (filename, os.strerror(err)))
+
+    def close(self):
+        if self.handle:
+            self.lib.metadb_close(self.handle)
+            self.handle = None
+
+    def _find(self, key):
+        [pattern, size, chunk] = key.split("_")
+        return self.lib.metadb_find(self.handle, pattern, int(size),
+            int(chunk))
+
+    def __contains__(self, key):
+        return self._find(key) >= 0
+
+    def __len__(self):
+        return self.lib.metadb_count(self.handle)
+
+    def read(self, key, blob, off=0, size=None):
+        """Range of a blob, inflating only the frames it covers."""
+        rec = _check(self._find(key), key)
+        if size is None:
+            size = _check(self.lib.metadb_blob_size(self.handle, rec, blob),
+                key)
+        buf = ctypes.create_string_buffer(size)
+        n = _check(self.lib.metadb_read(self.handle, rec, blob, buf, size,
+            off), key)
+        return buf.raw[:n]
+
+    def __getitem__(self, key):
+        if key not in self:
+            raise KeyError(key)
+        return tuple(self.read(key, b) for b in range(BLOBS))
+
+    def __setitem__(self, key, value):
+        [pattern, size, chunk] = key.split("_")
+        blobs = (ctypes.c_char_p * len(value))(*value)
+        sizes = (ctypes.c_uint64 * len(value))(*[len(v) for v in value])
+        _check(self.lib.metadb_add(self.handle, pattern, int(size),
+            int(chunk), len(value), blobs, sizes), key)
+
+    def iterkeys(self):
+        pos = ctypes.c_uint64(0)
+        pattern = ctypes.create_string_buffer(9)
+        size, chunk = ctypes.c_uint64(), ctypes.c_uint32()
+        while True:
+            rec = self.lib.metadb_next(self.handle, ctypes.byref(pos))
+            if rec < 0:
+                return
+            _check(self.lib.metadb_key(self.handle, rec, pattern,
+                ctypes.byref(size), ctypes.byref(chunk)), "key")
+            yield "%s_%d_%d" % (pattern.value, size.value, chunk.value)
+
+    __iter__ = iterkeys
+
+    def iteritems(self):
+        for key in self.iterkeys():
+            yield (key, self[key])
+
+    def items(self):
+        return list(self.iteritems())
+
+    def commit(self):
+        _check(self.lib.metadb_commit(self.handle), "commit")
+
+class NativeMetaDB(MetaDB):
+    """MetaDB in the native container. Additions go straight to the file,
+    persist() makes them durable."""
+
+    def __init__(self, filename, writable=True):
+        MetaDB.__init__(self, filename)
+        self.db = NativeDict(filename, writable)
+
+    def load(self):
+        pass
+
+    def persist(self):
+        self.db.commit()
+
+    def read(self, key, blob, off=0, size=None):
+        return self.db.read(key, blob, off, size)
+
+    def _encode(self, s):
+        return s
+
+    def _decode(self, s):
+        return s
+
+def open_metadb(filename):
+    """The right MetaDB for the file: native if it is one (or is new and the
+    library is built), the old binary format otherwise."""
+    try:
+        with open(filename, "rb") as f:
+            native = f.read(len(NATIVE_MAGIC)) == NATIVE_MAGIC
+    except IOError:
+        native = native_lib() is not None
+    if native:
+        return NativeMetaDB(filename)
+    return BinaryMetaDB(filename)
+
+def convert(old_file, new_file):
+    """Copies a database in the old binary format into a native one."""
+    old = BinaryMetaDB(old_file)
+    old.load()
+    new = NativeMetaDB(new_file)
+    for (key, value) in old.db.iteritems():
+        new.db[key] = value
+    new.persist()
+    print "[*] Converted %d entries to %s" % (len(new.db), new_file)
+
+def compact(metadb_file):
+    """Drops superseded records and indexes, replacing the file."""
+    tmp = metadb_file + ".compact"
+    _check(native_lib().metadb_compact(metadb_file, tmp), metadb_file)
+    os.rename(tmp, metadb_file)
+
 def restore_metafiles(metadb_file, files_dir):
     from create_mocks import compact_size
 
     print "[*] Restoring to dir:", files_dir
     print "[*] Reading from libswift metadata file:", metadb_file
 
-    mdb = BinaryMetaDB(metadb_file)
+    mdb = open_metadb(metadb_file)
     mdb.load()
 
-    for (key, value) in mdb.db.items():
+    for (key, value) in mdb.db.iteritems():
         [pattern, size, chunk] = key.split("_")
         size = compact_size(size)
 
@@ -142,11 +312,16 @@ def restore_metafiles(metadb_file, files_dir):
 
 if __name__ == "__main__":
     import sys
-    import os
 
     from precompute_meta import call_swift, content_files
     from create_mocks import parse_size
 
+    if len(sys.argv) == 4 and sys.argv[1] == "convert":
+        convert(os.path.abspath(sys.argv[2]), os.path.abspath(sys.argv[3]))
+        exit(0)
+    if len(sys.argv) == 3 and sys.argv[1] == "compact":
+        compact(os.path.abspath(sys.argv[2]))
+        exit(0)
     if len(sys.argv) != 3:
         if len(sys.argv) == 4 and sys.argv[1] == "restore":
             # restore
@@ -156,6 +331,8 @@ if __name__ == "__main__":
             exit(0)
         else:
             print >>sys.stderr, "Usage: %s [restore] <files_dir> <metadb_file>" % sys.argv[0]
+            print >>sys.stderr, "       %s convert <old_metadb> <new_metadb>" % sys.argv[0]
+            print >>sys.stderr, "       %s compact <metadb_file>" % sys.argv[0]
             exit(1)
     if not os.path.exists(SWIFTBINARY):
         print >>sys.stderr, "[-] Cannot find swift binary at:", SWIFTBINARY
@@ -166,7 +343,7 @@ if __name__ == "__main__":
     print "[*] Computing hashes for files in dir:", files_dir
     print "[*] Saving libswift metadata in metadb file:", metadb_file
 
-    mdb = BinaryMetaDB(metadb_file)
+    mdb = open_metadb(metadb_file)
     mdb.load()
 
     for (f, abspath) in content_files(files_dir):
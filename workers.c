@@ -0,0 +1,539 @@
+/*
+ * Fixed-size pool of pinned FUSE workers. See workers.h.
+ */
+
+#define _GNU_SOURCE /* CPU_SET, pthread_attr_setaffinity_np */
+#define FUSE_USE_VERSION 26
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+#include "workers.h"
+
+#define WORKERS_NOMEM_WAIT 10000 /* us before retrying a request */
+
+#ifndef FUSE_DEV_IOC_CLONE
+#define FUSE_DEV_IOC_CLONE _IOR(229, 0, uint32_t)
+#endif
+
+struct worker {
+    pthread_t thread;
+    const struct worker_opts *o;
+    struct fuse_session *se;
+    struct fuse_chan *ch; /* own clone, or the session channel */
+    int cloned;
+    sem_t *finish;
+};
+
+/* A session of a shared pool, see workers_start(). */
+struct pool_session {
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+    void (*enter)(void *);
+    void *arg;
+    unsigned busy; /* workers holding one of its requests */
+    int removed;
+    struct pool_session *next;
+};
+
+struct workers {
+    int epfd;
+    int stopfd; /* eventfd, readable once the pool stops */
+    pthread_t *threads;
+    unsigned n;
+    pthread_mutex_t lock; /* protects the sessions */
+    pthread_cond_t idle;  /* a removed session has no busy worker left */
+    void (*busy_hook)(void);
+    void (*idle_hook)(void);
+    sem_t exited;         /* posted whenever a session exits */
+    /*
+     * Removed ones stay until the pool stops: a worker may have an event for
+     * one that it hasn't looked at yet.
+     */
+    struct pool_session *sessions;
+};
+
+/*
+ * Channel on a cloned device fd. Same behaviour as the kernel channel of
+ * libfuse, which can't be created for an fd we opened ourselves.
+ */
+static int clone_receive(struct fuse_chan **chp, char *buf, size_t size)
+{
+    struct fuse_chan *ch = *chp;
+    struct fuse_session *se = fuse_chan_data(ch);
+    ssize_t res;
+    int err;
+
+    do {
+        res = read(fuse_chan_fd(ch), buf, size);
+        err = errno;
+    } while (res == -1 && err == ENOENT); /* request was interrupted */
+
+    if (fuse_session_exited(se)) {
+        return 0;
+    }
+    if (res == -1) {
+        if (err == ENODEV) {
+            /* unmounted */
+            fuse_session_exit(se);
+            return 0;
+        }
+        return -err;
+    }
+
+    return res;
+}
+
+static int clone_send(struct fuse_chan *ch, const struct iovec iov[],
+    size_t count)
+{
+    if (iov != NULL && writev(fuse_chan_fd(ch), iov, count) == -1) {
+        return -errno; /* ENOENT: the request was interrupted */
+    }
+
+    return 0;
+}
+
+static void clone_destroy(struct fuse_chan *ch)
+{
+    close(fuse_chan_fd(ch));
+}
+
+static struct fuse_chan_ops clone_ops = {
+    .receive = clone_receive,
+    .send    = clone_send,
+    .destroy = clone_destroy,
+};
+
+/* Returns a channel on a new fd of the same connection, or NULL. */
+static struct fuse_chan *clone_chan(struct fuse_session *se,
+    struct fuse_chan *master)
+{
+    uint32_t masterfd = fuse_chan_fd(master);
+    struct fuse_chan *ch;
+    int fd;
+
+    if ((fd = open("/dev/fuse", O_RDWR | O_CLOEXEC)) == -1) {
+        return NULL;
+    }
+    if (ioctl(fd, FUSE_DEV_IOC_CLONE, &masterfd) == -1) {
+        close(fd); /* kernel older than 4.2 */
+        return NULL;
+    }
+    ch = fuse_chan_new(&clone_ops, fd, fuse_chan_bufsize(master), se);
+    if (ch == NULL) {
+        close(fd);
+    }
+
+    return ch;
+}
+
+static void *worker_run(void *arg)
+{
+    struct worker *w = arg;
+    size_t bufsize = fuse_chan_bufsize(w->ch);
+    char *buf = malloc(bufsize); /* this worker's own request buffer */
+    struct fuse_chan *ch;
+    struct fuse_buf fbuf;
+    int res;
+
+    while (buf != NULL && !fuse_session_exited(w->se)) {
+        ch = w->ch;
+        memset(&fbuf, 0, sizeof(fbuf));
+        fbuf.mem = buf;
+        fbuf.size = bufsize;
+
+        /* only cancelled while waiting for a request, see workers_loop() */
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        res = fuse_session_receive_buf(w->se, &fbuf, &ch);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        if (res == -EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            if (res < 0) {
+                fuse_session_exit(w->se);
+            }
+            break;
+        }
+        if (w->o->busy != NULL) {
+            w->o->busy();
+        }
+        fuse_session_process_buf(w->se, &fbuf, ch);
+        if (w->o->idle != NULL) {
+            w->o->idle();
+        }
+    }
+
+    free(buf);
+    sem_post(w->finish);
+
+    return NULL;
+}
+
+int workers_parse_cpus(const char *s, int *cpus, unsigned max)
+{
+    unsigned n = 0;
+    long a, b;
+    char *end;
+
+    while (*s) {
+        a = b = strtol(s, &end, 10);
+        if (end == s || a < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            s = end + 1;
+            b = strtol(s, &end, 10);
+            if (end == s || b < a) {
+                return -1;
+            }
+        }
+        for (; a <= b; a++) {
+            if (n == max) {
+                return -1;
+            }
+            cpus[n++] = a;
+        }
+        if (*end == ':' || *end == ',') {
+            end++;
+        } else if (*end != 0) {
+            return -1;
+        }
+        s = end;
+    }
+
+    return n;
+}
+
+int workers_loop(struct fuse_session *se, const struct worker_opts *o)
+{
+    struct fuse_chan *master = fuse_session_next_chan(se, NULL);
+    struct worker *w;
+    pthread_attr_t attr;
+    sigset_t all, old;
+    cpu_set_t set;
+    sem_t finish;
+    unsigned i, started = 0, cloned = 0;
+
+    if ((w = calloc(o->n, sizeof(*w))) == NULL) {
+        return -1;
+    }
+    sem_init(&finish, 0, 0);
+
+    /* signals are left to this thread, which then stops the workers */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (i = 0; i < o->n; i++) {
+        w[i].o = o;
+        w[i].se = se;
+        w[i].finish = &finish;
+        w[i].ch = o->clone ? clone_chan(se, master) : NULL;
+        w[i].cloned = (w[i].ch != NULL);
+        if (!w[i].cloned) {
+            w[i].ch = master;
+        }
+
+        pthread_attr_init(&attr);
+        if (o->ncpus > 0) {
+            CPU_ZERO(&set);
+            CPU_SET(o->cpus[i % o->ncpus], &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+        if (pthread_create(&w[i].thread, &attr, worker_run, &w[i]) != 0) {
+            pthread_attr_destroy(&attr);
+            if (w[i].cloned) {
+                fuse_chan_destroy(w[i].ch);
+            }
+            break;
+        }
+        pthread_attr_destroy(&attr);
+        started++;
+        cloned += w[i].cloned;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    printf("Workers: %u, %u with a cloned channel\n", started, cloned);
+    if (started == 0) {
+        sem_destroy(&finish);
+        free(w);
+        return -1;
+    }
+
+    /* a signal handler exiting the session interrupts the wait */
+    while (!fuse_session_exited(se)) {
+        sem_wait(&finish);
+    }
+
+    for (i = 0; i < started; i++) {
+        pthread_cancel(w[i].thread);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(w[i].thread, NULL);
+        if (w[i].cloned) {
+            fuse_chan_destroy(w[i].ch);
+        }
+    }
+
+    sem_destroy(&finish);
+    free(w);
+    fuse_session_reset(se);
+
+    return 0;
+}
+
+/* Arms the session's channel for the next request, for one worker. */
+static void pool_arm(struct workers *p, struct pool_session *s, int op)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = s;
+    epoll_ctl(p->epfd, op, fuse_chan_fd(s->ch), &ev); /* ENOENT if removed */
+}
+
+static void *pool_run(void *arg)
+{
+    struct workers *p = arg;
+    struct pool_session *s;
+    struct epoll_event ev;
+    struct fuse_chan *ch;
+    struct fuse_buf fbuf;
+    char *buf = NULL, *newbuf;
+    size_t bufsize = 0; /* this worker's buffer, used for every session */
+    unsigned batch = 0;  /* requests since the last wait */
+    int res;
+
+    for (;;) {
+        /* take what's ready without waiting, until the batch is full */
+        if (batch == 0 || batch >= WORKERS_BATCH ||
+            epoll_wait(p->epfd, &ev, 1, 0) != 1) {
+            if (batch > 0 && p->idle_hook != NULL) {
+                p->idle_hook();
+            }
+            batch = 0;
+            if (epoll_wait(p->epfd, &ev, 1, -1) != 1) {
+                continue; /* EINTR */
+            }
+        }
+        if (batch++ == 0 && p->busy_hook != NULL) {
+            p->busy_hook();
+        }
+        if ((s = ev.data.ptr) == NULL) {
+            break; /* stopfd, which stays readable for the others */
+        }
+
+        pthread_mutex_lock(&p->lock);
+        if (s->removed) {
+            pthread_mutex_unlock(&p->lock);
+            continue;
+        }
+        s->busy++;
+        pthread_mutex_unlock(&p->lock);
+
+        res = -ENOMEM;
+        if (fuse_chan_bufsize(s->ch) > bufsize &&
+            (newbuf = realloc(buf, fuse_chan_bufsize(s->ch))) != NULL) {
+            buf = newbuf;
+            bufsize = fuse_chan_bufsize(s->ch);
+        }
+        if (bufsize >= fuse_chan_bufsize(s->ch)) {
+            memset(&fbuf, 0, sizeof(fbuf));
+            fbuf.mem = buf;
+            fbuf.size = bufsize;
+            ch = s->ch;
+            res = fuse_session_receive_buf(s->se, &fbuf, &ch);
+        }
+
+        if (res == -ENOMEM) {
+            /* no buffer for it, give the others and the allocator a while */
+            usleep(WORKERS_NOMEM_WAIT);
+            pool_arm(p, s, EPOLL_CTL_MOD);
+        } else if (res > 0 || res == -EAGAIN || res == -EINTR) {
+            /* another worker takes the next request meanwhile */
+            pool_arm(p, s, EPOLL_CTL_MOD);
+        } else {
+            /* unmounted or exited, left for workers_remove() */
+            fuse_session_exit(s->se);
+            sem_post(&p->exited);
+        }
+        if (res > 0) {
+            s->enter(s->arg);
+            fuse_session_process_buf(s->se, &fbuf, ch);
+        }
+
+        pthread_mutex_lock(&p->lock);
+        if (--s->busy == 0 && s->removed) {
+            pthread_cond_broadcast(&p->idle);
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+    if (p->idle_hook != NULL) {
+        p->idle_hook();
+    }
+
+    free(buf);
+
+    return NULL;
+}
+
+struct workers *workers_start(const struct worker_opts *o)
+{
+    struct workers *p = calloc(1, sizeof(*p));
+    struct epoll_event ev;
+    pthread_attr_t attr;
+    sigset_t all, old;
+    cpu_set_t set;
+    unsigned i;
+
+    if (p == NULL) {
+        return NULL;
+    }
+    p->epfd = epoll_create1(EPOLL_CLOEXEC);
+    p->stopfd = eventfd(0, EFD_CLOEXEC);
+    p->threads = calloc(o->n, sizeof(*p->threads));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (p->epfd == -1 || p->stopfd == -1 || p->threads == NULL ||
+        epoll_ctl(p->epfd, EPOLL_CTL_ADD, p->stopfd, &ev) == -1) {
+        goto err;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->idle, NULL);
+    p->busy_hook = o->busy;
+    p->idle_hook = o->idle;
+    sem_init(&p->exited, 0, 0);
+
+    /* signals are left to the caller, see workers_wait() */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (i = 0; i < o->n; i++) {
+        pthread_attr_init(&attr);
+        if (o->ncpus > 0) {
+            CPU_ZERO(&set);
+            CPU_SET(o->cpus[i % o->ncpus], &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+        if (pthread_create(&p->threads[i], &attr, pool_run, p) != 0) {
+            pthread_attr_destroy(&attr);
+            break;
+        }
+        pthread_attr_destroy(&attr);
+        p->n++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    printf("Workers: %u, shared by all mounts\n", p->n);
+    if (p->n == 0) {
+        workers_stop(p);
+        return NULL;
+    }
+
+    return p;
+
+err:
+    if (p->epfd != -1) {
+        close(p->epfd);
+    }
+    if (p->stopfd != -1) {
+        close(p->stopfd);
+    }
+    free(p->threads);
+    free(p);
+    return NULL;
+}
+
+int workers_add(struct workers *p, struct fuse_session *se,
+    void (*enter)(void *), void *arg)
+{
+    struct pool_session *s = calloc(1, sizeof(*s));
+    int fd;
+
+    if (s == NULL) {
+        return -1;
+    }
+    s->se = se;
+    s->ch = fuse_session_next_chan(se, NULL);
+    s->enter = enter;
+    s->arg = arg;
+    fd = fuse_chan_fd(s->ch);
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+        free(s);
+        return -1;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    s->next = p->sessions;
+    p->sessions = s;
+    pthread_mutex_unlock(&p->lock);
+    pool_arm(p, s, EPOLL_CTL_ADD);
+
+    return 0;
+}
+
+void workers_remove(struct workers *p, struct fuse_session *se)
+{
+    struct pool_session *s;
+
+    pthread_mutex_lock(&p->lock);
+    for (s = p->sessions; s != NULL; s = s->next) {
+        if (s->se == se && !s->removed) {
+            break;
+        }
+    }
+    if (s != NULL) {
+        s->removed = 1;
+        epoll_ctl(p->epfd, EPOLL_CTL_DEL, fuse_chan_fd(s->ch), NULL);
+        while (s->busy > 0) {
+            pthread_cond_wait(&p->idle, &p->lock);
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+void workers_wait(struct workers *p, struct fuse_session *se)
+{
+    /* a signal handler exiting the session interrupts the wait */
+    while (!fuse_session_exited(se)) {
+        sem_wait(&p->exited);
+    }
+}
+
+void workers_stop(struct workers *p)
+{
+    struct pool_session *s, *next;
+    uint64_t one = 1;
+    unsigned i;
+
+    if (write(p->stopfd, &one, sizeof(one)) != sizeof(one)) {
+        perror("workers_stop");
+    }
+    for (i = 0; i < p->n; i++) {
+        pthread_join(p->threads[i], NULL);
+    }
+
+    for (s = p->sessions; s != NULL; s = next) {
+        next = s->next;
+        free(s);
+    }
+    sem_destroy(&p->exited);
+    pthread_cond_destroy(&p->idle);
+    pthread_mutex_destroy(&p->lock);
+    close(p->stopfd);
+    close(p->epfd);
+    free(p->threads);
+    free(p);
+}
@@ -0,0 +1,74 @@
+/*
+ * Fixed-size pool of pinned FUSE workers.
+ *
+ * Replaces fuse_session_loop_mt(), which starts threads on demand and has them
+ * all read the same /dev/fuse fd. Here every worker is started up front,
+ * optionally pinned to a CPU, and reads from its own clone of the device fd
+ * (FUSE_DEV_IOC_CLONE, Linux 4.2 and later), so workers don't contend on one
+ * file and replies go back on the fd the request came from. If the kernel
+ * can't clone, workers share the session channel.
+ */
+
+#ifndef LFS_WORKERS_H
+#define LFS_WORKERS_H
+
+#include <fuse_lowlevel.h>
+
+#define MAXWORKERS 256
+
+struct worker_opts {
+    unsigned n;               /* workers */
+    int cpus[MAXWORKERS];     /* worker i runs on cpus[i % ncpus] */
+    unsigned ncpus;           /* 0 leaves affinity alone */
+    int clone;                /* try a device fd per worker */
+    void (*busy)(void);       /* optional, a worker starts handling requests */
+    void (*idle)(void);       /* and is about to wait for more */
+};
+
+/* Parses a CPU list like "0-3,6". Returns the count, or -1 if malformed. */
+int workers_parse_cpus(const char *s, int *cpus, unsigned max);
+
+/*
+ * Serves the session until it exits, like fuse_session_loop_mt(). Returns 0,
+ * or -1 if no worker could be started.
+ */
+int workers_loop(struct fuse_session *se, const struct worker_opts *o);
+
+/*
+ * Pool shared by several sessions, for one process serving many mountpoints.
+ *
+ * Workers wait on one epoll set holding the channel of every session, armed
+ * for a single wakeup (EPOLLONESHOT) and rearmed as soon as a request is read,
+ * so requests of one mount are still handled in parallel and an idle mount
+ * costs an fd and nothing else. Channels are not cloned, a session has one
+ * non-blocking fd shared by the workers. Before handling a request the worker
+ * calls the session's enter hook, which selects the filesystem's state for it.
+ *
+ * A worker goes on with requests that are already waiting, up to
+ * WORKERS_BATCH, before it calls the idle hook and waits. Workers of
+ * workers_loop() call the hooks around every request.
+ */
+#define WORKERS_BATCH 16
+
+struct workers;
+
+/* Starts o->n workers waiting for sessions. Returns NULL if none started. */
+struct workers *workers_start(const struct worker_opts *o);
+
+/* Serves se from now on. Returns 0, or -1 on error. */
+int workers_add(struct workers *p, struct fuse_session *se,
+    void (*enter)(void *), void *arg);
+
+/* Stops serving se. Returns once no worker handles a request of it. */
+void workers_remove(struct workers *p, struct fuse_session *se);
+
+/*
+ * Waits until se exits, or a signal handler exits it. Sessions exit when they
+ * are unmounted, a session that exited is no longer served.
+ */
+void workers_wait(struct workers *p, struct fuse_session *se);
+
+/* Stops the workers and frees the pool. */
+void workers_stop(struct workers *p);
+
+#endif /* LFS_WORKERS_H */